@@ -1,12 +1,21 @@
 #include "bsp.h"
+#include "bspcook.h"
 #include "cache.h"
+#include "texture.h"
+#include "lightmap.h"
+#include "etcpack.h"
+#include "rgbe.h"
 #include "collection.h"
 #include "mempools.h"
 #include "common.h"
 #include "log.h"
 //#include "profiler.h"
 #include "camera.h"
+#include "cull.h"
+#include "occlusion.h"
 #include "vmfparser.h"
+#include "loader.h"
+#include "thread.h"
 
 #include "atto/app.h"
 #include "atto/math.h"
@@ -17,6 +26,8 @@
 
 static char persistent_data[128*1024*1024];
 static char temp_data[256*1024*1024];
+/* cache is filled by loader threads concurrently with main thread, so it has its own storage */
+static char cache_data[32*1024*1024];
 
 static struct Stack stack_temp = {
 	.storage = temp_data,
@@ -30,6 +41,12 @@ static struct Stack stack_persistent = {
 	.cursor = 0
 };
 
+static struct Stack stack_cache = {
+	.storage = cache_data,
+	.size = sizeof(cache_data),
+	.cursor = 0
+};
+
 static struct Memories mem = {
 	&stack_temp,
 	&stack_persistent
@@ -39,19 +56,31 @@ typedef enum {
 	MapFlags_Empty = 0,
 	MapFlags_Loaded = 1,
 	MapFlags_FixedOffset = 2,
-	MapFlags_Broken = 4
+	MapFlags_Broken = 4,
+	MapFlags_Loading = 8, /* being loaded in background */
+	MapFlags_Ready = 16 /* loaded in background, waiting for its turn to be finished */
 } MapFlags;
 
+/* how much time main thread can spend on background loader requests every frame */
+#define LOADER_FRAME_BUDGET_US 4000
+
 typedef struct Map {
 	char *name;
 	char *depend_name;
 	int flags;
+	LoaderJob job;
+	BSPLoadModelContext loadctx;
 	struct AVec3f offset;
 	struct AVec3f debug_offset;
 	struct BSPModel model;
 	struct Map *prev, *next;
+	ATimeUs load_start, load_time;
 	const struct Map *parent;
 	struct AVec3f parent_offset;
+	/* against camera frustum in current frame */
+	CullResult cull;
+	/* hidden behind other maps */
+	ROcclusion occlusion;
 } Map;
 
 typedef struct Patch {
@@ -74,11 +103,35 @@ static struct {
 	Map *maps_begin, *maps_end;
 	int maps_count, maps_limit;
 	Map *selected_map;
+
+	/* last reported RStats.models_occluded */
+	int models_occluded;
+	/* last reported RStats.draw_calls */
+	int draw_calls;
+
+	/* occluders of maps in view, rasterized every frame */
+	OcclusionBuffer occluders;
+	/* last reported number of maps hidden behind occluders */
+	int maps_hidden;
+
+	/* maps that failed to load because loader memory was exhausted */
+	int maps_out_of_memory;
 } g;
 
 static struct {
 	const char *steam_basedir;
 	int maps_limit;
+	int loader_threads;
+	int headless;
+	int etc1_benchmark;
+	int lightmap_benchmark;
+	const char *cook_dir;
+	int max_texture_size;
+	int texture_budget; /* MiB */
+	int packed_vertices;
+	int occlusion_queries;
+	int software_occlusion;
+	int occlusion_test;
 } g_cfg;
 
 static Map *opensrcAllocMap(StringView name) {
@@ -108,6 +161,7 @@ static Map *opensrcAllocMap(StringView name) {
 	map->depend_name = map->name + name.length + 1;
 
 	memcpy(map->name, name.str, name.length);
+	renderOcclusionInit(&map->occlusion);
 
 	if (!g.maps_end)
 		g.maps_begin = map;
@@ -124,7 +178,21 @@ static Map *opensrcAllocMap(StringView name) {
 	return map;
 }
 
+static void opensrcAddMapMessage(void *payload) {
+	const StringView name = { .str = payload, .length = (int)strlen(payload) };
+	opensrcAllocMap(name);
+}
+
 void openSourceAddMap(StringView name) {
+	if (!loaderIsMainThread()) {
+		/* maps list is only ever modified on main thread */
+		char *name_copy = loaderMainThreadAlloc((size_t)name.length + 1);
+		memcpy(name_copy, name.str, name.length);
+		name_copy[name.length] = '\0';
+		loaderMainThreadPost(opensrcAddMapMessage, name_copy);
+		return;
+	}
+
 	opensrcAllocMap(name);
 }
 
@@ -136,11 +204,11 @@ static void mapUpdatePosition(Map *map) {
 		map->offset.x, map->offset.y, map->offset.z);
 }
 
-static enum BSPLoadResult loadMap(Map *map, ICollection *collection) {
+static BSPLoadModelContext mapLoadContext(Map *map, ICollection *collection, struct Memories *memories) {
 	BSPLoadModelContext loadctx = {
 		.collection = collection,
-		.persistent = &stack_persistent,
-		.tmp = &stack_temp,
+		.persistent = memories->persistent,
+		.tmp = memories->temp,
 		.model = &map->model,
 		.name = { .str = map->name, .length = (int)strlen(map->name) },
 		.prev_map_name = { .str = NULL, .length = 0 },
@@ -157,12 +225,67 @@ static enum BSPLoadResult loadMap(Map *map, ICollection *collection) {
 		loadctx.next_map_name.length = (int)strlen(map->next->name);
 	}
 
-	const enum BSPLoadResult result = bspLoadWorldspawn(loadctx);
+	return loadctx;
+}
+
+static void mapFinishLoading(Map *map);
+
+static enum BSPLoadResult loadMap(Map *map, ICollection *collection) {
+	map->load_start = aAppTime();
+	const enum BSPLoadResult result = bspLoadWorldspawn(mapLoadContext(map, collection, &mem));
 	if (result != BSPLoadResult_Success) {
 		PRINTF("Cannot load map \"%s\": %d", map->name, result);
+		if (result == BSPLoadResult_ErrorMemory)
+			++g.maps_out_of_memory;
 		return result;
 	}
 
+	mapFinishLoading(map);
+	return BSPLoadResult_Success;
+}
+
+typedef struct {
+	Map *map;
+	enum BSPLoadResult result;
+} MapLoadedMessage;
+
+static void opensrcMapLoadedMessage(void *payload) {
+	const MapLoadedMessage *message = payload;
+	Map *map = message->map;
+
+	/* all uploads for this map were posted before this message, so it is ready to be drawn */
+	map->flags &= ~MapFlags_Loading;
+	map->flags |= (message->result == BSPLoadResult_Success) ? MapFlags_Ready : MapFlags_Broken;
+	if (message->result == BSPLoadResult_ErrorMemory)
+		++g.maps_out_of_memory;
+}
+
+static void opensrcLoadMapJob(LoaderJob *job, struct Memories *memories) {
+	Map *map = job->user;
+	BSPLoadModelContext loadctx = map->loadctx;
+	loadctx.persistent = memories->persistent;
+	loadctx.tmp = memories->temp;
+
+	const enum BSPLoadResult result = bspLoadWorldspawn(loadctx);
+	if (result != BSPLoadResult_Success)
+		PRINTF("Cannot load map \"%s\": %d", map->name, result);
+
+	MapLoadedMessage *message = loaderMainThreadAlloc(sizeof(*message));
+	message->map = map;
+	message->result = result;
+	loaderMainThreadPost(opensrcMapLoadedMessage, message);
+}
+
+static void opensrcQueueMap(Map *map) {
+	map->flags |= MapFlags_Loading;
+	map->load_start = aAppTime();
+	map->loadctx = mapLoadContext(map, g.collection_chain, &mem);
+	map->job.func = opensrcLoadMapJob;
+	map->job.user = map;
+	loaderSubmit(&map->job);
+}
+
+static void mapFinishLoading(Map *map) {
 	aAppDebugPrintf("Loaded %s to %u draw calls", map->name, map->model.detailed.draws_count);
 	aAppDebugPrintf("AABB (%f, %f, %f) - (%f, %f, %f)",
 			map->model.aabb.min.x,
@@ -264,25 +387,68 @@ static enum BSPLoadResult loadMap(Map *map, ICollection *collection) {
 	}
 
 loaded:
+	map->load_time = aAppTime() - map->load_start;
+	map->flags &= ~MapFlags_Ready;
 	map->flags |= MapFlags_Loaded;
 	mapUpdatePosition(map);
+}
 
-	return BSPLoadResult_Success;
+/* returns 1 when there are no more maps left to load */
+static int opensrcLoadMaps(void) {
+	int can_load_map = 1;
+	int done = 1;
+	for (struct Map *map = g.maps_begin; map; map = map->next) {
+		if (map->flags & (MapFlags_Broken | MapFlags_Loaded))
+			continue;
+
+		done = 0;
+
+		if (!loaderWorkersCount()) {
+			if (can_load_map) {
+				if (BSPLoadResult_Success != loadMap(map, g.collection_chain))
+					map->flags |= MapFlags_Broken;
+			}
+
+			can_load_map = 0;
+			continue;
+		}
+
+		if (!(map->flags & (MapFlags_Loading | MapFlags_Ready)))
+			opensrcQueueMap(map);
+
+		/* finish maps in order, so that they can find their parents by landmarks */
+		if (!can_load_map || !(map->flags & MapFlags_Ready)) {
+			can_load_map = 0;
+			continue;
+		}
+
+		mapFinishLoading(map);
+	}
+
+	return done;
 }
 
 static void opensrcInit() {
-	cacheInit(&stack_persistent);
+	cacheInit(&stack_cache);
 
-	if (!renderInit()) {
+	if (!renderInit(g_cfg.headless ? RBackend_Null : RBackend_GL)) {
 		PRINT("Failed to initialize render");
 		aAppTerminate(-1);
 	}
 
-	bspInit();
+	textureInit(g_cfg.max_texture_size);
+	lightmapInit();
+	textureStreamInit((size_t)g_cfg.texture_budget << 20, g.collection_chain, &stack_persistent);
+	bspInit(g_cfg.packed_vertices ? BSPVertexFormat_Packed : BSPVertexFormat_Float);
+	bspCookInit(g_cfg.cook_dir);
+	if (g_cfg.software_occlusion)
+		occlusionInit();
 
 	if (BSPLoadResult_Success != loadMap(g.maps_begin, g.collection_chain))
 		aAppTerminate(-2);
 
+	loaderInit(g_cfg.loader_threads);
+
 	g.center = aVec3fMulf(aVec3fAdd(g.maps_begin->model.aabb.min, g.maps_begin->model.aabb.max), .5f);
 	float r = aVec3fLength(aVec3fSub(g.maps_begin->model.aabb.max, g.maps_begin->model.aabb.min)) * .5f;
 
@@ -298,6 +464,45 @@ static void opensrcInit() {
 			g.center, aVec3f(0.f, 0.f, 1.f));
 }
 
+/* load all maps as fast as possible without drawing anything, print timings and exit */
+static void opensrcRunHeadless(ATimeUs start) {
+	for (;;) {
+		loaderUpdate(LOADER_FRAME_BUDGET_US);
+		if (opensrcLoadMaps())
+			break;
+		loaderWaitMessages();
+	}
+
+	const ATimeUs total = aAppTime() - start;
+
+	int loaded = 0, broken = 0;
+	for (const Map *map = g.maps_begin; map; map = map->next) {
+		if (map->flags & MapFlags_Broken) {
+			++broken;
+			PRINTF("Map %s: broken", map->name);
+		} else {
+			++loaded;
+			PRINTF("Map %s: %.3fms, %d draw calls", map->name, map->load_time / 1000.f,
+				map->model.detailed.draws_count);
+		}
+	}
+
+	const RStats *stats = renderGetStats();
+	PRINTF("Loaded %d maps (%d broken) in %.3fms using %d loader threads",
+		loaded, broken, total / 1000.f, loaderWorkersCount());
+	PRINTF("Textures: %zu, %zuKiB; buffers: %zu, %zuKiB",
+		stats->textures_count, stats->textures_size >> 10,
+		stats->buffers_count, stats->buffers_size >> 10);
+	PRINTF("Memory peak persistent: %zuKiB, cache: %zuKiB, temp: %zuKiB",
+		stack_persistent.peak >> 10, stack_cache.peak >> 10, stack_temp.peak >> 10);
+	loaderPrintMemUsage();
+	lightmapPrintStats();
+	if (g.maps_out_of_memory)
+		PRINTF("%d maps ran out of loader memory", g.maps_out_of_memory);
+
+	aAppTerminate(broken ? 2 : 0);
+}
+
 static void opensrcResize(ATimeUs timestamp, unsigned int old_w, unsigned int old_h) {
 	(void)(timestamp); (void)(old_w); (void)(old_h);
 	renderResize(a_app_state->width, a_app_state->height);
@@ -306,6 +511,76 @@ static void opensrcResize(ATimeUs timestamp, unsigned int old_w, unsigned int ol
 	cameraRecompute(&g.camera);
 }
 
+/* classifies all loaded maps against frustum. The hierarchy is rebuilt every frame:
+ * it is cheap for a few hundred maps and follows maps being loaded and moved around */
+static void opensrcCullMaps(const CullFrustum *frustum) {
+	int count = 0;
+	for (struct Map *map = g.maps_begin; map; map = map->next)
+		if (map->flags & MapFlags_Loaded)
+			++count;
+
+	if (!count)
+		return;
+
+	void *const tmp_cursor = stackGetCursor(&stack_temp);
+	struct Map **const maps = stackAlloc(&stack_temp, sizeof(*maps) * count);
+	CullBox *const boxes = stackAlloc(&stack_temp, sizeof(*boxes) * count);
+	CullBVHNode *const nodes = stackAlloc(&stack_temp, sizeof(*nodes) * (2 * count - 1));
+	int *const items = stackAlloc(&stack_temp, sizeof(*items) * count);
+	CullVisible *const visible = stackAlloc(&stack_temp, sizeof(*visible) * count);
+	ASSERT(maps && boxes && nodes && items && visible);
+
+	int index = 0;
+	for (struct Map *map = g.maps_begin; map; map = map->next) {
+		if (!(map->flags & MapFlags_Loaded))
+			continue;
+
+		const struct AVec3f translation = aVec3fAdd(map->offset, map->debug_offset);
+		maps[index] = map;
+		boxes[index].min = aVec3fAdd(map->model.aabb.min, translation);
+		boxes[index].max = aVec3fAdd(map->model.aabb.max, translation);
+		map->cull = CullResult_Outside;
+		++index;
+	}
+
+	CullBVH bvh;
+	cullBVHBuild(&bvh, nodes, items, boxes, count);
+	const int visible_count = cullBVHFrustum(&bvh, boxes, frustum, visible);
+	for (int i = 0; i < visible_count; ++i)
+		maps[visible[i].item]->cull = visible[i].result;
+
+	stackFreeUpToPosition(&stack_temp, tmp_cursor);
+}
+
+/* rasterizes occluders of maps in view, and culls maps that are entirely behind them.
+ * Occluders of a map are inside of its bounds, so it is never hidden by its own */
+static void opensrcOccludeMaps(void) {
+	OcclusionBuffer *const buffer = &g.occluders;
+	occlusionBufferBegin(buffer, &g.camera.view_projection);
+
+	for (struct Map *map = g.maps_begin; map; map = map->next) {
+		if (!(map->flags & MapFlags_Loaded) || map->cull == CullResult_Outside)
+			continue;
+
+		const struct BSPOccluders *const occluders = &map->model.occluders;
+		occlusionBufferAddTriangles(buffer, aVec3fAdd(map->offset, map->debug_offset),
+			occluders->vertices, occluders->indices, occluders->indices_count);
+	}
+
+	for (struct Map *map = g.maps_begin; map; map = map->next) {
+		if (!(map->flags & MapFlags_Loaded) || map->cull == CullResult_Outside)
+			continue;
+
+		const struct AVec3f translation = aVec3fAdd(map->offset, map->debug_offset);
+		const CullBox box = {
+			aVec3fAdd(map->model.aabb.min, translation),
+			aVec3fAdd(map->model.aabb.max, translation)
+		};
+		if (!occlusionBufferTestBox(buffer, &box))
+			map->cull = CullResult_Outside;
+	}
+}
+
 static void opensrcPaint(ATimeUs timestamp, float dt) {
 	(void)(timestamp); (void)(dt);
 
@@ -313,31 +588,41 @@ static void opensrcPaint(ATimeUs timestamp, float dt) {
 	cameraMove(&g.camera, aVec3f(g.right * move, 0.f, -g.forward * move));
 	cameraRecompute(&g.camera);
 
+	loaderUpdate(LOADER_FRAME_BUDGET_US);
+	opensrcLoadMaps();
+
+	CullFrustum frustum;
+	cullFrustumFromMatrix(&frustum, &g.camera.view_projection);
+	opensrcCullMaps(&frustum);
+	if (g_cfg.software_occlusion)
+		opensrcOccludeMaps();
+	const int maps_hidden = g.occluders.boxes_occluded;
+
 	renderBegin();
 
 	int triangles = 0;
-	int can_load_map = 1;
 	for (struct Map *map = g.maps_begin; map; map = map->next) {
-		if (map->flags & MapFlags_Broken)
+		if (!(map->flags & MapFlags_Loaded))
 			continue;
 
-		if (!(map->flags & MapFlags_Loaded)) {
-			if (can_load_map) {
-				if (BSPLoadResult_Success != loadMap(map, g.collection_chain))
-					map->flags |= MapFlags_Broken;
-			}
-
-			can_load_map = 0;
-			continue;
-		}
+		const struct AVec3f translation = aVec3fAdd(map->offset, map->debug_offset);
+		if (map->cull != CullResult_Outside)
+			bspModelUpdateVisibility(&map->model, aVec3fSub(g.camera.pos, translation));
 
 		const RDrawParams params = {
 			.camera = &g.camera,
-			.translation = aVec3fAdd(map->offset, map->debug_offset),
-			.selected = map == g.selected_map
+			.translation = translation,
+			.selected = map == g.selected_map,
+			/* draws of maps entirely in view don't need to be tested one by one */
+			.frustum = map->cull == CullResult_Intersects ? &frustum : NULL,
+			.culled = map->cull == CullResult_Outside,
+			.occlusion = g_cfg.occlusion_queries ? &map->occlusion : NULL,
+			.occluders = g_cfg.software_occlusion ? &g.occluders : NULL,
 		};
 
 		renderModelDraw(&params, &map->model);
+		if (params.culled)
+			continue;
 
 		for (int i = 0; i < map->model.detailed.draws_count; ++i)
 			triangles += map->model.detailed.draws[i].count / 3;
@@ -345,6 +630,30 @@ static void opensrcPaint(ATimeUs timestamp, float dt) {
 
 	renderEnd(&g.camera);
 
+	const RStats *stats = renderGetStats();
+	if (stats->models_occluded != g.models_occluded) {
+		g.models_occluded = stats->models_occluded;
+		PRINTF("Occluded maps: %d, draws: %d, occlusion queries: %d",
+			stats->models_occluded, stats->draws_occluded, stats->occlusion_queries);
+	}
+
+	if (stats->draw_calls != g.draw_calls) {
+		const RStateChanges *sorted = &stats->state_changes, *unsorted = &stats->state_changes_unsorted;
+		g.draw_calls = stats->draw_calls;
+		PRINTF("Draw calls: %d; programs, textures, lightmaps, buffers, uniforms: sorted %d/%d/%d/%d/%d, unsorted %d/%d/%d/%d/%d",
+			stats->draw_calls,
+			sorted->programs, sorted->textures, sorted->lightmaps, sorted->buffers, sorted->uniforms,
+			unsorted->programs, unsorted->textures, unsorted->lightmaps, unsorted->buffers, unsorted->uniforms);
+	}
+
+	if (g_cfg.software_occlusion && maps_hidden != g.maps_hidden) {
+		g.maps_hidden = maps_hidden;
+		PRINTF("Hidden behind occluders: %d maps, %d draws; %d occluder triangles",
+			maps_hidden, g.occluders.boxes_occluded - maps_hidden, g.occluders.triangles);
+	}
+
+	textureStreamUpdate(&stack_temp);
+
 	// if (profilerFrame(&stack_temp)) {
 	// 	PRINTF("Total triangles: %d", triangles);
 	// }
@@ -591,6 +900,12 @@ static VMFAction configReadCallback(VMFState *state, VMFEntryType entry, const V
 			g_cfg.maps_limit = atoi(kv->value.str);
 		} else if (strncasecmp("map", kv->key.str, kv->key.length) == 0) {
 			openSourceAddMap(kv->value);
+		} else if (strncasecmp("max_texture_size", kv->key.str, kv->key.length) == 0) {
+			// FIXME null-terminate
+			g_cfg.max_texture_size = atoi(kv->value.str);
+		} else if (strncasecmp("texture_budget", kv->key.str, kv->key.length) == 0) {
+			// FIXME null-terminate
+			g_cfg.texture_budget = atoi(kv->value.str);
 		} else if (strncasecmp("z_far", kv->key.str, kv->key.length) == 0) {
 			// FIXME null-terminate
 			g.R = (float)atof(kv->value.str);
@@ -671,19 +986,24 @@ const char *getDefaultSteamBaseDir() {
 typedef int (*ArgFunc)(const char *value, void *user_ptr);
 
 typedef struct {
-	const char *arg;
+	const char *arg; /* single letter for -x, longer names are given as --name */
 	const char *desc;
 	ArgFunc func;
 	void *user_ptr;
+	int no_value; /* boolean flag, func is called with NULL value */
 } Arg;
 
+static const char *argPrefix(const Arg *arg) {
+	return arg->arg[0] && arg->arg[1] ? "--" : "-";
+}
+
 void argsPrintUsage(const Arg* args, int nargs, char const* prog) {
 	PRINTF("Usage: %s", prog);
 	const Arg* in = NULL;
 	for (int i = 0; i < nargs; ++i) {
 		const Arg* arg = args + i;
 		if (arg->arg) {
-			PRINTF("\t-%s: %s", arg->arg, arg->desc);
+			PRINTF("\t%s%s: %s", argPrefix(arg), arg->arg, arg->desc);
 		} else {
 			if (!in)
 				in = arg;
@@ -705,8 +1025,6 @@ int argsParse(const Arg* args, int nargs, int argc, char const* const* argv) {
 
 	// TODO:
 	// - handle '--' as delimiter
-	// - handle boolean flags w/o arguments
-	// - long/short args
 	// - optional/mandatory args
 	for (int i = 1; i < argc; ++i) {
 		char const *arg = argv[i];
@@ -714,16 +1032,29 @@ int argsParse(const Arg* args, int nargs, int argc, char const* const* argv) {
 		if (arg[0] == '-') {
 			for (int j = 0; j < nargs; ++j) {
 				const Arg* parg = args + j;
-				if (parg->arg && arg[1] == parg->arg[0]) {
-					if (i == argc - 1) {
-						PRINTF("Option %s requres an argument", arg);
-						return 0;
-					}
+				if (!parg->arg)
+					continue;
+
+				const int matches = (arg[1] == '-')
+					? strcmp(arg + 2, parg->arg) == 0
+					: arg[1] == parg->arg[0] && parg->arg[1] == '\0';
+				if (!matches)
+					continue;
+
+				if (parg->no_value) {
 					handler = parg;
-					++i;
-					arg = argv[i];
+					arg = NULL;
 					break;
 				}
+
+				if (i == argc - 1) {
+					PRINTF("Option %s requres an argument", arg);
+					return 0;
+				}
+				handler = parg;
+				++i;
+				arg = argv[i];
+				break;
 			}
 		} else {
 			handler = in;
@@ -735,7 +1066,7 @@ int argsParse(const Arg* args, int nargs, int argc, char const* const* argv) {
 		}
 
 		if (handler->func(arg, handler->user_ptr) == 0) {
-			PRINTF("Error handling %s%s with argument '%s'", handler->arg ? "option -" : "free option", handler->arg ? handler->arg : "", arg);
+			PRINTF("Error handling %s%s with argument '%s'", handler->arg ? "option " : "free option", handler->arg ? handler->arg : "", arg ? arg : "");
 			return 0;
 		}
 	}
@@ -749,6 +1080,13 @@ int argStoreString(const char *str, void *user_ptr) {
 	return 1;
 }
 
+int argStoreFlag(const char *str, void *user_ptr) {
+	(void)str;
+	int *pint = user_ptr;
+	*pint = 1;
+	return 1;
+}
+
 int argStoreInt(const char *str, void *user_ptr) {
 	int *pint = user_ptr;
 	// FIXME null-terminate
@@ -795,13 +1133,24 @@ int argAddMap(const char *str, void *unused) {
 }
 
 static Arg g_args[] = {
-	{"s", "Override steam basedir", argStoreString, (void*)&g_cfg.steam_basedir},
-	{"m", "Add map name to list of maps to load", argAddMap, NULL},
-	{"p", "Add VPK file to list of files to load assets from", argAddVpkToCollection, NULL},
-	{"d", "Add directory to list of files to load assets from", argAddDirToCollection, NULL},
-	{"n", "Specify a limit of number of maps to load", argStoreInt, &g_cfg.maps_limit},
+	{"s", "Override steam basedir", argStoreString, (void*)&g_cfg.steam_basedir, 0},
+	{"m", "Add map name to list of maps to load", argAddMap, NULL, 0},
+	{"p", "Add VPK file to list of files to load assets from", argAddVpkToCollection, NULL, 0},
+	{"d", "Add directory to list of files to load assets from", argAddDirToCollection, NULL, 0},
+	{"n", "Specify a limit of number of maps to load", argStoreInt, &g_cfg.maps_limit, 0},
+	{"j", "Number of background map loading threads, 0 to load on main thread", argStoreInt, &g_cfg.loader_threads, 0},
+	{"cook-dir", "Directory to keep cooked map geometry in for faster loading, \"\" to disable (default: cooked)", argStoreString, (void*)&g_cfg.cook_dir, 0},
+	{"max-texture-size", "Use smaller stored mips of textures larger than this, 0 for no limit (default: 0)", argStoreInt, &g_cfg.max_texture_size, 0},
+	{"texture-budget", "Stream textures in and out to keep them within this many MiB of video memory, 0 to load everything at once (default: 0)", argStoreInt, &g_cfg.texture_budget, 0},
+	{"packed-vertices", "Store map geometry as 20-byte quantized vertices instead of 32-byte float ones, 0 or 1 (default: 1 on Raspberry Pi, 0 otherwise)", argStoreInt, &g_cfg.packed_vertices, 0},
+	{"occlusion-queries", "Skip maps hidden behind other maps using GPU occlusion queries, 0 or 1 (default: 1)", argStoreInt, &g_cfg.occlusion_queries, 0},
+	{"software-occlusion", "Skip maps and draws hidden behind large faces rasterized on CPU, 0 or 1 (default: 1 on Raspberry Pi, 0 otherwise)", argStoreInt, &g_cfg.software_occlusion, 0},
+	{"headless", "Load all maps without drawing them and exit, printing load timings and memory usage; still opens a window, use OpenSourceHeadless where there is no display", argStoreFlag, &g_cfg.headless, 1},
+	{"etc1-benchmark", "Compare ETC1 texture packing speed and quality on a synthetic image and exit", argStoreFlag, &g_cfg.etc1_benchmark, 1},
+	{"lightmap-benchmark", "Compare lightmap color conversion speed on synthetic samples and exit", argStoreFlag, &g_cfg.lightmap_benchmark, 1},
+	{"occlusion-test", "Check software occlusion culling of boxes around a synthetic wall from several camera poses and exit", argStoreFlag, &g_cfg.occlusion_test, 1},
 	// TODO -h
-	{NULL, "Game configuration file to load", argReadConfigFile, NULL},
+	{NULL, "Game configuration file to load", argReadConfigFile, NULL, 0},
 };
 
 void attoAppInit(struct AAppProctable *proctable) {
@@ -816,6 +1165,26 @@ void attoAppInit(struct AAppProctable *proctable) {
 	g.R = 0;
 
 	g_cfg.maps_limit = 1;
+	g_cfg.loader_threads = 2;
+#ifdef OPENSOURCE_HEADLESS
+	g_cfg.headless = 1;
+#else
+	g_cfg.headless = 0;
+#endif
+	g_cfg.etc1_benchmark = 0;
+	g_cfg.lightmap_benchmark = 0;
+	g_cfg.cook_dir = "cooked";
+	g_cfg.max_texture_size = 0;
+	g_cfg.texture_budget = 0;
+#ifdef ATTO_PLATFORM_RPI
+	g_cfg.packed_vertices = 1;
+	g_cfg.software_occlusion = 1;
+#else
+	g_cfg.packed_vertices = 0;
+	g_cfg.software_occlusion = 0;
+#endif
+	g_cfg.occlusion_queries = 1;
+	g_cfg.occlusion_test = 0;
 	g_cfg.steam_basedir = getDefaultSteamBaseDir();
 	PRINTF("Default platform steam basedir = %s", g_cfg.steam_basedir);
 
@@ -827,13 +1196,40 @@ void attoAppInit(struct AAppProctable *proctable) {
 	if (g_cfg.maps_limit < 1)
 		g_cfg.maps_limit = 1;
 
+	if (g_cfg.loader_threads < 0)
+		g_cfg.loader_threads = 0;
+
+	if (g_cfg.texture_budget < 0)
+		g_cfg.texture_budget = 0;
+
+	if (g_cfg.etc1_benchmark) {
+		etc1Init(aThreadCpuCount() - 1);
+		etc1Benchmark();
+		aAppTerminate(0);
+	}
+
+	if (g_cfg.lightmap_benchmark) {
+		rgbeInit();
+		rgbeBenchmark();
+		aAppTerminate(0);
+	}
+
+	if (g_cfg.occlusion_test) {
+		occlusionInit();
+		aAppTerminate(occlusionSelfTest() ? 0 : 1);
+	}
+
 	if (!g.maps_count || !g.collection_chain) {
 		aAppDebugPrintf("At least one map and one collection required");
 		goto print_usage_and_exit;
 	}
 
+	const ATimeUs start = aAppTime();
 	opensrcInit();
 
+	if (g_cfg.headless)
+		opensrcRunHeadless(start);
+
 	proctable->resize = opensrcResize;
 	proctable->paint = opensrcPaint;
 	proctable->key = opensrcKeyPress;
@@ -36,6 +36,7 @@ typedef struct {
 } AHash;
 
 void aHashInit(AHash *hash);
+/* returns pointer to inserted value copy */
 void *aHashInsert(AHash *hash, const void *key, const void *value);
 void *aHashGet(const AHash *hash, const void *key);
 
@@ -113,7 +114,7 @@ void *aHashInsert(AHash *hash, const void *key, const void *value) {
 	++bucket->count;
 	if (bucket->count > hash->stat.worst_bucket_items) hash->stat.worst_bucket_items = bucket->count;
 	++hash->stat.items;
-	return new_item;
+	return item_data.value;
 }
 
 void *aHashGet(const AHash *hash, const void *key) {
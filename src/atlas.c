@@ -1,96 +1,201 @@
 #include "atlas.h"
+#include <stdlib.h> /* qsort */
+#include <string.h> /* memmove */
+#include <limits.h>
 
-struct AtlasRect { unsigned int x, y, w, h; };
+struct AtlasItem { unsigned int w, h, index; };
+
+/* tallest first, then widest first */
+static int atlasItemCompare(const void *a, const void *b) {
+	const struct AtlasItem *ia = a, *ib = b;
+	if (ia->h != ib->h) return ia->h < ib->h ? 1 : -1;
+	if (ia->w != ib->w) return ia->w < ib->w ? 1 : -1;
+	return ia->index < ib->index ? -1 : ia->index > ib->index;
+}
+
+struct AtlasSkylineFit {
+	unsigned int y;
+	/* pixels between skyline and bottom of the rect */
+	unsigned int waste;
+	/* right edge of rect is also right edge of a skyline segment */
+	int exact;
+};
+
+/* returns 0 if rect of width w doesn't fit horizontally when put at the beginning of node i */
+static int atlasSkylineFit(const struct AtlasSkylineNode *nodes, unsigned int i, unsigned int w,
+		unsigned int width, struct AtlasSkylineFit *fit) {
+	if (nodes[i].x + w > width)
+		return 0;
+
+	fit->y = 0;
+	unsigned int j = i;
+	for (unsigned int left = w; left; ++j) {
+		if (nodes[j].y > fit->y) fit->y = nodes[j].y;
+		left -= nodes[j].w < left ? nodes[j].w : left;
+	}
+
+	fit->waste = 0;
+	fit->exact = 0;
+	for (unsigned int left = w; left; ++i) {
+		const unsigned int span = nodes[i].w < left ? nodes[i].w : left;
+		fit->waste += (fit->y - nodes[i].y) * span;
+		fit->exact = span == nodes[i].w;
+		left -= span;
+	}
+
+	return 1;
+}
+
+void atlasSkylineInit(struct AtlasSkyline *skyline, unsigned int width, unsigned int height,
+		struct AtlasSkylineNode *nodes, unsigned int max_nodes) {
+	skyline->width = width;
+	skyline->height = height;
+	skyline->nodes = nodes;
+	skyline->max_nodes = max_nodes;
+	skyline->nodes_count = 1;
+	nodes[0].x = nodes[0].y = 0;
+	nodes[0].w = width;
+}
+
+int atlasSkylineAdd(struct AtlasSkyline *skyline, struct AtlasVec size, struct AtlasVec *pos, int *exact) {
+	struct AtlasSkylineNode *const nodes = skyline->nodes;
+	if (skyline->nodes_count >= skyline->max_nodes)
+		return 0;
+
+	/* lowest top edge wins, then least waste under the rect */
+	unsigned int best = skyline->nodes_count, best_top = UINT_MAX;
+	struct AtlasSkylineFit best_fit = {0, 0, 0};
+	for (unsigned int j = 0; j < skyline->nodes_count; ++j) {
+		struct AtlasSkylineFit fit;
+		if (!atlasSkylineFit(nodes, j, size.x, skyline->width, &fit))
+			break;
+
+		const unsigned int top = fit.y + size.y;
+		if (top > skyline->height)
+			continue;
+
+		if (top < best_top || (top == best_top && fit.waste < best_fit.waste)) {
+			best = j;
+			best_top = top;
+			best_fit = fit;
+		}
+	}
+
+	if (best == skyline->nodes_count)
+		return 0;
+
+	const unsigned int x = nodes[best].x, right = x + size.x;
+	pos->x = x;
+	pos->y = best_fit.y;
+	if (exact)
+		*exact = best_fit.waste == 0 && best_fit.exact;
+
+	/* raise skyline under the rect */
+	unsigned int nodes_count = skyline->nodes_count;
+	memmove(nodes + best + 1, nodes + best, sizeof(*nodes) * (nodes_count - best));
+	++nodes_count;
+	nodes[best].x = x;
+	nodes[best].y = best_top;
+	nodes[best].w = size.x;
+
+	for (unsigned int j = best + 1; j < nodes_count && nodes[j].x < right;) {
+		const unsigned int overlap = right - nodes[j].x;
+		if (overlap < nodes[j].w) {
+			nodes[j].x += overlap;
+			nodes[j].w -= overlap;
+			break;
+		}
+
+		memmove(nodes + j, nodes + j + 1, sizeof(*nodes) * (nodes_count - j - 1));
+		--nodes_count;
+	}
+
+	/* merge with neighbours at the same height */
+	if (best + 1 < nodes_count && nodes[best + 1].y == nodes[best].y) {
+		nodes[best].w += nodes[best + 1].w;
+		memmove(nodes + best + 1, nodes + best + 2, sizeof(*nodes) * (nodes_count - best - 2));
+		--nodes_count;
+	}
+	if (best > 0 && nodes[best - 1].y == nodes[best].y) {
+		nodes[best - 1].w += nodes[best].w;
+		memmove(nodes + best, nodes + best + 1, sizeof(*nodes) * (nodes_count - best - 1));
+		--nodes_count;
+	}
+
+	skyline->nodes_count = nodes_count;
+	return 1;
+}
 
 /* temp memory is freed by caller */
 enum AtlasResult atlasCompute(const struct AtlasContext* context) {
-	const unsigned int max_rects_count = 1 + context->rects_count;
-	unsigned int rects_count = 1;
-	if (context->temp_storage.size < sizeof(struct AtlasRect) * max_rects_count)
+	const unsigned int count = context->rects_count;
+	if (context->temp_storage.size < sizeof(struct AtlasItem) * count + sizeof(struct AtlasSkylineNode) * (1 + count))
 		return Atlas_ErrorInsufficientTemp;
-	struct AtlasRect *rects = context->temp_storage.ptr;
+	struct AtlasItem *items = context->temp_storage.ptr;
+	struct AtlasSkylineNode *nodes = (void*)(items + count);
 
-	rects[0].x = rects[0].y = 0;
-	rects[0].w = context->width; rects[0].h = context->height;
-
-	for (unsigned int i = 0; i < context->rects_count; ++i) {
+	for (unsigned int i = 0; i < count; ++i) {
 		const struct AtlasVec * const item = (void*)((char*)context->rects + i * context->rects_stride);
-		const unsigned int area = item->x * item->y;
-
-		/* find best fit for this rect */
-		struct AtlasRect *fit = 0;
-		struct AtlasRect *first_empty = 0; /* optimization */
-		unsigned int wasted_area = context->width * context->height;
-		for (unsigned int j = 0; j < rects_count; ++j) {
-			struct AtlasRect *const r = rects + j;
-			if (!first_empty && (!r->w || !r->h)) first_empty = r;
-
-			if (r->w < item->x || r->h < item->y)
-				continue;
-
-			/* exact match is the best */
-			if (r->w == item->x && r->h == item->y) {
-				fit = r;
-				break;
-			}
-
-			const unsigned int r_area = r->w * r->h;
-			const unsigned int fit_waste = r_area - area;
-			if (!fit || ((r->w < fit->w || r->h < fit->h) && (fit_waste <= wasted_area))) {
-				wasted_area = fit_waste;
-				fit = r;
-			}
-		} /* find best fit in all empty rects */
-
-		if (!fit)
-			/* cannot allocate space for this lightmap fragment */
-			return Atlas_ErrorDoesntFit;
+		items[i].w = item->x;
+		items[i].h = item->y;
+		items[i].index = i;
+	}
+	qsort(items, count, sizeof(*items), atlasItemCompare);
 
-		struct AtlasVec * const pos = (void*)((char*)context->pos + i * context->pos_stride);
+	const unsigned int max_pages = context->max_pages ? context->max_pages : 1;
+	unsigned int page = 0;
+	struct AtlasSkyline skyline;
+	atlasSkylineInit(&skyline, context->width, context->height, nodes, 1 + count);
 
-		pos->x = fit->x;
-		pos->y = fit->y;
+	struct AtlasStats stats;
+	memset(&stats, 0, sizeof(stats));
+	struct AtlasVec page_used = {0, 0};
+	unsigned int page_area = 0;
 
-		/* how to split */
-		unsigned int rem_width = fit->w - item->x;
-		unsigned int rem_height = fit->h - item->y;
-		if (!rem_width && !rem_height) {
-			fit->w = fit->h = 0;
+	for (unsigned int i = 0; i < count; ++i) {
+		const struct AtlasItem *const item = items + i;
+		struct AtlasVec * const pos = (void*)((char*)context->pos + item->index * context->pos_stride);
+		unsigned int * const pos_page = context->page
+			? (void*)((char*)context->page + item->index * context->page_stride) : NULL;
+
+		if (!item->w || !item->h) {
+			pos->x = pos->y = 0;
+			if (pos_page) *pos_page = 0;
+			continue;
+		}
+
+		const struct AtlasVec size = {item->w, item->h};
+		int exact;
+		if (!atlasSkylineAdd(&skyline, size, pos, &exact)) {
+			/* cannot allocate space for this lightmap fragment */
+			if (page + 1 >= max_pages || !page_area)
+				return Atlas_ErrorDoesntFit;
+
+			/* start a new page and try this rect again */
+			stats.wasted_pixels += page_used.x * page_used.y - page_area;
+			page_used.x = page_used.y = 0;
+			page_area = 0;
+			++page;
+			atlasSkylineInit(&skyline, context->width, context->height, nodes, 1 + count);
+			--i;
 			continue;
 		}
 
-		if (rem_width && rem_height && !first_empty)
-			first_empty = rects + (rects_count++);
-
-		/* split! */
-		if (rem_width > rem_height) {
-			if (rem_height) {
-				first_empty->x = fit->x + item->x;
-				first_empty->y = fit->y;
-				first_empty->w = rem_width;
-				first_empty->h = fit->h;
-				fit->y += item->y;
-				fit->w = item->x;
-				fit->h = rem_height;
-			} else {
-				fit->x += item->x;
-				fit->w = rem_width;
-			}
-		} else {
-			if (rem_width) {
-				first_empty->x = fit->x;
-				first_empty->y = fit->y + item->y;
-				first_empty->w = fit->w;
-				first_empty->h = rem_height;
-				fit->x += item->x;
-				fit->w = rem_width;
-				fit->h = item->y;
-			} else {
-				fit->y += item->y;
-				fit->h = rem_height;
-			}
-		} /* split */
+		if (pos_page) *pos_page = page;
+
+		const unsigned int right = pos->x + item->w, top = pos->y + item->h;
+		stats.exact_matches += exact;
+		if (right > page_used.x) page_used.x = right;
+		if (top > page_used.y) page_used.y = top;
+		if (right > stats.used.x) stats.used.x = right;
+		if (top > stats.used.y) stats.used.y = top;
+		page_area += item->w * item->h;
 	} /* for all input rects */
 
+	stats.wasted_pixels += page_used.x * page_used.y - page_area;
+	stats.pages = page + 1;
+	if (context->stats)
+		*context->stats = stats;
+
 	return Atlas_Success;
 }
@@ -9,16 +9,28 @@ enum AtlasResult {
 
 struct AtlasVec { unsigned int x, y; };
 
+struct AtlasStats {
+	/* bounding box of all placed rects on all pages */
+	struct AtlasVec used;
+	unsigned int pages;
+	/* pixels inside used area of each page not covered by any rect */
+	unsigned int wasted_pixels;
+	/* rects that exactly filled a gap in skyline */
+	unsigned int exact_matches;
+};
+
 struct AtlasContext {
 	/* temporary buffer/scrap space for atlas to use */
-	/* worst case consumption: 4 * sizeof(unsigned int) * (1 + rects_count) */
+	/* worst case consumption: 6 * sizeof(unsigned int) * (1 + rects_count) */
 	struct {
 		void *ptr;
 		unsigned int size;
 	} temp_storage;
-	
+
 	/* input */
 	unsigned int width, height;
+	/* rects that don't fit are put onto next page of the same size, up to this many pages; 0 is the same as 1 */
+	unsigned int max_pages;
 	const struct AtlasVec *rects;
 	unsigned int rects_count;
 	unsigned int rects_stride;
@@ -26,16 +38,32 @@ struct AtlasContext {
 	/* output */
 	struct AtlasVec *pos;
 	unsigned int pos_stride;
+	/* page of each rect, can be NULL if max_pages <= 1 */
+	unsigned int *page;
+	unsigned int page_stride;
+	/* optional, can be NULL */
+	struct AtlasStats *stats;
 };
 
-/* TODO ?
-struct AtlasStats {
-	unsigned int wasted_pixels;
-	struct AtlasVec min_waste, max_waste;
-	unsigned int exact_matches;
+/* segment of skyline: top edge of already placed rects, nodes are sorted by x and cover whole width */
+struct AtlasSkylineNode { unsigned int x, y, w; };
+
+/* Single page that rects can be added to one by one, e.g. as maps stream in.
+ * Every added rect takes at most one more node */
+struct AtlasSkyline {
+	unsigned int width, height;
+	struct AtlasSkylineNode *nodes;
+	unsigned int nodes_count, max_nodes;
 };
-*/
 
+void atlasSkylineInit(struct AtlasSkyline *skyline, unsigned int width, unsigned int height,
+		struct AtlasSkylineNode *nodes, unsigned int max_nodes);
+/* returns 0 if rect doesn't fit; exact, if not NULL, is set when rect filled a gap in skyline exactly */
+int atlasSkylineAdd(struct AtlasSkyline *skyline, struct AtlasVec size, struct AtlasVec *pos, int *exact);
+
+/* Skyline packer: rects are placed tallest first, each one at the lowest spot along the top edge of
+ * already placed ones, preferring spots that leave fewer pixels unusable under it.
+ * Once a rect doesn't fit, the page is closed and packing continues on the next one */
 enum AtlasResult atlasCompute(const struct AtlasContext* context);
 
 #endif /* ATLAS_H__INCLUDED */
@@ -1,10 +1,15 @@
 #include "bsp.h"
+#include "bspcook.h"
 #include "atlas.h"
+#include "lightmap.h"
+#include "rgbe.h"
+#include "vcache.h"
 #include "vbsp.h"
 #include "collection.h"
 #include "mempools.h"
 #include "vmfparser.h"
 #include "common.h"
+#include <limits.h> /* INT_MAX */
 
 // DEBUG
 #include "texture.h"
@@ -32,46 +37,191 @@ struct AnyLump {
 	uint32_t n;
 };
 
-struct Lumps {
-	uint32_t version;
+/* steps of loading that need lumps; a lump is read right before the first step that needs it,
+ * and is released as soon as all steps that need it are done */
+enum LumpUse {
+	LumpUse_Materials = (1 << 0), /* whole load */
+	LumpUse_Entities = (1 << 1),
+	LumpUse_Faces = (1 << 2),
+	LumpUse_Lightmaps = (1 << 3),
+	LumpUse_Draws = (1 << 4),
+	LumpUse_Visibility = (1 << 5),
+	LumpUse_All = 0x3f
+};
+
+/* order matters: when lump can't be used in place, it is read onto temp stack, and can only be freed early
+ * if it was the last thing allocated there */
 #define LIST_LUMPS \
-	BSPLUMP(Entity, char, entities); \
-	BSPLUMP(Plane, struct VBSPLumpPlane, planes); \
-	BSPLUMP(TexData, struct VBSPLumpTexData, texdata); \
-	BSPLUMP(Vertex, struct VBSPLumpVertex, vertices); \
-	\
-	BSPLUMP(Node, struct VBSPLumpNode, nodes); \
-	BSPLUMP(TexInfo, struct VBSPLumpTexInfo, texinfos); \
-	BSPLUMP(Face, struct VBSPLumpFace, faces); \
-	BSPLUMP(LightMap, struct VBSPLumpLightMap, lightmaps); \
-	\
-	BSPLUMP(Leaf, struct VBSPLumpLeaf, leaves); \
-	\
-	BSPLUMP(Edge, struct VBSPLumpEdge, edges); \
-	BSPLUMP(Surfedge, int32_t, surfedges); \
-	BSPLUMP(Model, struct VBSPLumpModel, models); \
+	BSPLUMP(PakFile, uint8_t, pakfile, LumpUse_Materials) \
+	BSPLUMP(Entity, char, entities, LumpUse_Entities) \
 	\
-	BSPLUMP(LeafFace, uint16_t, leaffaces); \
+	BSPLUMP(Model, struct VBSPLumpModel, models, LumpUse_Faces | LumpUse_Visibility) \
+	BSPLUMP(TexData, struct VBSPLumpTexData, texdata, LumpUse_Faces) \
+	BSPLUMP(TexDataStringData, char, texdatastringdata, LumpUse_Faces | LumpUse_Draws) /* material names */ \
+	BSPLUMP(TexDataStringTable, int32_t, texdatastringtable, LumpUse_Faces) \
+	BSPLUMP(Plane, struct VBSPLumpPlane, planes, LumpUse_Faces | LumpUse_Draws | LumpUse_Visibility) \
+	BSPLUMP(TexInfo, struct VBSPLumpTexInfo, texinfos, LumpUse_Faces | LumpUse_Draws) \
+	BSPLUMP(Face, struct VBSPLumpFace, faces, LumpUse_Faces | LumpUse_Draws) \
+	BSPLUMP(Vertex, struct VBSPLumpVertex, vertices, LumpUse_Faces | LumpUse_Draws) \
+	BSPLUMP(Edge, struct VBSPLumpEdge, edges, LumpUse_Faces | LumpUse_Draws) \
+	BSPLUMP(Surfedge, int32_t, surfedges, LumpUse_Faces | LumpUse_Draws) \
+	BSPLUMP(DispInfo, struct VBSPLumpDispInfo, dispinfos, LumpUse_Faces | LumpUse_Draws) \
+	BSPLUMP(Leaf, uint8_t, leaves, LumpUse_Faces | LumpUse_Visibility) /* see bspLeaf() */ \
+	BSPLUMP(LeafFace, uint16_t, leaffaces, LumpUse_Faces) \
 	\
-	BSPLUMP(DispInfo, struct VBSPLumpDispInfo, dispinfos); \
+	BSPLUMP(LightMap, struct VBSPLumpLightMap, lightmaps, LumpUse_Lightmaps) \
 	\
-	BSPLUMP(DispVerts, struct VBSPLumpDispVert, dispverts); \
+	BSPLUMP(DispVerts, struct VBSPLumpDispVert, dispverts, LumpUse_Draws) \
 	\
-	BSPLUMP(PakFile, uint8_t, pakfile); \
-	\
-	BSPLUMP(TexDataStringData, char, texdatastringdata); \
-	BSPLUMP(TexDataStringTable, int32_t, texdatastringtable); \
-	\
-	BSPLUMP(FaceHDR, struct VBSPLumpFace, faces_hdr); \
-	\
-	BSPLUMP(LightMapHDR, struct VBSPLumpLightMap, lightmaps_hdr); \
+	BSPLUMP(Node, struct VBSPLumpNode, nodes, LumpUse_Visibility) \
+	BSPLUMP(Visibility, uint8_t, visibility, LumpUse_Visibility) \
 
+enum LumpIndex {
+#define BSPLUMP(name,type,field,use) LumpIndex_##name,
+	LIST_LUMPS
+#undef BSPLUMP
+	LumpIndex_COUNT
+};
 
-#define BSPLUMP(name,type,field) struct{const type *p;uint32_t n;} field
+/* element counts are known before lumps are read, pointers are NULL until then */
+struct Lumps {
+	uint32_t version;
+	uint32_t leaf_size;
+#define BSPLUMP(name,type,field,use) struct{const type *p;uint32_t n;} field;
 	LIST_LUMPS
 #undef BSPLUMP
 };
 
+struct LumpsLoader {
+	struct IFile *file;
+	struct Stack *tmp;
+	const struct VBSPHeader *header;
+	/* map has only HDR lighting, use Face and LightMap lumps from there */
+	int hdr_only;
+	struct Lumps lumps;
+	struct {
+		struct AnyLump *lump;
+		const void *data;
+		uint32_t size;
+		int loaded;
+	} state[LumpIndex_COUNT];
+};
+
+static const char *lump_names[LumpIndex_COUNT] = {
+#define BSPLUMP(name,type,field,use) #name,
+	LIST_LUMPS
+#undef BSPLUMP
+};
+
+static const unsigned lump_uses[LumpIndex_COUNT] = {
+#define BSPLUMP(name,type,field,use) use,
+	LIST_LUMPS
+#undef BSPLUMP
+};
+
+static const int lump_header_index[LumpIndex_COUNT] = {
+#define BSPLUMP(name,type,field,use) VBSP_Lump_##name,
+	LIST_LUMPS
+#undef BSPLUMP
+};
+
+static const struct VBSPLumpHeader *lumpHeader(const struct LumpsLoader *loader, enum LumpIndex index) {
+	int lump = lump_header_index[index];
+	if (loader->hdr_only) {
+		if (lump == VBSP_Lump_Face) lump = VBSP_Lump_FaceHDR;
+		else if (lump == VBSP_Lump_LightMap) lump = VBSP_Lump_LightMapHDR;
+	}
+	return loader->header->lump_headers + lump;
+}
+
+static void lumpsInit(struct LumpsLoader *loader, struct IFile *file, struct Stack *tmp,
+		const struct VBSPHeader *header) {
+	memset(loader, 0, sizeof(*loader));
+	loader->file = file;
+	loader->tmp = tmp;
+	loader->header = header;
+	loader->lumps.version = header->version;
+	loader->hdr_only = header->lump_headers[VBSP_Lump_LightMap].size == 0;
+	loader->lumps.leaf_size = header->lump_headers[VBSP_Lump_Leaf].version == 0 ? VBSP_LEAF_SIZE_V0 : VBSP_LEAF_SIZE_V1;
+
+#define BSPLUMP(name,type,field,use) \
+	loader->state[LumpIndex_##name].lump = (struct AnyLump*)&loader->lumps.field; \
+	loader->lumps.field.n = lumpHeader(loader, LumpIndex_##name)->size / sizeof(type);
+	LIST_LUMPS
+#undef BSPLUMP
+}
+
+static int lumpRead(struct LumpsLoader *loader, enum LumpIndex index) {
+	const char *name = lump_names[index];
+	const struct VBSPLumpHeader *header = lumpHeader(loader, index);
+	struct IFile *file = loader->file;
+	const void *data;
+
+	/* lump structures can only be used in place if they are properly aligned */
+	if (header->file_offset % 4 == 0) {
+		data = collectionFileMap(file, header->file_offset, header->size, loader->tmp);
+		if (!data) {
+			PRINTF("Cannot get lump %s of %u bytes", name, header->size);
+			return 0;
+		}
+	} else {
+		void *buffer = stackAlloc(loader->tmp, header->size);
+		if (!buffer) {
+			PRINTF("Not enough temp memory to allocate storage for lump %s; need: %u (%x)", name, header->size, header->size);
+			return 0;
+		}
+
+		const size_t bytes = file->read(file, header->file_offset, header->size, buffer);
+		if (bytes != header->size) {
+			PRINTF("Cannot read full lump %s, read only %zu bytes out of %u", name, bytes, header->size);
+			return 0;
+		}
+		data = buffer;
+	}
+
+	PRINTF("Read lump %s, offset %u, size %u bytes = %u elements",
+			name, header->file_offset, header->size, loader->state[index].lump->n);
+
+	loader->state[index].lump->p = data;
+	loader->state[index].data = data;
+	loader->state[index].size = header->size;
+	loader->state[index].loaded = 1;
+	return 1;
+}
+
+/* read all lumps needed by any of use steps */
+static int lumpsAcquire(struct LumpsLoader *loader, unsigned use) {
+	for (int i = 0; i < LumpIndex_COUNT; ++i) {
+		if (loader->state[i].loaded || !(lump_uses[i] & use))
+			continue;
+
+		if (!lumpRead(loader, (enum LumpIndex)i))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* release all lumps that are not needed by steps other than done */
+static void lumpsRelease(struct LumpsLoader *loader, unsigned done) {
+	for (int i = LumpIndex_COUNT - 1; i >= 0; --i) {
+		if (!loader->state[i].loaded || (lump_uses[i] & ~done))
+			continue;
+
+		collectionFileUnmap(loader->file, loader->state[i].data, loader->state[i].size, loader->tmp);
+		loader->state[i].loaded = 0;
+		loader->state[i].lump->p = NULL;
+	}
+}
+
+static uint32_t bspLeavesCount(const struct Lumps *lumps) {
+	return lumps->leaves.n / lumps->leaf_size;
+}
+
+static const struct VBSPLumpLeaf *bspLeaf(const struct Lumps *lumps, uint32_t index) {
+	return (const struct VBSPLumpLeaf*)(lumps->leaves.p + (size_t)index * lumps->leaf_size);
+}
+
 /* data needed for making lightmap atlas */
 struct Face {
 	const struct VBSPLumpFace *vface;
@@ -79,21 +229,36 @@ struct Face {
 	int vertices;
 	int indices;
 	int width, height;
-	const struct VBSPLumpLightMap *samples;
+	unsigned sample_offset; /* in lightmap lump */
 	const struct VBSPLumpTexInfo *texinfo;
 	const struct VBSPLumpTexData *texdata;
 	const struct VBSPLumpDispInfo *dispinfo;
 	int dispquadvtx[4]; // filled only when displaced
 	int dispstartvtx;
 	const Material *material;
+	const char *material_name;
+
+	/* rect in atlas: lightmap size, 2x2 for the first face of each constant color, 0x0 for the rest of them */
+	int atlas_width, atlas_height;
+	/* -1 if lightmap samples differ, otherwise index of face whose slot of lightmap_color is used */
+	int lightmap_owner;
+	uint16_t lightmap_color;
 
 	/* filled as a result of atlas allocation */
 	int atlas_x, atlas_y;
+	unsigned atlas_page;
+
+	/* index into BSPVisibility.cluster_sets */
+	unsigned cluster_set;
+
+	/* position of face center along Z-order curve through model bounds */
+	uint32_t morton;
 };
 
 struct LoadModelContext {
 	struct Stack *tmp;
 	struct ICollection *collection;
+	struct LumpsLoader *loader;
 	const struct Lumps *lumps;
 	const struct VBSPLumpModel *model;
 	struct Face *faces;
@@ -105,8 +270,18 @@ struct LoadModelContext {
 		int pixels;
 		int max_width;
 		int max_height;
-		RTexture texture;
+		/* atlas pages sizes, each page becomes a region of a shared lightmap page */
+		int pages_count;
+		struct {
+			int width, height;
+		} pages[BSP_MAX_LIGHTMAP_PAGES];
+		LightmapRegion *regions;
+		/* all pages back to back, kept until the model is loaded for cooking */
+		const uint16_t *atlas_pixels;
 	} lightmap;
+	/* non-NULL if loaded model should be cooked */
+	const BSPCookKey *cook_key;
+	StringView name;
 };
 
 enum FacePreload {
@@ -117,10 +292,8 @@ enum FacePreload {
 
 static struct {
 	const Material *coarse_material;
-	struct {
-		int color[256];
-		int exponent[256];
-	} lightmap_tables;
+	BSPVertexFormat vertex_format;
+	int index_size;
 } bsp_global;
 
 static inline int shouldSkipFace(const struct VBSPLumpFace *face, const struct Lumps *lumps) {
@@ -155,6 +328,7 @@ static enum FacePreload bspFacePreloadMetadata(struct LoadModelContext *ctx,
 	const char *texture = lumps->texdatastringdata.p + texdatastringdata_offset;
 	//PRINTF("F%u: texture %s", index, face->texture);
 	face->material = materialGet(texture, ctx->collection, ctx->tmp);
+	face->material_name = texture;
 	if (!face->material)
 		return FacePreload_Skip;
 
@@ -239,11 +413,8 @@ static enum FacePreload bspFacePreloadMetadata(struct LoadModelContext *ctx,
 
 	face->width = lm_width;
 	face->height = lm_height;
-	face->samples = lumps->lightmaps.p + sample_offset;
-	if (lm_width > ctx->lightmap.max_width) ctx->lightmap.max_width = lm_width;
-	if (lm_height > ctx->lightmap.max_height) ctx->lightmap.max_height = lm_height;
+	face->sample_offset = sample_offset;
 
-	ctx->lightmap.pixels += lightmap_size;
 	ctx->vertices += face->vertices;
 	ctx->indices += face->indices;
 	ctx->faces_count++;
@@ -251,16 +422,73 @@ static enum FacePreload bspFacePreloadMetadata(struct LoadModelContext *ctx,
 	return FacePreload_Ok;
 }
 
+/* only applies to 16-bit indices */
 const int c_max_draw_vertices = 65536;
 
-static uint8_t scaleLightmapColor(int c, int exp) {
-	const unsigned c2 =
-		(bsp_global.lightmap_tables.exponent[exp+128] * bsp_global.lightmap_tables.color[c]) >> 12;
+static uint16_t lightmapColor565(unsigned r, unsigned g, unsigned b) {
+	return (uint16_t)(((r&0xf8) << 8) | ((g&0xfc) << 3) | (b >> 3));
+}
+
+/* samples that differ by less than this are lost in RGB565 anyway */
+#define BSP_LIGHTMAP_CONSTANT_TOLERANCE 4
+
+static int bspFaceLightmapConstant(const struct LoadModelContext *ctx, const struct Face *face, uint16_t *color) {
+	const struct VBSPLumpLightMap *const samples = ctx->lumps->lightmaps.p + face->sample_offset;
+	unsigned min[3] = {255, 255, 255}, max[3] = {0, 0, 0};
+	for (int i = 0; i < face->width * face->height; ++i) {
+		const unsigned c[3] = {
+			rgbeScaleColor(samples[i].r, samples[i].exponent),
+			rgbeScaleColor(samples[i].g, samples[i].exponent),
+			rgbeScaleColor(samples[i].b, samples[i].exponent)
+		};
+
+		for (int j = 0; j < 3; ++j) {
+			if (c[j] < min[j]) min[j] = c[j];
+			if (c[j] > max[j]) max[j] = c[j];
+			if (max[j] - min[j] > BSP_LIGHTMAP_CONSTANT_TOLERANCE)
+				return 0;
+		}
+	}
+
+	*color = lightmapColor565((min[0] + max[0]) / 2, (min[1] + max[1]) / 2, (min[2] + max[2]) / 2);
+	return 1;
+}
+
+/* Lots of faces are evenly lit (or not lit at all). Such faces share a single 2x2 slot per color,
+ * so that bilinear filtering of its center can't pick up neighbours */
+static enum BSPLoadResult bspLoadModelConstantLightmaps(struct LoadModelContext *ctx) {
+	int *const owners = stackAlloc(ctx->tmp, sizeof(int) * 65536);
+	if (!owners) return BSPLoadResult_ErrorTempMemory;
+	memset(owners, 0xff, sizeof(int) * 65536);
+
+	int constant = 0, slots = 0;
+	ctx->lightmap.pixels = ctx->lightmap.max_width = ctx->lightmap.max_height = 0;
+	for (int i = 0; i < ctx->faces_count; ++i) {
+		struct Face *const face = ctx->faces + i;
+		face->atlas_width = face->width;
+		face->atlas_height = face->height;
+		face->lightmap_owner = -1;
+
+		if (bspFaceLightmapConstant(ctx, face, &face->lightmap_color)) {
+			++constant;
+			if (owners[face->lightmap_color] < 0) {
+				owners[face->lightmap_color] = i;
+				face->atlas_width = face->atlas_height = 2;
+				++slots;
+			} else {
+				face->atlas_width = face->atlas_height = 0;
+			}
+			face->lightmap_owner = owners[face->lightmap_color];
+		}
 
-	//const int c1 = 255.f * pow(c * powf(2.f, exp) / 255.f, 1.0f / 2.2f) * .5f;
-	//PRINTF("%d^%d => %d, %d => %d", c, exp, c1, c2, c2 - c1);
+		if (face->atlas_width > ctx->lightmap.max_width) ctx->lightmap.max_width = face->atlas_width;
+		if (face->atlas_height > ctx->lightmap.max_height) ctx->lightmap.max_height = face->atlas_height;
+		ctx->lightmap.pixels += face->atlas_width * face->atlas_height;
+	}
 
-	return c2 < 255 ? (uint8_t)c2 : 255;
+	stackFreeUpToPosition(ctx->tmp, owners);
+	PRINTF("Lightmaps: %d of %d faces are constant, sharing %d slots", constant, ctx->faces_count, slots);
+	return BSPLoadResult_Success;
 }
 
 static enum BSPLoadResult bspLoadModelPreloadFaces(struct LoadModelContext *ctx) {
@@ -297,79 +525,262 @@ static enum BSPLoadResult bspLoadModelPreloadFaces(struct LoadModelContext *ctx)
 	return BSPLoadResult_Success;
 }
 
+struct FaceCluster { uint32_t face; uint16_t cluster; };
+
+static int faceClusterCompare(const void *a, const void *b) {
+	const struct FaceCluster *fa = a, *fb = b;
+	if (fa->face != fb->face)
+		return fa->face < fb->face ? -1 : 1;
+	return (int)fa->cluster - (int)fb->cluster;
+}
+
+struct FaceClusters { const struct FaceCluster *clusters; uint32_t count; uint32_t face; };
+
+static int faceClustersCompare(const void *a, const void *b) {
+	const struct FaceClusters *fa = a, *fb = b;
+	if (fa->count != fb->count)
+		return fa->count < fb->count ? -1 : 1;
+	for (uint32_t i = 0; i < fa->count; ++i)
+		if (fa->clusters[i].cluster != fb->clusters[i].cluster)
+			return (int)fa->clusters[i].cluster - (int)fb->clusters[i].cluster;
+	return 0;
+}
+
+/* Faces can be in several leaves, and leaves of different clusters. Faces that are in exactly the same
+ * clusters are given the same cluster set, so that they can be drawn together */
+static enum BSPLoadResult bspLoadModelClusterSets(struct LoadModelContext *ctx, struct Stack *persistent,
+		struct BSPVisibility *vis) {
+	void * const tmp_cursor = stackGetCursor(ctx->tmp);
+	const struct Lumps * const lumps = ctx->lumps;
+
+	const uint32_t leaves_count = bspLeavesCount(lumps);
+	uint32_t max_pairs = 0;
+	for (uint32_t i = 0; i < leaves_count; ++i) {
+		const struct VBSPLumpLeaf *const leaf = bspLeaf(lumps, i);
+		if (leaf->cluster != 0xffffu && leaf->first_leafface + leaf->num_leaffaces <= lumps->leaffaces.n)
+			max_pairs += leaf->num_leaffaces;
+	}
+
+	int32_t *const face_index = stackAlloc(ctx->tmp, sizeof(*face_index) * lumps->faces.n);
+	struct FaceCluster *const pairs = stackAlloc(ctx->tmp, sizeof(*pairs) * (max_pairs + 1));
+	struct FaceClusters *const faces = stackAlloc(ctx->tmp, sizeof(*faces) * ctx->faces_count);
+	uint32_t *const cluster_sets = stackAlloc(ctx->tmp, sizeof(*cluster_sets) * (ctx->faces_count + 1));
+	uint16_t *const set_clusters = stackAlloc(ctx->tmp, sizeof(*set_clusters) * (max_pairs + 1));
+	if (!face_index || !pairs || !faces || !cluster_sets || !set_clusters)
+		return BSPLoadResult_ErrorTempMemory;
+
+	for (uint32_t i = 0; i < lumps->faces.n; ++i)
+		face_index[i] = -1;
+	for (int i = 0; i < ctx->faces_count; ++i)
+		face_index[ctx->faces[i].vface - lumps->faces.p] = i;
+
+	uint32_t pairs_count = 0;
+	for (uint32_t i = 0; i < leaves_count; ++i) {
+		const struct VBSPLumpLeaf *const leaf = bspLeaf(lumps, i);
+		if (leaf->cluster == 0xffffu)
+			continue;
+
+		if (leaf->first_leafface + leaf->num_leaffaces > lumps->leaffaces.n) {
+			PRINTF("Leaf %u faces %u+%u are out of %u leaffaces", i,
+				leaf->first_leafface, leaf->num_leaffaces, lumps->leaffaces.n);
+			continue;
+		}
+
+		for (int j = 0; j < leaf->num_leaffaces; ++j) {
+			const uint16_t face = lumps->leaffaces.p[leaf->first_leafface + j];
+			if (face >= lumps->faces.n || face_index[face] < 0)
+				continue;
+
+			pairs[pairs_count].face = (uint32_t)face_index[face];
+			pairs[pairs_count].cluster = leaf->cluster;
+			++pairs_count;
+		}
+	}
+
+	qsort(pairs, pairs_count, sizeof(*pairs), faceClusterCompare);
+
+	/* clusters of each face, without repeats */
+	for (int i = 0; i < ctx->faces_count; ++i) {
+		faces[i].clusters = pairs;
+		faces[i].count = 0;
+		faces[i].face = (uint32_t)i;
+	}
+
+	uint32_t unique = 0;
+	for (uint32_t i = 0; i < pairs_count; ++i) {
+		if (unique > 0 && pairs[unique - 1].face == pairs[i].face && pairs[unique - 1].cluster == pairs[i].cluster)
+			continue;
+		pairs[unique] = pairs[i];
+		struct FaceClusters *const face = faces + pairs[unique].face;
+		if (!face->count)
+			face->clusters = pairs + unique;
+		++face->count;
+		++unique;
+	}
+
+	qsort(faces, ctx->faces_count, sizeof(*faces), faceClustersCompare);
+
+	int sets_count = 0;
+	cluster_sets[0] = 0;
+	for (int i = 0; i < ctx->faces_count; ++i) {
+		if (i == 0 || faceClustersCompare(faces + i - 1, faces + i) != 0) {
+			for (uint32_t j = 0; j < faces[i].count; ++j)
+				set_clusters[cluster_sets[sets_count] + j] = faces[i].clusters[j].cluster;
+			cluster_sets[sets_count + 1] = cluster_sets[sets_count] + faces[i].count;
+			++sets_count;
+		}
+		ctx->faces[faces[i].face].cluster_set = (unsigned)(sets_count - 1);
+	}
+
+	uint32_t *const persistent_sets = stackAlloc(persistent, sizeof(*cluster_sets) * (sets_count + 1));
+	uint16_t *const persistent_clusters = stackAlloc(persistent, sizeof(*set_clusters) * (cluster_sets[sets_count] + 1));
+	if (!persistent_sets || !persistent_clusters)
+		return BSPLoadResult_ErrorMemory;
+
+	memcpy(persistent_sets, cluster_sets, sizeof(*cluster_sets) * (sets_count + 1));
+	memcpy(persistent_clusters, set_clusters, sizeof(*set_clusters) * cluster_sets[sets_count]);
+	vis->cluster_sets_count = sets_count;
+	vis->cluster_sets = persistent_sets;
+	vis->set_clusters = persistent_clusters;
+
+	PRINTF("Faces: %d, in clusters: %u, cluster sets: %d", ctx->faces_count, unique, sets_count);
+
+	stackFreeUpToPosition(ctx->tmp, tmp_cursor);
+	return BSPLoadResult_Success;
+}
+
 static enum BSPLoadResult bspLoadModelLightmaps(struct LoadModelContext *ctx) {
-	/* TODO optional sort lightmaps */
+	/* lightmap samples are read before anything is allocated for the atlas, so that they can be freed
+	 * right after it is uploaded */
+	if (!lumpsAcquire(ctx->loader, LumpUse_Lightmaps))
+		return BSPLoadResult_ErrorFileFormat;
 
+	const enum BSPLoadResult result = bspLoadModelConstantLightmaps(ctx);
+	if (result != BSPLoadResult_Success)
+		return result;
+
+	const unsigned max_size = (unsigned)lightmapPageSize();
+	if ((unsigned)ctx->lightmap.max_width > max_size || (unsigned)ctx->lightmap.max_height > max_size) {
+		PRINTF("Lightmap of %dx%d doesn't fit into lightmap page size %u",
+			ctx->lightmap.max_width, ctx->lightmap.max_height, max_size);
+		return BSPLoadResult_ErrorCapabilities;
+	}
+
+	struct AtlasStats stats;
 	struct AtlasContext atlas_context;
 	atlas_context.temp_storage.ptr = stackGetCursor(ctx->tmp);
 	atlas_context.temp_storage.size = (int)stackGetFree(ctx->tmp);
-	atlas_context.width = 16; /* TODO opengl caps */
+	atlas_context.width = 16;
 	atlas_context.height = 16;
-	atlas_context.rects = (void*)(&ctx->faces[0].width);
+	atlas_context.max_pages = 1;
+	atlas_context.rects = (void*)(&ctx->faces[0].atlas_width);
 	atlas_context.rects_count = ctx->faces_count;
 	atlas_context.rects_stride = sizeof(ctx->faces[0]);
 	atlas_context.pos = (void*)(&ctx->faces[0].atlas_x);
 	atlas_context.pos_stride = sizeof(ctx->faces[0]);
+	atlas_context.page = &ctx->faces[0].atlas_page;
+	atlas_context.page_stride = sizeof(ctx->faces[0]);
+	atlas_context.stats = &stats;
 	while (atlas_context.width < (unsigned)ctx->lightmap.max_width) atlas_context.width <<= 1;
 	while (atlas_context.height < (unsigned)ctx->lightmap.max_height) atlas_context.height <<= 1;
 	while (atlas_context.width * atlas_context.height < (unsigned)ctx->lightmap.pixels)
 		if (atlas_context.width < atlas_context.height) atlas_context.width <<= 1; else atlas_context.height <<= 1;
+	if (atlas_context.width > max_size)
+		atlas_context.width = max_size;
 
+	/* pack into a strip of the estimated width as tall as possible, then cut the unused part off.
+	 * Only when a single max size page is not enough, spill into more pages */
+	atlas_context.height = max_size;
 	for(;;) {
 		const enum AtlasResult result = atlasCompute(&atlas_context);
 
-		PRINTF("atlas: %u %u %d", atlas_context.width, atlas_context.height, result);
-
 		if (result == Atlas_Success)
 			break;
 
 		if (result == Atlas_ErrorInsufficientTemp)
 			return BSPLoadResult_ErrorTempMemory;
 
-		if (atlas_context.width < atlas_context.height) atlas_context.width <<= 1; else atlas_context.height <<= 1;
-		if (atlas_context.width > 2048 || atlas_context.height > 2048) /* TODO limit based on GL driver caps */
+		if (atlas_context.width < max_size) {
+			atlas_context.width <<= 1;
+			if (atlas_context.width > max_size)
+				atlas_context.width = max_size;
+		} else if (atlas_context.max_pages < BSP_MAX_LIGHTMAP_PAGES) {
+			atlas_context.max_pages = BSP_MAX_LIGHTMAP_PAGES;
+		} else {
+			PRINTF("Lightmaps don't fit into %d pages of %ux%u", BSP_MAX_LIGHTMAP_PAGES, max_size, max_size);
 			return BSPLoadResult_ErrorCapabilities;
+		}
 	}
 
-	/* Build an atlas texture based on calculated fragment positions */
-	const size_t atlas_size = sizeof(uint16_t) * atlas_context.width * atlas_context.height;
+	ctx->lightmap.pages_count = (int)stats.pages;
+	for (int i = 0; i < ctx->lightmap.pages_count; ++i)
+		ctx->lightmap.pages[i].width = ctx->lightmap.pages[i].height = 0;
+	for (int i = 0; i < ctx->faces_count; ++i) {
+		struct Face *const face = ctx->faces + i;
+		if (face->lightmap_owner >= 0 && face->lightmap_owner != i) {
+			/* owner is the first face of this color, its slot came from the atlas */
+			const struct Face *const owner = ctx->faces + face->lightmap_owner;
+			face->atlas_x = owner->atlas_x;
+			face->atlas_y = owner->atlas_y;
+			face->atlas_page = owner->atlas_page;
+		}
+
+		const int right = face->atlas_x + face->atlas_width, bottom = face->atlas_y + face->atlas_height;
+		if (right > ctx->lightmap.pages[face->atlas_page].width) ctx->lightmap.pages[face->atlas_page].width = right;
+		if (bottom > ctx->lightmap.pages[face->atlas_page].height) ctx->lightmap.pages[face->atlas_page].height = bottom;
+	}
+
+	size_t page_offsets[BSP_MAX_LIGHTMAP_PAGES];
+	size_t atlas_pixels = 0;
+	for (int i = 0; i < ctx->lightmap.pages_count; ++i) {
+		ctx->lightmap.pages[i].width = (ctx->lightmap.pages[i].width + 3) & ~3;
+		ctx->lightmap.pages[i].height = (ctx->lightmap.pages[i].height + 3) & ~3;
+		page_offsets[i] = atlas_pixels;
+		atlas_pixels += (size_t)ctx->lightmap.pages[i].width * ctx->lightmap.pages[i].height;
+		PRINTF("Lightmap atlas page %d: %dx%d", i, ctx->lightmap.pages[i].width, ctx->lightmap.pages[i].height);
+	}
+	PRINTF("Lightmap atlas: %d faces, %u wasted pixels (%.1f%%), %u exact matches",
+		ctx->faces_count, stats.wasted_pixels, 100.f * stats.wasted_pixels / atlas_pixels, stats.exact_matches);
+
+	/* Build atlas textures based on calculated fragment positions */
+	const size_t atlas_size = sizeof(uint16_t) * atlas_pixels;
 	uint16_t *const pixels = stackAlloc(ctx->tmp, atlas_size);
 	if (!pixels) return BSPLoadResult_ErrorTempMemory;
 	memset(pixels, 0x0f, atlas_size); /* TODO debug pattern */
 
 	for (int i = 0; i < ctx->faces_count; ++i) {
 		const struct Face *const face = ctx->faces + i;
-		ASSERT((unsigned)face->atlas_x + face->width <= atlas_context.width);
-		ASSERT((unsigned)face->atlas_y + face->height <= atlas_context.height);
-		for (int y = 0; y < face->height; ++y) {
-			for (int x = 0; x < face->width; ++x) {
-				const struct VBSPLumpLightMap *const pixel = face->samples + x + (int)(y * face->width);
-
-				const unsigned int
-					r = scaleLightmapColor(pixel->r, pixel->exponent),
-					g = scaleLightmapColor(pixel->g, pixel->exponent),
-					b = scaleLightmapColor(pixel->b, pixel->exponent);
-
-				pixels[face->atlas_x + x + (face->atlas_y + y) * atlas_context.width]
-					= (uint16_t)(((r&0xf8) << 8) | ((g&0xfc) << 3) | (b >> 3));
-			} /* for x */
-		} /* for y */
+		const int page_width = ctx->lightmap.pages[face->atlas_page].width;
+		uint16_t *const page_pixels = pixels + page_offsets[face->atlas_page];
+		ASSERT(face->atlas_x + face->atlas_width <= page_width);
+		ASSERT(face->atlas_y + face->atlas_height <= ctx->lightmap.pages[face->atlas_page].height);
+
+		if (face->lightmap_owner >= 0) {
+			for (int y = 0; y < face->atlas_height; ++y)
+				for (int x = 0; x < face->atlas_width; ++x)
+					page_pixels[face->atlas_x + x + (face->atlas_y + y) * page_width] = face->lightmap_color;
+			continue;
+		}
+
+		for (int y = 0; y < face->height; ++y)
+			rgbeUnpackRow(ctx->lumps->lightmaps.p + face->sample_offset + y * face->width,
+				page_pixels + face->atlas_x + (face->atlas_y + y) * page_width, face->width);
 	} /* fot all visible faces */
 
-	RTextureUploadParams upload;
-	upload.width = atlas_context.width;
-	upload.height = atlas_context.height;
-	upload.format = RTexFormat_RGB565;
-	upload.pixels = pixels;
-	upload.mip_level = -2;
-	upload.type = RTexType_2D;
-	upload.wrap = RTexWrap_Clamp;
-	renderTextureInit(&ctx->lightmap.texture);
-	renderTextureUpload(&ctx->lightmap.texture, upload);
-	//ctx->lightmap.texture.min_filter = RTmF_Nearest;
-
-	/* pixels buffer is not needed anymore */
-	stackFreeUpToPosition(ctx->tmp, pixels);
+	for (int i = 0; i < ctx->lightmap.pages_count; ++i) {
+		LightmapRegion *const region = ctx->lightmap.regions + i;
+		if (!lightmapAlloc(ctx->lightmap.pages[i].width, ctx->lightmap.pages[i].height, region))
+			return BSPLoadResult_ErrorCapabilities;
+		lightmapUpload(region, pixels + page_offsets[i]);
+	}
+
+	/* pixels buffer is not needed anymore, unless it is going to be cooked */
+	if (ctx->cook_key)
+		ctx->lightmap.atlas_pixels = pixels;
+	else
+		stackFreeUpToPosition(ctx->tmp, pixels);
+
+	lumpsRelease(ctx->loader, LumpUse_Entities | LumpUse_Faces | LumpUse_Lightmaps);
 
 	return BSPLoadResult_Success;
 }
@@ -404,7 +815,7 @@ static int shouldSwapUV(struct AVec3f mapU, struct AVec3f mapV, const struct AVe
 static void bspLoadDisplacement(
 		const struct LoadModelContext *ctx,
 		const struct Face *face,
-		struct BSPModelVertex *out_vertices, uint16_t *out_indices, int index_shift) {
+		struct BSPModelVertex *out_vertices, uint32_t *out_indices, int index_shift) {
  	const int side = (1 << face->dispinfo->power) + 1;
 	const struct VBSPLumpVertex *const vertices = ctx->lumps->vertices.p;
 	const struct VBSPLumpTexInfo * const tinfo = face->texinfo;
@@ -449,7 +860,8 @@ static void bspLoadDisplacement(
 				aVec3f(tinfo->lightmap_vecs[1][0], tinfo->lightmap_vecs[1][1], tinfo->lightmap_vecs[1][2]), vec);
 #endif /*ifdef DEBUG_DISP_LIGHTMAP*/
 
-	const struct AVec2f atlas_scale = aVec2f(1.f / ctx->lightmap.texture.width, 1.f / ctx->lightmap.texture.height);
+	const struct AVec2f atlas_scale = aVec2f(
+			1.f / ctx->lightmap.pages[face->atlas_page].width, 1.f / ctx->lightmap.pages[face->atlas_page].height);
 	const struct AVec2f atlas_offset = aVec2f(
 			.5f + face->atlas_x /*+ tinfo->lightmap_vecs[0][3] - face->face->lightmap_min[0]*/,
 			.5f + face->atlas_y /*+ tinfo->lightmap_vecs[1][3] - face->face->lightmap_min[1]*/);
@@ -488,6 +900,9 @@ static void bspLoadDisplacement(
 				PRINTF("Error: DISP OOB LM F:V%d: x=%f y=%f z=%f tx=%f, ty=%f u=%f v=%f w=%d h=%d",
 						x + y * side, v->vertex.x, v->vertex.y, v->vertex.z, tx, ty, v->lightmap_uv.x, v->lightmap_uv.y, face->width, face->height);
 
+			if (face->lightmap_owner >= 0)
+				v->lightmap_uv = aVec2f(.5f, .5f);
+
 			v->lightmap_uv = aVec2fMul(aVec2fAdd(v->lightmap_uv, atlas_offset), atlas_scale);
 
 #if 0
@@ -503,15 +918,13 @@ static void bspLoadDisplacement(
 
 	for (int y = 0; y < side - 1; ++y) {
 		for (int x = 0; x < side - 1; ++x) {
-			const int ibase = index_shift + y * side + x;
-			ASSERT(ibase + side + 1 < 65536);
-			const uint16_t base = (uint16_t)ibase;
+			const uint32_t base = (uint32_t)(index_shift + y * side + x);
 			*out_indices++ = base;
-			*out_indices++ = base + (uint16_t)side + 1;
-			*out_indices++ = base + (uint16_t)side;
+			*out_indices++ = base + (uint32_t)side + 1;
+			*out_indices++ = base + (uint32_t)side;
 			*out_indices++ = base;
 			*out_indices++ = base + 1;
-			*out_indices++ = base + (uint16_t)side + 1;
+			*out_indices++ = base + (uint32_t)side + 1;
 		}
 	}
 }
@@ -519,7 +932,7 @@ static void bspLoadDisplacement(
 static void bspLoadFace(
 		const struct LoadModelContext *ctx,
 		const struct Face *face,
-		struct BSPModelVertex *out_vertices, uint16_t *out_indices, int index_shift) {
+		struct BSPModelVertex *out_vertices, uint32_t *out_indices, int index_shift) {
 	const struct VBSPLumpFace *vface = face->vface;
 	const struct VBSPLumpTexInfo * const tinfo = face->texinfo;
 	struct AVec3f normal;
@@ -568,26 +981,467 @@ static void bspLoadFace(
 			PRINTF("Error: OOB LM F:V%u: x=%f y=%f z=%f u=%f v=%f w=%d h=%d", iedge, lv->x, lv->y, lv->z, vertex->lightmap_uv.x, vertex->lightmap_uv.y, face->width, face->height);
 		*/
 
-		vertex->lightmap_uv.x = (vertex->lightmap_uv.x + face->atlas_x + .5f) / ctx->lightmap.texture.width;
-		vertex->lightmap_uv.y = (vertex->lightmap_uv.y + face->atlas_y + .5f) / ctx->lightmap.texture.height;
+		/* center of 2x2 slot */
+		if (face->lightmap_owner >= 0)
+			vertex->lightmap_uv = aVec2f(.5f, .5f);
+
+		vertex->lightmap_uv.x = (vertex->lightmap_uv.x + face->atlas_x + .5f) / ctx->lightmap.pages[face->atlas_page].width;
+		vertex->lightmap_uv.y = (vertex->lightmap_uv.y + face->atlas_y + .5f) / ctx->lightmap.pages[face->atlas_page].height;
 
 		if (iedge > 1) {
-			out_indices[(iedge-2)*3+0] = (uint16_t)(index_shift + 0);
-			out_indices[(iedge-2)*3+1] = (uint16_t)(index_shift + iedge);
-			out_indices[(iedge-2)*3+2] = (uint16_t)(index_shift + iedge - 1);
+			out_indices[(iedge-2)*3+0] = (uint32_t)(index_shift + 0);
+			out_indices[(iedge-2)*3+1] = (uint32_t)(index_shift + iedge);
+			out_indices[(iedge-2)*3+2] = (uint32_t)(index_shift + iedge - 1);
 		}
 	}
 }
 
-static int faceMaterialCompare(const void *a, const void *b) {
+/* faces are grouped by lightmap page first, so that coarse draws only need to be split by page */
+static int faceDrawCompare(const void *a, const void *b) {
 	const struct Face *fa = a, *fb = b;
 
+	if (fa->atlas_page != fb->atlas_page)
+		return fa->atlas_page < fb->atlas_page ? -1 : 1;
+
 	if (fa->material == fb->material)
 		return 0;
 
 	return (int)(fa->material->base_texture.texture - fb->material->base_texture.texture);
 }
 
+/* within a draw, faces of the same cluster set are next to each other and make up a single range;
+ * within a range, faces close in space are next to each other so that they end up in the same meshlet */
+static int faceSortCompare(const void *a, const void *b) {
+	const int draw = faceDrawCompare(a, b);
+	if (draw != 0)
+		return draw;
+
+	const struct Face *fa = a, *fb = b;
+	if (fa->cluster_set != fb->cluster_set)
+		return fa->cluster_set < fb->cluster_set ? -1 : 1;
+
+	return fa->morton < fb->morton ? -1 : fa->morton > fb->morton;
+}
+
+/* 10 lower bits of v to every third bit */
+static uint32_t bspMortonSpread(uint32_t v) {
+	v &= 0x3ffu;
+	v = (v | (v << 16)) & 0x030000ffu;
+	v = (v | (v << 8)) & 0x0300f00fu;
+	v = (v | (v << 4)) & 0x030c30c3u;
+	v = (v | (v << 2)) & 0x09249249u;
+	return v;
+}
+
+/* displacements are close enough to their base faces, so only face polygon is used */
+static uint32_t bspFaceMorton(const struct LoadModelContext *ctx, const struct Face *face, const struct AABB *aabb) {
+	const struct VBSPLumpFace *const vface = face->vface;
+	const int32_t *const surfedges = ctx->lumps->surfedges.p + vface->first_edge;
+	struct AVec3f center = aVec3ff(0.f);
+	for (int iedge = 0; iedge < vface->num_edges; ++iedge) {
+		const uint16_t vstart = (surfedges[iedge] >= 0)
+			? ctx->lumps->edges.p[surfedges[iedge]].v[0]
+			: ctx->lumps->edges.p[-surfedges[iedge]].v[1];
+		center = aVec3fAdd(center, aVec3fLumpVec(ctx->lumps->vertices.p[vstart]));
+	}
+	center = aVec3fMulf(center, 1.f / (float)(vface->num_edges > 0 ? vface->num_edges : 1));
+
+	const struct AVec3f size = aVec3fSub(aabb->max, aabb->min);
+	const float x = (center.x - aabb->min.x) / floatMax(size.x, 1.f);
+	const float y = (center.y - aabb->min.y) / floatMax(size.y, 1.f);
+	const float z = (center.z - aabb->min.z) / floatMax(size.z, 1.f);
+	return bspMortonSpread((uint32_t)clamp(x * 1023.f, 0.f, 1023.f))
+		| (bspMortonSpread((uint32_t)clamp(y * 1023.f, 0.f, 1023.f)) << 1)
+		| (bspMortonSpread((uint32_t)clamp(z * 1023.f, 0.f, 1023.f)) << 2);
+}
+
+static void bspCookDraws(BSPCookedDraw *out, const struct BSPDrawSet *set, const char *const *material_names,
+		char *strings, int *strings_size) {
+	for (int i = 0; i < set->draws_count; ++i) {
+		const struct BSPDraw *draw = set->draws + i;
+		const char *name = material_names ? material_names[i] : "opensource/coarse";
+
+		/* draws are sorted by material, so the name is likely the same as previous one */
+		if (i > 0 && strcmp(strings + out[i - 1].material, name) == 0) {
+			out[i].material = out[i - 1].material;
+		} else {
+			const int length = (int)strlen(name);
+			memcpy(strings + *strings_size, name, length + 1);
+			out[i].material = (uint32_t)*strings_size;
+			*strings_size += length + 1;
+		}
+
+		out[i].start = draw->start;
+		out[i].count = draw->count;
+		out[i].vbo_offset = draw->vbo_offset;
+		out[i].lightmap = draw->lightmap;
+		out[i].aabb = draw->aabb;
+		out[i].first_range = draw->first_range;
+		out[i].ranges_count = draw->ranges_count;
+		out[i].first_meshlet = draw->first_meshlet;
+		out[i].meshlets_count = draw->meshlets_count;
+	}
+}
+
+static void bspCookModel(const struct LoadModelContext *ctx, const struct BSPModel *model,
+		const char *const *draw_material_names, BSPCooked cooked) {
+	void * const tmp_cursor = stackGetCursor(ctx->tmp);
+
+	int strings_max = (int)sizeof("opensource/coarse");
+	for (int i = 0; i < model->detailed.draws_count; ++i)
+		strings_max += (int)strlen(draw_material_names[i]) + 1;
+
+	BSPCookedDraw *draws = stackAlloc(ctx->tmp,
+		sizeof(*draws) * (model->detailed.draws_count + model->coarse.draws_count));
+	char *strings = stackAlloc(ctx->tmp, strings_max);
+	BSPCookedRange *ranges = stackAlloc(ctx->tmp, sizeof(*ranges) * model->vis.ranges_count);
+	BSPCookedMeshlet *meshlets = stackAlloc(ctx->tmp, sizeof(*meshlets) * model->detailed.meshlets_count);
+	if (!draws || !strings || !ranges || !meshlets) {
+		PRINT("Not enough temp memory to cook map");
+		goto exit;
+	}
+
+	int strings_size = 0;
+	bspCookDraws(draws, &model->detailed, draw_material_names, strings, &strings_size);
+	bspCookDraws(draws + model->detailed.draws_count, &model->coarse, NULL, strings, &strings_size);
+
+	for (int i = 0; i < model->vis.ranges_count; ++i) {
+		ranges[i].start = model->vis.ranges[i].start;
+		ranges[i].count = model->vis.ranges[i].count;
+		ranges[i].cluster_set = model->vis.ranges[i].cluster_set;
+	}
+
+	for (int i = 0; i < model->detailed.meshlets_count; ++i) {
+		const struct BSPMeshlet *const meshlet = model->detailed.meshlets + i;
+		meshlets[i].start = meshlet->start;
+		meshlets[i].count = meshlet->count;
+		meshlets[i].cluster_set = meshlet->cluster_set;
+		meshlets[i].center = meshlet->center;
+		meshlets[i].radius = meshlet->radius;
+		meshlets[i].cone_axis = meshlet->cone_axis;
+		meshlets[i].cone_cutoff = meshlet->cone_cutoff;
+	}
+
+	cooked.detailed_count = model->detailed.draws_count;
+	cooked.coarse_count = model->coarse.draws_count;
+	cooked.draws = draws;
+	cooked.strings_size = strings_size;
+	cooked.strings = strings;
+	cooked.cluster_sets_count = model->vis.cluster_sets_count;
+	cooked.cluster_sets = model->vis.cluster_sets;
+	cooked.set_clusters = model->vis.set_clusters;
+	cooked.ranges_count = model->vis.ranges_count;
+	cooked.ranges = ranges;
+	cooked.occluder_vertices_count = model->occluders.vertices_count;
+	cooked.occluder_vertices = model->occluders.vertices;
+	cooked.occluder_indices_count = model->occluders.indices_count;
+	cooked.occluder_indices = model->occluders.indices;
+	cooked.meshlets_count = model->detailed.meshlets_count;
+	cooked.meshlets = meshlets;
+	bspCookSave(ctx->name, ctx->cook_key, &cooked);
+
+exit:
+	stackFreeUpToPosition(ctx->tmp, tmp_cursor);
+}
+
+/* texture uvs can be moved by whole repeats, which keeps them small regardless of where the face is */
+static void bspFaceShiftTexUV(const struct Face *face, struct BSPModelVertex *vertices) {
+	const Texture *const texture = face->material->base_texture.texture;
+	if (!texture || texture->width <= 0 || texture->height <= 0)
+		return;
+
+	struct AVec2f min = vertices[0].tex_uv;
+	for (int i = 1; i < face->vertices; ++i) {
+		min.x = floatMin(min.x, vertices[i].tex_uv.x);
+		min.y = floatMin(min.y, vertices[i].tex_uv.y);
+	}
+
+	const struct AVec2f shift = aVec2f(
+		floorf(min.x / texture->width) * texture->width,
+		floorf(min.y / texture->height) * texture->height);
+	for (int i = 0; i < face->vertices; ++i) {
+		vertices[i].tex_uv.x -= shift.x;
+		vertices[i].tex_uv.y -= shift.y;
+	}
+}
+
+static int16_t bspPackInt16(float f) {
+	const long q = lrintf(f);
+	return (int16_t)(q < -32767 ? -32767 : (q > 32767 ? 32767 : q));
+}
+
+static int16_t bspPackSnorm16(float f) {
+	return bspPackInt16(f * 32767.f);
+}
+
+static void bspPackVertices(const struct BSPModelVertex *in, int count,
+		struct BSPModelPackedVertex *out, struct BSPVertexDequant *dequant) {
+	struct AVec3f min = in[0].vertex, max = in[0].vertex;
+	float max_tex_uv = 0.f;
+	for (int i = 0; i < count; ++i) {
+		min = aVec3fMin(min, in[i].vertex);
+		max = aVec3fMax(max, in[i].vertex);
+		max_tex_uv = floatMax(max_tex_uv, floatMax(fabsf(in[i].tex_uv.x), fabsf(in[i].tex_uv.y)));
+	}
+
+	dequant->center = aVec3fMulf(aVec3fAdd(min, max), .5f);
+	dequant->half_size = aVec3fMax(aVec3fMulf(aVec3fSub(max, min), .5f), aVec3ff(1.f));
+
+	/* finest power of two subdivision of a texel that still fits all of them */
+	dequant->tex_uv_units = 16.f;
+	while (dequant->tex_uv_units > 1.f / 256.f && max_tex_uv * dequant->tex_uv_units > 32767.f)
+		dequant->tex_uv_units *= .5f;
+
+	for (int i = 0; i < count; ++i) {
+		const struct BSPModelVertex *const v = in + i;
+		struct BSPModelPackedVertex *const p = out + i;
+		p->vertex[0] = bspPackSnorm16((v->vertex.x - dequant->center.x) / dequant->half_size.x);
+		p->vertex[1] = bspPackSnorm16((v->vertex.y - dequant->center.y) / dequant->half_size.y);
+		p->vertex[2] = bspPackSnorm16((v->vertex.z - dequant->center.z) / dequant->half_size.z);
+		p->vertex[3] = 0;
+		p->lightmap_uv[0] = (uint16_t)lrintf(clamp(v->lightmap_uv.x, 0.f, 1.f) * 65535.f);
+		p->lightmap_uv[1] = (uint16_t)lrintf(clamp(v->lightmap_uv.y, 0.f, 1.f) * 65535.f);
+		p->tex_uv[0] = bspPackInt16(v->tex_uv.x * dequant->tex_uv_units);
+		p->tex_uv[1] = bspPackInt16(v->tex_uv.y * dequant->tex_uv_units);
+		p->average_color[0] = v->average_color.r;
+		p->average_color[1] = v->average_color.g;
+		p->average_color[2] = v->average_color.b;
+		p->average_color[3] = 255;
+	}
+}
+
+/* draws are empty until first face with any indices is added */
+static void bspDrawAddAABB(struct BSPDraw *draw, const struct AABB *aabb) {
+	if (!draw->count) {
+		draw->aabb = *aabb;
+	} else {
+		draw->aabb.min = aVec3fMin(draw->aabb.min, aabb->min);
+		draw->aabb.max = aVec3fMax(draw->aabb.max, aabb->max);
+	}
+}
+
+/* FIFO size that index order is tuned for, small enough for GLES2-era GPUs */
+#define BSP_VERTEX_CACHE_SIZE 16
+
+/* reorder triangles within each meshlet for post-transform vertex cache reuse; meshlets can be skipped
+ * by visibility and culling, so triangles must not move between them */
+static enum BSPLoadResult bspOptimizeMeshletsVertexCache(struct Stack *tmp, const struct BSPMeshlet *meshlets,
+		int meshlets_count, uint32_t *indices) {
+	VCacheStats before = {0, 0, 0}, after = {0, 0, 0};
+	for (int i = 0; i < meshlets_count; ++i) {
+		const struct BSPMeshlet *const meshlet = meshlets + i;
+		uint32_t *const meshlet_indices = indices + meshlet->start;
+		if (!meshlet->count)
+			continue;
+
+		uint32_t first = meshlet_indices[0], last = meshlet_indices[0];
+		for (unsigned int j = 1; j < meshlet->count; ++j) {
+			if (meshlet_indices[j] < first) first = meshlet_indices[j];
+			if (meshlet_indices[j] > last) last = meshlet_indices[j];
+		}
+
+		const unsigned int vertices = last - first + 1;
+		void *const temp = stackAlloc(tmp, vcacheOptimizeTempSize(meshlet->count, vertices));
+		if (!temp) return BSPLoadResult_ErrorTempMemory;
+
+		vcacheSimulate(meshlet_indices, meshlet->count, first, vertices, BSP_VERTEX_CACHE_SIZE, temp, &before);
+		vcacheOptimize(meshlet_indices, meshlet->count, first, vertices, BSP_VERTEX_CACHE_SIZE, temp);
+		vcacheSimulate(meshlet_indices, meshlet->count, first, vertices, BSP_VERTEX_CACHE_SIZE, temp, &after);
+
+		stackFreeUpToPosition(tmp, temp);
+	}
+
+	PRINTF("Vertex cache of %d: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f", BSP_VERTEX_CACHE_SIZE,
+		VCACHE_ACMR(before), VCACHE_ACMR(after), VCACHE_ATVR(before), VCACHE_ATVR(after));
+	return BSPLoadResult_Success;
+}
+
+/* indices_buffer[start .. start + count) of a face, relative to vbo_offset; area is only used to pick occluders */
+struct FaceIndices {
+	uint32_t start, count;
+	uint32_t vbo_offset;
+	float area;
+};
+
+/* faces are only split into meshlets at face boundaries, so a larger displacement gets a meshlet of its own */
+#define BSP_MAX_MESHLET_TRIANGLES 256
+
+static void bspMeshletBounds(struct BSPMeshlet *meshlet, const struct BSPModelVertex *vertices,
+		const uint32_t *indices) {
+	const uint32_t *const meshlet_indices = indices + meshlet->start;
+	struct AVec3f min = vertices[meshlet_indices[0]].vertex, max = min;
+	for (unsigned int i = 1; i < meshlet->count; ++i) {
+		min = aVec3fMin(min, vertices[meshlet_indices[i]].vertex);
+		max = aVec3fMax(max, vertices[meshlet_indices[i]].vertex);
+	}
+
+	meshlet->center = aVec3fMulf(aVec3fAdd(min, max), .5f);
+	float radius2 = 0.f;
+	for (unsigned int i = 0; i < meshlet->count; ++i)
+		radius2 = floatMax(radius2, aVec3fLength2(aVec3fSub(vertices[meshlet_indices[i]].vertex, meshlet->center)));
+	meshlet->radius = sqrtf(radius2);
+
+	/* counter-clockwise triangles are front facing, same as for GL */
+	struct AVec3f axis = aVec3ff(0.f);
+	for (unsigned int i = 0; i + 2 < meshlet->count; i += 3) {
+		const struct AVec3f a = vertices[meshlet_indices[i]].vertex,
+			b = vertices[meshlet_indices[i + 1]].vertex, c = vertices[meshlet_indices[i + 2]].vertex;
+		const struct AVec3f normal = aVec3fCross(aVec3fSub(b, a), aVec3fSub(c, a));
+		const float length = aVec3fLength(normal);
+		if (length > 0.f)
+			axis = aVec3fAdd(axis, aVec3fMulf(normal, 1.f / length));
+	}
+
+	meshlet->cone_cutoff = 1.f;
+	const float axis_length = aVec3fLength(axis);
+	meshlet->cone_axis = axis_length > 0.f ? aVec3fMulf(axis, 1.f / axis_length) : aVec3f(0.f, 0.f, 1.f);
+	if (axis_length <= 0.f)
+		return;
+
+	float min_dot = 1.f;
+	for (unsigned int i = 0; i + 2 < meshlet->count; i += 3) {
+		const struct AVec3f a = vertices[meshlet_indices[i]].vertex,
+			b = vertices[meshlet_indices[i + 1]].vertex, c = vertices[meshlet_indices[i + 2]].vertex;
+		const struct AVec3f normal = aVec3fCross(aVec3fSub(b, a), aVec3fSub(c, a));
+		const float length = aVec3fLength(normal);
+		if (length > 0.f)
+			min_dot = floatMin(min_dot, aVec3fDot(normal, meshlet->cone_axis) / length);
+	}
+
+	if (min_dot > 0.f)
+		meshlet->cone_cutoff = sqrtf(1.f - floatMin(min_dot * min_dot, 1.f));
+}
+
+/* splits ranges of detailed draws into meshlets of neighbouring faces; faces are in draw order */
+static enum BSPLoadResult bspLoadModelMeshlets(struct Stack *tmp, struct Stack *persistent, struct BSPDrawSet *set,
+		const struct BSPDrawRange *ranges, const struct FaceIndices *faces, int faces_count,
+		const struct BSPModelVertex *vertices, const uint32_t *indices) {
+	/* every meshlet has at least one face */
+	struct BSPMeshlet *const meshlets = stackAlloc(tmp, sizeof(*meshlets) * faces_count);
+	if (!meshlets) return BSPLoadResult_ErrorTempMemory;
+
+	int meshlets_count = 0, iface = 0;
+	for (int i = 0; i < set->draws_count; ++i) {
+		struct BSPDraw *const draw = set->draws + i;
+		draw->first_meshlet = (unsigned)meshlets_count;
+		draw->meshlets_count = 0;
+
+		for (unsigned int j = 0; j < draw->ranges_count; ++j) {
+			const struct BSPDrawRange *const range = ranges + draw->first_range + j;
+			struct BSPMeshlet *meshlet = NULL;
+			for (; iface < faces_count && faces[iface].start < range->start + range->count; ++iface) {
+				const struct FaceIndices *const face = faces + iface;
+				if (!face->count)
+					continue;
+
+				if (!meshlet || meshlet->count + face->count > BSP_MAX_MESHLET_TRIANGLES * 3) {
+					ASSERT(meshlets_count < faces_count);
+					meshlet = meshlets + meshlets_count++;
+					meshlet->start = face->start;
+					meshlet->count = 0;
+					meshlet->cluster_set = range->cluster_set;
+					++draw->meshlets_count;
+				}
+
+				meshlet->count += face->count;
+			}
+		}
+
+		for (unsigned int j = 0; j < draw->meshlets_count; ++j)
+			bspMeshletBounds(meshlets + draw->first_meshlet + j, vertices + draw->vbo_offset, indices);
+	}
+
+	struct BSPMeshlet *const persistent_meshlets = stackAlloc(persistent, sizeof(*meshlets) * (meshlets_count + 1));
+	if (!persistent_meshlets) return BSPLoadResult_ErrorMemory;
+
+	unsigned int triangles = 0;
+	for (int i = 0; i < meshlets_count; ++i)
+		triangles += meshlets[i].count / 3;
+	PRINTF("Meshlets: %d, %.1f triangles on average", meshlets_count,
+		meshlets_count ? (float)triangles / (float)meshlets_count : 0.f);
+
+	memcpy(persistent_meshlets, meshlets, sizeof(*meshlets) * meshlets_count);
+	stackFreeUpToPosition(tmp, meshlets);
+	set->meshlets = persistent_meshlets;
+	set->meshlets_count = meshlets_count;
+	return BSPLoadResult_Success;
+}
+
+/* smaller faces rarely hide anything on their own */
+#define BSP_OCCLUDER_MIN_AREA (256.f * 256.f)
+/* occluders are rasterized on cpu every frame, so only this many triangles of the largest faces are kept */
+#define BSP_MAX_OCCLUDER_TRIANGLES 1024
+
+static int faceIndicesAreaCompare(const void *a, const void *b) {
+	const struct FaceIndices *fa = a, *fb = b;
+	return fa->area > fb->area ? -1 : fa->area < fb->area;
+}
+
+static enum BSPLoadResult bspLoadModelOccluders(struct Stack *tmp, struct Stack *persistent,
+		struct FaceIndices *faces, int faces_count, const struct BSPModelVertex *vertices, int vertices_count,
+		const uint32_t *indices, struct BSPOccluders *occluders) {
+	occluders->vertices = NULL;
+	occluders->indices = NULL;
+	occluders->vertices_count = occluders->indices_count = 0;
+
+	for (int i = 0; i < faces_count; ++i) {
+		struct FaceIndices *const face = faces + i;
+		const struct BSPModelVertex *const v = vertices + face->vbo_offset;
+		face->area = 0.f;
+		for (uint32_t j = face->start; j + 2 < face->start + face->count; j += 3) {
+			const struct AVec3f a = v[indices[j]].vertex, b = v[indices[j + 1]].vertex, c = v[indices[j + 2]].vertex;
+			face->area += .5f * aVec3fLength(aVec3fCross(aVec3fSub(b, a), aVec3fSub(c, a)));
+		}
+	}
+
+	qsort(faces, faces_count, sizeof(*faces), faceIndicesAreaCompare);
+
+	/* largest faces that fit, in place */
+	int selected = 0, indices_count = 0;
+	for (int i = 0; i < faces_count && faces[i].area >= BSP_OCCLUDER_MIN_AREA; ++i) {
+		if (indices_count + (int)faces[i].count > BSP_MAX_OCCLUDER_TRIANGLES * 3)
+			continue;
+		indices_count += (int)faces[i].count;
+		faces[selected++] = faces[i];
+	}
+
+	if (!selected)
+		return BSPLoadResult_Success;
+
+	uint32_t *const remap = stackAlloc(tmp, sizeof(*remap) * vertices_count);
+	if (!remap) return BSPLoadResult_ErrorTempMemory;
+	memset(remap, 0xff, sizeof(*remap) * vertices_count);
+
+	int occluder_vertices_count = 0;
+	for (int i = 0; i < selected; ++i)
+		for (uint32_t j = faces[i].start; j < faces[i].start + faces[i].count; ++j) {
+			const uint32_t v = faces[i].vbo_offset + indices[j];
+			if (remap[v] == 0xffffffffu)
+				remap[v] = (uint32_t)occluder_vertices_count++;
+		}
+
+	struct AVec3f *const out_vertices = stackAlloc(persistent, sizeof(*out_vertices) * occluder_vertices_count);
+	uint16_t *const out_indices = stackAlloc(persistent, sizeof(*out_indices) * indices_count);
+	if (!out_vertices || !out_indices) return BSPLoadResult_ErrorMemory;
+
+	int index = 0;
+	for (int i = 0; i < selected; ++i)
+		for (uint32_t j = faces[i].start; j < faces[i].start + faces[i].count; ++j) {
+			const uint32_t v = faces[i].vbo_offset + indices[j];
+			out_vertices[remap[v]] = vertices[v].vertex;
+			out_indices[index++] = (uint16_t)remap[v];
+		}
+
+	stackFreeUpToPosition(tmp, remap);
+
+	occluders->vertices = out_vertices;
+	occluders->vertices_count = occluder_vertices_count;
+	occluders->indices = out_indices;
+	occluders->indices_count = indices_count;
+	PRINTF("Occluders: %d faces, %d triangles, %d vertices", selected, indices_count / 3, occluder_vertices_count);
+	return BSPLoadResult_Success;
+}
+
 static enum BSPLoadResult bspLoadModelDraws(const struct LoadModelContext *ctx, struct Stack *persistent,
 		struct BSPModel *model) {
 	void * const tmp_cursor = stackGetCursor(ctx->tmp);
@@ -597,11 +1451,26 @@ static enum BSPLoadResult bspLoadModelDraws(const struct LoadModelContext *ctx,
 	if (!vertices_buffer) return BSPLoadResult_ErrorTempMemory;
 
 	/* each vertex after second in a vface is a new triangle */
-	uint16_t * const indices_buffer = stackAlloc(ctx->tmp, sizeof(uint16_t) * ctx->indices);
+	uint32_t * const indices_buffer = stackAlloc(ctx->tmp, sizeof(uint32_t) * ctx->indices);
 	if (!indices_buffer) return BSPLoadResult_ErrorTempMemory;
 
-	qsort(ctx->faces, ctx->faces_count, sizeof(*ctx->faces), faceMaterialCompare);
+	/* with 32-bit indices the whole model is addressed from a single vbo_offset,
+	 * so draws are only split by material and lightmap page */
+	model->index_size = bsp_global.index_size;
+	const int max_draw_vertices = model->index_size == 4 ? INT_MAX : c_max_draw_vertices;
 
+	struct FaceIndices * const face_indices = stackAlloc(ctx->tmp, sizeof(struct FaceIndices) * ctx->faces_count);
+	if (!face_indices) return BSPLoadResult_ErrorTempMemory;
+
+	if (!lumpsAcquire(ctx->loader, LumpUse_Draws))
+		return BSPLoadResult_ErrorFileFormat;
+
+	for (int iface = 0; iface < ctx->faces_count; ++iface)
+		ctx->faces[iface].morton = bspFaceMorton(ctx, ctx->faces + iface, &model->aabb);
+
+	qsort(ctx->faces, ctx->faces_count, sizeof(*ctx->faces), faceSortCompare);
+
+	int ranges_count = 1;
 	{
 		int vbo_offset = 0, vertex_pos = 0;
 		model->detailed.draws_count = 1;
@@ -609,25 +1478,39 @@ static enum BSPLoadResult bspLoadModelDraws(const struct LoadModelContext *ctx,
 		for (int iface = 0; iface < ctx->faces_count; ++iface) {
 			const struct Face *face = ctx->faces + iface;
 
-			const int update_vbo_offset = (vertex_pos - vbo_offset) + face->vertices >= c_max_draw_vertices;
-			if (update_vbo_offset || (iface > 0 && faceMaterialCompare(ctx->faces+iface-1,face) != 0)) {
+			const int update_vbo_offset = (vertex_pos - vbo_offset) + face->vertices >= max_draw_vertices;
+			if (update_vbo_offset || (iface > 0 && faceDrawCompare(ctx->faces+iface-1,face) != 0)) {
 				//PRINTF("%p -> %p", (void*)ctx->faces[iface-1].material->base_texture[0], (void*)face->material->base_texture[0]);
 				++model->detailed.draws_count;
+				++ranges_count;
+			} else if (iface > 0 && ctx->faces[iface-1].cluster_set != face->cluster_set) {
+				++ranges_count;
 			}
 
-			if (update_vbo_offset) {
-				vbo_offset = vertex_pos;
+			if (update_vbo_offset || (iface > 0 && ctx->faces[iface-1].atlas_page != face->atlas_page))
 				++model->coarse.draws_count;
-			}
+
+			if (update_vbo_offset)
+				vbo_offset = vertex_pos;
 
 			vertex_pos += face->vertices;
 		}
 	}
 
-	PRINTF("Faces: %d -> %d detailed draws", ctx->faces_count, model->detailed.draws_count);
+	PRINTF("Faces: %d -> %d detailed draws, %d visibility ranges", ctx->faces_count, model->detailed.draws_count,
+		ranges_count);
 
 	model->detailed.draws = stackAlloc(persistent, sizeof(struct BSPDraw) * model->detailed.draws_count);
 	model->coarse.draws = stackAlloc(persistent, sizeof(struct BSPDraw) * model->coarse.draws_count);
+	struct BSPDrawRange *const ranges = stackAlloc(persistent, sizeof(struct BSPDrawRange) * ranges_count);
+	if (!model->detailed.draws || !model->coarse.draws || !ranges)
+		return BSPLoadResult_ErrorMemory;
+
+	const char **draw_material_names = NULL;
+	if (ctx->cook_key) {
+		draw_material_names = stackAlloc(ctx->tmp, sizeof(*draw_material_names) * model->detailed.draws_count);
+		if (!draw_material_names) return BSPLoadResult_ErrorTempMemory;
+	}
 
 	int vertex_pos = 0;
 	int draw_indices_start = 0, indices_pos = 0;
@@ -635,34 +1518,53 @@ static enum BSPLoadResult bspLoadModelDraws(const struct LoadModelContext *ctx,
 	int idraw = 0;
 	struct BSPDraw *detailed_draw = model->detailed.draws - 1,
 								 *coarse_draw = model->coarse.draws - 1;
+	struct BSPDrawRange *range = ranges - 1;
 
 	for (int iface = 0; iface < ctx->faces_count/* + 1*/; ++iface) {
 		const struct Face *face = ctx->faces + iface;
 
-		const int update_vbo_offset = (vertex_pos - vbo_offset) + face->vertices >= c_max_draw_vertices;
+		const int update_vbo_offset = (vertex_pos - vbo_offset) + face->vertices >= max_draw_vertices;
 
 		if (update_vbo_offset) {
 			PRINTF("vbo_offset %d -> %d", vbo_offset, vertex_pos);
 			vbo_offset = vertex_pos;
 		}
 
-		if (update_vbo_offset || iface == 0 || faceMaterialCompare(ctx->faces+iface-1,face) != 0) {
+		if (update_vbo_offset || iface == 0 || faceDrawCompare(ctx->faces+iface-1,face) != 0) {
 			++detailed_draw;
 			detailed_draw->start = draw_indices_start;
 			detailed_draw->count = 0;
 			detailed_draw->vbo_offset = vbo_offset;
+			detailed_draw->lightmap = face->atlas_page;
 			detailed_draw->material = face->material;
+			detailed_draw->first_range = (unsigned)(range + 1 - ranges);
+			detailed_draw->ranges_count = 0;
+			if (draw_material_names)
+				draw_material_names[idraw] = face->material_name;
 
 			++idraw;
 			ASSERT(idraw <= model->detailed.draws_count);
 		}
 
-		if (update_vbo_offset || iface == 0) {
+		if (detailed_draw->ranges_count == 0 || range->cluster_set != face->cluster_set) {
+			++range;
+			ASSERT(range < ranges + ranges_count);
+			range->start = draw_indices_start;
+			range->count = 0;
+			range->cluster_set = face->cluster_set;
+			++detailed_draw->ranges_count;
+		}
+
+		if (update_vbo_offset || iface == 0 || ctx->faces[iface-1].atlas_page != face->atlas_page) {
 			++coarse_draw;
+			ASSERT(coarse_draw < model->coarse.draws + model->coarse.draws_count);
 			coarse_draw->start = draw_indices_start;
 			coarse_draw->count = 0;
 			coarse_draw->vbo_offset = vbo_offset;
+			coarse_draw->lightmap = face->atlas_page;
 			coarse_draw->material = bsp_global.coarse_material;
+			coarse_draw->first_range = coarse_draw->ranges_count = 0;
+			coarse_draw->first_meshlet = coarse_draw->meshlets_count = 0;
 		}
 
 		if (face->dispinfo) {
@@ -670,6 +1572,15 @@ static enum BSPLoadResult bspLoadModelDraws(const struct LoadModelContext *ctx,
 		} else {
 			bspLoadFace(ctx, face, vertices_buffer + vertex_pos, indices_buffer + indices_pos, vertex_pos - vbo_offset);
 		}
+		bspFaceShiftTexUV(face, vertices_buffer + vertex_pos);
+
+		struct AABB face_aabb = { vertices_buffer[vertex_pos].vertex, vertices_buffer[vertex_pos].vertex };
+		for (int i = 1; i < face->vertices; ++i) {
+			face_aabb.min = aVec3fMin(face_aabb.min, vertices_buffer[vertex_pos + i].vertex);
+			face_aabb.max = aVec3fMax(face_aabb.max, vertices_buffer[vertex_pos + i].vertex);
+		}
+		bspDrawAddAABB(detailed_draw, &face_aabb);
+		bspDrawAddAABB(coarse_draw, &face_aabb);
 
 		for (int i = 0; i < face->vertices; ++i) {
 			vertices_buffer[vertex_pos + i].average_color.r =
@@ -680,19 +1591,91 @@ static enum BSPLoadResult bspLoadModelDraws(const struct LoadModelContext *ctx,
 				(uint8_t)(face->material->average_color.z * 255.f);
 		}
 
+		face_indices[iface].start = draw_indices_start;
+		face_indices[iface].count = face->indices;
+		face_indices[iface].vbo_offset = vbo_offset;
+
 		vertex_pos += face->vertices;
 		indices_pos += face->indices;
 
 		detailed_draw->count += indices_pos - draw_indices_start;
 		coarse_draw->count += indices_pos - draw_indices_start;
+		range->count += indices_pos - draw_indices_start;
 
 		//vertex_pos = 0;
 		draw_indices_start = indices_pos;
 	}
 	ASSERT(idraw == model->detailed.draws_count);
+	ASSERT(range + 1 == ranges + ranges_count);
+	model->vis.ranges = ranges;
+	model->vis.ranges_count = ranges_count;
+
+	model->coarse.meshlets = NULL;
+	model->coarse.meshlets_count = 0;
+	const enum BSPLoadResult meshlets_result = bspLoadModelMeshlets(ctx->tmp, persistent, &model->detailed, ranges,
+		face_indices, ctx->faces_count, vertices_buffer, indices_buffer);
+	if (meshlets_result != BSPLoadResult_Success)
+		return meshlets_result;
+
+	/* before vertex cache optimization moves triangles of faces around */
+	const enum BSPLoadResult occluders_result = bspLoadModelOccluders(ctx->tmp, persistent, face_indices,
+		ctx->faces_count, vertices_buffer, vertex_pos, indices_buffer, &model->occluders);
+	if (occluders_result != BSPLoadResult_Success)
+		return occluders_result;
+
+	const void *vertices = vertices_buffer;
+	model->vertex_format = bsp_global.vertex_format;
+	const int vertex_size = (int)bspVertexSize(model->vertex_format);
+	if (model->vertex_format == BSPVertexFormat_Packed) {
+		struct BSPModelPackedVertex *const packed = stackAlloc(ctx->tmp, sizeof(*packed) * vertex_pos);
+		if (!packed) return BSPLoadResult_ErrorTempMemory;
+		bspPackVertices(vertices_buffer, vertex_pos, packed, &model->dequant);
+		vertices = packed;
+	} else {
+		model->dequant.center = aVec3ff(0.f);
+		model->dequant.half_size = aVec3ff(1.f);
+		model->dequant.tex_uv_units = 1.f;
+	}
 
-	renderBufferCreate(&model->ibo, RBufferType_Index, sizeof(uint16_t) * ctx->indices, indices_buffer);
-	renderBufferCreate(&model->vbo, RBufferType_Vertex, sizeof(struct BSPModelVertex) * vertex_pos, vertices_buffer);
+	/* draws and ranges only span whole meshlets, so they stay valid */
+	const enum BSPLoadResult vcache_result = bspOptimizeMeshletsVertexCache(ctx->tmp, model->detailed.meshlets,
+		model->detailed.meshlets_count, indices_buffer);
+	if (vcache_result != BSPLoadResult_Success)
+		return vcache_result;
+
+	if (model->index_size == 2) {
+		/* narrow in place, each uint16_t lands at or before the uint32_t it came from */
+		uint16_t *const indices16 = (uint16_t*)indices_buffer;
+		for (int i = 0; i < ctx->indices; ++i) {
+			ASSERT(indices_buffer[i] < 65536);
+			indices16[i] = (uint16_t)indices_buffer[i];
+		}
+	}
+
+	renderBufferCreate(&model->ibo, RBufferType_Index, model->index_size * ctx->indices, indices_buffer);
+	renderBufferCreate(&model->vbo, RBufferType_Vertex, vertex_size * vertex_pos, vertices);
+
+	if (ctx->cook_key) {
+		BSPCooked cooked = {
+			.aabb = model->aabb,
+			.lightmaps_count = ctx->lightmap.pages_count,
+			.lightmap = ctx->lightmap.atlas_pixels,
+			.vertex_format = model->vertex_format,
+			.dequant = model->dequant,
+			.vertices_count = vertex_pos,
+			.vertices = vertices,
+			.index_size = model->index_size,
+			.indices_count = ctx->indices,
+			.indices = indices_buffer,
+		};
+		for (int i = 0; i < ctx->lightmap.pages_count; ++i) {
+			cooked.lightmaps[i].width = ctx->lightmap.pages[i].width;
+			cooked.lightmaps[i].height = ctx->lightmap.pages[i].height;
+		}
+		bspCookModel(ctx, model, draw_material_names, cooked);
+	}
+
+	lumpsRelease(ctx->loader, LumpUse_All & ~LumpUse_Materials);
 
 	stackFreeUpToPosition(ctx->tmp, tmp_cursor);
 	return BSPLoadResult_Success;
@@ -700,16 +1683,31 @@ static enum BSPLoadResult bspLoadModelDraws(const struct LoadModelContext *ctx,
 
 static enum BSPLoadResult bspLoadModel(
 		struct ICollection *collection, struct BSPModel *model, struct Stack *persistent, struct Stack *temp,
-		const struct Lumps *lumps, unsigned index) {
+		struct LumpsLoader *loader, unsigned index, StringView name, const BSPCookKey *cook_key) {
 	struct LoadModelContext context;
 	memset(&context, 0, sizeof context);
 
+	const struct Lumps *lumps = &loader->lumps;
+	if (!lumpsAcquire(loader, LumpUse_Faces))
+		return BSPLoadResult_ErrorFileFormat;
+
 	ASSERT(index < lumps->models.n);
 
 	context.tmp = temp;
 	context.collection = collection;
+	context.loader = loader;
 	context.lumps = lumps;
 	context.model = lumps->models.p + index;
+	context.lightmap.regions = model->lightmaps;
+	context.name = name;
+	context.cook_key = cook_key;
+
+	model->aabb.min.x = context.model->min.x;
+	model->aabb.min.y = context.model->min.y;
+	model->aabb.min.z = context.model->min.z;
+	model->aabb.max.x = context.model->max.x;
+	model->aabb.max.y = context.model->max.y;
+	model->aabb.max.z = context.model->max.z;
 
 	/* Step 1. Collect lightmaps for all faces */
 	enum BSPLoadResult result = bspLoadModelPreloadFaces(&context);
@@ -718,12 +1716,19 @@ static enum BSPLoadResult bspLoadModel(
 		return result;
 	}
 
+	result = bspLoadModelClusterSets(&context, persistent, &model->vis);
+	if (result != BSPLoadResult_Success) {
+		PRINTF("Error: bspLoadModelClusterSets() => %s", R2S(result));
+		return result;
+	}
+
 	/* Step 2. Build an atlas of all lightmaps */
 	result = bspLoadModelLightmaps(&context);
 	if (result != BSPLoadResult_Success) {
 		PRINTF("Error: bspLoadModelLightmaps() => %s", R2S(result));
 		return result;
 	}
+	model->lightmaps_count = context.lightmap.pages_count;
 
 	/* Step 3. Generate draw operations data */
 	result = bspLoadModelDraws(&context, persistent, model);
@@ -732,17 +1737,276 @@ static enum BSPLoadResult bspLoadModel(
 		return result;
 	}
 
-	model->lightmap = context.lightmap.texture;
-	model->aabb.min.x = context.model->min.x;
-	model->aabb.min.y = context.model->min.y;
-	model->aabb.min.z = context.model->min.z;
-	model->aabb.max.x = context.model->max.x;
-	model->aabb.max.y = context.model->max.y;
-	model->aabb.max.z = context.model->max.z;
-
 	return BSPLoadResult_Success;
 } // bspLoadModel()
 
+static void bspUncookDraws(struct BSPDrawSet *set, const BSPCookedDraw *draws, const char *strings,
+		struct ICollection *collection, struct Stack *tmp) {
+	for (int i = 0; i < set->draws_count; ++i) {
+		struct BSPDraw *draw = set->draws + i;
+		draw->start = draws[i].start;
+		draw->count = draws[i].count;
+		draw->vbo_offset = draws[i].vbo_offset;
+		draw->lightmap = draws[i].lightmap;
+		draw->aabb = draws[i].aabb;
+		draw->first_range = draws[i].first_range;
+		draw->ranges_count = draws[i].ranges_count;
+		draw->first_meshlet = draws[i].first_meshlet;
+		draw->meshlets_count = draws[i].meshlets_count;
+
+		if (i > 0 && draws[i].material == draws[i - 1].material)
+			draw->material = set->draws[i - 1].material;
+		else
+			draw->material = materialGet(strings + draws[i].material, collection, tmp);
+	}
+}
+
+static enum BSPLoadResult bspLoadCookedModel(struct ICollection *collection, struct BSPModel *model,
+		struct Stack *persistent, struct Stack *tmp, const BSPCooked *cooked) {
+	model->aabb = cooked->aabb;
+
+	model->detailed.draws_count = cooked->detailed_count;
+	model->coarse.draws_count = cooked->coarse_count;
+	model->detailed.draws = stackAlloc(persistent, sizeof(struct BSPDraw) * model->detailed.draws_count);
+	model->coarse.draws = stackAlloc(persistent, sizeof(struct BSPDraw) * model->coarse.draws_count);
+	if (!model->detailed.draws || !model->coarse.draws)
+		return BSPLoadResult_ErrorMemory;
+
+	bspUncookDraws(&model->detailed, cooked->draws, cooked->strings, collection, tmp);
+	bspUncookDraws(&model->coarse, cooked->draws + cooked->detailed_count, cooked->strings, collection, tmp);
+
+	struct BSPVisibility *const vis = &model->vis;
+	const uint32_t set_clusters_count = cooked->cluster_sets[cooked->cluster_sets_count];
+	uint32_t *const cluster_sets = stackAlloc(persistent, sizeof(*cluster_sets) * (cooked->cluster_sets_count + 1));
+	uint16_t *const set_clusters = stackAlloc(persistent, sizeof(*set_clusters) * (set_clusters_count + 1));
+	struct BSPDrawRange *const ranges = stackAlloc(persistent, sizeof(*ranges) * (cooked->ranges_count + 1));
+	if (!cluster_sets || !set_clusters || !ranges)
+		return BSPLoadResult_ErrorMemory;
+
+	memcpy(cluster_sets, cooked->cluster_sets, sizeof(*cluster_sets) * (cooked->cluster_sets_count + 1));
+	memcpy(set_clusters, cooked->set_clusters, sizeof(*set_clusters) * set_clusters_count);
+	for (int i = 0; i < cooked->ranges_count; ++i) {
+		ranges[i].start = cooked->ranges[i].start;
+		ranges[i].count = cooked->ranges[i].count;
+		ranges[i].cluster_set = cooked->ranges[i].cluster_set;
+	}
+	vis->cluster_sets_count = cooked->cluster_sets_count;
+	vis->cluster_sets = cluster_sets;
+	vis->set_clusters = set_clusters;
+	vis->ranges_count = cooked->ranges_count;
+	vis->ranges = ranges;
+
+	struct BSPMeshlet *const meshlets = stackAlloc(persistent, sizeof(*meshlets) * (cooked->meshlets_count + 1));
+	if (!meshlets)
+		return BSPLoadResult_ErrorMemory;
+
+	for (int i = 0; i < cooked->meshlets_count; ++i) {
+		const BSPCookedMeshlet *const meshlet = cooked->meshlets + i;
+		meshlets[i].start = meshlet->start;
+		meshlets[i].count = meshlet->count;
+		meshlets[i].cluster_set = meshlet->cluster_set;
+		meshlets[i].center = meshlet->center;
+		meshlets[i].radius = meshlet->radius;
+		meshlets[i].cone_axis = meshlet->cone_axis;
+		meshlets[i].cone_cutoff = meshlet->cone_cutoff;
+	}
+	model->detailed.meshlets = meshlets;
+	model->detailed.meshlets_count = cooked->meshlets_count;
+	model->coarse.meshlets = NULL;
+	model->coarse.meshlets_count = 0;
+
+	struct BSPOccluders *const occluders = &model->occluders;
+	struct AVec3f *const occluder_vertices =
+		stackAlloc(persistent, sizeof(*occluder_vertices) * cooked->occluder_vertices_count);
+	uint16_t *const occluder_indices = stackAlloc(persistent, sizeof(*occluder_indices) * cooked->occluder_indices_count);
+	if (!occluder_vertices || !occluder_indices)
+		return BSPLoadResult_ErrorMemory;
+
+	memcpy(occluder_vertices, cooked->occluder_vertices, sizeof(*occluder_vertices) * cooked->occluder_vertices_count);
+	memcpy(occluder_indices, cooked->occluder_indices, sizeof(*occluder_indices) * cooked->occluder_indices_count);
+	occluders->vertices = occluder_vertices;
+	occluders->vertices_count = cooked->occluder_vertices_count;
+	occluders->indices = occluder_indices;
+	occluders->indices_count = cooked->occluder_indices_count;
+
+	const uint16_t *pixels = cooked->lightmap;
+	model->lightmaps_count = cooked->lightmaps_count;
+	for (int i = 0; i < cooked->lightmaps_count; ++i) {
+		LightmapRegion *const region = model->lightmaps + i;
+		if (!lightmapAlloc(cooked->lightmaps[i].width, cooked->lightmaps[i].height, region))
+			return BSPLoadResult_ErrorCapabilities;
+		lightmapUpload(region, pixels);
+		pixels += region->width * region->height;
+	}
+
+	model->index_size = cooked->index_size;
+	renderBufferCreate(&model->ibo, RBufferType_Index, cooked->index_size * cooked->indices_count, cooked->indices);
+	model->vertex_format = cooked->vertex_format;
+	model->dequant = cooked->dequant;
+	renderBufferCreate(&model->vbo, RBufferType_Vertex,
+		(int)bspVertexSize(cooked->vertex_format) * cooked->vertices_count, cooked->vertices);
+
+	PRINTF("Loaded cooked model: %d detailed draws", model->detailed.draws_count);
+	return BSPLoadResult_Success;
+}
+
+/* bytes of run-length encoded PVS row at offset, as read by bspModelUpdateVisibility() */
+static uint32_t bspPvsRowLength(const uint8_t *data, uint32_t size, uint32_t offset, int row_size) {
+	const uint32_t begin = offset;
+	for (int i = 0; i < row_size && offset < size;) {
+		const uint8_t value = data[offset++];
+		if (value) {
+			++i;
+			continue;
+		}
+
+		const int zeroes = offset < size ? data[offset++] : 0;
+		i += zeroes ? zeroes : 1;
+	}
+	return offset - begin;
+}
+
+/* bsp tree and PVS rows are small and needed as is, so they are read from lumps even for cooked maps.
+ * Only nodes of the world model and PVS rows are kept, brush models and PAS are not needed */
+static void bspLoadModelVisibility(struct LumpsLoader *loader, struct Stack *persistent, struct Stack *tmp,
+		struct BSPModel *model) {
+	struct BSPVisibility *const vis = &model->vis;
+	const struct Lumps *const lumps = &loader->lumps;
+	vis->clusters_count = 0;
+	vis->camera_cluster = -1;
+
+	if (!lumpsAcquire(loader, LumpUse_Visibility)) {
+		PRINT("Cannot read visibility lumps, everything will be drawn");
+		return;
+	}
+
+	void *const persistent_cursor = stackGetCursor(persistent);
+	void *const tmp_cursor = stackGetCursor(tmp);
+
+	uint32_t clusters_count = 0;
+	if (lumps->visibility.n >= sizeof(clusters_count))
+		memcpy(&clusters_count, lumps->visibility.p, sizeof(clusters_count));
+
+	const uint32_t leaves_count = bspLeavesCount(lumps);
+	if (clusters_count == 0 || clusters_count > 32767 || lumps->models.n < 1
+			|| lumps->visibility.n < sizeof(uint32_t) * (1 + 2 * (uint64_t)clusters_count)) {
+		PRINTF("Map has no visibility data: %u clusters, %u bytes", clusters_count, lumps->visibility.n);
+		goto exit;
+	}
+
+	const int row_size = (int)(clusters_count + 7) / 8;
+	uint32_t pvs_size = 0;
+	for (uint32_t i = 0; i < clusters_count; ++i) {
+		uint32_t pvs_offset;
+		memcpy(&pvs_offset, lumps->visibility.p + sizeof(uint32_t) * (1 + 2 * i), sizeof(pvs_offset));
+		if (pvs_offset >= lumps->visibility.n) {
+			PRINTF("Cluster %u PVS offset %u is out of %u bytes", i, pvs_offset, lumps->visibility.n);
+			goto exit;
+		}
+		pvs_size += bspPvsRowLength(lumps->visibility.p, lumps->visibility.n, pvs_offset, row_size);
+	}
+
+	const int32_t head_node = lumps->models.p[0].head_node;
+	if (head_node < 0 || (uint32_t)head_node >= lumps->nodes.n) {
+		PRINTF("Head node %d is out of %u nodes", head_node, lumps->nodes.n);
+		goto exit;
+	}
+
+	/* number nodes reachable from world model head node in depth first order */
+	int32_t *const remap = stackAlloc(tmp, sizeof(*remap) * lumps->nodes.n);
+	int32_t *const stack = stackAlloc(tmp, sizeof(*stack) * (2 * (size_t)lumps->nodes.n + 1));
+	if (!remap || !stack) {
+		PRINT("Not enough temp memory for visibility data");
+		goto exit;
+	}
+
+	for (uint32_t i = 0; i < lumps->nodes.n; ++i)
+		remap[i] = -1;
+
+	int32_t nodes_count = 0;
+	int stack_size = 0;
+	stack[stack_size++] = head_node;
+	while (stack_size) {
+		const int32_t index = stack[--stack_size];
+		if (remap[index] >= 0)
+			continue;
+		remap[index] = nodes_count++;
+
+		const struct VBSPLumpNode *const node = lumps->nodes.p + index;
+		if (node->plane >= lumps->planes.n) {
+			PRINTF("Node %d plane %u is out of %u planes", index, node->plane, lumps->planes.n);
+			goto exit;
+		}
+
+		for (int j = 0; j < 2; ++j) {
+			const int32_t child = (int32_t)node->children[j];
+			if (child >= 0 ? (uint32_t)child >= lumps->nodes.n : (uint32_t)~child >= leaves_count) {
+				PRINTF("Node %d child %d is out of %u nodes and %u leaves", index, child, lumps->nodes.n, leaves_count);
+				goto exit;
+			}
+			if (child >= 0 && remap[child] < 0)
+				stack[stack_size++] = child;
+		}
+	}
+
+	struct BSPVisNode *const nodes = stackAlloc(persistent, sizeof(*nodes) * nodes_count);
+	int16_t *const leaf_clusters = stackAlloc(persistent, sizeof(*leaf_clusters) * (leaves_count + 1));
+	uint32_t *const pvs_offsets = stackAlloc(persistent, sizeof(*pvs_offsets) * clusters_count);
+	uint8_t *const pvs = stackAlloc(persistent, pvs_size + 1);
+	uint8_t *const visible_sets = stackAlloc(persistent, vis->cluster_sets_count + 1);
+	if (!nodes || !leaf_clusters || !pvs_offsets || !pvs || !visible_sets) {
+		PRINT("Not enough memory for visibility data");
+		goto exit;
+	}
+
+	for (uint32_t i = 0; i < lumps->nodes.n; ++i) {
+		if (remap[i] < 0)
+			continue;
+
+		const struct VBSPLumpNode *const node = lumps->nodes.p + i;
+		const struct VBSPLumpPlane *const plane = lumps->planes.p + node->plane;
+		struct BSPVisNode *const out = nodes + remap[i];
+		out->plane = aVec4f(plane->x, plane->y, plane->z, plane->d);
+		for (int j = 0; j < 2; ++j) {
+			const int32_t child = (int32_t)node->children[j];
+			out->children[j] = child >= 0 ? remap[child] : child;
+		}
+	}
+
+	for (uint32_t i = 0; i < leaves_count; ++i) {
+		const uint16_t cluster = bspLeaf(lumps, i)->cluster;
+		leaf_clusters[i] = cluster < clusters_count ? (int16_t)cluster : -1;
+	}
+
+	uint32_t pvs_cursor = 0;
+	for (uint32_t i = 0; i < clusters_count; ++i) {
+		uint32_t pvs_offset;
+		memcpy(&pvs_offset, lumps->visibility.p + sizeof(uint32_t) * (1 + 2 * i), sizeof(pvs_offset));
+		const uint32_t length = bspPvsRowLength(lumps->visibility.p, lumps->visibility.n, pvs_offset, row_size);
+		memcpy(pvs + pvs_cursor, lumps->visibility.p + pvs_offset, length);
+		pvs_offsets[i] = pvs_cursor;
+		pvs_cursor += length;
+	}
+
+	vis->nodes = nodes;
+	vis->head_node = remap[head_node];
+	vis->leaf_clusters = leaf_clusters;
+	vis->leaves_count = (int)leaves_count;
+	vis->pvs_offsets = pvs_offsets;
+	vis->pvs = pvs;
+	vis->pvs_size = pvs_size;
+	vis->visible_sets = visible_sets;
+	vis->clusters_count = (int)clusters_count;
+	PRINTF("Visibility: %d clusters, %d leaves, %d of %u nodes, %u of %u bytes of PVS", vis->clusters_count,
+		vis->leaves_count, nodes_count, lumps->nodes.n, pvs_size, lumps->visibility.n);
+
+exit:
+	if (!vis->clusters_count)
+		stackFreeUpToPosition(persistent, persistent_cursor);
+	stackFreeUpToPosition(tmp, tmp_cursor);
+	lumpsRelease(loader, LumpUse_Visibility);
+}
+
 static const char *bsp_skybox_suffix[6] = {
 	"rt", "lf", "ft", "bk", "up", "dn" };
 
@@ -950,38 +2214,20 @@ ENTITY_LIST_PROPS
 		? BSPLoadResult_Success : BSPLoadResult_ErrorFileFormat;
 }
 
-static int lumpRead(const char *name, const struct VBSPLumpHeader *header,
-		struct IFile *file, struct Stack *tmp,
-		struct AnyLump *out_ptr, uint32_t item_size) {
-	out_ptr->p = stackAlloc(tmp, header->size);
-	if (!out_ptr->p) {
-		PRINTF("Not enough temp memory to allocate storage for lump %s; need: %u (%x)", name, header->size, header->size);
-		return -1;
-	}
-
-	const size_t bytes = file->read(file, header->file_offset, header->size, (void*)out_ptr->p);
-	if (bytes != header->size) {
-		PRINTF("Cannot read full lump %s, read only %zu bytes out of %u", name, bytes, header->size);
-		return -1;
-	}
-
-	PRINTF("Read lump %s, offset %u, size %u bytes / %u item = %u elements",
-			name, header->file_offset, header->size, item_size, header->size / item_size);
-
-	out_ptr->n = header->size / item_size;
-	return 1;
-}
-
 enum BSPLoadResult bspLoadWorldspawn(BSPLoadModelContext context) {
 	enum BSPLoadResult result = BSPLoadResult_Success;
 	struct IFile *file = 0;
 	if (CollectionOpen_Success !=
-			collectionChainOpen(context.collection, context.name.str /* FIXME assumes null-terminated string */, File_Map, &file)) {
+			collectionChainOpen(context.collection, context.name.str /* FIXME assumes null-terminated string */, File_Map, context.tmp, &file)) {
 		return BSPLoadResult_ErrorFileOpen;
 	}
 
 	void *tmp_cursor = stackGetCursor(context.tmp);
 	struct ICollection *pakfile = NULL;
+	struct LumpsLoader loader;
+	memset(&loader, 0, sizeof(loader));
+	int is_cooked = 0;
+	BSPCooked cooked;
 
 	struct VBSPHeader vbsp_header;
 	size_t bytes = file->read(file, 0, sizeof vbsp_header, &vbsp_header);
@@ -1007,58 +2253,127 @@ enum BSPLoadResult bspLoadWorldspawn(BSPLoadModelContext context) {
 
 	PRINTF("VBSP version %u opened", vbsp_header.version);
 
-	struct Lumps lumps;
-	lumps.version = vbsp_header.version;
-#define BSPLUMP(name, type, field) \
-	if (1 != lumpRead(#name, vbsp_header.lump_headers + VBSP_Lump_##name, file, context.tmp, \
-			(struct AnyLump*)&lumps.field, sizeof(type))) { \
-		result = BSPLoadResult_ErrorFileFormat; \
-		goto exit; \
-	}
-	LIST_LUMPS
-#undef BSPLUMP
-
-	if (lumps.lightmaps.n == 0) {
-		memcpy(&lumps.lightmaps, &lumps.lightmaps_hdr, sizeof(lumps.lightmaps));
-		memcpy(&lumps.faces, &lumps.faces_hdr, sizeof(lumps.faces));
+	const BSPCookKey cook_key = {
+		.size = file->size,
+		.mtime = file->mtime,
+		.version = vbsp_header.version,
+		.revision = vbsp_header.map_revision,
+	};
+	is_cooked = bspCookLoad(context.name, &cook_key, bsp_global.vertex_format, bsp_global.index_size,
+		context.tmp, &cooked);
+
+	/* the rest of lumps is read only when and if they're needed,
+	 * e.g. cooked geometry only needs entities and embedded materials from the bsp itself */
+	lumpsInit(&loader, file, context.tmp, &vbsp_header);
+	const struct Lumps *lumps = &loader.lumps;
+	if (!lumpsAcquire(&loader, LumpUse_Materials | LumpUse_Entities)) {
+		result = BSPLoadResult_ErrorFileFormat;
+		goto exit;
 	}
 
-	if (lumps.pakfile.n > 0) {
+	if (lumps->pakfile.n > 0) {
 		struct Memories memories = { context.tmp, context.tmp };
-		pakfile = collectionCreatePakfile(&memories, lumps.pakfile.p, lumps.pakfile.n);
+		pakfile = collectionCreatePakfile(&memories, lumps->pakfile.p, lumps->pakfile.n);
 		if (pakfile)
 			pakfile->next = context.collection;
 	}
 
-	result = bspLoadModel(pakfile ? pakfile : context.collection, context.model, context.persistent, context.tmp, &lumps, 0);
-	if (result != BSPLoadResult_Success) {
-		PRINTF("Error: bspLoadModel() => %s", R2S(result));
-		goto exit;
-	}
-
-	result = bspReadEntities(&context, lumps.entities.p, lumps.entities.n);
+	/* entities go first: they contain changelevel triggers, and neighbour maps can start loading
+	 * in background while this one is still being processed */
+	result = bspReadEntities(&context, lumps->entities.p, lumps->entities.n);
 	if (result != BSPLoadResult_Success)
 		PRINTF("Error: bspReadEntities() => %s", R2S(result));
+	lumpsRelease(&loader, LumpUse_Entities);
+
+	if (is_cooked) {
+		result = bspLoadCookedModel(pakfile ? pakfile : context.collection, context.model,
+			context.persistent, context.tmp, &cooked);
+	} else {
+		result = bspLoadModel(pakfile ? pakfile : context.collection, context.model, context.persistent, context.tmp,
+			&loader, 0, context.name, bspCookEnabled() ? &cook_key : NULL);
+	}
+	if (result != BSPLoadResult_Success)
+		PRINTF("Error: bspLoadModel() => %s", R2S(result));
+	else
+		bspLoadModelVisibility(&loader, context.persistent, context.tmp, context.model);
 
 exit:
 	if (pakfile)
 		pakfile->close(pakfile);
 
+	if (is_cooked)
+		bspCookRelease(&cooked);
+
+	if (loader.file)
+		lumpsRelease(&loader, LumpUse_All);
+
 	stackFreeUpToPosition(context.tmp, tmp_cursor);
 	if (file) file->close(file);
 	return result;
 }
 
-void bspInit() {
+void bspInit(BSPVertexFormat vertex_format) {
 	bsp_global.coarse_material = materialGet("opensource/coarse", NULL, NULL);
+	bsp_global.vertex_format = vertex_format;
+	bsp_global.index_size = renderIndices32Supported() ? 4 : 2;
+	rgbeInit();
+}
 
-	const int scaling_factor = 4096;
-	for (int i = 0; i < 256; ++i) {
-		const int exp = i - 128;
-		bsp_global.lightmap_tables.exponent[i] = (exp < -15 || exp > 15) ? 0 :
-			(int)((float)scaling_factor * powf(2.f, (float)exp / 2.2f - 1.f));
+void bspModelUpdateVisibility(struct BSPModel *model, struct AVec3f pos) {
+	struct BSPVisibility *const vis = &model->vis;
+	if (!vis->clusters_count)
+		return;
+
+	int cluster = -1;
+	if (pos.x >= model->aabb.min.x && pos.y >= model->aabb.min.y && pos.z >= model->aabb.min.z
+			&& pos.x <= model->aabb.max.x && pos.y <= model->aabb.max.y && pos.z <= model->aabb.max.z) {
+		int32_t node = vis->head_node;
+		while (node >= 0) {
+			const struct BSPVisNode *const n = vis->nodes + node;
+			node = n->children[aVec3fDot(aVec3f(n->plane.x, n->plane.y, n->plane.z), pos) >= n->plane.w ? 0 : 1];
+		}
+		cluster = vis->leaf_clusters[~node];
+	}
 
-		bsp_global.lightmap_tables.color[i] =
-			(int)(255.f * powf((float)i / 255.f, 1.f / 2.2f));
+	if (cluster == vis->camera_cluster)
+		return;
+
+	vis->camera_cluster = cluster;
+	if (cluster < 0)
+		return;
+
+	/* run-length encoded row: zero byte is followed by count of zero bytes */
+	uint8_t row[65536 / 8];
+	const int row_size = (vis->clusters_count + 7) / 8;
+	uint32_t offset = vis->pvs_offsets[cluster];
+	const uint32_t row_end = cluster + 1 < vis->clusters_count ? vis->pvs_offsets[cluster + 1] : vis->pvs_size;
+	for (int i = 0; i < row_size;) {
+		if (offset >= row_end) {
+			memset(row + i, 0, row_size - i);
+			break;
+		}
+
+		const uint8_t value = vis->pvs[offset++];
+		if (value) {
+			row[i++] = value;
+			continue;
+		}
+
+		const int zeroes = offset < row_end ? vis->pvs[offset++] : 0;
+		for (int j = 0; j < zeroes && i < row_size; ++j)
+			row[i++] = 0;
+		if (!zeroes)
+			row[i++] = 0;
+	}
+	row[cluster / 8] |= (uint8_t)(1 << (cluster % 8));
+
+	for (int i = 0; i < vis->cluster_sets_count; ++i) {
+		const uint32_t begin = vis->cluster_sets[i], end = vis->cluster_sets[i + 1];
+		uint8_t set_visible = begin == end;
+		for (uint32_t j = begin; j < end && !set_visible; ++j) {
+			const int c = vis->set_clusters[j];
+			set_visible = c >= vis->clusters_count || (row[c / 8] & (1 << (c % 8)));
+		}
+		vis->visible_sets[i] = set_visible;
 	}
 }
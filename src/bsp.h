@@ -1,6 +1,7 @@
 #pragma once
 #include "material.h"
 #include "render.h"
+#include "lightmap.h"
 #include "atto/math.h"
 #include "common.h"
 
@@ -14,12 +15,113 @@ struct BSPModelVertex {
 	struct { uint8_t r, g, b; } average_color;
 };
 
+typedef enum {
+	BSPVertexFormat_Float,
+	/* BSPModelPackedVertex */
+	BSPVertexFormat_Packed,
+} BSPVertexFormat;
+
+/* Compact layout, 20 bytes instead of 32. Position is normalized to model bounds, lightmap uv
+ * to its atlas page, and texture uv is fixed point; see BSPVertexDequant */
+struct BSPModelPackedVertex {
+	int16_t vertex[4]; /* w is unused, but keeps the rest 4 bytes aligned */
+	uint16_t lightmap_uv[2];
+	int16_t tex_uv[2];
+	uint8_t average_color[4];
+};
+
+static inline size_t bspVertexSize(BSPVertexFormat format) {
+	return format == BSPVertexFormat_Packed ? sizeof(struct BSPModelPackedVertex) : sizeof(struct BSPModelVertex);
+}
+
+/* position = center + vertex * half_size, with vertex in [-1, 1]; tex_uv = texels * tex_uv_units */
+struct BSPVertexDequant {
+	struct AVec3f center, half_size;
+	float tex_uv_units;
+};
+
 struct BSPDraw {
 	const Material *material;
 	unsigned int start, count;
 	unsigned int vbo_offset;
+	unsigned int lightmap; /* index into BSPModel.lightmaps */
+	struct AABB aabb; /* of all vertices, in model space */
+	/* BSPVisibility.ranges that make up this draw; only detailed draws have them */
+	unsigned int first_range, ranges_count;
+	/* BSPDrawSet.meshlets that make up this draw; only detailed draws have them */
+	unsigned int first_meshlet, meshlets_count;
+};
+
+/* Spatially close faces of a draw, so that parts of it that are out of view or facing away from
+ * camera can be skipped. Meshlets are within a single BSPDrawRange */
+struct BSPMeshlet {
+	unsigned int start, count;
+	unsigned int cluster_set; /* of its range */
+	/* bounding sphere, in model space */
+	struct AVec3f center;
+	float radius;
+	/* normals of all triangles are within angle a of cone_axis, and cone_cutoff = sin(a);
+	 * 1 if they point too far apart for the meshlet to ever be entirely back facing */
+	struct AVec3f cone_axis;
+	float cone_cutoff;
+};
+
+/* faces of a draw that are in the same set of clusters, and are either all potentially visible or not */
+struct BSPDrawRange {
+	unsigned int start, count;
+	unsigned int cluster_set;
+};
+
+/* bsp tree node, for finding which leaf a point is in */
+struct BSPVisNode {
+	/* dot(plane.xyz, p) >= plane.w is in front */
+	struct AVec4f plane;
+	/* front, back; negative are ~leaf */
+	int32_t children[2];
+};
+
+/* Potentially visible set: when camera is inside of a map, only faces in clusters visible from
+ * camera's cluster are drawn */
+struct BSPVisibility {
+	/* 0 if map has no visibility data, then everything is always drawn */
+	int clusters_count;
+	const struct BSPVisNode *nodes;
+	int head_node;
+	const int16_t *leaf_clusters; /* -1 for solid leaves */
+	int leaves_count;
+	/* run-length encoded PVS row of each cluster starts at pvs + pvs_offsets[cluster], as in the Visibility lump
+	 * without its PAS rows; a row is only decoded when camera moves to another cluster */
+	const uint32_t *pvs_offsets;
+	const uint8_t *pvs;
+	uint32_t pvs_size;
+
+	/* clusters of set i are set_clusters[cluster_sets[i] .. cluster_sets[i + 1]); faces that
+	 * are not in any leaf have an empty set and are always visible */
+	int cluster_sets_count;
+	const uint32_t *cluster_sets;
+	const uint16_t *set_clusters;
+
+	/* all detailed draws split by cluster sets of their faces */
+	const struct BSPDrawRange *ranges;
+	int ranges_count;
+
+	/* updated by bspModelUpdateVisibility() */
+	/* -1 if everything is drawn */
+	int camera_cluster;
+	uint8_t *visible_sets;
+};
+
+/* largest faces of a map, in model space, for software occlusion culling; see occlusion.h */
+struct BSPOccluders {
+	const struct AVec3f *vertices;
+	int vertices_count;
+	const uint16_t *indices;
+	int indices_count;
 };
 
+/* lightmaps that don't fit into a single shared lightmap page are split into several */
+#define BSP_MAX_LIGHTMAP_PAGES 16
+
 #define BSP_LANDMARK_NAME_LENGTH 64
 #define BSP_MAX_LANDMARKS 32
 
@@ -31,6 +133,8 @@ typedef struct BSPLandmark {
 struct BSPDrawSet {
 	int draws_count;
 	struct BSPDraw *draws;
+	int meshlets_count;
+	const struct BSPMeshlet *meshlets;
 };
 
 typedef enum {
@@ -45,13 +149,22 @@ typedef enum {
 
 struct BSPModel {
 	struct AABB aabb;
-	RTexture lightmap;
+	/* where each atlas page of this model ended up on shared lightmap pages */
+	LightmapRegion lightmaps[BSP_MAX_LIGHTMAP_PAGES];
+	int lightmaps_count;
 	RBuffer vbo, ibo;
+	/* bytes per index in ibo: 4 if renderIndices32Supported(), then all draws have vbo_offset 0; 2 otherwise */
+	int index_size;
+	BSPVertexFormat vertex_format;
+	/* only for BSPVertexFormat_Packed */
+	struct BSPVertexDequant dequant;
 
 	const Material *skybox[BSPSkyboxDir_COUNT];
 
 	struct BSPDrawSet detailed;
 	struct BSPDrawSet coarse;
+	struct BSPVisibility vis;
+	struct BSPOccluders occluders;
 
 	struct BSPLandmark landmarks[BSP_MAX_LANDMARKS];
 	int landmarks_count;
@@ -84,9 +197,12 @@ typedef enum BSPLoadResult {
 	BSPLoadResult_ErrorCapabilities
 } BSPLoadResult;
 
-/* should be called AFTER renderInit() */
-void bspInit();
+/* should be called AFTER renderInit(); format is used for all maps loaded after this */
+void bspInit(BSPVertexFormat vertex_format);
 
 enum BSPLoadResult bspLoadWorldspawn(BSPLoadModelContext context);
 
+/* pos is in model space; main thread only */
+void bspModelUpdateVisibility(struct BSPModel *model, struct AVec3f pos);
+
 void openSourceAddMap(StringView name);
@@ -0,0 +1,408 @@
+#include "bspcook.h"
+#include "filemap.h"
+#include "mempools.h"
+#include "common.h"
+
+#ifndef _WIN32
+#include <sys/stat.h> /* mkdir */
+#include <errno.h>
+#endif
+
+#define BSPCOOK_MAGIC 0x4b43534fu /* "OSCK" */
+/* bump this whenever layout of anything stored changes */
+#define BSPCOOK_VERSION 9
+#define BSPCOOK_ALIGNMENT 8
+
+typedef enum {
+	BSPCookSection_Lightmap,
+	BSPCookSection_Vertices,
+	BSPCookSection_Indices,
+	BSPCookSection_Draws,
+	BSPCookSection_Strings,
+	BSPCookSection_ClusterSets,
+	BSPCookSection_SetClusters,
+	BSPCookSection_Ranges,
+	BSPCookSection_OccluderVertices,
+	BSPCookSection_OccluderIndices,
+	BSPCookSection_Meshlets,
+	BSPCookSection_COUNT
+} BSPCookSection;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	BSPCookKey key;
+	uint32_t vertex_size; /* also tells vertex format */
+	struct BSPVertexDequant dequant;
+	uint32_t index_size;
+	uint32_t lightmaps_count;
+	struct {
+		uint32_t width, height;
+	} lightmaps[BSP_MAX_LIGHTMAP_PAGES];
+	uint32_t detailed_count, coarse_count;
+	struct AABB aabb;
+	struct {
+		uint32_t offset, size;
+	} sections[BSPCookSection_COUNT];
+} BSPCookHeader;
+
+static struct {
+	char dir[512];
+} cook;
+
+void bspCookInit(const char *dir) {
+	cook.dir[0] = '\0';
+	if (!dir || !dir[0])
+		return;
+
+	if (strlen(dir) >= sizeof(cook.dir) - 64) {
+		PRINTF("Cooked maps directory name \"%s\" is too long, cooking disabled", dir);
+		return;
+	}
+
+#ifndef _WIN32
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+#else
+	if (!CreateDirectoryA(dir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+#endif
+		PRINTF("Cannot create cooked maps directory \"%s\", cooking disabled", dir);
+		return;
+	}
+
+	strcpy(cook.dir, dir);
+	PRINTF("Cooked maps directory: %s", cook.dir);
+}
+
+int bspCookEnabled(void) {
+	return cook.dir[0] != '\0';
+}
+
+/* FNV-1a of key fields */
+static uint64_t bspCookKeyHash(const BSPCookKey *key) {
+	const uint64_t fields[4] = { key->size, key->mtime, key->version, key->revision };
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (int i = 0; i < 4; ++i)
+		for (int j = 0; j < 8; ++j) {
+			hash ^= (fields[i] >> (j * 8)) & 0xff;
+			hash *= 0x100000001b3ull;
+		}
+	return hash;
+}
+
+/* maps with the same name exist in several games, e.g. background01, so file name also has a hash of the key
+ * to keep them from overwriting each other's cooked files */
+static int bspCookMakePath(char *path, int path_size, StringView map_name, const BSPCookKey *key, const char *suffix) {
+	const int prefix_length = (int)strlen(cook.dir);
+	char hash[18];
+	snprintf(hash, sizeof(hash), "-%016llx", (unsigned long long)bspCookKeyHash(key));
+	const int hash_length = (int)strlen(hash);
+	const int suffix_length = (int)strlen(suffix);
+	if (prefix_length + 1 + map_name.length + hash_length + suffix_length + 1 > path_size)
+		return 0;
+
+	char *p = path;
+	memcpy(p, cook.dir, prefix_length); p += prefix_length;
+	*p++ = '/';
+	for (int i = 0; i < map_name.length; ++i) {
+		const char c = map_name.str[i];
+		*p++ = (c == '/' || c == '\\' || c == ':') ? '_' : c;
+	}
+	memcpy(p, hash, hash_length); p += hash_length;
+	memcpy(p, suffix, suffix_length + 1);
+	return 1;
+}
+
+static uint32_t bspCookAlign(uint32_t offset) {
+	return (offset + BSPCOOK_ALIGNMENT - 1) & ~(uint32_t)(BSPCOOK_ALIGNMENT - 1);
+}
+
+static uint64_t bspCookLightmapSize(int count, const BSPCookHeader *header) {
+	uint64_t size = 0;
+	for (int i = 0; i < count; ++i)
+		size += sizeof(uint16_t) * (uint64_t)header->lightmaps[i].width * header->lightmaps[i].height;
+	return size;
+}
+
+/* largest index in [start, start + count), 0 for no indices */
+static uint32_t bspCookMaxIndex(const void *indices, int index_size, uint32_t start, uint32_t count) {
+	uint32_t max = 0;
+	if (index_size == 4) {
+		const uint32_t *const indices32 = (const uint32_t*)indices + start;
+		for (uint32_t i = 0; i < count; ++i)
+			if (indices32[i] > max)
+				max = indices32[i];
+	} else {
+		const uint16_t *const indices16 = (const uint16_t*)indices + start;
+		for (uint32_t i = 0; i < count; ++i)
+			if (indices16[i] > max)
+				max = indices16[i];
+	}
+	return max;
+}
+
+int bspCookLoad(StringView map_name, const BSPCookKey *key, BSPVertexFormat vertex_format, int index_size,
+		struct Stack *tmp, BSPCooked *cooked) {
+	if (!bspCookEnabled())
+		return 0;
+
+	char path[1024];
+	if (!bspCookMakePath(path, sizeof(path), map_name, key, ".cooked"))
+		return 0;
+
+	AFile file;
+	aFileReset(&file);
+	if (AFile_Success != aFileOpen(&file, path))
+		return 0;
+
+	const char *data = NULL;
+	char *data_read = NULL;
+	BSPCookHeader header;
+
+	cooked->mapping = NULL;
+	cooked->mapping_size = 0;
+
+	if (file.size < sizeof(header) || file.size > 0xffffffffu)
+		goto fail;
+
+	data = aFileMap(&file, 0, file.size);
+	if (data) {
+		cooked->mapping = data;
+		cooked->mapping_size = file.size;
+	} else {
+		data = data_read = stackAlloc(tmp, file.size);
+		if (!data_read) {
+			PRINTF("Not enough temp memory to read cooked map %s of %zu bytes", path, file.size);
+			goto fail;
+		}
+
+		if (file.size != aFileReadAtOffset(&file, 0, file.size, data_read))
+			goto fail;
+	}
+
+	memcpy(&header, data, sizeof(header));
+	const size_t vertex_size = bspVertexSize(vertex_format);
+	if (header.magic != BSPCOOK_MAGIC || header.version != BSPCOOK_VERSION || header.vertex_size != vertex_size
+			|| header.index_size != (uint32_t)index_size)
+		goto fail;
+
+	if (memcmp(&header.key, key, sizeof(*key)) != 0) {
+		PRINTF("Cooked map %s is stale", path);
+		goto fail;
+	}
+
+	for (int i = 0; i < BSPCookSection_COUNT; ++i)
+		if (header.sections[i].offset % 4 != 0 || header.sections[i].offset > file.size
+				|| file.size - header.sections[i].offset < header.sections[i].size)
+			goto fail;
+
+#define SECTION(name) (data + header.sections[BSPCookSection_##name].offset)
+#define SECTION_SIZE(name) (header.sections[BSPCookSection_##name].size)
+	const uint32_t draws_count = header.detailed_count + header.coarse_count;
+	if (header.lightmaps_count < 1 || header.lightmaps_count > BSP_MAX_LIGHTMAP_PAGES
+			|| SECTION_SIZE(Lightmap) != bspCookLightmapSize((int)header.lightmaps_count, &header)
+			|| SECTION_SIZE(Vertices) % vertex_size != 0
+			|| SECTION_SIZE(Indices) % index_size != 0
+			|| SECTION_SIZE(Draws) != sizeof(BSPCookedDraw) * draws_count
+			|| SECTION_SIZE(Strings) < 1 || SECTION(Strings)[SECTION_SIZE(Strings) - 1] != '\0'
+			|| SECTION_SIZE(ClusterSets) < sizeof(uint32_t) || SECTION_SIZE(ClusterSets) % sizeof(uint32_t) != 0
+			|| SECTION_SIZE(SetClusters) % sizeof(uint16_t) != 0
+			|| SECTION_SIZE(Ranges) % sizeof(BSPCookedRange) != 0
+			|| SECTION_SIZE(OccluderVertices) % sizeof(struct AVec3f) != 0
+			|| SECTION_SIZE(OccluderIndices) % (3 * sizeof(uint16_t)) != 0
+			|| SECTION_SIZE(Meshlets) % sizeof(BSPCookedMeshlet) != 0)
+		goto fail;
+
+	cooked->aabb = header.aabb;
+	cooked->lightmaps_count = (int)header.lightmaps_count;
+	for (int i = 0; i < cooked->lightmaps_count; ++i) {
+		cooked->lightmaps[i].width = (int)header.lightmaps[i].width;
+		cooked->lightmaps[i].height = (int)header.lightmaps[i].height;
+	}
+	cooked->lightmap = (const void*)SECTION(Lightmap);
+	cooked->vertex_format = vertex_format;
+	cooked->dequant = header.dequant;
+	cooked->vertices_count = (int)(SECTION_SIZE(Vertices) / vertex_size);
+	cooked->vertices = (const void*)SECTION(Vertices);
+	cooked->index_size = index_size;
+	cooked->indices_count = (int)(SECTION_SIZE(Indices) / index_size);
+	cooked->indices = (const void*)SECTION(Indices);
+	cooked->detailed_count = (int)header.detailed_count;
+	cooked->coarse_count = (int)header.coarse_count;
+	cooked->draws = (const void*)SECTION(Draws);
+	cooked->strings_size = (int)SECTION_SIZE(Strings);
+	cooked->strings = SECTION(Strings);
+	cooked->cluster_sets_count = (int)(SECTION_SIZE(ClusterSets) / sizeof(uint32_t)) - 1;
+	cooked->cluster_sets = (const void*)SECTION(ClusterSets);
+	const uint32_t set_clusters_count = SECTION_SIZE(SetClusters) / sizeof(uint16_t);
+	cooked->set_clusters = (const void*)SECTION(SetClusters);
+	cooked->ranges_count = (int)(SECTION_SIZE(Ranges) / sizeof(BSPCookedRange));
+	cooked->ranges = (const void*)SECTION(Ranges);
+	cooked->occluder_vertices_count = (int)(SECTION_SIZE(OccluderVertices) / sizeof(struct AVec3f));
+	cooked->occluder_vertices = (const void*)SECTION(OccluderVertices);
+	cooked->occluder_indices_count = (int)(SECTION_SIZE(OccluderIndices) / sizeof(uint16_t));
+	cooked->occluder_indices = (const void*)SECTION(OccluderIndices);
+	cooked->meshlets_count = (int)(SECTION_SIZE(Meshlets) / sizeof(BSPCookedMeshlet));
+	cooked->meshlets = (const void*)SECTION(Meshlets);
+#undef SECTION
+#undef SECTION_SIZE
+
+	for (uint32_t i = 0; i < draws_count; ++i) {
+		const BSPCookedDraw *draw = cooked->draws + i;
+		if (draw->material >= (uint32_t)cooked->strings_size
+				|| draw->start > (uint32_t)cooked->indices_count
+				|| (uint32_t)cooked->indices_count - draw->start < draw->count
+				|| draw->vbo_offset > (uint32_t)cooked->vertices_count
+				|| draw->lightmap >= (uint32_t)cooked->lightmaps_count
+				|| draw->first_range > (uint32_t)cooked->ranges_count
+				|| (uint32_t)cooked->ranges_count - draw->first_range < draw->ranges_count
+				|| draw->first_meshlet > (uint32_t)cooked->meshlets_count
+				|| (uint32_t)cooked->meshlets_count - draw->first_meshlet < draw->meshlets_count)
+			goto fail;
+
+		/* vertices are fetched at vbo_offset + index, and meshlets are drawn with vbo_offset of their draw */
+		if (draw->count && (uint64_t)draw->vbo_offset
+				+ bspCookMaxIndex(cooked->indices, index_size, draw->start, draw->count) >= (uint64_t)cooked->vertices_count)
+			goto fail;
+
+		for (uint32_t j = 0; j < draw->meshlets_count; ++j) {
+			const BSPCookedMeshlet *meshlet = cooked->meshlets + draw->first_meshlet + j;
+			if (meshlet->start < draw->start || meshlet->start - draw->start > draw->count
+					|| draw->count - (meshlet->start - draw->start) < meshlet->count)
+				goto fail;
+		}
+	}
+
+	if (cooked->cluster_sets[0] != 0 || cooked->cluster_sets[cooked->cluster_sets_count] != set_clusters_count)
+		goto fail;
+	for (int i = 0; i < cooked->cluster_sets_count; ++i)
+		if (cooked->cluster_sets[i] > cooked->cluster_sets[i + 1])
+			goto fail;
+
+	for (int i = 0; i < cooked->ranges_count; ++i) {
+		const BSPCookedRange *range = cooked->ranges + i;
+		if (range->start > (uint32_t)cooked->indices_count
+				|| (uint32_t)cooked->indices_count - range->start < range->count
+				|| range->cluster_set >= (uint32_t)cooked->cluster_sets_count)
+			goto fail;
+	}
+
+	for (int i = 0; i < cooked->meshlets_count; ++i) {
+		const BSPCookedMeshlet *meshlet = cooked->meshlets + i;
+		if (meshlet->start > (uint32_t)cooked->indices_count
+				|| (uint32_t)cooked->indices_count - meshlet->start < meshlet->count
+				|| meshlet->cluster_set >= (uint32_t)cooked->cluster_sets_count)
+			goto fail;
+	}
+
+	for (int i = 0; i < cooked->occluder_indices_count; ++i)
+		if (cooked->occluder_indices[i] >= cooked->occluder_vertices_count)
+			goto fail;
+
+	aFileClose(&file);
+	PRINTF("Loaded cooked map %s", path);
+	return 1;
+
+fail:
+	PRINTF("Ignoring cooked map %s", path);
+	bspCookRelease(cooked);
+	if (data_read)
+		stackFreeUpToPosition(tmp, data_read);
+	aFileClose(&file);
+	return 0;
+}
+
+void bspCookRelease(BSPCooked *cooked) {
+	if (cooked->mapping)
+		aFileUnmap(cooked->mapping, cooked->mapping_size);
+	cooked->mapping = NULL;
+	cooked->mapping_size = 0;
+}
+
+int bspCookSave(StringView map_name, const BSPCookKey *key, const BSPCooked *cooked) {
+	if (!bspCookEnabled())
+		return 0;
+
+	char path[1024], path_tmp[1024];
+	if (!bspCookMakePath(path, sizeof(path), map_name, key, ".cooked")
+			|| !bspCookMakePath(path_tmp, sizeof(path_tmp), map_name, key, ".cooked.tmp"))
+		return 0;
+
+	BSPCookHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = BSPCOOK_MAGIC;
+	header.version = BSPCOOK_VERSION;
+	header.key = *key;
+	header.vertex_size = (uint32_t)bspVertexSize(cooked->vertex_format);
+	header.dequant = cooked->dequant;
+	header.index_size = (uint32_t)cooked->index_size;
+	header.lightmaps_count = (uint32_t)cooked->lightmaps_count;
+	for (int i = 0; i < cooked->lightmaps_count; ++i) {
+		header.lightmaps[i].width = (uint32_t)cooked->lightmaps[i].width;
+		header.lightmaps[i].height = (uint32_t)cooked->lightmaps[i].height;
+	}
+	header.detailed_count = (uint32_t)cooked->detailed_count;
+	header.coarse_count = (uint32_t)cooked->coarse_count;
+	header.aabb = cooked->aabb;
+
+	const void *sections[BSPCookSection_COUNT] = {
+		cooked->lightmap, cooked->vertices, cooked->indices, cooked->draws, cooked->strings,
+		cooked->cluster_sets, cooked->set_clusters, cooked->ranges,
+		cooked->occluder_vertices, cooked->occluder_indices, cooked->meshlets
+	};
+	header.sections[BSPCookSection_Lightmap].size =
+		(uint32_t)bspCookLightmapSize(cooked->lightmaps_count, &header);
+	header.sections[BSPCookSection_Vertices].size = header.vertex_size * cooked->vertices_count;
+	header.sections[BSPCookSection_Indices].size = header.index_size * cooked->indices_count;
+	header.sections[BSPCookSection_Draws].size =
+		sizeof(BSPCookedDraw) * (cooked->detailed_count + cooked->coarse_count);
+	header.sections[BSPCookSection_Strings].size = cooked->strings_size;
+	header.sections[BSPCookSection_ClusterSets].size = sizeof(uint32_t) * (cooked->cluster_sets_count + 1);
+	header.sections[BSPCookSection_SetClusters].size =
+		sizeof(uint16_t) * cooked->cluster_sets[cooked->cluster_sets_count];
+	header.sections[BSPCookSection_Ranges].size = sizeof(BSPCookedRange) * cooked->ranges_count;
+	header.sections[BSPCookSection_OccluderVertices].size =
+		sizeof(struct AVec3f) * cooked->occluder_vertices_count;
+	header.sections[BSPCookSection_OccluderIndices].size = sizeof(uint16_t) * cooked->occluder_indices_count;
+	header.sections[BSPCookSection_Meshlets].size = sizeof(BSPCookedMeshlet) * cooked->meshlets_count;
+
+	uint32_t offset = bspCookAlign(sizeof(header));
+	for (int i = 0; i < BSPCookSection_COUNT; ++i) {
+		header.sections[i].offset = offset;
+		offset = bspCookAlign(offset + header.sections[i].size);
+	}
+
+	FILE *f = fopen(path_tmp, "wb");
+	if (!f) {
+		PRINTF("Cannot open %s for writing", path_tmp);
+		return 0;
+	}
+
+	static const char padding[BSPCOOK_ALIGNMENT] = {0};
+	int ok = 1 == fwrite(&header, sizeof(header), 1, f);
+	long position = (long)sizeof(header);
+	for (int i = 0; ok && i < BSPCookSection_COUNT; ++i) {
+		const long pad = (long)header.sections[i].offset - position;
+		if (pad > 0)
+			ok = (size_t)pad == fwrite(padding, 1, pad, f);
+		if (ok && header.sections[i].size)
+			ok = 1 == fwrite(sections[i], header.sections[i].size, 1, f);
+		position = (long)header.sections[i].offset + (long)header.sections[i].size;
+	}
+
+	ok = (fclose(f) == 0) && ok;
+	if (ok) {
+#ifdef _WIN32
+		remove(path);
+#endif
+		ok = rename(path_tmp, path) == 0;
+	}
+
+	if (!ok) {
+		PRINTF("Cannot write cooked map %s", path);
+		remove(path_tmp);
+		return 0;
+	}
+
+	PRINTF("Cooked map to %s, %ld bytes", path, position);
+	return 1;
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include "bsp.h"
+
+/* Cooked map cache: deterministic outputs of loading a bsp model (lightmap atlas pixels, vertex and
+ * index buffers, draw lists, aabb) are stored in a single flat file, so that next time the map can
+ * be uploaded as is, without reading and processing most of the lumps.
+ *
+ * Everything in the file is addressed by offsets from its beginning, so it can be used in place
+ * right after being read or mapped. */
+
+/* identifies the source bsp file; cooked data is discarded if any of these don't match */
+typedef struct BSPCookKey {
+	uint64_t size;
+	uint64_t mtime;
+	uint32_t version;
+	uint32_t revision;
+} BSPCookKey;
+
+typedef struct BSPCookedDraw {
+	uint32_t start, count;
+	uint32_t vbo_offset;
+	uint32_t material; /* offset of material name in strings */
+	uint32_t lightmap; /* lightmap page */
+	struct AABB aabb;
+	uint32_t first_range, ranges_count;
+	uint32_t first_meshlet, meshlets_count;
+} BSPCookedDraw;
+
+typedef struct BSPCookedRange {
+	uint32_t start, count;
+	uint32_t cluster_set;
+} BSPCookedRange;
+
+typedef struct BSPCookedMeshlet {
+	uint32_t start, count;
+	uint32_t cluster_set;
+	struct AVec3f center;
+	float radius;
+	struct AVec3f cone_axis;
+	float cone_cutoff;
+} BSPCookedMeshlet;
+
+typedef struct BSPCooked {
+	struct AABB aabb;
+	int lightmaps_count;
+	struct {
+		int width, height;
+	} lightmaps[BSP_MAX_LIGHTMAP_PAGES];
+	const uint16_t *lightmap; /* pixels of all pages back to back */
+	BSPVertexFormat vertex_format;
+	struct BSPVertexDequant dequant;
+	int vertices_count;
+	const void *vertices; /* of vertex_format */
+	int index_size; /* 2 or 4 */
+	int indices_count;
+	const void *indices;
+	int detailed_count, coarse_count;
+	const BSPCookedDraw *draws; /* detailed draws followed by coarse ones */
+	int strings_size;
+	const char *strings;
+	int cluster_sets_count;
+	const uint32_t *cluster_sets; /* cluster_sets_count + 1 offsets into set_clusters */
+	const uint16_t *set_clusters;
+	int ranges_count;
+	const BSPCookedRange *ranges;
+	int meshlets_count;
+	const BSPCookedMeshlet *meshlets; /* of detailed draws */
+	int occluder_vertices_count;
+	const struct AVec3f *occluder_vertices;
+	int occluder_indices_count;
+	const uint16_t *occluder_indices;
+
+	/* file contents, if mapped */
+	const void *mapping;
+	size_t mapping_size;
+} BSPCooked;
+
+/* dir == NULL or empty string disables cooking */
+void bspCookInit(const char *dir);
+int bspCookEnabled(void);
+
+/* returns 1 and fills cooked with pointers into mapped file (or data read onto tmp stack) if a valid cooked file
+ * with vertices in vertex_format and indices of index_size exists. bspCookRelease must be called when the data is no longer needed */
+int bspCookLoad(StringView map_name, const BSPCookKey *key, BSPVertexFormat vertex_format, int index_size,
+		struct Stack *tmp, BSPCooked *cooked);
+void bspCookRelease(BSPCooked *cooked);
+/* returns 1 if cooked data was written to disk */
+int bspCookSave(StringView map_name, const BSPCookKey *key, const BSPCooked *cooked);
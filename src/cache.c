@@ -4,17 +4,38 @@
 #define AHASH_IMPLEMENT
 #include "ahash.h"
 #include "mempools.h"
+#include "thread.h"
+
+#define CACHE_KEY_SIZE 256
+/* names that can be loaded at the same time; threads wait for a free slot when all are taken */
+#define CACHE_MAX_LOADING 32
+
+typedef enum {
+	CacheKind_Material,
+	CacheKind_Texture,
+} CacheKind;
 
 static struct {
+	AMutex lock;
+	/* signaled when any name is done loading */
+	ACond loaded;
+	struct Stack *pool;
 	AHash materials;
+	/* values are pointers to textures, which never move */
 	AHash textures;
+
+	struct {
+		CacheKind kind;
+		char name[CACHE_KEY_SIZE];
+	} loading[CACHE_MAX_LOADING];
+	int loading_count;
 } g;
 
 static void initHash(AHash *hash, struct Stack *pool, long item_size) {
 	hash->alloc_param = pool;
 	hash->alloc = (AHashAllocFunc)stackAlloc;
 	hash->nbuckets = 64;
-	hash->key_size = 256;
+	hash->key_size = CACHE_KEY_SIZE;
 	hash->value_size = item_size;
 	hash->key_hash = aHashStringHash;
 	hash->key_compare = (AHashKeyCompareFunc)strcmp;
@@ -22,22 +43,122 @@ static void initHash(AHash *hash, struct Stack *pool, long item_size) {
 }
 
 void cacheInit(struct Stack *pool) {
+	aMutexInit(&g.lock);
+	aCondInit(&g.loaded);
+	g.pool = pool;
+	g.loading_count = 0;
 	initHash(&g.materials, pool, sizeof(struct Material));
-	initHash(&g.textures, pool, sizeof(struct Texture));
+	initHash(&g.textures, pool, sizeof(struct Texture*));
+}
+
+/* the rest of cacheLoading* functions must be called with lock held */
+static int cacheLoadingFind(CacheKind kind, const char *name) {
+	for (int i = 0; i < g.loading_count; ++i)
+		if (g.loading[i].kind == kind && strcmp(g.loading[i].name, name) == 0)
+			return i;
+	return -1;
+}
+
+static void cacheLoadingWait(CacheKind kind, const char *name) {
+	while (cacheLoadingFind(kind, name) >= 0)
+		aCondWait(&g.loaded, &g.lock);
+}
+
+static void cacheLoadingBegin(CacheKind kind, const char *name) {
+	while (g.loading_count == CACHE_MAX_LOADING)
+		aCondWait(&g.loaded, &g.lock);
+
+	g.loading[g.loading_count].kind = kind;
+	memset(g.loading[g.loading_count].name, 0, CACHE_KEY_SIZE);
+	strncpy(g.loading[g.loading_count].name, name, CACHE_KEY_SIZE - 1);
+	++g.loading_count;
+}
+
+static void cacheLoadingEnd(CacheKind kind, const char *name) {
+	const int index = cacheLoadingFind(kind, name);
+	ASSERT(index >= 0);
+	g.loading[index] = g.loading[--g.loading_count];
+	aCondBroadcast(&g.loaded);
 }
 
 const struct Material *cacheGetMaterial(const char *name) {
-	return aHashGet(&g.materials, name);
+	aMutexLock(&g.lock);
+	const struct Material *mat = aHashGet(&g.materials, name);
+	aMutexUnlock(&g.lock);
+	return mat;
 }
 
 void cachePutMaterial(const char *name, const struct Material *mat /* copied */) {
+	aMutexLock(&g.lock);
 	aHashInsert(&g.materials, name, mat);
+	aMutexUnlock(&g.lock);
+}
+
+const struct Material *cacheAcquireMaterial(const char *name) {
+	aMutexLock(&g.lock);
+	cacheLoadingWait(CacheKind_Material, name);
+	const struct Material *mat = aHashGet(&g.materials, name);
+	if (!mat)
+		cacheLoadingBegin(CacheKind_Material, name);
+	aMutexUnlock(&g.lock);
+	return mat;
+}
+
+const struct Material *cacheReleaseMaterial(const char *name, const struct Material *mat) {
+	aMutexLock(&g.lock);
+	const struct Material *cached = mat ? aHashInsert(&g.materials, name, mat) : NULL;
+	cacheLoadingEnd(CacheKind_Material, name);
+	aMutexUnlock(&g.lock);
+	return cached;
+}
+
+static const struct Texture *cacheFindTexture(const char *name) {
+	struct Texture *const *const tex = aHashGet(&g.textures, name);
+	return tex ? *tex : NULL;
 }
 
 const struct Texture *cacheGetTexture(const char *name) {
-	return aHashGet(&g.textures, name);
+	aMutexLock(&g.lock);
+	const struct Texture *tex = cacheFindTexture(name);
+	aMutexUnlock(&g.lock);
+	return tex;
+}
+
+struct Texture *cachePutTexture(const char *name, const struct Texture *tex /* copied */) {
+	struct Texture *cached = cacheAllocTexture();
+	if (!cached)
+		return NULL;
+
+	*cached = *tex;
+	aMutexLock(&g.lock);
+	aHashInsert(&g.textures, name, &cached);
+	aMutexUnlock(&g.lock);
+	return cached;
+}
+
+const struct Texture *cacheAcquireTexture(const char *name) {
+	aMutexLock(&g.lock);
+	cacheLoadingWait(CacheKind_Texture, name);
+	const struct Texture *tex = cacheFindTexture(name);
+	if (!tex)
+		cacheLoadingBegin(CacheKind_Texture, name);
+	aMutexUnlock(&g.lock);
+	return tex;
+}
+
+struct Texture *cacheAllocTexture(void) {
+	aMutexLock(&g.lock);
+	struct Texture *tex = stackAlloc(g.pool, sizeof(*tex));
+	aMutexUnlock(&g.lock);
+	if (!tex)
+		PRINT("Not enough cache memory for another texture");
+	return tex;
 }
 
-void cachePutTexture(const char *name, const struct Texture *tex /* copied */) {
-	aHashInsert(&g.textures, name, tex);
+void cacheReleaseTexture(const char *name, const struct Texture *tex) {
+	aMutexLock(&g.lock);
+	if (tex)
+		aHashInsert(&g.textures, name, &tex);
+	cacheLoadingEnd(CacheKind_Texture, name);
+	aMutexUnlock(&g.lock);
 }
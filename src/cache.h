@@ -4,11 +4,29 @@ struct Stack;
 
 void cacheInit(struct Stack* pool);
 
+/* Cache is shared between loader threads and guards itself. A missing entry is loaded by the first thread
+ * that acquires it, outside of the lock; other threads acquiring the same name wait until it is released */
+
 struct Material;
 struct Texture;
 
 const struct Material *cacheGetMaterial(const char *name);
 void cachePutMaterial(const char *name, const struct Material *mat /* copied */);
 
+/* returns cached material, waiting for it if it is being loaded; NULL means that it is not cached,
+ * and then caller must load it and call cacheReleaseMaterial() whether it succeeded or not */
+const struct Material *cacheAcquireMaterial(const char *name);
+/* mat is copied, NULL if it could not be loaded; returns pointer to the cached copy, or NULL */
+const struct Material *cacheReleaseMaterial(const char *name, const struct Material *mat);
+
 const struct Texture *cacheGetTexture(const char *name);
-void cachePutTexture(const char *name, const struct Texture *tex /* copied */);
+/* returns pointer to the cached copy, which stays valid forever */
+struct Texture *cachePutTexture(const char *name, const struct Texture *tex /* copied */);
+
+/* same as for materials, except that texture is not copied: its data might be uploaded later on main thread,
+ * so it is loaded right into storage from cacheAllocTexture() */
+const struct Texture *cacheAcquireTexture(const char *name);
+/* stays valid forever, whether it ends up in cache or not */
+struct Texture *cacheAllocTexture(void);
+/* tex is NULL if it could not be loaded */
+void cacheReleaseTexture(const char *name, const struct Texture *tex);
@@ -13,9 +13,9 @@
 #endif
 
 enum CollectionOpenResult collectionChainOpen(struct ICollection *collection,
-		const char *name, enum FileType type, struct IFile **out_file) {
+		const char *name, enum FileType type, struct Stack *temp, struct IFile **out_file) {
 	while (collection) {
-		enum CollectionOpenResult result = collection->open(collection, name, type, out_file);
+		enum CollectionOpenResult result = collection->open(collection, name, type, temp, out_file);
 		if (result == CollectionOpen_Success) return result;
 		if (result == CollectionOpen_NotFound) {
 			collection = collection->next;
@@ -28,6 +28,40 @@ enum CollectionOpenResult collectionChainOpen(struct ICollection *collection,
 	return CollectionOpen_NotFound;
 }
 
+const void *collectionFileMap(struct IFile *file, size_t offset, size_t size, struct Stack *temp) {
+	if (file->map) {
+		const void *data = file->map(file, offset, size);
+		if (data)
+			return data;
+	}
+
+	void *buffer = stackAlloc(temp, size);
+	if (!buffer) {
+		PRINTF("Not enough temp memory to read %zu bytes", size);
+		return NULL;
+	}
+
+	if (file->read(file, offset, size, buffer) != size) {
+		stackFreeUpToPosition(temp, buffer);
+		return NULL;
+	}
+
+	return buffer;
+}
+
+void collectionFileUnmap(struct IFile *file, const void *data, size_t size, struct Stack *temp) {
+	const char *p = data;
+	if (p >= temp->storage && p < temp->storage + temp->size) {
+		/* read onto temp: can only be freed right away if nothing was allocated after it */
+		if (p + 4 * ((size + 3) / 4) == stackGetCursor(temp))
+			stackFreeUpToPosition(temp, (void*)p);
+		return;
+	}
+
+	ASSERT(file->unmap);
+	file->unmap(file, data, size);
+}
+
 struct FilesystemCollectionFile {
 	struct IFile head;
 	struct AFile file;
@@ -46,6 +80,16 @@ static size_t filesystemCollectionFile_Read(struct IFile *file, size_t offset, s
 	return result != AFileError ? result : 0;
 }
 
+static const void *filesystemCollectionFile_Map(struct IFile *file, size_t offset, size_t size) {
+	struct FilesystemCollectionFile *f = (void*)file;
+	return aFileMap(&f->file, offset, size);
+}
+
+static void filesystemCollectionFile_Unmap(struct IFile *file, const void *data, size_t size) {
+	(void)file;
+	aFileUnmap(data, size);
+}
+
 static void filesystemCollectionFile_Close(struct IFile *file) {
 	struct FilesystemCollectionFile *f = (void*)file;
 	aFileClose(&f->file);
@@ -101,13 +145,13 @@ static char *makeResourceFilename(struct Stack *temp, const char *prefix, const
 }
 
 static enum CollectionOpenResult filesystemCollectionOpen(struct ICollection *collection,
-			const char *name, enum FileType type, struct IFile **out_file) {
+			const char *name, enum FileType type, struct Stack *temp, struct IFile **out_file) {
 	struct FilesystemCollection *fsc = (struct FilesystemCollection*)collection;
 
 	*out_file = NULL;
 
-	struct FilesystemCollectionFile *file = stackAlloc(fsc->mem.temp, sizeof(*file));
-	char *filename = makeResourceFilename(fsc->mem.temp, fsc->prefix, name, type);
+	struct FilesystemCollectionFile *file = stackAlloc(temp, sizeof(*file));
+	char *filename = makeResourceFilename(temp, fsc->prefix, name, type);
 
 	if (!file || !filename) {
 		PRINTF("Not enough memory for file %s", name);
@@ -117,18 +161,21 @@ static enum CollectionOpenResult filesystemCollectionOpen(struct ICollection *co
 	if (aFileOpen(&file->file, filename) != AFile_Success) {
 		if (type == File_Map)
 			PRINTF("Cannot open map %s", filename);
-		stackFreeUpToPosition(fsc->mem.temp, file);
+		stackFreeUpToPosition(temp, file);
 		return CollectionOpen_NotFound;
 		
 	}
 
 	file->head.size = file->file.size;
+	file->head.mtime = file->file.mtime;
 	file->head.read = filesystemCollectionFile_Read;
+	file->head.map = filesystemCollectionFile_Map;
+	file->head.unmap = filesystemCollectionFile_Unmap;
 	file->head.close = filesystemCollectionFile_Close;
-	file->temp = fsc->mem.temp;
+	file->temp = temp;
 	*out_file = &file->head;
 
-	stackFreeUpToPosition(fsc->mem.temp, filename);
+	stackFreeUpToPosition(temp, filename);
 	return CollectionOpen_Success;
 }
 
@@ -194,6 +241,7 @@ struct VPKCollectionFile {
 	struct IFile head;
 	const struct VPKFileMetadata *metadata;
 	struct VPKCollection *collection;
+	struct Stack *temp;
 };
 
 static void vpkCollectionClose(struct ICollection *collection) {
@@ -231,19 +279,47 @@ static size_t vpkCollectionFileRead(struct IFile *file, size_t offset, size_t si
 	return size_read;
 }
 
+static const void *vpkCollectionFileMap(struct IFile *file, size_t offset, size_t size) {
+	struct VPKCollectionFile *f = (struct VPKCollectionFile*)file;
+	const struct VPKFileMetadata *meta = f->metadata;
+
+	/* preload data lives in directory, which is already in memory */
+	if (offset + size <= meta->dir.size)
+		return f->collection->dir.data + meta->dir.off + offset;
+
+	/* ranges spanning both parts need to be read */
+	if (offset < meta->dir.size || meta->archive < 0)
+		return NULL;
+
+	offset -= meta->dir.size;
+	if (offset + size > meta->arc.size)
+		return NULL;
+
+	return aFileMap(&f->collection->archives[meta->archive], meta->arc.off + offset, size);
+}
+
+static void vpkCollectionFileUnmap(struct IFile *file, const void *data, size_t size) {
+	struct VPKCollectionFile *f = (struct VPKCollectionFile*)file;
+	const char *dir = f->collection->dir.data;
+	if ((const char*)data >= dir && (const char*)data < dir + f->collection->dir.size)
+		return;
+
+	aFileUnmap(data, size);
+}
+
 static void vpkCollectionFileClose(struct IFile *file) {
 	struct VPKCollectionFile *f = (void*)file;
-	stackFreeUpToPosition(f->collection->mem.temp, f);
+	stackFreeUpToPosition(f->temp, f);
 }
 
 static enum CollectionOpenResult vpkCollectionFileOpen(struct ICollection *collection,
-		const char *name, enum FileType type, struct IFile **out_file) {
+		const char *name, enum FileType type, struct Stack *temp, struct IFile **out_file) {
 	struct VPKCollection *vpkc = (struct VPKCollection*)collection;
 
 	*out_file = NULL;
 
-	struct VPKCollectionFile *file = stackAlloc(vpkc->mem.temp, sizeof(*file));
-	char *filename = makeResourceFilename(vpkc->mem.temp, NULL, name, type);
+	struct VPKCollectionFile *file = stackAlloc(temp, sizeof(*file));
+	char *filename = makeResourceFilename(temp, NULL, name, type);
 
 	if (!file || !filename) {
 		PRINTF("Not enough memory for file %s", name);
@@ -263,11 +339,15 @@ static enum CollectionOpenResult vpkCollectionFileOpen(struct ICollection *colle
 			if (comparison == 0) {
 				file->metadata = meta;
 				file->collection = vpkc;
+				file->temp = temp;
 				file->head.size = meta->arc.size + meta->dir.size;
+				file->head.mtime = meta->archive >= 0 ? vpkc->archives[meta->archive].mtime : 0;
 				file->head.read = vpkCollectionFileRead;
+				file->head.map = vpkCollectionFileMap;
+				file->head.unmap = vpkCollectionFileUnmap;
 				file->head.close = vpkCollectionFileClose;
 				*out_file = &file->head;
-				stackFreeUpToPosition(vpkc->mem.temp, filename);
+				stackFreeUpToPosition(temp, filename);
 				return CollectionOpen_Success;
 			}
 
@@ -280,7 +360,7 @@ static enum CollectionOpenResult vpkCollectionFileOpen(struct ICollection *colle
 		}
 	}
 
-	stackFreeUpToPosition(vpkc->mem.temp, file);
+	stackFreeUpToPosition(temp, file);
 	return CollectionOpen_NotFound;
 }
 
@@ -515,19 +595,33 @@ static size_t pakfileCollectionFileRead(struct IFile *file, size_t offset, size_
 	return size;
 }
 
+static const void *pakfileCollectionFileMap(struct IFile *file, size_t offset, size_t size) {
+	struct PakfileCollectionFile *f = (struct PakfileCollectionFile*)file;
+	const struct PakfileFileMetadata *meta = f->metadata;
+
+	/* whole pakfile is already in memory */
+	if (offset > meta->size || meta->size - offset < size)
+		return NULL;
+	return (const char*)meta->data + offset;
+}
+
+static void pakfileCollectionFileUnmap(struct IFile *file, const void *data, size_t size) {
+	(void)file; (void)data; (void)size;
+}
+
 static void pakfileCollectionFileClose(struct IFile *file) {
 	struct PakfileCollectionFile *f = (void*)file;
 	stackFreeUpToPosition(f->stack, f);
 }
 
 static enum CollectionOpenResult pakfileCollectionFileOpen(struct ICollection *collection,
-		const char *name, enum FileType type, struct IFile **out_file) {
+		const char *name, enum FileType type, struct Stack *temp, struct IFile **out_file) {
 	struct PakfileCollection *pakfilec = (struct PakfileCollection*)collection;
 
 	*out_file = NULL;
 
-	struct PakfileCollectionFile *file = stackAlloc(pakfilec->mem.temp, sizeof(*file));
-	char *filename = makeResourceFilename(pakfilec->mem.temp, NULL, name, type);
+	struct PakfileCollectionFile *file = stackAlloc(temp, sizeof(*file));
+	char *filename = makeResourceFilename(temp, NULL, name, type);
 
 	if (!file || !filename) {
 		PRINTF("Not enough memory for file %s", name);
@@ -546,12 +640,15 @@ static enum CollectionOpenResult pakfileCollectionFileOpen(struct ICollection *c
 			const int comparison = strncmp(filename, meta->filename.s, meta->filename.len);
 			if (comparison == 0) {
 				file->metadata = meta;
-				file->stack = pakfilec->mem.temp;
+				file->stack = temp;
 				file->head.size = meta->size;
+				file->head.mtime = 0;
 				file->head.read = pakfileCollectionFileRead;
+				file->head.map = pakfileCollectionFileMap;
+				file->head.unmap = pakfileCollectionFileUnmap;
 				file->head.close = pakfileCollectionFileClose;
 				*out_file = &file->head;
-				stackFreeUpToPosition(pakfilec->mem.temp, filename);
+				stackFreeUpToPosition(temp, filename);
 				return CollectionOpen_Success;
 			}
 
@@ -564,7 +661,7 @@ static enum CollectionOpenResult pakfileCollectionFileOpen(struct ICollection *c
 		}
 	}
 
-	stackFreeUpToPosition(pakfilec->mem.temp, file);
+	stackFreeUpToPosition(temp, file);
 	return CollectionOpen_NotFound;
 }
 
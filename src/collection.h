@@ -5,14 +5,28 @@
 
 typedef struct IFile {
 	size_t size;
+	/* modification time of underlying file, 0 if unknown */
+	uint64_t mtime;
 	/* read size bytes into buffer
 	 * returns bytes read, or < 0 on error. error codes aren't specified */
 	size_t (*read)(struct IFile *file, size_t offset, size_t size, void *buffer);
+	/* optional, can be NULL: get pointer to size bytes at offset without copying.
+	 * returns NULL if this range can't be mapped, in which case read should be used */
+	const void *(*map)(struct IFile *file, size_t offset, size_t size);
+	/* release pointer returned by map */
+	void (*unmap)(struct IFile *file, const void *data, size_t size);
 	/* free any internal resources.
 	 * will not free memory associated with this structure itself */
 	void (*close)(struct IFile *file);
 } IFile;
 
+/* get size bytes at offset: mapped in place if file supports that, or read onto temp stack otherwise.
+ * returns NULL on failure */
+const void *collectionFileMap(struct IFile *file, size_t offset, size_t size, struct Stack *temp);
+/* release data returned by collectionFileMap. data read onto temp is freed only if it is the last allocation there,
+ * otherwise it is freed by caller with the rest of temp */
+void collectionFileUnmap(struct IFile *file, const void *data, size_t size, struct Stack *temp);
+
 enum CollectionOpenResult {
 	CollectionOpen_Success,
 	CollectionOpen_NotFound, /* such item was not found in collection */
@@ -30,13 +44,14 @@ enum FileType {
 typedef struct ICollection {
 	/* free any internal resources, but don't deallocate this structure itself */
 	void (*close)(struct ICollection *collection);
+	/* file structure is allocated on temp stack, and is freed there on close */
 	enum CollectionOpenResult (*open)(struct ICollection *collection,
-			const char *name, enum FileType type, struct IFile **out_file);
+			const char *name, enum FileType type, struct Stack *temp, struct IFile **out_file);
 	struct ICollection *next;
 } ICollection;
 
 enum CollectionOpenResult collectionChainOpen(struct ICollection *collection,
-		const char *name, enum FileType type, struct IFile **out_file);
+		const char *name, enum FileType type, struct Stack *temp, struct IFile **out_file);
 
 struct ICollection *collectionCreateFilesystem(struct Memories *mem, const char *dir);
 struct ICollection *collectionCreateVPK(struct Memories *mem, const char *dir_filename);
@@ -0,0 +1,188 @@
+#include "cull.h"
+#include <math.h>
+
+/* boxes in a node that is not split any further */
+#define CULL_BVH_LEAF_SIZE 2
+#define CULL_BVH_MAX_DEPTH 64
+
+void cullFrustumFromMatrix(CullFrustum *frustum, const struct AMat4f *m) {
+	/* rows of column-major matrix */
+	const struct AVec4f
+		x = aVec4f(m->X.x, m->Y.x, m->Z.x, m->W.x),
+		y = aVec4f(m->X.y, m->Y.y, m->Z.y, m->W.y),
+		z = aVec4f(m->X.z, m->Y.z, m->Z.z, m->W.z),
+		w = aVec4f(m->X.w, m->Y.w, m->Z.w, m->W.w);
+
+	frustum->planes[0] = aVec4f(w.x + x.x, w.y + x.y, w.z + x.z, w.w + x.w);
+	frustum->planes[1] = aVec4f(w.x - x.x, w.y - x.y, w.z - x.z, w.w - x.w);
+	frustum->planes[2] = aVec4f(w.x + y.x, w.y + y.y, w.z + y.z, w.w + y.w);
+	frustum->planes[3] = aVec4f(w.x - y.x, w.y - y.y, w.z - y.z, w.w - y.w);
+	frustum->planes[4] = aVec4f(w.x + z.x, w.y + z.y, w.z + z.z, w.w + z.w);
+	frustum->planes[5] = aVec4f(w.x - z.x, w.y - z.y, w.z - z.z, w.w - z.w);
+
+	for (int i = 0; i < 6; ++i) {
+		struct AVec4f *const p = frustum->planes + i;
+		const float length = sqrtf(p->x * p->x + p->y * p->y + p->z * p->z);
+		if (length > 0.f)
+			*p = aVec4f(p->x / length, p->y / length, p->z / length, p->w / length);
+	}
+}
+
+CullResult cullFrustumBox(const CullFrustum *frustum, const CullBox *box) {
+	CullResult result = CullResult_Inside;
+	for (int i = 0; i < 6; ++i) {
+		const struct AVec4f *const p = frustum->planes + i;
+
+		/* corner furthest along plane normal, and the opposite one */
+		const float outer = p->w
+			+ p->x * (p->x > 0.f ? box->max.x : box->min.x)
+			+ p->y * (p->y > 0.f ? box->max.y : box->min.y)
+			+ p->z * (p->z > 0.f ? box->max.z : box->min.z);
+		if (outer < 0.f)
+			return CullResult_Outside;
+
+		const float inner = p->w
+			+ p->x * (p->x > 0.f ? box->min.x : box->max.x)
+			+ p->y * (p->y > 0.f ? box->min.y : box->max.y)
+			+ p->z * (p->z > 0.f ? box->min.z : box->max.z);
+		if (inner < 0.f)
+			result = CullResult_Intersects;
+	}
+
+	return result;
+}
+
+CullResult cullFrustumSphere(const CullFrustum *frustum, struct AVec3f center, float radius) {
+	CullResult result = CullResult_Inside;
+	for (int i = 0; i < 6; ++i) {
+		const struct AVec4f *const p = frustum->planes + i;
+		const float distance = p->x * center.x + p->y * center.y + p->z * center.z + p->w;
+		if (distance < -radius)
+			return CullResult_Outside;
+		if (distance < radius)
+			result = CullResult_Intersects;
+	}
+
+	return result;
+}
+
+static float cullBoxCenter(const CullBox *box, int axis) {
+	switch (axis) {
+		case 0: return box->min.x + box->max.x;
+		case 1: return box->min.y + box->max.y;
+		default: return box->min.z + box->max.z;
+	}
+}
+
+static void cullBVHSplit(CullBVH *bvh, const CullBox *boxes, int node_index, int depth) {
+	CullBVHNode *node = bvh->nodes + node_index;
+	int *const items = bvh->items + node->first;
+
+	node->box = boxes[items[0]];
+	struct AVec3f center_min = aVec3fAdd(node->box.min, node->box.max), center_max = center_min;
+	for (int i = 1; i < node->count; ++i) {
+		const CullBox *const box = boxes + items[i];
+		const struct AVec3f center = aVec3fAdd(box->min, box->max);
+		node->box.min = aVec3fMin(node->box.min, box->min);
+		node->box.max = aVec3fMax(node->box.max, box->max);
+		center_min = aVec3fMin(center_min, center);
+		center_max = aVec3fMax(center_max, center);
+	}
+
+	node->children = 0;
+	if (node->count <= CULL_BVH_LEAF_SIZE || depth >= CULL_BVH_MAX_DEPTH)
+		return;
+
+	/* halve the longest extent of box centers */
+	const struct AVec3f extent = aVec3fSub(center_max, center_min);
+	const int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+	const float split = axis == 0 ? (center_min.x + center_max.x) * .5f
+		: (axis == 1 ? (center_min.y + center_max.y) * .5f : (center_min.z + center_max.z) * .5f);
+
+	int left = 0, right = node->count;
+	while (left < right) {
+		if (cullBoxCenter(boxes + items[left], axis) < split) {
+			++left;
+		} else {
+			const int tmp = items[left];
+			items[left] = items[--right];
+			items[right] = tmp;
+		}
+	}
+
+	/* all centers are the same, split anyway to keep leaves small */
+	if (left == 0 || left == node->count)
+		left = node->count / 2;
+
+	const int children = bvh->nodes_count;
+	bvh->nodes_count += 2;
+	node->children = children;
+
+	bvh->nodes[children].first = node->first;
+	bvh->nodes[children].count = left;
+	bvh->nodes[children + 1].first = node->first + left;
+	bvh->nodes[children + 1].count = node->count - left;
+
+	cullBVHSplit(bvh, boxes, children, depth + 1);
+	cullBVHSplit(bvh, boxes, children + 1, depth + 1);
+}
+
+void cullBVHBuild(CullBVH *bvh, CullBVHNode *nodes, int *items, const CullBox *boxes, int count) {
+	bvh->nodes = nodes;
+	bvh->items = items;
+	bvh->nodes_count = 0;
+	if (count < 1)
+		return;
+
+	for (int i = 0; i < count; ++i)
+		items[i] = i;
+
+	bvh->nodes_count = 1;
+	nodes[0].first = 0;
+	nodes[0].count = count;
+	cullBVHSplit(bvh, boxes, 0, 0);
+}
+
+int cullBVHFrustum(const CullBVH *bvh, const CullBox *boxes, const CullFrustum *frustum, CullVisible *visible) {
+	if (!bvh->nodes_count)
+		return 0;
+
+	int visible_count = 0;
+	int stack[CULL_BVH_MAX_DEPTH + 2];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size) {
+		const CullBVHNode *const node = bvh->nodes + stack[--stack_size];
+		const CullResult result = cullFrustumBox(frustum, &node->box);
+		if (result == CullResult_Outside)
+			continue;
+
+		if (result == CullResult_Inside) {
+			for (int i = 0; i < node->count; ++i) {
+				visible[visible_count].item = bvh->items[node->first + i];
+				visible[visible_count].result = CullResult_Inside;
+				++visible_count;
+			}
+			continue;
+		}
+
+		if (node->children) {
+			stack[stack_size++] = node->children;
+			stack[stack_size++] = node->children + 1;
+			continue;
+		}
+
+		for (int i = 0; i < node->count; ++i) {
+			const int item = bvh->items[node->first + i];
+			const CullResult item_result = node->count > 1 ? cullFrustumBox(frustum, boxes + item) : result;
+			if (item_result == CullResult_Outside)
+				continue;
+			visible[visible_count].item = item;
+			visible[visible_count].result = item_result;
+			++visible_count;
+		}
+	}
+
+	return visible_count;
+}
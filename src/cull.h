@@ -0,0 +1,50 @@
+#pragma once
+#include "atto/math.h"
+
+/* View frustum as 6 world space planes; a point p is inside of a plane when dot(plane.xyz, p) + plane.w >= 0.
+ * Planes are normalized, so that this is also the distance to the plane */
+typedef struct CullFrustum {
+	struct AVec4f planes[6];
+} CullFrustum;
+
+typedef enum {
+	CullResult_Outside,
+	CullResult_Intersects,
+	CullResult_Inside,
+} CullResult;
+
+typedef struct CullBox { struct AVec3f min, max; } CullBox;
+
+/* planes of clip space volume -w <= x, y, z <= w, e.g. of Camera.view_projection */
+void cullFrustumFromMatrix(CullFrustum *frustum, const struct AMat4f *view_projection);
+CullResult cullFrustumBox(const CullFrustum *frustum, const CullBox *box);
+CullResult cullFrustumSphere(const CullFrustum *frustum, struct AVec3f center, float radius);
+
+/* Bounding volume hierarchy over boxes, to classify many of them against a frustum
+ * without testing each one when large parts of the world are outside or inside of it */
+typedef struct CullBVHNode {
+	CullBox box;
+	/* boxes of this node are items[first .. first + count) */
+	int first, count;
+	/* index of the first of two child nodes, 0 for leaves */
+	int children;
+} CullBVHNode;
+
+typedef struct CullBVH {
+	CullBVHNode *nodes;
+	int nodes_count;
+	int *items;
+} CullBVH;
+
+/* nodes must have room for 2 * count - 1 elements, items for count; boxes must outlive bvh */
+void cullBVHBuild(CullBVH *bvh, CullBVHNode *nodes, int *items, const CullBox *boxes, int count);
+
+typedef struct CullVisible {
+	int item;
+	/* CullResult_Intersects or CullResult_Inside */
+	CullResult result;
+} CullVisible;
+
+/* writes index of every box that is not outside of frustum to visible, which must have room for all of them.
+ * Returns number of visible boxes */
+int cullBVHFrustum(const CullBVH *bvh, const CullBox *boxes, const CullFrustum *frustum, CullVisible *visible);
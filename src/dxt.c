@@ -1,7 +1,30 @@
 #include "dxt.h"
 #include "libc.h"
+#include "common.h"
+#include "log.h"
 #include <stdint.h>
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define DXT_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#include <immintrin.h>
+#define DXT_TARGET(t)
+#else
+#include <immintrin.h>
+#define DXT_TARGET(t) __attribute__((target(t)))
+#endif
+#endif /* x86 */
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define DXT_NEON
+#include <arm_neon.h>
+#endif
+
+/* decodes count horizontally adjacent blocks, whose color parts are stride bytes apart,
+ * into dst with pitch pixels between rows */
+typedef void (*DXTUnpackBlocksFunc)(const uint8_t *src, int stride, uint16_t *dst, int pitch, int count);
+
 static uint16_t dxtColorSum(int m1, uint16_t c1, int m2, uint16_t c2, int add, int denom) {
 	const int mask_r = 0xf800, shift_r = 11;
 	const int mask_g = 0x07e0, shift_g = 5;
@@ -18,44 +41,305 @@ static uint16_t dxtColorSum(int m1, uint16_t c1, int m2, uint16_t c2, int add, i
 	return (uint16_t)(((r << shift_r) & mask_r) | ((g << shift_g) & mask_g) | ((b << shift_b) & mask_b));
 }
 
-void dxtUnpack(struct DXTUnpackContext ctx, int offset) {
+static void dxtUnpackBlocksScalar(const uint8_t *src, int stride, uint16_t *dst, int pitch, int count) {
+	const uint16_t transparent = 0;
+	for (int i = 0; i < count; ++i, src += stride, dst += 4) {
+		uint16_t c[4];
+		memcpy(c, src, 2);
+		memcpy(c+1, src + 2, 2);
+
+		if (c[0] > c[1]) {
+			c[2] = dxtColorSum(2, c[0], 1, c[1], 1, 3);
+			c[3] = dxtColorSum(1, c[0], 2, c[1], 1, 3);
+		} else {
+			c[2] = dxtColorSum(1, c[0], 1, c[1], 0, 2);
+			c[3] = transparent;
+		}
+
+		uint16_t *pix = dst;
+		for (int r = 0; r < 4; ++r, pix += pitch) {
+			const uint8_t bitmap = src[4 + r];
+			pix[3] = c[(bitmap >> 6) & 3];
+			pix[2] = c[(bitmap >> 4) & 3];
+			pix[1] = c[(bitmap >> 2) & 3];
+			pix[0] = c[(bitmap >> 0) & 3];
+		} /* for all rows in 4x4 */
+	}
+}
+
+/* SIMD versions compute the same palettes as dxtColorSum does, 4 colors per block in 16-bit lanes:
+ *   c0 > c1:  (3*c0 + 0*c1 + 0)/3, (0*c0 + 3*c1 + 0)/3, (2*c0 + c1 + 1)/3, (c0 + 2*c1 + 1)/3
+ *   c0 <= c1: (2*c0 + 0*c1)/2,     (0*c0 + 2*c1)/2,     (c0 + c1)/2,         0
+ * x/3 is (x * 0xaaab) >> 17, exact for all possible sums here.
+ * Pixels are then picked from palette with byte shuffles: 2-bit index i becomes bytes 2i, 2i+1 */
+
+#ifdef DXT_X86
+DXT_TARGET("ssse3")
+static inline __m128i dxtMixSSSE3(__m128i a, __m128i b, __m128i four_colors) {
+	const __m128i w0_3 = _mm_setr_epi16(3, 0, 2, 1, 3, 0, 2, 1);
+	const __m128i w1_3 = _mm_setr_epi16(0, 3, 1, 2, 0, 3, 1, 2);
+	const __m128i add_3 = _mm_setr_epi16(0, 0, 1, 1, 0, 0, 1, 1);
+	const __m128i w0_2 = _mm_setr_epi16(2, 0, 1, 0, 2, 0, 1, 0);
+	const __m128i w1_2 = _mm_setr_epi16(0, 2, 1, 0, 0, 2, 1, 0);
+	const __m128i div3 = _mm_set1_epi16((short)0xaaab);
+
+	const __m128i mix3 = _mm_srli_epi16(_mm_mulhi_epu16(_mm_add_epi16(_mm_add_epi16(
+						_mm_mullo_epi16(a, w0_3), _mm_mullo_epi16(b, w1_3)), add_3), div3), 1);
+	const __m128i mix2 = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a, w0_2), _mm_mullo_epi16(b, w1_2)), 1);
+	return _mm_or_si128(_mm_and_si128(four_colors, mix3), _mm_andnot_si128(four_colors, mix2));
+}
+
+/* two blocks at a time: palettes of both fit into one register, and their rows make 16 contiguous bytes */
+DXT_TARGET("ssse3")
+static void dxtUnpackBlocksSSSE3(const uint8_t *src, int stride, uint16_t *dst, int pitch, int count) {
+	const __m128i sign = _mm_set1_epi16((short)0x8000);
+	const __m128i mask5 = _mm_set1_epi16(0x1f), mask6 = _mm_set1_epi16(0x3f);
+	const __m128i index_shift = _mm_setr_epi16(1 << 14, 1 << 12, 1 << 10, 1 << 8, 1 << 14, 1 << 12, 1 << 10, 1 << 8);
+	const __m128i lookup_scale = _mm_set1_epi16(0x0202);
+	const __m128i lookup_base = _mm_setr_epi16(0x0100, 0x0100, 0x0100, 0x0100, 0x0908, 0x0908, 0x0908, 0x0908);
+
+	for (; count >= 2; count -= 2, src += 2 * stride, dst += 8) {
+		int32_t colors[2];
+		memcpy(colors + 0, src, 4);
+		memcpy(colors + 1, src + stride, 4);
+
+		const __m128i c = _mm_setr_epi32(colors[0], colors[1], 0, 0);
+		const __m128i c0 = _mm_unpacklo_epi64(
+				_mm_shufflelo_epi16(c, _MM_SHUFFLE(0, 0, 0, 0)), _mm_shufflelo_epi16(c, _MM_SHUFFLE(2, 2, 2, 2)));
+		const __m128i c1 = _mm_unpacklo_epi64(
+				_mm_shufflelo_epi16(c, _MM_SHUFFLE(1, 1, 1, 1)), _mm_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 3, 3)));
+		const __m128i four_colors = _mm_cmpgt_epi16(_mm_xor_si128(c0, sign), _mm_xor_si128(c1, sign));
+
+		const __m128i r = dxtMixSSSE3(_mm_srli_epi16(c0, 11), _mm_srli_epi16(c1, 11), four_colors);
+		const __m128i g = dxtMixSSSE3(_mm_and_si128(_mm_srli_epi16(c0, 5), mask6),
+				_mm_and_si128(_mm_srli_epi16(c1, 5), mask6), four_colors);
+		const __m128i b = dxtMixSSSE3(_mm_and_si128(c0, mask5), _mm_and_si128(c1, mask5), four_colors);
+		const __m128i palette = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(r, 11), _mm_slli_epi16(g, 5)), b);
+
+		for (int row = 0; row < 4; ++row) {
+			const __m128i bitmaps = _mm_set_epi64x(
+					(long long)(0x0001000100010001ull * src[stride + 4 + row]),
+					(long long)(0x0001000100010001ull * src[4 + row]));
+			const __m128i index = _mm_srli_epi16(_mm_mullo_epi16(bitmaps, index_shift), 14);
+			const __m128i lookup = _mm_add_epi16(_mm_mullo_epi16(index, lookup_scale), lookup_base);
+			_mm_storeu_si128((__m128i*)(dst + row * pitch), _mm_shuffle_epi8(palette, lookup));
+		}
+	}
+
+	dxtUnpackBlocksScalar(src, stride, dst, pitch, count);
+}
+
+DXT_TARGET("avx2")
+static inline __m256i dxtMixAVX2(__m256i a, __m256i b, __m256i four_colors) {
+	const __m256i w0_3 = _mm256_setr_epi16(3, 0, 2, 1, 3, 0, 2, 1, 3, 0, 2, 1, 3, 0, 2, 1);
+	const __m256i w1_3 = _mm256_setr_epi16(0, 3, 1, 2, 0, 3, 1, 2, 0, 3, 1, 2, 0, 3, 1, 2);
+	const __m256i add_3 = _mm256_setr_epi16(0, 0, 1, 1, 0, 0, 1, 1, 0, 0, 1, 1, 0, 0, 1, 1);
+	const __m256i w0_2 = _mm256_setr_epi16(2, 0, 1, 0, 2, 0, 1, 0, 2, 0, 1, 0, 2, 0, 1, 0);
+	const __m256i w1_2 = _mm256_setr_epi16(0, 2, 1, 0, 0, 2, 1, 0, 0, 2, 1, 0, 0, 2, 1, 0);
+	const __m256i div3 = _mm256_set1_epi16((short)0xaaab);
+
+	const __m256i mix3 = _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_add_epi16(_mm256_add_epi16(
+						_mm256_mullo_epi16(a, w0_3), _mm256_mullo_epi16(b, w1_3)), add_3), div3), 1);
+	const __m256i mix2 = _mm256_srli_epi16(
+			_mm256_add_epi16(_mm256_mullo_epi16(a, w0_2), _mm256_mullo_epi16(b, w1_2)), 1);
+	return _mm256_or_si256(_mm256_and_si256(four_colors, mix3), _mm256_andnot_si256(four_colors, mix2));
+}
+
+/* same as SSSE3 one, but four blocks at a time: each 128-bit lane handles a pair of blocks */
+DXT_TARGET("avx2")
+static void dxtUnpackBlocksAVX2(const uint8_t *src, int stride, uint16_t *dst, int pitch, int count) {
+	const __m256i sign = _mm256_set1_epi16((short)0x8000);
+	const __m256i mask5 = _mm256_set1_epi16(0x1f), mask6 = _mm256_set1_epi16(0x3f);
+	const __m256i index_shift = _mm256_setr_epi16(
+			1 << 14, 1 << 12, 1 << 10, 1 << 8, 1 << 14, 1 << 12, 1 << 10, 1 << 8,
+			1 << 14, 1 << 12, 1 << 10, 1 << 8, 1 << 14, 1 << 12, 1 << 10, 1 << 8);
+	const __m256i lookup_scale = _mm256_set1_epi16(0x0202);
+	const __m256i lookup_base = _mm256_setr_epi16(
+			0x0100, 0x0100, 0x0100, 0x0100, 0x0908, 0x0908, 0x0908, 0x0908,
+			0x0100, 0x0100, 0x0100, 0x0100, 0x0908, 0x0908, 0x0908, 0x0908);
+
+	for (; count >= 4; count -= 4, src += 4 * stride, dst += 16) {
+		int32_t colors[4];
+		for (int i = 0; i < 4; ++i)
+			memcpy(colors + i, src + i * stride, 4);
+
+		const __m256i c = _mm256_setr_epi32(colors[0], colors[1], 0, 0, colors[2], colors[3], 0, 0);
+		const __m256i c0 = _mm256_unpacklo_epi64(
+				_mm256_shufflelo_epi16(c, _MM_SHUFFLE(0, 0, 0, 0)), _mm256_shufflelo_epi16(c, _MM_SHUFFLE(2, 2, 2, 2)));
+		const __m256i c1 = _mm256_unpacklo_epi64(
+				_mm256_shufflelo_epi16(c, _MM_SHUFFLE(1, 1, 1, 1)), _mm256_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 3, 3)));
+		const __m256i four_colors = _mm256_cmpgt_epi16(_mm256_xor_si256(c0, sign), _mm256_xor_si256(c1, sign));
+
+		const __m256i r = dxtMixAVX2(_mm256_srli_epi16(c0, 11), _mm256_srli_epi16(c1, 11), four_colors);
+		const __m256i g = dxtMixAVX2(_mm256_and_si256(_mm256_srli_epi16(c0, 5), mask6),
+				_mm256_and_si256(_mm256_srli_epi16(c1, 5), mask6), four_colors);
+		const __m256i b = dxtMixAVX2(_mm256_and_si256(c0, mask5), _mm256_and_si256(c1, mask5), four_colors);
+		const __m256i palette = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi16(r, 11), _mm256_slli_epi16(g, 5)), b);
+
+		for (int row = 0; row < 4; ++row) {
+			const __m256i bitmaps = _mm256_setr_epi64x(
+					(long long)(0x0001000100010001ull * src[4 + row]),
+					(long long)(0x0001000100010001ull * src[stride + 4 + row]),
+					(long long)(0x0001000100010001ull * src[2 * stride + 4 + row]),
+					(long long)(0x0001000100010001ull * src[3 * stride + 4 + row]));
+			const __m256i index = _mm256_srli_epi16(_mm256_mullo_epi16(bitmaps, index_shift), 14);
+			const __m256i lookup = _mm256_add_epi16(_mm256_mullo_epi16(index, lookup_scale), lookup_base);
+			_mm256_storeu_si256((__m256i*)(dst + row * pitch), _mm256_shuffle_epi8(palette, lookup));
+		}
+	}
+
+	dxtUnpackBlocksSSSE3(src, stride, dst, pitch, count);
+}
+
+static int dxtCpuHasSSSE3(void) {
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] >> 9) & 1;
+#else
+	return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+static int dxtCpuHasAVX2(void) {
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 1);
+	const int osxsave_avx = (info[2] & (3 << 27)) == (3 << 27);
+	if (!osxsave_avx || (_xgetbv(0) & 6) != 6)
+		return 0;
+	__cpuidex(info, 7, 0);
+	return (info[1] >> 5) & 1;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif /* ifdef DXT_X86 */
+
+#ifdef DXT_NEON
+static inline uint16x4_t dxtMixNEON(uint16x4_t a, uint16x4_t b, uint16x4_t four_colors) {
+	static const uint16_t w0_3[4] = {3, 0, 2, 1}, w1_3[4] = {0, 3, 1, 2}, add_3[4] = {0, 0, 1, 1};
+	static const uint16_t w0_2[4] = {2, 0, 1, 0}, w1_2[4] = {0, 2, 1, 0};
+
+	const uint16x4_t sum3 = vadd_u16(vmla_u16(vmul_u16(a, vld1_u16(w0_3)), b, vld1_u16(w1_3)), vld1_u16(add_3));
+	const uint16x4_t mix3 = vmovn_u32(vshrq_n_u32(vmull_u16(sum3, vdup_n_u16(0xaaab)), 17));
+	const uint16x4_t mix2 = vshr_n_u16(vmla_u16(vmul_u16(a, vld1_u16(w0_2)), b, vld1_u16(w1_2)), 1);
+	return vbsl_u16(four_colors, mix3, mix2);
+}
+
+/* one block at a time: its whole palette fits into a single 8-byte table lookup */
+static void dxtUnpackBlocksNEON(const uint8_t *src, int stride, uint16_t *dst, int pitch, int count) {
+	static const uint16_t index_shift[4] = {1 << 14, 1 << 12, 1 << 10, 1 << 8};
+	const uint16x4_t shift = vld1_u16(index_shift);
+	const uint16x4_t mask5 = vdup_n_u16(0x1f), mask6 = vdup_n_u16(0x3f);
+
+	for (; count > 0; --count, src += stride, dst += 4) {
+		uint16_t colors[2];
+		memcpy(colors, src, 4);
+
+		const uint16x4_t c0 = vdup_n_u16(colors[0]), c1 = vdup_n_u16(colors[1]);
+		const uint16x4_t four_colors = vcgt_u16(c0, c1);
+		const uint16x4_t r = dxtMixNEON(vshr_n_u16(c0, 11), vshr_n_u16(c1, 11), four_colors);
+		const uint16x4_t g = dxtMixNEON(vand_u16(vshr_n_u16(c0, 5), mask6), vand_u16(vshr_n_u16(c1, 5), mask6), four_colors);
+		const uint16x4_t b = dxtMixNEON(vand_u16(c0, mask5), vand_u16(c1, mask5), four_colors);
+		const uint8x8_t palette = vreinterpret_u8_u16(vorr_u16(vorr_u16(vshl_n_u16(r, 11), vshl_n_u16(g, 5)), b));
+
+		for (int row = 0; row < 4; ++row) {
+			const uint16x4_t index = vshr_n_u16(vmul_u16(vdup_n_u16(src[4 + row]), shift), 14);
+			const uint16x4_t lookup = vmla_u16(vdup_n_u16(0x0100), index, vdup_n_u16(0x0202));
+			vst1_u8((uint8_t*)(dst + row * pitch), vtbl1_u8(palette, vreinterpret_u8_u16(lookup)));
+		}
+	}
+}
+#endif /* ifdef DXT_NEON */
+
+static struct {
+	const char *name;
+	DXTUnpackBlocksFunc unpack_blocks;
+} dxt = { "scalar", dxtUnpackBlocksScalar };
+
+static void dxtUnpack(struct DXTUnpackContext ctx, int offset) {
 	if (ctx.width < 4 || ctx.height < 4 || ctx.width & 3 || ctx.height & 3)
 		return;
 
-	const uint16_t transparent = 0;
 	const uint8_t *src = (const uint8_t*)ctx.packed;
-	for (int y = 0; y < ctx.height; y+=4) {
-		uint16_t *dst_4x4 = (uint16_t*)ctx.output + ctx.width * y;
-		for (int x = 0; x < ctx.width; x+=4, dst_4x4 += 4, src += offset) {
-			uint16_t c[4];
-			memcpy(c, src, 2);
-			memcpy(c+1, src + 2, 2);
-
-			if (c[0] > c[1]) {
-				c[2] = dxtColorSum(2, c[0], 1, c[1], 1, 3);
-				c[3] = dxtColorSum(1, c[0], 2, c[1], 1, 3);
-			} else {
-				c[2] = dxtColorSum(1, c[0], 1, c[1], 0, 2);
-				c[3] = transparent;
-			}
-
-			uint16_t *pix = dst_4x4;
-			for (int r = 0; r < 4; ++r, pix += ctx.width) {
-				const uint8_t bitmap = src[4 + r];
-				pix[3] = c[(bitmap >> 6) & 3];
-				pix[2] = c[(bitmap >> 4) & 3];
-				pix[1] = c[(bitmap >> 2) & 3];
-				pix[0] = c[(bitmap >> 0) & 3];
-			} /* for all rows in 4x4 */
-		} /* for x */
-	} /* for y */
+	const int blocks_per_row = ctx.width / 4;
+	for (int y = 0; y < ctx.height; y += 4, src += blocks_per_row * offset)
+		dxt.unpack_blocks(src, offset, (uint16_t*)ctx.output + ctx.width * y, ctx.width, blocks_per_row);
 }
 
 void dxt1Unpack(struct DXTUnpackContext ctx) {
 	dxtUnpack(ctx, 8);
 }
 
+void dxt3Unpack(struct DXTUnpackContext ctx) {
+	dxt5Unpack(ctx);
+}
+
 void dxt5Unpack(struct DXTUnpackContext ctx) {
 	ctx.packed = ((char*)ctx.packed) + 8;
 	dxtUnpack(ctx, 16);
 }
+
+/* compare against scalar decoder on pseudo-random blocks, both with 4 and 3 color palettes,
+ * and enough of them per row to have leftovers for any number of blocks per iteration */
+static int dxtSelfTest(DXTUnpackBlocksFunc func) {
+	enum { Blocks = 7, Rows = 8 };
+	uint8_t packed[Rows * Blocks * 8];
+	uint16_t expected[Blocks * 4 * 4], actual[Blocks * 4 * 4];
+
+	uint32_t seed = 0x2545f491u;
+	for (int i = 0; i < (int)sizeof(packed); ++i) {
+		seed = seed * 1664525u + 1013904223u;
+		packed[i] = (uint8_t)(seed >> 24);
+	}
+
+	/* make sure that equal endpoints are covered too */
+	memcpy(packed + 8 * 3 + 2, packed + 8 * 3, 2);
+
+	for (int row = 0; row < Rows; ++row) {
+		const uint8_t *src = packed + row * Blocks * 8;
+		memset(expected, 0, sizeof(expected));
+		memset(actual, 0xff, sizeof(actual));
+		dxtUnpackBlocksScalar(src, 8, expected, Blocks * 4, Blocks);
+		func(src, 8, actual, Blocks * 4, Blocks);
+		if (memcmp(expected, actual, sizeof(expected)) != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+void dxtInit(void) {
+	dxt.name = "scalar";
+	dxt.unpack_blocks = dxtUnpackBlocksScalar;
+
+	const char *name = NULL;
+	DXTUnpackBlocksFunc func = NULL;
+#ifdef DXT_X86
+#if !defined(_MSC_VER) || defined(__clang__)
+	__builtin_cpu_init();
+#endif
+	if (dxtCpuHasAVX2()) {
+		name = "AVX2";
+		func = dxtUnpackBlocksAVX2;
+	} else if (dxtCpuHasSSSE3()) {
+		name = "SSSE3";
+		func = dxtUnpackBlocksSSSE3;
+	}
+#elif defined(DXT_NEON)
+	name = "NEON";
+	func = dxtUnpackBlocksNEON;
+#endif
+
+	if (func) {
+		if (dxtSelfTest(func)) {
+			dxt.name = name;
+			dxt.unpack_blocks = func;
+		} else {
+			PRINTF("%s DXT decoder doesn't match scalar one, not using it", name);
+		}
+	}
+
+	PRINTF("Using %s DXT decoder", dxt.name);
+}
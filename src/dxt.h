@@ -6,5 +6,10 @@ struct DXTUnpackContext {
 	void *output;
 };
 
+/* pick the fastest decoder this cpu supports; must be called before any unpacking */
+void dxtInit(void);
+
+/* decode color part of blocks into RGB565, alpha is ignored */
 void dxt1Unpack(struct DXTUnpackContext ctx);
+void dxt3Unpack(struct DXTUnpackContext ctx);
 void dxt5Unpack(struct DXTUnpackContext ctx);
@@ -1,5 +1,11 @@
 #include "etcpack.h"
+#include "thread.h"
+#include "log.h"
 #include "libc.h"
+#include "atto/app.h"
+
+#include <limits.h>
+#include <math.h>
 
 static const int etc1_mod_table[8][4] = {
 	{2, 8, -2, -8},
@@ -12,6 +18,432 @@ static const int etc1_mod_table[8][4] = {
 	{47, 183, -47, -183},
 };
 
+/* column-major pixel numbers of both subblocks, for flip = 0 (2x4 halves) and flip = 1 (4x2 halves) */
+static const uint8_t etc1_subblock_pixels[2][2][8] = {
+	{{0, 1, 2, 3, 4, 5, 6, 7}, {8, 9, 10, 11, 12, 13, 14, 15}},
+	{{0, 1, 4, 5, 8, 9, 12, 13}, {2, 3, 6, 7, 10, 11, 14, 15}},
+};
+
+/* blocks this close to the source in squared error are not tried with other flips and modes in fast mode */
+#define ETC1_FAST_ENOUGH_ERROR (16 * 3 * 2)
+
+static int clamp8(int i) { return (i < 0) ? 0 : (i > 255) ? 255 : i; }
+
+typedef struct {
+	int r[8], g[8], b[8];
+} ETC1Subblock;
+
+typedef struct {
+	int table;
+	int error;
+	uint8_t index[8];
+} ETC1Fit;
+
+#if defined(__GNUC__)
+/* compiles to SSE2 on x86 and NEON on ARM, 4 pixels per vector */
+typedef int32_t ETC1Vec __attribute__((vector_size(16)));
+
+/* pick the best table and modifiers for subblock pixels around base color.
+ * fit->error is the error to beat on input, fit is left intact if no table beats it */
+static void etc1FitSubblock(const ETC1Subblock *sub, int r, int g, int b, ETC1Fit *fit) {
+	ETC1Vec pr[2], pg[2], pb[2];
+	memcpy(pr, sub->r, sizeof(pr));
+	memcpy(pg, sub->g, sizeof(pg));
+	memcpy(pb, sub->b, sizeof(pb));
+
+	for (int t = 0; t < 8; ++t) {
+		ETC1Vec best[2], index[2];
+		for (int m = 0; m < 4; ++m) {
+			const int mod = etc1_mod_table[t][m];
+			const int cr = clamp8(r + mod), cg = clamp8(g + mod), cb = clamp8(b + mod);
+			for (int h = 0; h < 2; ++h) {
+				const ETC1Vec dr = pr[h] - cr, dg = pg[h] - cg, db = pb[h] - cb;
+				const ETC1Vec err = dr * dr + dg * dg + db * db;
+				if (m == 0) {
+					best[h] = err;
+					index[h] = (ETC1Vec){0, 0, 0, 0};
+				} else {
+					const ETC1Vec better = err < best[h];
+					best[h] = (err & better) | (best[h] & ~better);
+					index[h] = (m & better) | (index[h] & ~better);
+				}
+			}
+		}
+
+		const ETC1Vec sum = best[0] + best[1];
+		const int error = sum[0] + sum[1] + sum[2] + sum[3];
+		if (error < fit->error) {
+			fit->error = error;
+			fit->table = t;
+			for (int i = 0; i < 4; ++i) {
+				fit->index[i] = (uint8_t)index[0][i];
+				fit->index[i + 4] = (uint8_t)index[1][i];
+			}
+			if (error == 0)
+				break;
+		}
+	}
+}
+#else
+static void etc1FitSubblock(const ETC1Subblock *sub, int r, int g, int b, ETC1Fit *fit) {
+	for (int t = 0; t < 8; ++t) {
+		int error = 0;
+		uint8_t index[8];
+		for (int i = 0; i < 8 && error < fit->error; ++i) {
+			int best = INT_MAX;
+			for (int m = 0; m < 4; ++m) {
+				const int mod = etc1_mod_table[t][m];
+				const int dr = sub->r[i] - clamp8(r + mod);
+				const int dg = sub->g[i] - clamp8(g + mod);
+				const int db = sub->b[i] - clamp8(b + mod);
+				const int err = dr * dr + dg * dg + db * db;
+				if (err < best) {
+					best = err;
+					index[i] = (uint8_t)m;
+				}
+			}
+			error += best;
+		}
+
+		if (error < fit->error) {
+			fit->error = error;
+			fit->table = t;
+			memcpy(fit->index, index, sizeof(index));
+			if (error == 0)
+				break;
+		}
+	}
+}
+#endif
+
+typedef struct {
+	int diff, flip;
+	/* quantized base colors, 4 bits in individual mode, 5 bits in differential mode */
+	int base[2][3];
+	ETC1Fit fit[2];
+	int error;
+} ETC1Encoding;
+
+static int etc1Expand(int diff, int q) {
+	return diff ? (q << 3) | (q >> 2) : (q << 4) | q;
+}
+
+/* sum of 8 pixel values to nearest base color of max + 1 levels */
+static int etc1Quantize(int sum, int max) {
+	return (sum * max + 1020) / 2040;
+}
+
+static int etc1BaseValid(const ETC1Encoding *enc) {
+	const int max = enc->diff ? 31 : 15;
+	for (int s = 0; s < 2; ++s)
+		for (int c = 0; c < 3; ++c)
+			if (enc->base[s][c] < 0 || enc->base[s][c] > max)
+				return 0;
+
+	if (enc->diff)
+		for (int c = 0; c < 3; ++c) {
+			const int delta = enc->base[1][c] - enc->base[0][c];
+			if (delta < -4 || delta > 3)
+				return 0;
+		}
+
+	return 1;
+}
+
+static void etc1FitBase(const ETC1Subblock *sub, const ETC1Encoding *enc, int s, ETC1Fit *fit) {
+	etc1FitSubblock(sub, etc1Expand(enc->diff, enc->base[s][0]), etc1Expand(enc->diff, enc->base[s][1]),
+		etc1Expand(enc->diff, enc->base[s][2]), fit);
+}
+
+/* fills fits and error of enc, returns 0 if it cannot beat max_error */
+static int etc1Evaluate(const ETC1Subblock *subs, ETC1Encoding *enc, int max_error) {
+	enc->error = 0;
+	for (int s = 0; s < 2; ++s) {
+		enc->fit[s].error = max_error - enc->error;
+		etc1FitBase(subs + s, enc, s, enc->fit + s);
+		enc->error += enc->fit[s].error;
+		if (enc->error >= max_error)
+			return 0;
+	}
+	return 1;
+}
+
+/* try all base colors one quantization step away from current ones, one subblock at a time */
+static void etc1Refine(const ETC1Subblock *subs, ETC1Encoding *enc) {
+	for (int s = 0; s < 2; ++s) {
+		const int base[3] = { enc->base[s][0], enc->base[s][1], enc->base[s][2] };
+		for (int d = 0; d < 27; ++d) {
+			if (d == 13) /* current base */
+				continue;
+
+			ETC1Encoding variant = *enc;
+			variant.base[s][0] = base[0] + d % 3 - 1;
+			variant.base[s][1] = base[1] + d / 3 % 3 - 1;
+			variant.base[s][2] = base[2] + d / 9 - 1;
+			if (!etc1BaseValid(&variant))
+				continue;
+
+			variant.fit[s].error = enc->fit[s].error;
+			etc1FitBase(subs + s, &variant, s, variant.fit + s);
+			if (variant.fit[s].error < enc->fit[s].error) {
+				variant.error = enc->error - enc->fit[s].error + variant.fit[s].error;
+				*enc = variant;
+			}
+		}
+	}
+}
+
+static void etc1WriteBlock(const ETC1Encoding *enc, uint8_t *out) {
+	for (int c = 0; c < 3; ++c)
+		out[c] = (uint8_t)(enc->diff
+			? (enc->base[0][c] << 3) | ((enc->base[1][c] - enc->base[0][c]) & 7)
+			: (enc->base[0][c] << 4) | enc->base[1][c]);
+	out[3] = (uint8_t)((enc->fit[0].table << 5) | (enc->fit[1].table << 2) | (enc->diff << 1) | enc->flip);
+
+	unsigned msb = 0, lsb = 0;
+	for (int s = 0; s < 2; ++s)
+		for (int i = 0; i < 8; ++i) {
+			const unsigned p = etc1_subblock_pixels[enc->flip][s][i];
+			const unsigned index = enc->fit[s].index[i];
+			msb |= (index >> 1) << p;
+			lsb |= (index & 1) << p;
+		}
+
+	out[4] = (uint8_t)(msb >> 8);
+	out[5] = (uint8_t)msb;
+	out[6] = (uint8_t)(lsb >> 8);
+	out[7] = (uint8_t)lsb;
+}
+
+void etc1PackBlock(const ETC1Color *in4x4, uint8_t *out, ETC1Quality quality) {
+	ETC1Subblock subs[2][2];
+	ETC1Encoding best;
+	memset(&best, 0, sizeof(best));
+	best.error = INT_MAX;
+
+	for (int flip = 0; flip < 2; ++flip) {
+		int sum[2][3];
+		for (int s = 0; s < 2; ++s) {
+			sum[s][0] = sum[s][1] = sum[s][2] = 0;
+			for (int i = 0; i < 8; ++i) {
+				const ETC1Color c = in4x4[etc1_subblock_pixels[flip][s][i]];
+				subs[flip][s].r[i] = c.r;
+				subs[flip][s].g[i] = c.g;
+				subs[flip][s].b[i] = c.b;
+				sum[s][0] += c.r;
+				sum[s][1] += c.g;
+				sum[s][2] += c.b;
+			}
+		}
+
+		/* differential mode has better base color precision, but subblocks must be close enough */
+		ETC1Encoding enc;
+		enc.diff = 1;
+		enc.flip = flip;
+		int delta_clamped = 0;
+		for (int c = 0; c < 3; ++c) {
+			const int q0 = etc1Quantize(sum[0][c], 31), q1 = etc1Quantize(sum[1][c], 31);
+			const int delta = q1 - q0 < -4 ? -4 : q1 - q0 > 3 ? 3 : q1 - q0;
+			delta_clamped |= delta != q1 - q0;
+			enc.base[0][c] = q0;
+			enc.base[1][c] = q0 + delta;
+		}
+
+		if (etc1Evaluate(subs[flip], &enc, best.error))
+			best = enc;
+
+		if (delta_clamped || quality == ETC1Quality_High) {
+			enc.diff = 0;
+			for (int c = 0; c < 3; ++c) {
+				enc.base[0][c] = etc1Quantize(sum[0][c], 15);
+				enc.base[1][c] = etc1Quantize(sum[1][c], 15);
+			}
+
+			if (etc1Evaluate(subs[flip], &enc, best.error))
+				best = enc;
+		}
+
+		if (quality == ETC1Quality_Fast && best.error <= ETC1_FAST_ENOUGH_ERROR)
+			break;
+	}
+
+	if (quality == ETC1Quality_High)
+		etc1Refine(subs[best.flip], &best);
+
+	etc1WriteBlock(&best, out);
+}
+
+void etc1UnpackBlock(const uint8_t *in, ETC1Color *out4x4) {
+	const int diff = (in[3] >> 1) & 1, flip = in[3] & 1;
+	const int tables[2] = { in[3] >> 5, (in[3] >> 2) & 7 };
+	int base[2][3];
+	for (int c = 0; c < 3; ++c) {
+		if (diff) {
+			const int q0 = in[c] >> 3, delta = (in[c] & 7) >= 4 ? (in[c] & 7) - 8 : (in[c] & 7);
+			base[0][c] = etc1Expand(1, q0);
+			base[1][c] = etc1Expand(1, (q0 + delta) & 31);
+		} else {
+			base[0][c] = etc1Expand(0, in[c] >> 4);
+			base[1][c] = etc1Expand(0, in[c] & 15);
+		}
+	}
+
+	const unsigned msb = (in[4] << 8) | in[5], lsb = (in[6] << 8) | in[7];
+	for (int p = 0; p < 16; ++p) {
+		const int s = flip ? (p & 3) >= 2 : p >= 8;
+		const int mod = etc1_mod_table[tables[s]][((msb >> p) & 1) * 2 + ((lsb >> p) & 1)];
+		out4x4[p].r = clamp8(base[s][0] + mod);
+		out4x4[p].g = clamp8(base[s][1] + mod);
+		out4x4[p].b = clamp8(base[s][2] + mod);
+	}
+}
+
+typedef struct ETC1Image {
+	const uint16_t *pixels;
+	int width, height;
+	uint8_t *out;
+	ETC1Quality quality;
+
+	/* in block rows */
+	int rows, rows_per_task;
+	int next_row, rows_done;
+
+	struct ETC1Image *next;
+} ETC1Image;
+
+#define ETC1_MAX_THREADS 16
+/* blocks packed by a thread between taking the lock, roughly */
+#define ETC1_BLOCKS_PER_TASK 64
+
+static struct {
+	int initialized;
+	int threads_count;
+	AThread threads[ETC1_MAX_THREADS];
+	AMutex lock;
+	ACond work, done;
+	/* images that still have rows nobody has taken */
+	ETC1Image *images;
+} etc1;
+
+static void etc1PackRows(const ETC1Image *image, int row, int count) {
+	const int width = image->width, height = image->height;
+	const int blocks_per_row = (width + 3) / 4;
+	uint8_t *block = image->out + (size_t)row * blocks_per_row * 8;
+	for (int by = row * 4; by < (row + count) * 4; by += 4) {
+		for (int bx = 0; bx < width; bx += 4) {
+			ETC1Color ec[16];
+			for (int x = 0; x < 4; ++x) {
+				for (int y = 0; y < 4; ++y) {
+					const int px = bx + x < width ? bx + x : width - 1;
+					const int py = by + y < height ? by + y : height - 1;
+					const unsigned p = image->pixels[px + py * width];
+					const unsigned r = (p >> 11) & 0x1f, g = (p >> 5) & 0x3f, b = p & 0x1f;
+					ec[x*4+y].r = (int)((r << 3) | (r >> 2));
+					ec[x*4+y].g = (int)((g << 2) | (g >> 4));
+					ec[x*4+y].b = (int)((b << 3) | (b >> 2));
+				}
+			}
+
+			etc1PackBlock(ec, block, image->quality);
+			block += 8;
+		}
+	}
+}
+
+/* take and pack rows of image until there are none left; etc1.lock must be held, it is released while packing */
+static void etc1PackImageTasks(ETC1Image *image) {
+	while (image->next_row < image->rows) {
+		const int row = image->next_row;
+		const int count = image->rows - row < image->rows_per_task ? image->rows - row : image->rows_per_task;
+		image->next_row += count;
+
+		if (image->next_row == image->rows) {
+			ETC1Image **prev = &etc1.images;
+			while (*prev != image)
+				prev = &(*prev)->next;
+			*prev = image->next;
+		}
+
+		aMutexUnlock(&etc1.lock);
+		etc1PackRows(image, row, count);
+		aMutexLock(&etc1.lock);
+
+		image->rows_done += count;
+		if (image->rows_done == image->rows)
+			aCondBroadcast(&etc1.done);
+	}
+}
+
+static void etc1ThreadMain(void *arg) {
+	(void)arg;
+	aMutexLock(&etc1.lock);
+	for (;;) {
+		if (!etc1.images) {
+			aCondWait(&etc1.work, &etc1.lock);
+			continue;
+		}
+
+		etc1PackImageTasks(etc1.images);
+	}
+}
+
+void etc1Init(int threads) {
+	if (etc1.initialized)
+		return;
+
+	etc1.initialized = 1;
+	aMutexInit(&etc1.lock);
+	aCondInit(&etc1.work);
+	aCondInit(&etc1.done);
+	etc1.images = NULL;
+
+	if (threads > ETC1_MAX_THREADS)
+		threads = ETC1_MAX_THREADS;
+
+	for (int i = 0; i < threads; ++i) {
+		if (!aThreadCreate(etc1.threads + i, etc1ThreadMain, NULL))
+			break;
+		++etc1.threads_count;
+	}
+
+	PRINTF("ETC1 packing threads: %d", etc1.threads_count);
+}
+
+void etc1PackImage565(const uint16_t *pixels, int width, int height, uint8_t *out, ETC1Quality quality) {
+	const int blocks_per_row = (width + 3) / 4;
+	ETC1Image image = {
+		.pixels = pixels,
+		.width = width,
+		.height = height,
+		.out = out,
+		.quality = quality,
+		.rows = (height + 3) / 4,
+		.rows_per_task = ETC1_BLOCKS_PER_TASK / blocks_per_row > 1 ? ETC1_BLOCKS_PER_TASK / blocks_per_row : 1,
+		.next_row = 0,
+		.rows_done = 0,
+		.next = NULL,
+	};
+
+	if (!etc1.threads_count || image.rows <= image.rows_per_task) {
+		etc1PackRows(&image, 0, image.rows);
+		return;
+	}
+
+	aMutexLock(&etc1.lock);
+	ETC1Image **tail = &etc1.images;
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = &image;
+	aCondBroadcast(&etc1.work);
+
+	etc1PackImageTasks(&image);
+	while (image.rows_done < image.rows)
+		aCondWait(&etc1.done, &etc1.lock);
+	aMutexUnlock(&etc1.lock);
+}
+
+/* the original packer, kept for comparison: individual mode and flip = 0 only,
+ * base colors truncated after the table search */
 typedef struct {
 	ETC1Color base;
 	int table;
@@ -19,16 +451,13 @@ typedef struct {
 	uint8_t msb, lsb;
 } ETC1SubblockPacked;
 
-static int clamp8(int i) { return (i < 0) ? 0 : (i > 255) ? 255 : i; }
-
 #define ETC1_PIXEL_ERROR_MAX 1000
 static int etc1PixelError(ETC1Color a, ETC1Color b) {
 	return abs(a.r - b.r) + abs(a.g - b.g) + abs(a.b - b.b);
 }
 
-static ETC1SubblockPacked etc1PackSubblock2x4(const ETC1Color *in4x2) {
+static ETC1SubblockPacked etc1ReferencePackSubblock2x4(const ETC1Color *in4x2) {
 	ETC1Color average = {.r = 0, .g = 0, .b = 0};
-
 	for (int i = 0; i < 8; ++i) {
 		average.r += in4x2[i].r;
 		average.g += in4x2[i].g;
@@ -43,7 +472,6 @@ static ETC1SubblockPacked etc1PackSubblock2x4(const ETC1Color *in4x2) {
 		.error = ETC1_PIXEL_ERROR_MAX * 8,
 	};
 	for (int itbl = 0; itbl < 8; ++itbl) {
-		const int *const pmod = etc1_mod_table[itbl];
 		ETC1SubblockPacked variant = {
 			.base = average,
 			.table = itbl,
@@ -51,18 +479,16 @@ static ETC1SubblockPacked etc1PackSubblock2x4(const ETC1Color *in4x2) {
 			.msb = 0, .lsb = 0,
 		};
 		for (int ip = 0; ip < 8; ++ip) {
-			const ETC1Color c = in4x2[ip];
 			int best_pixel_error = ETC1_PIXEL_ERROR_MAX;
 			int best_pixel_imod = 0;
 			for (int im = 0; im < 4; ++im) {
-				const int mod = pmod[im];
+				const int mod = etc1_mod_table[itbl][im];
 				const ETC1Color mc = {
 					.r = clamp8(variant.base.r + mod),
 					.g = clamp8(variant.base.g + mod),
 					.b = clamp8(variant.base.b + mod)
 				};
-				const int perr = etc1PixelError(c, mc);
-
+				const int perr = etc1PixelError(in4x2[ip], mc);
 				if (perr < best_pixel_error) {
 					best_pixel_error = perr;
 					best_pixel_imod = im;
@@ -71,9 +497,8 @@ static ETC1SubblockPacked etc1PackSubblock2x4(const ETC1Color *in4x2) {
 
 			variant.lsb >>= 1;
 			variant.msb >>= 1;
-			variant.lsb |= (best_pixel_imod & 1) << 7; 
-			variant.msb |= (best_pixel_imod & 2) << 7; 
-
+			variant.lsb |= (best_pixel_imod & 1) << 7;
+			variant.msb |= (best_pixel_imod & 2) << 6;
 			variant.error += best_pixel_error;
 		}
 
@@ -83,9 +508,9 @@ static ETC1SubblockPacked etc1PackSubblock2x4(const ETC1Color *in4x2) {
 	return packed;
 }
 
-void etc1PackBlock(const ETC1Color *in4x4, uint8_t *out) {
-	const ETC1SubblockPacked sub1 = etc1PackSubblock2x4(in4x4);
-	const ETC1SubblockPacked sub2 = etc1PackSubblock2x4(in4x4 + 8);
+static void etc1ReferencePackBlock(const ETC1Color *in4x4, uint8_t *out) {
+	const ETC1SubblockPacked sub1 = etc1ReferencePackSubblock2x4(in4x4);
+	const ETC1SubblockPacked sub2 = etc1ReferencePackSubblock2x4(in4x4 + 8);
 
 	out[0] = (sub1.base.r & 0xf0) | (sub2.base.r >> 4);
 	out[1] = (sub1.base.g & 0xf0) | (sub2.base.g >> 4);
@@ -96,3 +521,107 @@ void etc1PackBlock(const ETC1Color *in4x4, uint8_t *out) {
 	out[6] = sub2.lsb;
 	out[7] = sub1.lsb;
 }
+
+#define ETC1_BENCHMARK_SIZE 512
+
+static void etc1BenchmarkImage(uint16_t *pixels, int size) {
+	uint32_t seed = 0x2545f491u;
+	for (int y = 0; y < size; ++y) {
+		for (int x = 0; x < size; ++x) {
+			seed = seed * 1664525u + 1013904223u;
+			const int noise = (int)(seed >> 24) - 128;
+			int r, g, b;
+			if (x < size / 2 && y < size / 2) {
+				/* smooth gradients */
+				r = x * 255 / size * 2; g = y * 255 / size * 2; b = (x + y) * 255 / size;
+			} else if (x >= size / 2 && y < size / 2) {
+				/* hard edged tiles */
+				const uint32_t tile = (uint32_t)((x / 6) * 7919 + (y / 5) * 104729) * 2654435761u;
+				r = (int)(tile >> 24); g = (int)(tile >> 16) & 0xff; b = (int)(tile >> 8) & 0xff;
+			} else if (x < size / 2) {
+				/* gradient with grain, like most of the world textures */
+				r = clamp8(96 + x / 4 + noise / 8); g = clamp8(80 + y / 8 + noise / 8); b = clamp8(64 + noise / 8);
+			} else {
+				/* noise */
+				r = clamp8(128 + noise / 2); g = clamp8(112 - noise / 4); b = clamp8(96 + (int)(seed >> 10 & 0x3f) - 32);
+			}
+			pixels[x + y * size] = (uint16_t)(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+		}
+	}
+}
+
+static double etc1BenchmarkPSNR(const uint16_t *pixels, int size, const uint8_t *packed) {
+	double squared = 0;
+	for (int by = 0; by < size; by += 4) {
+		for (int bx = 0; bx < size; bx += 4) {
+			ETC1Color ec[16];
+			etc1UnpackBlock(packed, ec);
+			packed += 8;
+			for (int p = 0; p < 16; ++p) {
+				const unsigned c = pixels[bx + p / 4 + (by + p % 4) * size];
+				const unsigned r = (c >> 11) & 0x1f, g = (c >> 5) & 0x3f, b = c & 0x1f;
+				const int dr = ec[p].r - (int)((r << 3) | (r >> 2));
+				const int dg = ec[p].g - (int)((g << 2) | (g >> 4));
+				const int db = ec[p].b - (int)((b << 3) | (b >> 2));
+				squared += dr * dr + dg * dg + db * db;
+			}
+		}
+	}
+
+	const double mse = squared / ((double)size * size * 3);
+	return mse > 0 ? 10. * log10(255. * 255. / mse) : 99.;
+}
+
+void etc1Benchmark(void) {
+	const int size = ETC1_BENCHMARK_SIZE;
+	const int blocks = (size / 4) * (size / 4);
+	uint16_t *pixels = malloc(sizeof(*pixels) * size * size);
+	uint8_t *packed = malloc((size_t)blocks * 8);
+	if (!pixels || !packed) {
+		PRINT("Cannot allocate ETC1 benchmark image");
+		free(pixels);
+		free(packed);
+		return;
+	}
+
+	etc1BenchmarkImage(pixels, size);
+	const ETC1Image image = {
+		.pixels = pixels, .width = size, .height = size, .out = packed,
+		.quality = ETC1Quality_Fast, .rows = size / 4,
+	};
+	ETC1Image image_high = image;
+	image_high.quality = ETC1Quality_High;
+
+	static const char *const names[] = {
+		"reference", "fast", "high", "fast, threaded", "high, threaded"
+	};
+	for (int variant = 0; variant < (int)(sizeof(names) / sizeof(*names)); ++variant) {
+		const ATimeUs start = aAppTime();
+		switch (variant) {
+			case 0:
+				for (int by = 0; by < size; by += 4)
+					for (int bx = 0; bx < size; bx += 4) {
+						ETC1Color ec[16];
+						for (int p = 0; p < 16; ++p) {
+							const unsigned c = pixels[bx + p / 4 + (by + p % 4) * size];
+							ec[p].r = (int)(c & 0xf800u) >> 8;
+							ec[p].g = (int)(c & 0x07e0u) >> 3;
+							ec[p].b = (int)(c & 0x001fu) << 3;
+						}
+						etc1ReferencePackBlock(ec, packed + ((by / 4) * (size / 4) + bx / 4) * 8);
+					}
+				break;
+			case 1: etc1PackRows(&image, 0, image.rows); break;
+			case 2: etc1PackRows(&image_high, 0, image.rows); break;
+			case 3: etc1PackImage565(pixels, size, size, packed, ETC1Quality_Fast); break;
+			case 4: etc1PackImage565(pixels, size, size, packed, ETC1Quality_High); break;
+		}
+		const ATimeUs time = aAppTime() - start;
+
+		PRINTF("ETC1 %-15s %10.0f blocks/s, PSNR %.2fdB", names[variant],
+			time > 0 ? blocks * 1e6 / time : 0., etc1BenchmarkPSNR(pixels, size, packed));
+	}
+
+	free(pixels);
+	free(packed);
+}
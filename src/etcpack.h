@@ -4,5 +4,27 @@
 
 typedef struct { int r, g, b; } ETC1Color;
 
+typedef enum {
+	/* rounded subblock averages as base colors, best of individual/differential modes and both flips */
+	ETC1Quality_Fast,
+	/* also tries individual mode on every block and searches base colors around the best one, several times slower */
+	ETC1Quality_High,
+} ETC1Quality;
+
+/* start threads that etc1PackImage565 spreads its blocks across, 0 to pack on calling thread only.
+ * Only the first call has any effect */
+void etc1Init(int threads);
+
 // in4x4 layout is column-major
-void etc1PackBlock(const ETC1Color *in4x4, uint8_t *out);
+void etc1PackBlock(const ETC1Color *in4x4, uint8_t *out, ETC1Quality quality);
+// out4x4 layout is column-major
+void etc1UnpackBlock(const uint8_t *in, ETC1Color *out4x4);
+
+/* pack RGB565 image of any size, partial blocks at the edges repeat edge pixels.
+ * out must hold ((width + 3) / 4) * ((height + 3) / 4) * 8 bytes.
+ * Can be called from several threads at once, calling thread helps packing its own image */
+void etc1PackImage565(const uint16_t *pixels, int width, int height, uint8_t *out, ETC1Quality quality);
+
+/* pack a synthetic image with the original brute-force packer and with each quality mode,
+ * printing blocks per second and PSNR of each */
+void etc1Benchmark(void);
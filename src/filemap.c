@@ -6,11 +6,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h> /* open */
+#include <sys/mman.h> /* mmap */
 #include <unistd.h> /* close */
 #include <stdio.h> /* perror */
 
 void aFileReset(struct AFile *file) {
 	file->size = 0;
+	file->mtime = 0;
 	file->impl_.fd = -1;
 }
 
@@ -22,6 +24,7 @@ enum AFileResult aFileOpen(struct AFile *file, const char *filename) {
 	struct stat stat;
 	fstat(file->impl_.fd, &stat);
 	file->size = stat.st_size;
+	file->mtime = (uint64_t)stat.st_mtime;
 
 	return AFile_Success;
 }
@@ -40,10 +43,39 @@ void aFileClose(struct AFile *file) {
 	}
 }
 
+static size_t aFileMapGranularity(void) {
+	static size_t page_size = 0;
+	if (!page_size)
+		page_size = (size_t)sysconf(_SC_PAGESIZE);
+	return page_size;
+}
+
+const void *aFileMap(struct AFile *file, size_t off, size_t size) {
+	if (file->impl_.fd < 0 || size == 0 || off > file->size || file->size - off < size)
+		return NULL;
+
+	/* offset must be page-aligned */
+	const size_t delta = off % aFileMapGranularity();
+	void *map = mmap(NULL, size + delta, PROT_READ, MAP_PRIVATE, file->impl_.fd, (off_t)(off - delta));
+	if (map == MAP_FAILED) {
+		perror("mmap(fd)");
+		return NULL;
+	}
+
+	return (const char*)map + delta;
+}
+
+void aFileUnmap(const void *data, size_t size) {
+	/* mmap returns page-aligned address, so the beginning of mapping can be restored from data */
+	const size_t delta = (uintptr_t)data % aFileMapGranularity();
+	munmap((char*)data - delta, size + delta);
+}
+
 #else
 
 void aFileReset(struct AFile *file) {
 	file->size = 0;
+	file->mtime = 0;
 	file->impl_.handle = INVALID_HANDLE_VALUE;
 }
 
@@ -71,6 +103,13 @@ enum AFileResult aFileOpen(struct AFile *file, const char *filename) {
 	}
 
 	file->size = (size_t)splurge_integer.QuadPart;
+
+	FILETIME write_time;
+	if (GetFileTime(file->impl_.handle, NULL, NULL, &write_time))
+		file->mtime = ((uint64_t)write_time.dwHighDateTime << 32) | write_time.dwLowDateTime;
+	else
+		file->mtime = 0;
+
 	return AFile_Success;
 }
 
@@ -90,4 +129,46 @@ void aFileClose(struct AFile *file) {
 	CloseHandle(file->impl_.handle);
 }
 
+static size_t aFileMapGranularity(void) {
+	static size_t granularity = 0;
+	if (!granularity) {
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		granularity = info.dwAllocationGranularity;
+	}
+	return granularity;
+}
+
+const void *aFileMap(struct AFile *file, size_t off, size_t size) {
+	if (file->impl_.handle == INVALID_HANDLE_VALUE || size == 0 || off > file->size || file->size - off < size)
+		return NULL;
+
+	HANDLE mapping = CreateFileMappingW(file->impl_.handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping) {
+		PRINTF("Failed to create file mapping for %p", file->impl_.handle);
+		return NULL;
+	}
+
+	/* offset must be aligned to allocation granularity */
+	const size_t delta = off % aFileMapGranularity();
+	const uint64_t map_off = off - delta;
+	void *map = MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(map_off >> 32), (DWORD)map_off, size + delta);
+
+	/* view keeps the mapping object alive */
+	CloseHandle(mapping);
+
+	if (!map) {
+		PRINTF("Failed to map view of file %p", file->impl_.handle);
+		return NULL;
+	}
+
+	return (const char*)map + delta;
+}
+
+void aFileUnmap(const void *data, size_t size) {
+	(void)size;
+	const size_t delta = (uintptr_t)data % aFileMapGranularity();
+	UnmapViewOfFile((const char*)data - delta);
+}
+
 #endif
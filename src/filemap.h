@@ -4,6 +4,8 @@
 
 typedef struct AFile {
 	size_t size;
+	/* last modification time, platform-specific units; only good for comparing with itself */
+	uint64_t mtime;
 	struct {
 #ifndef _WIN32
 		int fd;
@@ -25,3 +27,9 @@ void aFileReset(struct AFile *file);
 enum AFileResult aFileOpen(struct AFile *file, const char *filename);
 size_t aFileReadAtOffset(struct AFile *file, size_t off, size_t size, void *buffer);
 void aFileClose(struct AFile *file);
+
+/* map size bytes at offset read-only into memory; returns NULL if that is not possible.
+ * mapping stays valid after file is closed, until aFileUnmap */
+const void *aFileMap(struct AFile *file, size_t off, size_t size);
+/* data and size must be the same as were used for and returned by aFileMap */
+void aFileUnmap(const void *data, size_t size);
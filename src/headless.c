@@ -0,0 +1,54 @@
+#include "atto/app.h"
+#include "libc.h"
+#include <stdarg.h>
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+/* Entry point of OpenSourceHeadless, which only loads maps with the null render backend. atto's platform
+ * layer opens a window and creates GL context before calling attoAppInit(), which fails on machines without
+ * a display, so this replaces it with the few app functions that the rest of the code uses */
+
+static struct AAppState state;
+const struct AAppState *a_app_state = &state;
+
+ATimeUs aAppTime(void) {
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (ATimeUs)(counter.QuadPart * 1000000ull / frequency.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ATimeUs)(ts.tv_sec * 1000000ull + ts.tv_nsec / 1000);
+#endif
+}
+
+void aAppDebugPrintf(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+void aAppTerminate(int code) {
+	exit(code);
+}
+
+void aAppGrabInput(int grab) {
+	(void)grab;
+}
+
+int main(int argc, char *argv[]) {
+	state.argc = argc;
+	state.argv = (const char *const *)argv;
+
+	struct AAppProctable proctable;
+	memset(&proctable, 0, sizeof(proctable));
+	attoAppInit(&proctable);
+
+	/* attoAppInit() only returns when there was nothing to load headless */
+	return 1;
+}
@@ -0,0 +1,148 @@
+#include "lightmap.h"
+#include "atlas.h"
+#include "thread.h"
+#include "common.h"
+#include "log.h"
+
+/* 8MiB of RGB565 each; maps of a typical set fill a few of them */
+#define LIGHTMAP_PAGE_MAX_SIZE 2048
+#define LIGHTMAP_MAX_PAGES 32
+/* every region adds at most one skyline node */
+#define LIGHTMAP_PAGE_MAX_REGIONS 255
+
+typedef struct {
+	RTexture texture;
+	struct AtlasSkyline skyline;
+	struct AtlasSkylineNode nodes[LIGHTMAP_PAGE_MAX_REGIONS + 1];
+	int regions;
+	size_t used_pixels;
+} LightmapPage;
+
+static struct {
+	AMutex lock;
+	int page_size;
+	int pages_count;
+	LightmapPage pages[LIGHTMAP_MAX_PAGES];
+} lightmap;
+
+void lightmapInit(void) {
+	aMutexInit(&lightmap.lock);
+	lightmap.page_size = renderMaxTextureSize();
+	if (lightmap.page_size > LIGHTMAP_PAGE_MAX_SIZE)
+		lightmap.page_size = LIGHTMAP_PAGE_MAX_SIZE;
+	lightmap.pages_count = 0;
+	PRINTF("Lightmap page size: %d", lightmap.page_size);
+}
+
+int lightmapPageSize(void) {
+	return lightmap.page_size;
+}
+
+static int lightmapPageAlloc(LightmapPage *page, int width, int height, LightmapRegion *region) {
+	const struct AtlasVec size = {(unsigned)width, (unsigned)height};
+	struct AtlasVec pos;
+	if (!atlasSkylineAdd(&page->skyline, size, &pos, NULL))
+		return 0;
+
+	region->page = (int)(page - lightmap.pages);
+	region->x = (int)pos.x;
+	region->y = (int)pos.y;
+	region->width = width;
+	region->height = height;
+	++page->regions;
+	page->used_pixels += (size_t)width * height;
+	return 1;
+}
+
+int lightmapAlloc(int width, int height, LightmapRegion *region) {
+	ASSERT(width > 0 && height > 0);
+	if (width > lightmap.page_size || height > lightmap.page_size) {
+		PRINTF("Lightmap %dx%d is larger than page %d", width, height, lightmap.page_size);
+		return 0;
+	}
+
+	int result = 0;
+	aMutexLock(&lightmap.lock);
+
+	/* older pages first, smaller maps can often fill what larger ones left */
+	for (int i = 0; i < lightmap.pages_count && !result; ++i)
+		result = lightmapPageAlloc(lightmap.pages + i, width, height, region);
+
+	if (!result && lightmap.pages_count < LIGHTMAP_MAX_PAGES) {
+		LightmapPage *page = lightmap.pages + lightmap.pages_count;
+		atlasSkylineInit(&page->skyline, lightmap.page_size, lightmap.page_size,
+				page->nodes, COUNTOF(page->nodes));
+		page->regions = 0;
+		page->used_pixels = 0;
+
+		/* posted while locked, so that storage is allocated before any region of this page is uploaded */
+		const RTextureUploadParams upload = {
+			.type = RTexType_2D,
+			.width = lightmap.page_size,
+			.height = lightmap.page_size,
+			.format = RTexFormat_RGB565,
+			.pixels = NULL,
+			.mip_level = -2,
+			.wrap = RTexWrap_Clamp,
+		};
+		renderTextureInit(&page->texture);
+		renderTextureUpload(&page->texture, upload);
+
+		++lightmap.pages_count;
+		PRINTF("Lightmap page %d added", lightmap.pages_count - 1);
+		result = lightmapPageAlloc(page, width, height, region);
+		ASSERT(result);
+	}
+
+	aMutexUnlock(&lightmap.lock);
+
+	if (!result)
+		PRINTF("No space left for lightmap %dx%d in %d pages", width, height, LIGHTMAP_MAX_PAGES);
+
+	return result;
+}
+
+void lightmapUpload(const LightmapRegion *region, const uint16_t *pixels) {
+	const RTextureUploadParams upload = {
+		.type = RTexType_2D,
+		.width = region->width,
+		.height = region->height,
+		.format = RTexFormat_RGB565,
+		.pixels = pixels,
+		.mip_level = -2,
+		.wrap = RTexWrap_Clamp,
+	};
+	renderTextureUploadRegion(&lightmap.pages[region->page].texture, region->x, region->y, upload);
+}
+
+const RTexture *lightmapPageTexture(int page) {
+	ASSERT(page >= 0 && page < LIGHTMAP_MAX_PAGES);
+	return &lightmap.pages[page].texture;
+}
+
+int lightmapPagesCount(void) {
+	aMutexLock(&lightmap.lock);
+	const int count = lightmap.pages_count;
+	aMutexUnlock(&lightmap.lock);
+	return count;
+}
+
+void lightmapPageStats(int page, LightmapPageStats *stats) {
+	aMutexLock(&lightmap.lock);
+	ASSERT(page >= 0 && page < lightmap.pages_count);
+	const LightmapPage *p = lightmap.pages + page;
+	stats->width = stats->height = lightmap.page_size;
+	stats->regions = p->regions;
+	stats->used_pixels = p->used_pixels;
+	aMutexUnlock(&lightmap.lock);
+}
+
+void lightmapPrintStats(void) {
+	const int count = lightmapPagesCount();
+	for (int i = 0; i < count; ++i) {
+		LightmapPageStats stats;
+		lightmapPageStats(i, &stats);
+		PRINTF("Lightmap page %d: %dx%d, %d regions, %.1f%% used", i, stats.width, stats.height,
+			stats.regions, 100. * stats.used_pixels / ((double)stats.width * stats.height));
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "render.h"
+#include <stdint.h>
+
+/* Lightmaps of all maps share a few large RGB565 pages, so that draws of different maps
+ * don't need to switch lightmap textures. Space is handed out as maps load and never freed */
+
+/* rect on a shared page */
+typedef struct {
+	int page;
+	int x, y, width, height;
+} LightmapRegion;
+
+typedef struct {
+	int width, height;
+	int regions;
+	/* pixels covered by regions */
+	size_t used_pixels;
+} LightmapPageStats;
+
+/* main thread, after renderInit() */
+void lightmapInit(void);
+/* edge length of every page, regions can't be larger than this; any thread */
+int lightmapPageSize(void);
+/* find space for width x height rect on an existing or a new page; returns 0 if out of pages.
+ * Any thread, but not main thread while loader threads are running */
+int lightmapAlloc(int width, int height, LightmapRegion *region);
+/* upload region->width x region->height RGB565 pixels; any thread */
+void lightmapUpload(const LightmapRegion *region, const uint16_t *pixels);
+/* main thread */
+const RTexture *lightmapPageTexture(int page);
+
+/* same threading rules as lightmapAlloc() */
+int lightmapPagesCount(void);
+void lightmapPageStats(int page, LightmapPageStats *stats);
+void lightmapPrintStats(void);
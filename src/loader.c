@@ -0,0 +1,228 @@
+#include "loader.h"
+#include "thread.h"
+#include "common.h"
+
+#define LOADER_MAX_WORKERS 8
+#define LOADER_WORKER_TEMP_SIZE (192*1024*1024)
+/* persistent memory of a worker grows by blocks that are never freed, as maps loaded into them live forever;
+ * a job starts in a new block when the current one has less than reserve left, so that all of a map fits */
+#define LOADER_PERSISTENT_BLOCK_SIZE (32*1024*1024)
+#define LOADER_PERSISTENT_RESERVE (12*1024*1024)
+/* workers will wait for main thread if it has more than this amount of data to process */
+#define LOADER_MAX_PENDING_BYTES (256*1024*1024)
+
+typedef struct LoaderMessage {
+	struct LoaderMessage *next;
+	LoaderMainThreadFunc func;
+	size_t size;
+	/* payload follows */
+} LoaderMessage;
+
+typedef struct {
+	AThread thread;
+	struct Stack temp;
+	/* current block */
+	struct Stack persistent;
+	int persistent_blocks;
+	/* used by maps in full blocks */
+	size_t persistent_full;
+} LoaderWorker;
+
+static struct {
+	int workers_count;
+	LoaderWorker workers[LOADER_MAX_WORKERS];
+
+	AMutex lock;
+	ACond jobs_available;
+	ACond messages_drained;
+	ACond messages_posted;
+
+	LoaderJob *jobs_head, *jobs_tail;
+	LoaderMessage *messages_head, *messages_tail;
+	size_t messages_bytes;
+} loader;
+
+static int loaderStackInit(struct Stack *stack, size_t size) {
+	stack->storage = malloc(size);
+	stack->size = stack->storage ? size : 0;
+	stack->cursor = 0;
+	stack->peak = 0;
+	return stack->storage != NULL;
+}
+
+static void loaderWorkerReservePersistent(LoaderWorker *worker) {
+	if (stackGetFree(&worker->persistent) >= LOADER_PERSISTENT_RESERVE)
+		return;
+
+	const struct Stack full = worker->persistent;
+	if (!loaderStackInit(&worker->persistent, LOADER_PERSISTENT_BLOCK_SIZE)) {
+		PRINTF("Cannot allocate another %dMiB persistent block for loader worker", LOADER_PERSISTENT_BLOCK_SIZE >> 20);
+		worker->persistent = full;
+		return;
+	}
+
+	worker->persistent_full += full.cursor;
+	++worker->persistent_blocks;
+}
+
+static void loaderWorkerMain(void *arg) {
+	LoaderWorker *worker = arg;
+	struct Memories mem = { &worker->temp, &worker->persistent };
+
+	for (;;) {
+		aMutexLock(&loader.lock);
+		while (!loader.jobs_head)
+			aCondWait(&loader.jobs_available, &loader.lock);
+
+		LoaderJob *job = loader.jobs_head;
+		loader.jobs_head = job->next;
+		if (!loader.jobs_head)
+			loader.jobs_tail = NULL;
+		aMutexUnlock(&loader.lock);
+
+		loaderWorkerReservePersistent(worker);
+		void *const temp_cursor = stackGetCursor(&worker->temp);
+		job->func(job, &mem);
+		stackFreeUpToPosition(&worker->temp, temp_cursor);
+	}
+}
+
+void loaderInit(int workers) {
+	memset(&loader, 0, sizeof(loader));
+
+	if (workers > LOADER_MAX_WORKERS)
+		workers = LOADER_MAX_WORKERS;
+
+	aMutexInit(&loader.lock);
+	aCondInit(&loader.jobs_available);
+	aCondInit(&loader.messages_drained);
+	aCondInit(&loader.messages_posted);
+
+	for (int i = 0; i < workers; ++i) {
+		LoaderWorker *worker = loader.workers + loader.workers_count;
+		if (!loaderStackInit(&worker->temp, LOADER_WORKER_TEMP_SIZE)
+				|| !loaderStackInit(&worker->persistent, LOADER_PERSISTENT_BLOCK_SIZE)) {
+			PRINTF("Cannot allocate memory for loader worker %d", i);
+			break;
+		}
+
+		worker->persistent_blocks = 1;
+		worker->persistent_full = 0;
+
+		if (!aThreadCreate(&worker->thread, loaderWorkerMain, worker))
+			break;
+
+		++loader.workers_count;
+	}
+
+	PRINTF("Started %d loader workers", loader.workers_count);
+}
+
+int loaderWorkersCount(void) {
+	return loader.workers_count;
+}
+
+void loaderSubmit(struct LoaderJob *job) {
+	ASSERT(loader.workers_count > 0);
+	job->next = NULL;
+
+	aMutexLock(&loader.lock);
+	if (loader.jobs_tail)
+		loader.jobs_tail->next = job;
+	else
+		loader.jobs_head = job;
+	loader.jobs_tail = job;
+	aCondSignal(&loader.jobs_available);
+	aMutexUnlock(&loader.lock);
+}
+
+int loaderIsMainThread(void) {
+	for (int i = 0; i < loader.workers_count; ++i)
+		if (aThreadIsCurrent(&loader.workers[i].thread))
+			return 0;
+	return 1;
+}
+
+void *loaderMainThreadAlloc(size_t payload_size) {
+	if (!loaderIsMainThread()) {
+		aMutexLock(&loader.lock);
+		while (loader.messages_head && loader.messages_bytes > LOADER_MAX_PENDING_BYTES)
+			aCondWait(&loader.messages_drained, &loader.lock);
+		aMutexUnlock(&loader.lock);
+	}
+
+	LoaderMessage *message = malloc(sizeof(LoaderMessage) + payload_size);
+	if (!message) {
+		PRINTF("Cannot allocate %zu bytes for loader message", payload_size);
+		abort();
+	}
+
+	message->next = NULL;
+	message->func = NULL;
+	message->size = payload_size;
+	return message + 1;
+}
+
+void loaderMainThreadPost(LoaderMainThreadFunc func, void *payload) {
+	LoaderMessage *message = (LoaderMessage*)payload - 1;
+	message->func = func;
+
+	aMutexLock(&loader.lock);
+	if (loader.messages_tail)
+		loader.messages_tail->next = message;
+	else
+		loader.messages_head = message;
+	loader.messages_tail = message;
+	loader.messages_bytes += message->size;
+	aCondSignal(&loader.messages_posted);
+	aMutexUnlock(&loader.lock);
+}
+
+void loaderWaitMessages(void) {
+	if (!loader.workers_count)
+		return;
+
+	aMutexLock(&loader.lock);
+	while (!loader.messages_head)
+		aCondWait(&loader.messages_posted, &loader.lock);
+	aMutexUnlock(&loader.lock);
+}
+
+void loaderPrintMemUsage(void) {
+	for (int i = 0; i < loader.workers_count; ++i) {
+		const LoaderWorker *worker = loader.workers + i;
+		PRINTF("Loader worker %d peak temp: %zuKiB/%zuKiB, persistent: %zuKiB in %d blocks of %zuKiB", i,
+			worker->temp.peak >> 10, worker->temp.size >> 10,
+			(worker->persistent_full + worker->persistent.cursor) >> 10,
+			worker->persistent_blocks, worker->persistent.size >> 10);
+	}
+}
+
+void loaderUpdate(ATimeUs budget) {
+	const ATimeUs start = aAppTime();
+	for (;;) {
+		aMutexLock(&loader.lock);
+		LoaderMessage *message = loader.messages_head;
+		if (message) {
+			loader.messages_head = message->next;
+			if (!loader.messages_head)
+				loader.messages_tail = NULL;
+		}
+		aMutexUnlock(&loader.lock);
+
+		if (!message)
+			break;
+
+		message->func(message + 1);
+
+		aMutexLock(&loader.lock);
+		loader.messages_bytes -= message->size;
+		aCondBroadcast(&loader.messages_drained);
+		aMutexUnlock(&loader.lock);
+
+		free(message);
+
+		if (aAppTime() - start > budget)
+			break;
+	}
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "mempools.h"
+#include "atto/app.h"
+
+/* Background loading: jobs run on worker threads, anything that must happen
+ * on the main (GL) thread is posted back as a message and executed by loaderUpdate() */
+
+struct LoaderJob;
+
+/* mem->temp is reset after the job returns; mem->persistent is owned by worker forever, and has at least
+ * a few MiB free when the job starts */
+typedef void (*LoaderJobFunc)(struct LoaderJob *job, struct Memories *mem);
+
+typedef struct LoaderJob {
+	LoaderJobFunc func;
+	void *user;
+	struct LoaderJob *next;
+} LoaderJob;
+
+typedef void (*LoaderMainThreadFunc)(void *payload);
+
+/* workers == 0 means that nothing is ever run in background */
+void loaderInit(int workers);
+int loaderWorkersCount(void);
+
+/* job structure must stay alive until job func is called */
+void loaderSubmit(struct LoaderJob *job);
+
+/* returns 1 if called outside of any worker thread */
+int loaderIsMainThread(void);
+
+/* allocate message payload; may block a worker while main thread is behind on messages */
+void *loaderMainThreadAlloc(size_t payload_size);
+/* payload must be allocated with loaderMainThreadAlloc(); it is freed after func is called */
+void loaderMainThreadPost(LoaderMainThreadFunc func, void *payload);
+
+/* execute posted messages on main thread until done or time budget is exceeded */
+void loaderUpdate(ATimeUs budget);
+
+/* block main thread until any message is posted; returns immediately if there are no workers */
+void loaderWaitMessages(void);
+
+void loaderPrintMemUsage(void);
@@ -147,16 +147,11 @@ static VMFAction materialParserCallback(VMFState *state, VMFEntryType entry, con
 }
 
 static int materialLoad(struct IFile *file, struct ICollection *coll, Material *output, struct Stack *tmp) {
-	char *buffer = stackAlloc(tmp, file->size);
+	void *const tmp_cursor = stackGetCursor(tmp);
+	const char *buffer = collectionFileMap(file, 0, file->size, tmp);
 
 	if (!buffer) {
-		PRINT("Out of temp memory");
-		return 0;
-	}
-
-	const int read_size = (int)file->read(file, 0, file->size, buffer);
-	if ((int)file->size != read_size) {
-		PRINTF("Cannot read material file: %d != %d", (int)file->size, read_size);
+		PRINTF("Cannot read material file of %d bytes", (int)file->size);
 		return 0;
 	}
 
@@ -181,31 +176,33 @@ static int materialLoad(struct IFile *file, struct ICollection *coll, Material *
 	if (success && ctx.mat->base_texture.texture)
 		ctx.mat->average_color = ctx.mat->base_texture.texture->avg_color;
 
-	stackFreeUpToPosition(tmp, buffer);
+	collectionFileUnmap(file, buffer, file->size, tmp);
+	stackFreeUpToPosition(tmp, tmp_cursor);
 
 	return success;
 }
 
+/* file i/o, parsing and loading of textures happen without cache lock, so that loader threads don't wait
+ * for each other unless they need the same material */
 const Material *materialGet(const char *name, struct ICollection *collection, struct Stack *tmp) {
-	const Material *mat = cacheGetMaterial(name);
+	const Material *mat = cacheAcquireMaterial(name);
 	if (mat) return mat;
 
 	struct IFile *matfile;
-	if (CollectionOpen_Success != collectionChainOpen(collection, name, File_Material, &matfile)) {
+	if (CollectionOpen_Success != collectionChainOpen(collection, name, File_Material, tmp, &matfile)) {
 		PRINTF("Material \"%s\" not found", name);
+		cacheReleaseMaterial(name, NULL);
 		return cacheGetMaterial("opensource/placeholder");
 	}
 
 	Material localmat;
 	memset(&localmat, 0, sizeof localmat);
-	if (materialLoad(matfile, collection, &localmat, tmp) == 0) {
+	const int loaded = materialLoad(matfile, collection, &localmat, tmp);
+	matfile->close(matfile);
+
+	if (!loaded)
 		PRINTF("Material \"%s\" found, but could not be loaded", name);
-	} else {
-		cachePutMaterial(name, &localmat);
-		mat = cacheGetMaterial(name);
-	}
 
-	matfile->close(matfile);
+	mat = cacheReleaseMaterial(name, loaded ? &localmat : NULL);
 	return mat ? mat : cacheGetMaterial("opensource/placeholder");
 }
-
@@ -6,6 +6,7 @@
 typedef struct Stack {
 	char *storage;
 	size_t size, cursor;
+	size_t peak; /* high-water mark of cursor */
 } Stack;
 
 static inline void *stackGetCursor(const struct Stack *stack) {
@@ -21,6 +22,8 @@ static inline void *stackAlloc(struct Stack *stack, size_t size) {
 
 	void *ret = stack->storage + stack->cursor;
 	stack->cursor += size;
+	if (stack->cursor > stack->peak)
+		stack->peak = stack->cursor;
 	return ret;
 }
 static inline void stackFree(struct Stack *stack, size_t size) {
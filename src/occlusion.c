@@ -0,0 +1,384 @@
+#include "occlusion.h"
+#include "camera.h"
+#include "libc.h"
+#include "common.h"
+#include "log.h"
+#include "atto/app.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OCCLUSION_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define OCCLUSION_NEON
+#include <arm_neon.h>
+#endif
+
+/* occluders this much closer than box are not hiding it, so that faces on its sides don't hide their own box */
+#define OCCLUSION_DEPTH_EPSILON 1e-3f
+
+/* depth[0 .. count) of a row, count is a multiple of 4: pixel i is covered when e[k] + de[k] * i >= 0
+ * for all three edges, and its depth is z + dz * i */
+typedef void (*OcclusionRowFunc)(float *depth, int count, const float e[3], const float de[3], float z, float dz);
+
+static struct {
+	const char *name;
+	OcclusionRowFunc rasterize_row;
+} occlusion;
+
+static void occlusionRasterizeRowScalar(float *depth, int count, const float e[3], const float de[3],
+		float z, float dz) {
+	for (int i = 0; i < count; ++i) {
+		const float x = (float)i;
+		if (e[0] + de[0] * x >= 0.f && e[1] + de[1] * x >= 0.f && e[2] + de[2] * x >= 0.f) {
+			const float pz = z + dz * x;
+			if (pz > depth[i])
+				depth[i] = pz;
+		}
+	}
+}
+
+#ifdef OCCLUSION_SSE2
+static void occlusionRasterizeRowSSE2(float *depth, int count, const float e[3], const float de[3],
+		float z, float dz) {
+	const __m128 e0 = _mm_set1_ps(e[0]), e1 = _mm_set1_ps(e[1]), e2 = _mm_set1_ps(e[2]);
+	const __m128 de0 = _mm_set1_ps(de[0]), de1 = _mm_set1_ps(de[1]), de2 = _mm_set1_ps(de[2]);
+	const __m128 z4 = _mm_set1_ps(z), dz4 = _mm_set1_ps(dz), zero = _mm_setzero_ps();
+	const __m128 offsets = _mm_set_ps(3.f, 2.f, 1.f, 0.f);
+	for (int i = 0; i < count; i += 4) {
+		const __m128 x = _mm_add_ps(_mm_set1_ps((float)i), offsets);
+		const __m128 inside = _mm_and_ps(
+			_mm_and_ps(
+				_mm_cmpge_ps(_mm_add_ps(e0, _mm_mul_ps(de0, x)), zero),
+				_mm_cmpge_ps(_mm_add_ps(e1, _mm_mul_ps(de1, x)), zero)),
+			_mm_cmpge_ps(_mm_add_ps(e2, _mm_mul_ps(de2, x)), zero));
+		if (!_mm_movemask_ps(inside))
+			continue;
+
+		const __m128 d = _mm_loadu_ps(depth + i);
+		const __m128 pz = _mm_max_ps(d, _mm_add_ps(z4, _mm_mul_ps(dz4, x)));
+		_mm_storeu_ps(depth + i, _mm_or_ps(_mm_and_ps(inside, pz), _mm_andnot_ps(inside, d)));
+	}
+}
+#endif /* OCCLUSION_SSE2 */
+
+#ifdef OCCLUSION_NEON
+static void occlusionRasterizeRowNEON(float *depth, int count, const float e[3], const float de[3],
+		float z, float dz) {
+	const float32x4_t e0 = vdupq_n_f32(e[0]), e1 = vdupq_n_f32(e[1]), e2 = vdupq_n_f32(e[2]);
+	const float32x4_t de0 = vdupq_n_f32(de[0]), de1 = vdupq_n_f32(de[1]), de2 = vdupq_n_f32(de[2]);
+	const float32x4_t z4 = vdupq_n_f32(z), dz4 = vdupq_n_f32(dz), zero = vdupq_n_f32(0.f);
+	static const float offsets_data[4] = {0.f, 1.f, 2.f, 3.f};
+	const float32x4_t offsets = vld1q_f32(offsets_data);
+	for (int i = 0; i < count; i += 4) {
+		const float32x4_t x = vaddq_f32(vdupq_n_f32((float)i), offsets);
+		const uint32x4_t inside = vandq_u32(
+			vandq_u32(
+				vcgeq_f32(vaddq_f32(e0, vmulq_f32(de0, x)), zero),
+				vcgeq_f32(vaddq_f32(e1, vmulq_f32(de1, x)), zero)),
+			vcgeq_f32(vaddq_f32(e2, vmulq_f32(de2, x)), zero));
+		const uint32x2_t any = vorr_u32(vget_low_u32(inside), vget_high_u32(inside));
+		if (!(vget_lane_u32(any, 0) | vget_lane_u32(any, 1)))
+			continue;
+
+		const float32x4_t d = vld1q_f32(depth + i);
+		const float32x4_t pz = vmaxq_f32(d, vaddq_f32(z4, vmulq_f32(dz4, x)));
+		vst1q_f32(depth + i, vbslq_f32(inside, pz, d));
+	}
+}
+#endif /* OCCLUSION_NEON */
+
+/* returns 1 if any of depth[0 .. count) is not closer than z */
+static int occlusionRowVisible(const float *depth, int count, float z) {
+	int i = 0;
+#ifdef OCCLUSION_SSE2
+	const __m128 z4 = _mm_set1_ps(z);
+	for (; i + 4 <= count; i += 4)
+		if (_mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps(depth + i), z4)))
+			return 1;
+#elif defined(OCCLUSION_NEON)
+	const float32x4_t z4 = vdupq_n_f32(z);
+	for (; i + 4 <= count; i += 4) {
+		const uint32x4_t le = vcleq_f32(vld1q_f32(depth + i), z4);
+		const uint32x2_t any = vorr_u32(vget_low_u32(le), vget_high_u32(le));
+		if (vget_lane_u32(any, 0) | vget_lane_u32(any, 1))
+			return 1;
+	}
+#endif
+	for (; i < count; ++i)
+		if (depth[i] <= z)
+			return 1;
+	return 0;
+}
+
+void occlusionInit(void) {
+	occlusion.name = "scalar";
+	occlusion.rasterize_row = occlusionRasterizeRowScalar;
+#ifdef OCCLUSION_SSE2
+	occlusion.name = "SSE2";
+	occlusion.rasterize_row = occlusionRasterizeRowSSE2;
+#elif defined(OCCLUSION_NEON)
+	occlusion.name = "NEON";
+	occlusion.rasterize_row = occlusionRasterizeRowNEON;
+#endif
+	PRINTF("Using %s occlusion rasterizer", occlusion.name);
+}
+
+void occlusionBufferBegin(OcclusionBuffer *buffer, const struct AMat4f *view_projection) {
+	buffer->view_projection = *view_projection;
+	memset(buffer->depth, 0, sizeof(buffer->depth));
+	buffer->triangles = 0;
+	buffer->boxes_tested = buffer->boxes_occluded = 0;
+}
+
+typedef struct { float x, y, z, w; } OcclusionClipVertex;
+
+static OcclusionClipVertex occlusionTransform(const struct AMat4f *m, struct AVec3f v) {
+	const OcclusionClipVertex c = {
+		m->X.x * v.x + m->Y.x * v.y + m->Z.x * v.z + m->W.x,
+		m->X.y * v.x + m->Y.y * v.y + m->Z.y * v.z + m->W.y,
+		m->X.z * v.x + m->Y.z * v.y + m->Z.z * v.z + m->W.z,
+		m->X.w * v.x + m->Y.w * v.y + m->Z.w * v.z + m->W.w,
+	};
+	return c;
+}
+
+/* clip triangle by near plane z >= -w; returns number of polygon vertices, 0, 3 or 4 */
+static int occlusionClipNear(const OcclusionClipVertex in[3], OcclusionClipVertex out[4]) {
+	int count = 0;
+	for (int i = 0; i < 3; ++i) {
+		const OcclusionClipVertex *a = in + i, *b = in + (i + 1) % 3;
+		const float da = a->z + a->w, db = b->z + b->w;
+		if (da >= 0.f)
+			out[count++] = *a;
+		if ((da >= 0.f) != (db >= 0.f)) {
+			const float t = da / (da - db);
+			out[count].x = a->x + (b->x - a->x) * t;
+			out[count].y = a->y + (b->y - a->y) * t;
+			out[count].z = a->z + (b->z - a->z) * t;
+			out[count].w = a->w + (b->w - a->w) * t;
+			++count;
+		}
+	}
+	return count;
+}
+
+typedef struct { float x, y, iz; } OcclusionScreenVertex;
+
+static OcclusionScreenVertex occlusionProject(const OcclusionClipVertex *c) {
+	const float iw = 1.f / c->w;
+	const OcclusionScreenVertex s = {
+		(c->x * iw * .5f + .5f) * OCCLUSION_WIDTH,
+		(c->y * iw * .5f + .5f) * OCCLUSION_HEIGHT,
+		iw
+	};
+	return s;
+}
+
+static void occlusionRasterizeTriangle(OcclusionBuffer *buffer, OcclusionRowFunc rasterize_row,
+		const OcclusionScreenVertex *a, const OcclusionScreenVertex *b, const OcclusionScreenVertex *c) {
+	/* twice the signed area, positive for counter-clockwise */
+	const float area = (b->x - a->x) * (c->y - a->y) - (b->y - a->y) * (c->x - a->x);
+	if (!(area > 0.f))
+		return;
+
+	const float minx = floatMin(a->x, floatMin(b->x, c->x));
+	const float maxx = floatMax(a->x, floatMax(b->x, c->x));
+	const float miny = floatMin(a->y, floatMin(b->y, c->y));
+	const float maxy = floatMax(a->y, floatMax(b->y, c->y));
+	if (maxx < 0.f || maxy < 0.f || minx > OCCLUSION_WIDTH || miny > OCCLUSION_HEIGHT)
+		return;
+
+	const int x0 = (int)floatMax(minx, 0.f) & ~3;
+	const int x1 = (int)floatMin(maxx, OCCLUSION_WIDTH - 1);
+	const int y0 = (int)floatMax(miny, 0.f);
+	const int y1 = (int)floatMin(maxy, OCCLUSION_HEIGHT - 1);
+	const int count = ((x1 - x0) / 4 + 1) * 4;
+
+	/* edge k is opposite to vertex k: E(x, y) = A * x + B * y + C, positive inside */
+	const OcclusionScreenVertex *const v[3] = {a, b, c};
+	float A[3], B[3], C[3];
+	for (int k = 0; k < 3; ++k) {
+		const OcclusionScreenVertex *p = v[(k + 1) % 3], *q = v[(k + 2) % 3];
+		A[k] = p->y - q->y;
+		B[k] = q->x - p->x;
+		C[k] = -A[k] * p->x - B[k] * p->y;
+	}
+
+	/* 1/w is linear in screen space; barycentric weight of vertex k is E_k / area */
+	float dzdx = 0.f, dzdy = 0.f, z0 = 0.f;
+	for (int k = 0; k < 3; ++k) {
+		dzdx += A[k] * v[k]->iz;
+		dzdy += B[k] * v[k]->iz;
+		z0 += C[k] * v[k]->iz;
+	}
+	dzdx /= area; dzdy /= area; z0 /= area;
+
+	const float px = (float)x0 + .5f;
+	for (int y = y0; y <= y1; ++y) {
+		const float py = (float)y + .5f;
+		const float e[3] = {
+			A[0] * px + B[0] * py + C[0],
+			A[1] * px + B[1] * py + C[1],
+			A[2] * px + B[2] * py + C[2],
+		};
+		rasterize_row(buffer->depth + y * OCCLUSION_WIDTH + x0, count, e, A,
+			z0 + dzdx * px + dzdy * py, dzdx);
+	}
+
+	++buffer->triangles;
+}
+
+static void occlusionAddTriangles(OcclusionBuffer *buffer, OcclusionRowFunc rasterize_row, struct AVec3f translation,
+		const struct AVec3f *vertices, const uint16_t *indices, int indices_count) {
+	for (int i = 0; i + 2 < indices_count; i += 3) {
+		const OcclusionClipVertex clip[3] = {
+			occlusionTransform(&buffer->view_projection, aVec3fAdd(vertices[indices[i + 0]], translation)),
+			occlusionTransform(&buffer->view_projection, aVec3fAdd(vertices[indices[i + 1]], translation)),
+			occlusionTransform(&buffer->view_projection, aVec3fAdd(vertices[indices[i + 2]], translation)),
+		};
+
+		OcclusionClipVertex polygon[4];
+		const int count = occlusionClipNear(clip, polygon);
+		if (count < 3)
+			continue;
+
+		OcclusionScreenVertex screen[4];
+		for (int j = 0; j < count; ++j)
+			screen[j] = occlusionProject(polygon + j);
+
+		for (int j = 2; j < count; ++j)
+			occlusionRasterizeTriangle(buffer, rasterize_row, screen, screen + j - 1, screen + j);
+	}
+}
+
+void occlusionBufferAddTriangles(OcclusionBuffer *buffer, struct AVec3f translation,
+		const struct AVec3f *vertices, const uint16_t *indices, int indices_count) {
+	occlusionAddTriangles(buffer, occlusion.rasterize_row, translation, vertices, indices, indices_count);
+}
+
+int occlusionBufferTestBox(OcclusionBuffer *buffer, const CullBox *box) {
+	++buffer->boxes_tested;
+
+	float minx = 0.f, maxx = 0.f, miny = 0.f, maxy = 0.f, max_iz = 0.f;
+	for (int i = 0; i < 8; ++i) {
+		const struct AVec3f corner = aVec3f(
+			(i & 1) ? box->max.x : box->min.x,
+			(i & 2) ? box->max.y : box->min.y,
+			(i & 4) ? box->max.z : box->min.z);
+		const OcclusionClipVertex clip = occlusionTransform(&buffer->view_projection, corner);
+
+		/* camera is inside or right next to the box */
+		if (clip.z + clip.w < 0.f || clip.w <= 0.f)
+			return 1;
+
+		const OcclusionScreenVertex s = occlusionProject(&clip);
+		minx = i ? floatMin(minx, s.x) : s.x;
+		maxx = i ? floatMax(maxx, s.x) : s.x;
+		miny = i ? floatMin(miny, s.y) : s.y;
+		maxy = i ? floatMax(maxy, s.y) : s.y;
+		max_iz = floatMax(max_iz, s.iz);
+	}
+
+	/* not on screen, that's for frustum culling to decide */
+	if (maxx < 0.f || maxy < 0.f || minx > OCCLUSION_WIDTH || miny > OCCLUSION_HEIGHT)
+		return 1;
+
+	const int x0 = (int)floatMax(minx, 0.f);
+	const int x1 = (int)floatMin(maxx, OCCLUSION_WIDTH - 1);
+	const int y0 = (int)floatMax(miny, 0.f);
+	const int y1 = (int)floatMin(maxy, OCCLUSION_HEIGHT - 1);
+	const float z = max_iz * (1.f + OCCLUSION_DEPTH_EPSILON);
+	for (int y = y0; y <= y1; ++y)
+		if (occlusionRowVisible(buffer->depth + y * OCCLUSION_WIDTH + x0, x1 - x0 + 1, z))
+			return 1;
+
+	++buffer->boxes_occluded;
+	return 0;
+}
+
+typedef struct {
+	const char *name;
+	struct AVec3f pos, at;
+	CullBox box;
+	int visible;
+} OcclusionTestCase;
+
+#define OCCLUSION_TEST_TRIANGLES 4096
+
+int occlusionSelfTest(void) {
+	static OcclusionBuffer buffer, reference;
+	struct Camera camera;
+	cameraProjection(&camera, 1.f, 20000.f, 3.1415926f / 2.f, (float)OCCLUSION_WIDTH / OCCLUSION_HEIGHT);
+
+	/* 600x600 wall at x = 500, facing -x */
+	const struct AVec3f wall[4] = {
+		{500.f, 300.f, -300.f}, {500.f, -300.f, -300.f}, {500.f, -300.f, 300.f}, {500.f, 300.f, 300.f},
+	};
+	const uint16_t wall_indices[6] = {0, 1, 2, 0, 2, 3};
+	const struct AVec3f origin = {0.f, 0.f, 0.f}, ahead = {1000.f, 0.f, 0.f};
+	const OcclusionTestCase cases[] = {
+		{"behind wall", origin, ahead, {{1000.f, -50.f, -50.f}, {1100.f, 50.f, 50.f}}, 0},
+		{"behind wall, up", origin, ahead, {{1000.f, -50.f, 300.f}, {1100.f, 50.f, 400.f}}, 0},
+		{"in front of wall", origin, ahead, {{200.f, -50.f, -50.f}, {300.f, 50.f, 50.f}}, 1},
+		{"behind wall edge", origin, ahead, {{1000.f, 500.f, -50.f}, {1100.f, 700.f, 50.f}}, 1},
+		{"around wall", origin, ahead, {{400.f, -400.f, -400.f}, {600.f, 400.f, 400.f}}, 1},
+		{"around camera", origin, ahead, {{-10.f, -10.f, -10.f}, {10.f, 10.f, 10.f}}, 1},
+		{"between wall back and camera", {2000.f, 0.f, 0.f}, origin, {{1000.f, -50.f, -50.f}, {1100.f, 50.f, 50.f}}, 1},
+		{"behind wall back", {2000.f, 0.f, 0.f}, origin, {{200.f, -50.f, -50.f}, {300.f, 50.f, 50.f}}, 1},
+		{"behind wall, from aside", {0.f, -400.f, 0.f}, {1000.f, 0.f, 0.f}, {{1000.f, 50.f, -50.f}, {1100.f, 150.f, 50.f}}, 0},
+		{"behind wall crossing near plane", {400.f, 0.f, 0.f}, {1000.f, 1000.f, 0.f}, {{600.f, 100.f, -50.f}, {700.f, 200.f, 50.f}}, 0},
+		{"wall in camera plane", {500.f, 0.f, 0.f}, {1000.f, 0.f, 0.f}, {{1000.f, -50.f, -50.f}, {1100.f, 50.f, 50.f}}, 1},
+	};
+
+	int failed = 0;
+	for (int i = 0; i < (int)COUNTOF(cases); ++i) {
+		const OcclusionTestCase *t = cases + i;
+		cameraLookAt(&camera, t->pos, t->at, aVec3f(0.f, 0.f, 1.f));
+		occlusionBufferBegin(&buffer, &camera.view_projection);
+		occlusionBufferAddTriangles(&buffer, aVec3ff(0.f), wall, wall_indices, COUNTOF(wall_indices));
+		const int visible = occlusionBufferTestBox(&buffer, &t->box);
+		PRINTF("Occlusion %-32s: %s%s", t->name, visible ? "visible" : "hidden", visible == t->visible ? "" : ", WRONG");
+		failed += visible != t->visible;
+	}
+
+	/* random triangles in front of camera, compare rasterizers and their speed */
+	static struct AVec3f vertices[OCCLUSION_TEST_TRIANGLES * 3];
+	static uint16_t indices[OCCLUSION_TEST_TRIANGLES * 3];
+	uint32_t seed = 0x9e3779b9u;
+	for (int i = 0; i < OCCLUSION_TEST_TRIANGLES * 3; ++i) {
+		float c[3];
+		for (int k = 0; k < 3; ++k) {
+			seed = seed * 1664525u + 1013904223u;
+			c[k] = (float)(seed >> 8) / (float)(1 << 24);
+		}
+		vertices[i] = aVec3f(100.f + c[0] * 2000.f, (c[1] - .5f) * 3000.f, (c[2] - .5f) * 1500.f);
+		indices[i] = (uint16_t)(i % 65536);
+	}
+	cameraLookAt(&camera, origin, ahead, aVec3f(0.f, 0.f, 1.f));
+
+	const OcclusionRowFunc funcs[2] = { occlusionRasterizeRowScalar, occlusion.rasterize_row };
+	OcclusionBuffer *const buffers[2] = { &reference, &buffer };
+	for (int variant = 0; variant < 2; ++variant) {
+		const int triangles = OCCLUSION_TEST_TRIANGLES / 4;
+		const ATimeUs start = aAppTime();
+		occlusionBufferBegin(buffers[variant], &camera.view_projection);
+		for (int i = 0; i < OCCLUSION_TEST_TRIANGLES; i += triangles)
+			occlusionAddTriangles(buffers[variant], funcs[variant], aVec3ff(0.f), vertices, indices + i * 3, triangles * 3);
+		const ATimeUs time = aAppTime() - start;
+		PRINTF("Occlusion %-6s rasterizer: %10.0f triangles/s", variant ? occlusion.name : "scalar",
+			time > 0 ? buffers[variant]->triangles * 1e6 / time : 0.);
+	}
+
+	/* fused multiply-add can be used for one and not for the other, so pixels on edges may differ */
+	int mismatched = 0;
+	for (int i = 0; i < OCCLUSION_WIDTH * OCCLUSION_HEIGHT; ++i)
+		mismatched += (buffer.depth[i] != reference.depth[i]);
+	PRINTF("Occlusion %s and scalar rasterizers differ in %d of %d pixels", occlusion.name, mismatched,
+		OCCLUSION_WIDTH * OCCLUSION_HEIGHT);
+	failed += mismatched > OCCLUSION_WIDTH * OCCLUSION_HEIGHT / 100;
+
+	PRINTF("Occlusion self test: %s", failed ? "FAILED" : "passed");
+	return !failed;
+}
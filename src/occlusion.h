@@ -0,0 +1,39 @@
+#pragma once
+#include "cull.h"
+#include <stdint.h>
+
+/* Software occlusion culling: a few large occluder triangles are rasterized on CPU into a small depth
+ * buffer, and then bounding boxes are tested against it. Unlike hardware queries, results are known
+ * in the same frame and need no GPU support.
+ *
+ * Like GPU rasterization, a pixel is covered by a triangle when its center is. Only triangles that are
+ * counter-clockwise on screen occlude, the same as GL draws them with back faces culled. */
+
+#define OCCLUSION_WIDTH 128
+#define OCCLUSION_HEIGHT 64
+
+typedef struct OcclusionBuffer {
+	struct AMat4f view_projection;
+	/* 1/w of the closest occluder, 0 where there is none; bottom row first */
+	float depth[OCCLUSION_WIDTH * OCCLUSION_HEIGHT];
+
+	/* since occlusionBufferBegin() */
+	int triangles;
+	int boxes_tested, boxes_occluded;
+} OcclusionBuffer;
+
+/* pick the fastest rasterizer this cpu supports */
+void occlusionInit(void);
+
+void occlusionBufferBegin(OcclusionBuffer *buffer, const struct AMat4f *view_projection);
+
+/* rasterize triangles of vertices + translation */
+void occlusionBufferAddTriangles(OcclusionBuffer *buffer, struct AVec3f translation,
+		const struct AVec3f *vertices, const uint16_t *indices, int indices_count);
+
+/* returns 0 if box is entirely hidden behind occluders, and 1 if any part of it can be seen */
+int occlusionBufferTestBox(OcclusionBuffer *buffer, const CullBox *box);
+
+/* check visibility of boxes around a synthetic wall from several camera poses, and that the optimized
+ * rasterizer matches the scalar one. Prints results, returns 1 if everything is as expected */
+int occlusionSelfTest(void);
@@ -1,11 +1,17 @@
 #pragma once
 #include "atto/math.h"
+#include <stddef.h>
 
 typedef enum {
 	RTexFormat_RGB565,
 #ifdef ATTO_PLATFORM_RPI
 	RTexFormat_Compressed_ETC1,
 #endif
+	/* S3TC, uploaded as is from VTF data; only usable if renderTextureFormatSupported() */
+	RTexFormat_Compressed_DXT1,
+	RTexFormat_Compressed_DXT1_A1,
+	RTexFormat_Compressed_DXT3,
+	RTexFormat_Compressed_DXT5,
 } RTexFormat;
 
 typedef enum {
@@ -28,6 +34,7 @@ typedef struct {
 	RTexFormat format;
 	int gl_name;
 	int type_flags;
+	int size; /* bytes of video memory taken by all uploaded images */
 } RTexture;
 
 typedef struct {
@@ -39,8 +46,21 @@ typedef struct {
 	RTexWrap wrap;
 } RTextureUploadParams;
 
-#define renderTextureInit(texture_ptr) do { (texture_ptr)->gl_name = -1; } while (0)
+#define renderTextureInit(texture_ptr) do { (texture_ptr)->gl_name = -1; (texture_ptr)->size = 0; } while (0)
+/* pixels can be NULL to only allocate storage, e.g. to fill it with renderTextureUploadRegion() later */
 void renderTextureUpload(RTexture *texture, RTextureUploadParams params);
+/* overwrite a rect of mip level 0 of uploaded 2D RGB565 texture; from any thread, applied in call order */
+void renderTextureUploadRegion(RTexture *texture, int x, int y, RTextureUploadParams params);
+/* main thread only; texture can be uploaded again after this */
+void renderTextureDestroy(RTexture *texture);
+/* can be called from any thread after renderInit() */
+int renderTextureFormatSupported(RTexFormat format);
+/* largest texture width and height, can be called from any thread after renderInit() */
+int renderMaxTextureSize(void);
+/* whether index buffers can be of uint32_t, otherwise only uint16_t; from any thread after renderInit() */
+int renderIndices32Supported(void);
+/* whether ROcclusion does anything, otherwise models are never occluded; from any thread after renderInit() */
+int renderOcclusionQueriesSupported(void);
 
 typedef struct {
 	int gl_name;
@@ -52,13 +72,35 @@ typedef enum {
 	RBufferType_Index
 } RBufferType;
 
-int renderInit();
+typedef enum {
+	RBackend_GL,
+	RBackend_Null, /* no GL calls at all, for headless runs */
+} RBackendType;
+
+int renderInit(RBackendType backend);
 void renderResize(int w, int h);
 
 void renderBufferCreate(RBuffer *buffer, RBufferType type, int size, const void *data);
 
+/* Hardware occlusion query of a model's bounds, kept by caller across frames. Bounds are tested after
+ * everything else is drawn, and the result is only read once GPU has it, a frame or more later,
+ * so that CPU never waits for it */
+typedef struct {
+	int gl_name;
+	/* query is issued, but result is not read yet */
+	int pending;
+	/* result of the last finished query */
+	int occluded;
+} ROcclusion;
+
+#define renderOcclusionInit(occlusion_ptr) \
+	do { (occlusion_ptr)->gl_name = -1; (occlusion_ptr)->pending = (occlusion_ptr)->occluded = 0; } while (0)
+
 struct BSPModel;
+struct AABB;
 struct Camera;
+struct CullFrustum;
+struct OcclusionBuffer;
 
 void renderBegin();
 
@@ -66,8 +108,40 @@ typedef struct {
 	const struct Camera *camera;
 	struct AVec3f translation;
 	int selected;
+	/* draws outside of it are skipped; NULL if the whole model is known to be in view */
+	const struct CullFrustum *frustum;
+	/* whole model is out of view: nothing is drawn, but it still counts for texture streaming and sky */
+	int culled;
+	/* model is not drawn while its bounds are hidden behind other models; NULL to always draw */
+	ROcclusion *occlusion;
+	/* draws hidden behind occluders rasterized into it are skipped; NULL to not test them */
+	struct OcclusionBuffer *occluders;
 } RDrawParams;
 
 void renderModelDraw(const RDrawParams *params, const struct BSPModel *model);
 
 void renderEnd(const struct Camera *camera);
+
+typedef struct {
+	int programs, textures, lightmaps;
+	/* vertex attributes set up for another model or vertex range */
+	int buffers;
+	/* model transforms and lightmap regions */
+	int uniforms;
+} RStateChanges;
+
+typedef struct {
+	size_t textures_count;
+	size_t textures_size;
+	size_t buffers_count;
+	size_t buffers_size;
+	/* of the last frame, i.e. since renderBegin() */
+	int models_occluded, draws_occluded;
+	int occlusion_queries;
+	/* of the last frame: draw calls, and state changes they needed as submitted, sorted by state across all models.
+	 * state_changes_unsorted is what the same draws would have needed if submitted model by model as they came */
+	int draw_calls;
+	RStateChanges state_changes, state_changes_unsorted;
+} RStats;
+
+const RStats *renderGetStats(void);
@@ -0,0 +1,34 @@
+#pragma once
+#include "render.h"
+
+/* Backend-specific part of the renderer. Frontend (render.c) keeps statistics and makes sure that
+ * all backend calls are made from the main thread. */
+typedef struct RBackend {
+	const char *name;
+	int (*init)(void);
+	/* only called after init */
+	int (*texture_format_supported)(RTexFormat format);
+	/* largest width and height of a 2d texture */
+	int (*max_texture_size)(void);
+	/* whether index buffers can hold 32-bit indices */
+	int (*indices32_supported)(void);
+	/* the rest of occlusion functions are only called if this returns 1 */
+	int (*occlusion_queries_supported)(void);
+	void (*texture_upload)(RTexture *texture, const RTextureUploadParams *params, int image_size);
+	/* params->pixels cover width x height rect at x, y of mip level 0 */
+	void (*texture_upload_region)(RTexture *texture, int x, int y, const RTextureUploadParams *params);
+	void (*texture_destroy)(RTexture *texture);
+	void (*buffer_create)(RBuffer *buffer, RBufferType type, int size, const void *data);
+	void (*resize)(int w, int h);
+	void (*begin)(void);
+	void (*model_draw)(const RDrawParams *params, const struct BSPModel *model);
+	/* updates occlusion->occluded and ->pending if result of the pending query is available, without waiting for it */
+	void (*occlusion_read)(ROcclusion *occlusion);
+	/* issue queries of boxes against everything drawn so far; called right before end */
+	void (*occlusion_query)(const struct Camera *camera, ROcclusion *const *occlusions, const struct AABB *boxes, int count);
+	/* fills draw calls and state changes of stats */
+	void (*end)(const struct Camera *camera, RStats *stats);
+} RBackend;
+
+extern const RBackend render_backend_gl;
+extern const RBackend render_backend_null;
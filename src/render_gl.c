@@ -0,0 +1,1263 @@
+#include "render_backend.h"
+#include "texture.h"
+#include "bsp.h"
+#include "lightmap.h"
+#include "common.h"
+#include "profiler.h"
+#include "camera.h"
+#include "cull.h"
+#include "occlusion.h"
+
+#include "atto/app.h"
+#include "atto/platform.h"
+
+#ifdef ATTO_PLATFORM_X11
+#define GL_GLEXT_PROTOTYPES 1
+#include <GL/glx.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+#define ATTO_GL_DESKTOP
+#endif /* ifdef ATTO_PLATFORM_X11 */
+
+#ifdef ATTO_PLATFORM_RPI
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+#define ATTO_GL_ES
+#endif /* ifdef ATTO_PLATFORM_RPI */
+
+#ifdef ATTO_PLATFORM_WINDOWS
+#include "libc.h"
+#include <GL/gl.h>
+#include <glext.h>
+#define ATTO_GL_DESKTOP
+#endif /* ifdef ATTO_PLATFORM_WINDOWS */
+
+#ifdef ATTO_PLATFORM_OSX
+#include <OpenGL/gl3.h>
+#define ATTO_GL_DESKTOP
+#endif
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT 0x83F1
+#define GL_COMPRESSED_RGBA_S3TC_DXT3_EXT 0x83F2
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+/* occlusion queries are core since GL 1.5; GLES2 only has them as an extension that Raspberry Pi lacks */
+#ifdef ATTO_GL_DESKTOP
+#ifdef GL_ANY_SAMPLES_PASSED
+#define RENDER_GL_OCCLUSION_TARGET GL_ANY_SAMPLES_PASSED
+#else
+#define RENDER_GL_OCCLUSION_TARGET GL_SAMPLES_PASSED
+#endif
+#endif
+
+#define RENDER_ERRORCHECK
+//#define RENDER_GL_TRACE
+
+//#define RENDER_GL_PROFILE_FUNC profileEvent
+
+#ifndef RENDER_ASSERT
+#define RENDER_ASSERT(cond) \
+	if (!(cond)) { \
+		aAppDebugPrintf("ERROR @ %s:%d: (%s) failed", __FILE__, __LINE__, #cond); \
+		aAppTerminate(-1); \
+	}
+#endif /* ifndef RENDER_ASSERT */
+
+#ifdef RENDER_GL_PROFILE_FUNC
+#define RENDER_GL_PROFILE_PREAMBLE const ATimeUs profile_time_start__ = aAppTime();
+#define RENDER_GL_PROFILE_START const ATimeUs agl_profile_start_ = aAppTime();
+#define RENDER_GL_PROFILE_END RENDER_GL_PROFILE_FUNC(__FUNCTION__, aAppTime() - agl_profile_start_);
+#define RENDER_GL_PROFILE_END_NAME(name) RENDER_GL_PROFILE_FUNC(name, aAppTime() - agl_profile_start_);
+#else
+#define RENDER_GL_PROFILE_PREAMBLE
+#define RENDER_GL_PROFILE_FUNC(...)
+#endif
+
+//#define RENDER_GL_DEBUG
+#ifdef RENDER_GL_DEBUG
+static void a__GlPrintError(const char *message, int error) {
+	const char *errstr = "UNKNOWN";
+	switch (error) {
+		case GL_INVALID_ENUM: errstr = "GL_INVALID_ENUM"; break;
+		case GL_INVALID_VALUE: errstr = "GL_INVALID_VALUE"; break;
+		case GL_INVALID_OPERATION: errstr = "GL_INVALID_OPERATION"; break;
+#ifdef GL_STACK_OVERFLOW
+		case GL_STACK_OVERFLOW: errstr = "GL_STACK_OVERFLOW"; break;
+#endif
+#ifdef GL_STACK_UNDERFLOW
+		case GL_STACK_UNDERFLOW: errstr = "GL_STACK_UNDERFLOW"; break;
+#endif
+		case GL_OUT_OF_MEMORY: errstr = "GL_OUT_OF_MEMORY"; break;
+#ifdef GL_TABLE_TOO_LARGE
+		case GL_TABLE_TOO_LARGE: errstr = "GL_TABLE_TOO_LARGE"; break;
+#endif
+	};
+	PRINTF("%s %s (%#x)", message, errstr, error);
+}
+#define RENDER_GL_GETERROR(f) \
+		const int glerror = glGetError(); \
+		if (glerror != GL_NO_ERROR) { \
+			a__GlPrintError(__FILE__ ":" RENDER__GL_STR(__LINE__) ": " #f " returned ", glerror); \
+			RENDER_ASSERT(!"GL error"); \
+		}
+#else
+#define RENDER_GL_GETERROR(f)
+#endif
+#define RENDER__GL_STR__(s) #s
+#define RENDER__GL_STR(s) RENDER__GL_STR__(s)
+#ifdef RENDER_GL_TRACE
+#define RENDER_GL_TRACE_PRINT PRINTF
+#else
+#define RENDER_GL_TRACE_PRINT(...)
+#endif
+#define GL_CALL(f) do{\
+		RENDER_GL_TRACE_PRINT("%s", #f); \
+		RENDER_GL_PROFILE_PREAMBLE \
+		f; \
+		RENDER_GL_PROFILE_FUNC(#f, aAppTime() - profile_time_start__); \
+		RENDER_GL_GETERROR(f) \
+	} while(0)
+
+#ifdef _WIN32
+#define WGL__FUNCLIST \
+	WGL__FUNCLIST_DO(PFNGLBLENDCOLORPROC, BlendColor) \
+	WGL__FUNCLIST_DO(PFNGLBLENDEQUATIONPROC, BlendEquation) \
+	WGL__FUNCLIST_DO(PFNGLGENBUFFERSPROC, GenBuffers) \
+	WGL__FUNCLIST_DO(PFNGLBINDBUFFERPROC, BindBuffer) \
+	WGL__FUNCLIST_DO(PFNGLBUFFERDATAPROC, BufferData) \
+	WGL__FUNCLIST_DO(PFNGLGETATTRIBLOCATIONPROC, GetAttribLocation) \
+	WGL__FUNCLIST_DO(PFNGLACTIVETEXTUREPROC, ActiveTexture) \
+	WGL__FUNCLIST_DO(PFNGLCREATESHADERPROC, CreateShader) \
+	WGL__FUNCLIST_DO(PFNGLSHADERSOURCEPROC, ShaderSource) \
+	WGL__FUNCLIST_DO(PFNGLCOMPILESHADERPROC, CompileShader) \
+	WGL__FUNCLIST_DO(PFNGLATTACHSHADERPROC, AttachShader) \
+	WGL__FUNCLIST_DO(PFNGLDELETESHADERPROC, DeleteShader) \
+	WGL__FUNCLIST_DO(PFNGLGETSHADERIVPROC, GetShaderiv) \
+	WGL__FUNCLIST_DO(PFNGLGETSHADERINFOLOGPROC, GetShaderInfoLog) \
+	WGL__FUNCLIST_DO(PFNGLCREATEPROGRAMPROC, CreateProgram) \
+	WGL__FUNCLIST_DO(PFNGLLINKPROGRAMPROC, LinkProgram) \
+	WGL__FUNCLIST_DO(PFNGLGETPROGRAMINFOLOGPROC, GetProgramInfoLog) \
+	WGL__FUNCLIST_DO(PFNGLDELETEPROGRAMPROC, DeleteProgram) \
+	WGL__FUNCLIST_DO(PFNGLGETPROGRAMIVPROC, GetProgramiv) \
+	WGL__FUNCLIST_DO(PFNGLUSEPROGRAMPROC, UseProgram) \
+	WGL__FUNCLIST_DO(PFNGLGETUNIFORMLOCATIONPROC, GetUniformLocation) \
+	WGL__FUNCLIST_DO(PFNGLUNIFORM1FPROC, Uniform1f) \
+	WGL__FUNCLIST_DO(PFNGLUNIFORM2FPROC, Uniform2f) \
+	WGL__FUNCLIST_DO(PFNGLUNIFORM4FVPROC, Uniform4fv) \
+	WGL__FUNCLIST_DO(PFNGLUNIFORM1IPROC, Uniform1i) \
+	WGL__FUNCLIST_DO(PFNGLUNIFORMMATRIX4FVPROC, UniformMatrix4fv) \
+	WGL__FUNCLIST_DO(PFNGLENABLEVERTEXATTRIBARRAYPROC, EnableVertexAttribArray) \
+	WGL__FUNCLIST_DO(PFNGLDISABLEVERTEXATTRIBARRAYPROC, DisableVertexAttribArray) \
+	WGL__FUNCLIST_DO(PFNGLVERTEXATTRIBPOINTERPROC, VertexAttribPointer) \
+	WGL__FUNCLIST_DO(PFNGLGENERATEMIPMAPPROC, GenerateMipmap) \
+	WGL__FUNCLIST_DO(PFNGLCOMPRESSEDTEXIMAGE2DPROC, CompressedTexImage2D) \
+	WGL__FUNCLIST_DO(PFNGLGENQUERIESPROC, GenQueries) \
+	WGL__FUNCLIST_DO(PFNGLBEGINQUERYPROC, BeginQuery) \
+	WGL__FUNCLIST_DO(PFNGLENDQUERYPROC, EndQuery) \
+	WGL__FUNCLIST_DO(PFNGLGETQUERYOBJECTUIVPROC, GetQueryObjectuiv) \
+
+#define WGL__FUNCLIST_DO(T,N) T gl##N = 0;
+WGL__FUNCLIST
+#undef WGL__FUNCLIST_DO
+#endif /* ifdef _WIN32 */
+
+static GLint render_ShaderCreate(GLenum type, const char *sources[]) {
+	int n;
+	GLuint shader = glCreateShader(type);
+
+	for (n = 0; sources[n]; ++n);
+
+	GL_CALL(glShaderSource(shader, n, (const GLchar **)sources, 0));
+	GL_CALL(glCompileShader(shader));
+
+#ifdef RENDER_ERRORCHECK
+	{
+		GLint status;
+		GL_CALL(glGetShaderiv(shader, GL_COMPILE_STATUS, &status));
+		if (status != GL_TRUE) {
+			char buffer[1024];
+			GL_CALL(glGetShaderInfoLog(shader, sizeof(buffer), 0, buffer));
+			PRINTF("Shader compilation error: %s", buffer);
+			GL_CALL(glDeleteShader(shader));
+			shader = 0;
+		}
+	}
+#endif
+
+	return shader;
+}
+
+static void renderGlTextureUpload(RTexture *texture, const RTextureUploadParams *upload, int image_size) {
+	const RTextureUploadParams params = *upload;
+	GLenum internal, format, type;
+
+	if (texture->gl_name == -1) {
+		GL_CALL(glGenTextures(1, (GLuint*)&texture->gl_name));
+		texture->type_flags = 0;
+	}
+
+	const GLenum binding = (params.type == RTexType_2D) ? GL_TEXTURE_2D : GL_TEXTURE_CUBE_MAP;
+	const GLint wrap = (params.type == RTexType_2D && params.wrap == RTexWrap_Repeat)
+		? GL_REPEAT : GL_CLAMP_TO_EDGE;
+
+	GL_CALL(glBindTexture(binding, texture->gl_name));
+
+	GLenum upload_binding = binding;
+	switch (params.type) {
+		case RTexType_2D: upload_binding = GL_TEXTURE_2D; break;
+		case RTexType_CubePX: upload_binding = GL_TEXTURE_CUBE_MAP_POSITIVE_X; break;
+		case RTexType_CubeNX: upload_binding = GL_TEXTURE_CUBE_MAP_NEGATIVE_X; break;
+		case RTexType_CubePY: upload_binding = GL_TEXTURE_CUBE_MAP_POSITIVE_Y; break;
+		case RTexType_CubeNY: upload_binding = GL_TEXTURE_CUBE_MAP_NEGATIVE_Y; break;
+		case RTexType_CubePZ: upload_binding = GL_TEXTURE_CUBE_MAP_POSITIVE_Z; break;
+		case RTexType_CubeNZ: upload_binding = GL_TEXTURE_CUBE_MAP_NEGATIVE_Z; break;
+	}
+
+	int compressed = 0;
+	switch (params.format) {
+		case RTexFormat_RGB565:
+			internal = format = GL_RGB; type = GL_UNSIGNED_SHORT_5_6_5;
+			break;
+#ifdef ATTO_PLATFORM_RPI
+		case RTexFormat_Compressed_ETC1:
+			internal = GL_ETC1_RGB8_OES;
+			compressed = 1;
+			break;
+#endif
+		case RTexFormat_Compressed_DXT1:
+			internal = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+			compressed = 1;
+			break;
+		case RTexFormat_Compressed_DXT1_A1:
+			internal = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+			compressed = 1;
+			break;
+		case RTexFormat_Compressed_DXT3:
+			internal = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;
+			compressed = 1;
+			break;
+		case RTexFormat_Compressed_DXT5:
+			internal = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+			compressed = 1;
+			break;
+		default:
+			ATTO_ASSERT(!"Impossible texture format");
+			return;
+	}
+
+	if (!compressed) {
+		GL_CALL(glTexImage2D(upload_binding, params.mip_level < 0 ? 0 : params.mip_level, internal, params.width, params.height, 0,
+				format, type, params.pixels));
+	} else {
+		GL_CALL(glCompressedTexImage2D(upload_binding, params.mip_level < 0 ? 0 : params.mip_level, internal, params.width, params.height,
+					0, image_size, params.pixels));
+	}
+
+	if (params.mip_level == -1)
+		GL_CALL(glGenerateMipmap(binding));
+
+	GL_CALL(glTexParameteri(binding, GL_TEXTURE_MIN_FILTER, params.mip_level >= -1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR));
+	GL_CALL(glTexParameteri(binding, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+
+	GL_CALL(glTexParameteri(binding, GL_TEXTURE_WRAP_S, wrap));
+	GL_CALL(glTexParameteri(binding, GL_TEXTURE_WRAP_T, wrap));
+
+	if (params.mip_level < 1) {
+		texture->width = params.width;
+		texture->height = params.height;
+	}
+
+	texture->format = params.format;
+	texture->type_flags |= params.type;
+}
+
+static void renderGlTextureUploadRegion(RTexture *texture, int x, int y, const RTextureUploadParams *params) {
+	GL_CALL(glBindTexture(GL_TEXTURE_2D, texture->gl_name));
+	GL_CALL(glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, params->width, params->height,
+				GL_RGB, GL_UNSIGNED_SHORT_5_6_5, params->pixels));
+}
+
+static void renderGlBufferCreate(RBuffer *buffer, RBufferType type, int size, const void *data) {
+	switch (type) {
+	case RBufferType_Vertex: buffer->type = GL_ARRAY_BUFFER; break;
+	case RBufferType_Index: buffer->type = GL_ELEMENT_ARRAY_BUFFER; break;
+	default: ASSERT(!"Invalid buffer type");
+	}
+	GL_CALL(glGenBuffers(1, (GLuint*)&buffer->gl_name));
+
+	GL_CALL(glBindBuffer(buffer->type, (GLuint)buffer->gl_name));
+	GL_CALL(glBufferData(buffer->type, size, data, GL_STATIC_DRAW));
+}
+
+typedef struct {
+	const char *name;
+	int components;
+	GLenum type;
+	GLboolean normalize;
+	int stride;
+	const void *ptr;
+} RAttrib;
+
+typedef struct {
+	const char *name;
+} RUniform;
+
+#define RENDER_LIST_ATTRIBS \
+	RENDER_DECLARE_ATTRIB(vertex, 3, GL_FLOAT, GL_FALSE) \
+	RENDER_DECLARE_ATTRIB(lightmap_uv, 2, GL_FLOAT, GL_FALSE) \
+	RENDER_DECLARE_ATTRIB(tex_uv, 2, GL_FLOAT, GL_FALSE) \
+	RENDER_DECLARE_ATTRIB(average_color, 3, GL_UNSIGNED_BYTE, GL_TRUE) \
+
+//	RENDER_DECLARE_ATTRIB(normal, 3, GL_FLOAT)
+
+/* same attributes in the same order for struct BSPModelPackedVertex; normalized ones need no shader changes,
+ * the rest of dequantization is folded into mvp and u_tex0_size */
+#define RENDER_LIST_PACKED_ATTRIBS \
+	RENDER_DECLARE_ATTRIB(vertex, 3, GL_SHORT, GL_TRUE) \
+	RENDER_DECLARE_ATTRIB(lightmap_uv, 2, GL_UNSIGNED_SHORT, GL_TRUE) \
+	RENDER_DECLARE_ATTRIB(tex_uv, 2, GL_SHORT, GL_FALSE) \
+	RENDER_DECLARE_ATTRIB(average_color, 3, GL_UNSIGNED_BYTE, GL_TRUE) \
+
+static const RAttrib g_attribs[] = {
+#define RENDER_DECLARE_ATTRIB(n,c,t,N) \
+	{"a_" # n, c, t, N, sizeof(struct BSPModelVertex), (void*)offsetof(struct BSPModelVertex, n)},
+RENDER_LIST_ATTRIBS
+#undef RENDER_DECLARE_ATTRIB
+};
+
+static const RAttrib g_packed_attribs[] = {
+#define RENDER_DECLARE_ATTRIB(n,c,t,N) \
+	{"a_" # n, c, t, N, sizeof(struct BSPModelPackedVertex), (void*)offsetof(struct BSPModelPackedVertex, n)},
+RENDER_LIST_PACKED_ATTRIBS
+#undef RENDER_DECLARE_ATTRIB
+};
+
+enum RAttribKinds {
+#define RENDER_DECLARE_ATTRIB(n,c,t,N) \
+	RAttribKind_ ## n,
+RENDER_LIST_ATTRIBS
+#undef RENDER_DECLARE_ATTRIB
+	RAttribKind_COUNT
+};
+
+#define RENDER_LIST_UNIFORMS \
+	RENDER_DECLARE_UNIFORM(mvp) \
+	RENDER_DECLARE_UNIFORM(far) \
+	RENDER_DECLARE_UNIFORM(lightmap) \
+	RENDER_DECLARE_UNIFORM(lightmap_transform) \
+	RENDER_DECLARE_UNIFORM(tex0) \
+	RENDER_DECLARE_UNIFORM(tex0_size) \
+	RENDER_DECLARE_UNIFORM(tex0_scale) \
+	RENDER_DECLARE_UNIFORM(tex0_translate) \
+
+static const RUniform uniforms[] = {
+#define RENDER_DECLARE_UNIFORM(n) {"u_" # n},
+	RENDER_LIST_UNIFORMS
+#undef RENDER_DECLARE_UNIFORM
+};
+
+enum RUniformKinds {
+#define RENDER_DECLARE_UNIFORM(n) RUniformKind_ ## n,
+	RENDER_LIST_UNIFORMS
+#undef RENDER_DECLARE_UNIFORM
+	RUniformKind_COUNT
+};
+
+typedef struct RProgram {
+	GLint name;
+	struct {
+		const char *common, *vertex, *fragment;
+	} shader_sources;
+	int attrib_locations[RAttribKind_COUNT];
+	int uniform_locations[RUniformKind_COUNT];
+} RProgram;
+
+static RProgram programs[MShader_COUNT] = {
+	/* MShader_Unknown */
+	{-1, {
+			/* common */
+			"varying vec3 v_pos;\n",
+			/* vertex */
+			"attribute vec3 a_vertex;\n"
+			"uniform mat4 u_mvp;\n"
+			"void main() {\n"
+				"v_pos = a_vertex;\n"
+				"gl_Position = u_mvp * vec4(a_vertex, 1.);\n"
+			"}\n",
+			/* fragment */
+			"void main() {\n"
+				"gl_FragColor = vec4(mod(v_pos,100.)/100., 1.);\n"
+			"}\n",
+			},
+		{ -1 }, { -1 }
+	},
+	/* MShader_LightmappedOnly */
+	{-1, {
+			/*common*/
+			"varying vec2 v_lightmap_uv;\n"
+			"varying vec3 v_color;\n",
+			/*vertex*/
+			"attribute vec3 a_vertex, a_average_color;\n"
+			"attribute vec2 a_lightmap_uv;\n"
+			"uniform mat4 u_mvp;\n"
+			"uniform vec4 u_lightmap_transform;\n"
+			"void main() {\n"
+				"v_lightmap_uv = a_lightmap_uv * u_lightmap_transform.xy + u_lightmap_transform.zw;\n"
+				"v_color = a_average_color;\n"
+				"gl_Position = u_mvp * vec4(a_vertex, 1.);\n"
+			"}\n",
+			/*fragment*/
+			"uniform sampler2D u_lightmap;\n"
+			"void main() {\n"
+				"gl_FragColor = vec4(v_color * texture2D(u_lightmap, v_lightmap_uv).xyz, 1.);\n"
+			"}\n"
+			},
+		{ -1 }, { -1 }
+	},
+	/* MShader_LightmappedGeneric */
+	{-1, {
+			/*common*/
+			"varying vec2 v_lightmap_uv, v_tex_uv;\n",
+			/*vertex*/
+			"attribute vec3 a_vertex;\n"
+			"attribute vec2 a_lightmap_uv, a_tex_uv;\n"
+			"uniform mat4 u_mvp;\n"
+			"uniform vec4 u_lightmap_transform;\n"
+			"void main() {\n"
+				"v_lightmap_uv = a_lightmap_uv * u_lightmap_transform.xy + u_lightmap_transform.zw;\n"
+				"v_tex_uv = a_tex_uv;\n"
+				"gl_Position = u_mvp * vec4(a_vertex, 1.);\n"
+			"}\n",
+			/*fragment*/
+			"uniform sampler2D u_lightmap, u_tex0;\n"
+			"uniform vec2 u_lightmap_size, u_tex0_size;\n"
+			"void main() {\n"
+				"vec4 albedo = texture2D(u_tex0, v_tex_uv/u_tex0_size);\n"
+				"vec3 lm = texture2D(u_lightmap, v_lightmap_uv).xyz;\n"
+				"vec3 color = albedo.xyz * lm;\n"
+				"gl_FragColor = vec4(color, 1.);\n"
+			"}\n"
+			},
+		{ -1 }, { -1 }
+	},
+	/* MShader_UnlitGeneric */
+	{-1, { /* common */
+		"varying vec2 v_uv;\n",
+		/* vertex */
+		"attribute vec3 a_vertex;\n"
+		"attribute vec2 a_tex_uv;\n"
+		"uniform mat4 u_mvp;\n"
+		"uniform float u_far;\n"
+		"uniform vec2 u_tex0_scale, u_tex0_translate;\n"
+		"void main() {\n"
+			"v_uv = a_tex_uv * u_tex0_scale + u_tex0_translate;\n"
+			"gl_Position = u_mvp * vec4(u_far * .5 * a_vertex, 1.);\n"
+		"}\n",
+		/* fragment */
+		"uniform sampler2D u_tex0;\n"
+		"uniform vec2 u_tex0_size;\n"
+		"void main() {\n"
+			"gl_FragColor = texture2D(u_tex0, v_uv + vec2(.5) / u_tex0_size);\n"
+			//"gl_FragColor = texture2D(u_tex0, v_uv);\n"
+		"}\n",
+		}, {-1}, {-1}},
+};
+
+static struct BSPModelVertex box[] = {
+	{{ 1.f, -1.f, -1.f}, {0.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
+	{{ 1.f,  1.f, -1.f}, {0.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
+	{{ 1.f,  1.f,  1.f}, {0.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
+	{{ 1.f,  1.f,  1.f}, {0.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
+	{{ 1.f, -1.f,  1.f}, {0.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
+	{{ 1.f, -1.f, -1.f}, {0.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
+
+	{{-1.f, -1.f,  1.f}, {1.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
+	{{-1.f,  1.f,  1.f}, {1.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
+	{{-1.f,  1.f, -1.f}, {1.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
+	{{-1.f,  1.f, -1.f}, {1.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
+	{{-1.f, -1.f, -1.f}, {1.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
+	{{-1.f, -1.f,  1.f}, {1.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
+
+	{{ 1.f, -1.f, -1.f}, {2.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
+	{{ 1.f, -1.f,  1.f}, {2.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
+	{{-1.f, -1.f,  1.f}, {2.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
+	{{-1.f, -1.f,  1.f}, {2.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
+	{{-1.f, -1.f, -1.f}, {2.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
+	{{ 1.f, -1.f, -1.f}, {2.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
+
+	{{ 1.f,  1.f,  1.f}, {3.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
+	{{ 1.f,  1.f, -1.f}, {3.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
+	{{-1.f,  1.f, -1.f}, {3.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
+	{{-1.f,  1.f, -1.f}, {3.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
+	{{-1.f,  1.f,  1.f}, {3.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
+	{{ 1.f,  1.f,  1.f}, {3.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
+
+	{{ 1.f, -1.f,  1.f}, {4.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
+	{{ 1.f,  1.f,  1.f}, {4.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
+	{{-1.f,  1.f,  1.f}, {4.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
+	{{-1.f,  1.f,  1.f}, {4.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
+	{{-1.f, -1.f,  1.f}, {4.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
+	{{ 1.f, -1.f,  1.f}, {4.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
+
+	{{-1.f, -1.f, -1.f}, {5.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
+	{{-1.f,  1.f, -1.f}, {5.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
+	{{ 1.f,  1.f, -1.f}, {5.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
+	{{ 1.f,  1.f, -1.f}, {5.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
+	{{ 1.f, -1.f, -1.f}, {5.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
+	{{-1.f, -1.f, -1.f}, {5.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
+};
+
+static RBuffer box_buffer;
+
+/* Draws of all models are queued during the frame and submitted at its end sorted by the state they need,
+ * so that programs, textures and lightmap pages are switched once per frame instead of once per model.
+ * The queue is also submitted early when it runs out of space, and before occlusion queries */
+#define RENDER_GL_QUEUE_MAX_MODELS 1024
+#define RENDER_GL_QUEUE_MAX_PACKETS 8192
+
+/* sort key, most significant first: blending (selected map is drawn last), program, texture, lightmap page,
+ * model and its vertex range, then distance, so that closer draws with the same state are drawn first */
+#define RENDER_GL_KEY_BLEND_SHIFT 63
+#define RENDER_GL_KEY_PROGRAM_SHIFT 60
+#define RENDER_GL_KEY_TEXTURE_SHIFT 44
+#define RENDER_GL_KEY_LIGHTMAP_SHIFT 36
+#define RENDER_GL_KEY_MODEL_SHIFT 24
+#define RENDER_GL_KEY_VBO_SHIFT 16
+
+typedef struct {
+	const struct BSPModel *model;
+	struct AMat4f mvp;
+	const RAttrib *attribs;
+	GLenum index_type;
+	float tex_uv_units;
+	int selected;
+} RGlQueueModel;
+
+typedef struct {
+	const Material *material;
+	const LightmapRegion *lightmap;
+	unsigned int vbo_offset;
+	/* range of model indices */
+	unsigned int start, count;
+	int model;
+} RGlPacket;
+
+static struct {
+	struct {
+		int s3tc;
+		int max_texture_size;
+		int indices32;
+		int occlusion_queries;
+	} caps;
+
+	const RTexture *current_tex0;
+	/* shared lightmap pages stay bound across models */
+	const RTexture *current_lightmap;
+
+	const RProgram *current_program;
+	struct {
+		const float *mvp;
+		float far;
+		/* scale.xy, offset.xy from region to page uv */
+		float lightmap_transform[4];
+		/* texture uv fixed point scale of current model */
+		float tex_uv_units;
+	} uniforms;
+
+	struct {
+		float distance;
+		const struct BSPModel *model;
+	} closest_map;
+
+	struct {
+		RGlQueueModel models[RENDER_GL_QUEUE_MAX_MODELS];
+		int models_count;
+		RGlPacket packets[RENDER_GL_QUEUE_MAX_PACKETS];
+		int packets_count;
+		/* keys[0] and order[0] are in the order packets were queued; the other half is for sorting */
+		uint64_t keys[2][RENDER_GL_QUEUE_MAX_PACKETS];
+		uint32_t order[2][RENDER_GL_QUEUE_MAX_PACKETS];
+
+		/* since renderGlBegin() */
+		int draw_calls;
+		RStateChanges changes, changes_unsorted;
+	} queue;
+} r;
+
+static void renderApplyAttribs(const RAttrib *attribs, const RBuffer *buffer, unsigned int vbo_offset) {
+	for(int i = 0; i < RAttribKind_COUNT; ++i) {
+		const RAttrib *a = attribs + i;
+		const int loc = r.current_program->attrib_locations[i];
+		if (loc < 0) continue;
+		GL_CALL(glEnableVertexAttribArray(loc));
+		GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, buffer->gl_name));
+		GL_CALL(glVertexAttribPointer(loc, a->components, a->type, a->normalize, a->stride, (const char*)a->ptr + vbo_offset * a->stride));
+	}
+}
+
+static int render_ProgramUse(RProgram *prog) {
+	if (r.current_program == prog)
+		return 0;
+
+	if (r.current_program) {
+		for (int i = 0; i < RAttribKind_COUNT; ++i) {
+			const int loc = r.current_program->attrib_locations[i];
+			if (loc >= 0)
+				GL_CALL(glDisableVertexAttribArray(loc));
+		}
+	}
+
+	GL_CALL(glUseProgram(prog->name));
+	GL_CALL(glUniform1i(prog->uniform_locations[RUniformKind_lightmap], 0));
+	GL_CALL(glUniform1i(prog->uniform_locations[RUniformKind_tex0], 1));
+
+	GL_CALL(glUniformMatrix4fv(prog->uniform_locations[RUniformKind_mvp], 1, GL_FALSE, r.uniforms.mvp));
+	GL_CALL(glUniform1f(prog->uniform_locations[RUniformKind_far], r.uniforms.far));
+	GL_CALL(glUniform4fv(prog->uniform_locations[RUniformKind_lightmap_transform], 1, r.uniforms.lightmap_transform));
+
+	r.current_program = prog;
+	r.current_tex0 = NULL;
+
+	return 1;
+}
+
+static int render_ProgramInit(RProgram *prog) {
+	GLuint program;
+	GLuint vertex_shader, fragment_shader;
+	const char *sources[] = {
+		prog->shader_sources.common, prog->shader_sources.fragment, 0
+	};
+	fragment_shader = render_ShaderCreate(GL_FRAGMENT_SHADER, sources);
+	if (fragment_shader == 0)
+		return -1;
+
+	sources[1] = prog->shader_sources.vertex;
+	vertex_shader = render_ShaderCreate(GL_VERTEX_SHADER, sources);
+	if (vertex_shader == 0) {
+		GL_CALL(glDeleteShader(fragment_shader));
+		return -2;
+	}
+
+	program = glCreateProgram();
+	GL_CALL(glAttachShader(program, fragment_shader));
+	GL_CALL(glAttachShader(program, vertex_shader));
+	GL_CALL(glLinkProgram(program));
+
+	GL_CALL(glDeleteShader(fragment_shader));
+	GL_CALL(glDeleteShader(vertex_shader));
+
+#ifdef RENDER_ERRORCHECK
+	{
+		GLint status;
+		GL_CALL(glGetProgramiv(program, GL_LINK_STATUS, &status));
+		if (status != GL_TRUE) {
+			char buffer[1024];
+			GL_CALL(glGetProgramInfoLog(program, sizeof(buffer), 0, buffer));
+			PRINTF("Program linking error: %s", buffer);
+			GL_CALL(glDeleteProgram(program));
+			return -3;
+		}
+	}
+#endif
+
+	prog->name = program;
+
+	for(int i = 0; i < RAttribKind_COUNT; ++i) {
+		prog->attrib_locations[i] = glGetAttribLocation(prog->name, g_attribs[i].name);
+		if (prog->attrib_locations[i] < 0)
+			PRINTF("Cannot locate attribute %s", g_attribs[i].name);
+	}
+
+	for(int i = 0; i < RUniformKind_COUNT; ++i) {
+		prog->uniform_locations[i] = glGetUniformLocation(prog->name, uniforms[i].name);
+		if (prog->uniform_locations[i] < 0)
+			PRINTF("Cannot locate uniform %s", uniforms[i].name);
+	}
+
+	return 0;
+}
+
+static void renderGlTextureDestroy(RTexture *texture) {
+	if (r.current_tex0 == texture)
+		r.current_tex0 = NULL;
+	if (r.current_lightmap == texture)
+		r.current_lightmap = NULL;
+	GL_CALL(glDeleteTextures(1, (const GLuint*)&texture->gl_name));
+}
+
+static int renderGlTextureFormatSupported(RTexFormat format) {
+	switch (format) {
+		case RTexFormat_RGB565:
+			return 1;
+#ifdef ATTO_PLATFORM_RPI
+		case RTexFormat_Compressed_ETC1:
+			return 1;
+#endif
+		case RTexFormat_Compressed_DXT1:
+		case RTexFormat_Compressed_DXT1_A1:
+		case RTexFormat_Compressed_DXT3:
+		case RTexFormat_Compressed_DXT5:
+			return r.caps.s3tc;
+	}
+	return 0;
+}
+
+static int renderGlMaxTextureSize(void) {
+	return r.caps.max_texture_size;
+}
+
+static int renderGlIndices32Supported(void) {
+	return r.caps.indices32;
+}
+
+static int renderGlOcclusionQueriesSupported(void) {
+	return r.caps.occlusion_queries;
+}
+
+static int renderGlInit(void) {
+	const char *extensions = (const char*)glGetString(GL_EXTENSIONS);
+	PRINTF("GL extensions: %s", extensions);
+#ifdef ATTO_PLATFORM_OSX
+	/* core profile doesn't list extensions this way, but s3tc is always there */
+	r.caps.s3tc = 1;
+#else
+	r.caps.s3tc = extensions && strstr(extensions, "GL_EXT_texture_compression_s3tc") != NULL;
+#endif
+	GLint max_texture_size = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+	/* GLES2 guarantees at least 64 */
+	r.caps.max_texture_size = max_texture_size >= 64 ? max_texture_size : 64;
+#ifdef ATTO_PLATFORM_RPI
+	/* GLES2 only has them as an extension */
+	r.caps.indices32 = extensions && strstr(extensions, "GL_OES_element_index_uint") != NULL;
+#else
+	r.caps.indices32 = 1;
+#endif
+#ifdef RENDER_GL_OCCLUSION_TARGET
+	r.caps.occlusion_queries = 1;
+#else
+	r.caps.occlusion_queries = 0;
+#endif
+#ifdef _WIN32
+#define WGL__FUNCLIST_DO(T, N) \
+	gl##N = (T)wglGetProcAddress("gl" #N); \
+	ASSERT(gl##N);
+
+	WGL__FUNCLIST
+#undef WGL__FUNCLIST_DO
+#endif
+
+	r.current_program = NULL;
+	r.current_tex0 = NULL;
+	r.current_lightmap = NULL;
+	r.uniforms.mvp = NULL;
+
+	for (int i = 0; i < MShader_COUNT; ++i) {
+		if (render_ProgramInit(programs + i) != 0) {
+			PRINTF("Cannot create program %d", i);
+			return 0;
+		}
+	}
+
+	renderBufferCreate(&box_buffer, RBufferType_Vertex, sizeof(box), box);
+
+	GL_CALL(glEnable(GL_DEPTH_TEST));
+	GL_CALL(glEnable(GL_CULL_FACE));
+	return 1;
+}
+
+static void renderBindTexture(const RTexture *texture, int slot, int norepeat) {
+	GL_CALL(glActiveTexture(GL_TEXTURE0 + slot));
+	GL_CALL(glBindTexture(GL_TEXTURE_2D, texture->gl_name));
+	if (norepeat) {
+		const GLuint wrap = GL_CLAMP_TO_EDGE;
+		GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap));
+		GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap));
+	}
+}
+
+static int renderUseMaterial(const Material *m) {
+	const int program_changed = render_ProgramUse(programs + m->shader);
+
+	if (m->base_texture.texture) {
+		const RTexture *t = &m->base_texture.texture->texture;
+		if (t != r.current_tex0) {
+			renderBindTexture(&m->base_texture.texture->texture, 1, m->shader == MShader_UnlitGeneric);
+			/* texture coordinates are in full resolution texels, regardless of what was actually uploaded */
+			GL_CALL(glUniform2f(r.current_program->uniform_locations[RUniformKind_tex0_size],
+						m->base_texture.texture->width * r.uniforms.tex_uv_units,
+						m->base_texture.texture->height * r.uniforms.tex_uv_units));
+			GL_CALL(glUniform2f(r.current_program->uniform_locations[RUniformKind_tex0_scale], m->base_texture.transform.scale.x, m->base_texture.transform.scale.y));
+			GL_CALL(glUniform2f(r.current_program->uniform_locations[RUniformKind_tex0_translate], m->base_texture.transform.translate.x, m->base_texture.transform.translate.y));
+			r.current_tex0 = t;
+		}
+	}
+
+	return program_changed;
+}
+
+static void renderUseLightmap(const LightmapRegion *region) {
+	const RTexture *texture = lightmapPageTexture(region->page);
+	if (texture != r.current_lightmap) {
+		renderBindTexture(texture, 0, 0);
+		r.current_lightmap = texture;
+	}
+
+	/* vertex lightmap uvs are normalized to the region, as if it was a texture of its own */
+	const float page_size = (float)lightmapPageSize();
+	r.uniforms.lightmap_transform[0] = region->width / page_size;
+	r.uniforms.lightmap_transform[1] = region->height / page_size;
+	r.uniforms.lightmap_transform[2] = region->x / page_size;
+	r.uniforms.lightmap_transform[3] = region->y / page_size;
+	if (r.current_program)
+		GL_CALL(glUniform4fv(r.current_program->uniform_locations[RUniformKind_lightmap_transform], 1,
+					r.uniforms.lightmap_transform));
+}
+
+/* meshlets are skipped when their faces are not potentially visible, out of view, or all facing away */
+static int renderMeshletVisible(const RDrawParams *params, const struct BSPMeshlet *meshlet,
+		const uint8_t *visible_sets, struct AVec3f camera_pos) {
+	if (visible_sets && !visible_sets[meshlet->cluster_set])
+		return 0;
+
+	/* camera is behind planes of all triangles for any point of bounding sphere */
+	const struct AVec3f to_center = aVec3fSub(meshlet->center, camera_pos);
+	if (meshlet->cone_cutoff < 1.f && aVec3fDot(to_center, meshlet->cone_axis)
+			>= meshlet->cone_cutoff * aVec3fLength(to_center) + meshlet->radius)
+		return 0;
+
+	if (params->frustum && cullFrustumSphere(params->frustum, aVec3fAdd(meshlet->center, params->translation),
+			meshlet->radius) == CullResult_Outside)
+		return 0;
+
+	return 1;
+}
+
+static void renderGlQueueFlush(void);
+
+/* adds a model that following packets are drawn with, submitting the queue if it is full */
+static RGlQueueModel *renderGlQueueModel(void) {
+	if (r.queue.models_count == RENDER_GL_QUEUE_MAX_MODELS)
+		renderGlQueueFlush();
+	return r.queue.models + r.queue.models_count++;
+}
+
+static void renderGlQueuePush(const Material *material, const LightmapRegion *lightmap, unsigned int vbo_offset,
+		unsigned int start, unsigned int count, float distance) {
+	if (r.queue.packets_count == RENDER_GL_QUEUE_MAX_PACKETS) {
+		/* the rest of the current model goes into the next batch */
+		const RGlQueueModel model = r.queue.models[r.queue.models_count - 1];
+		renderGlQueueFlush();
+		r.queue.models[r.queue.models_count++] = model;
+	}
+
+	const int model_index = r.queue.models_count - 1;
+	const int index = r.queue.packets_count++;
+	RGlPacket *const packet = r.queue.packets + index;
+	packet->material = material;
+	packet->lightmap = lightmap;
+	packet->vbo_offset = vbo_offset;
+	packet->start = start;
+	packet->count = count;
+	packet->model = model_index;
+
+	/* texture names only help grouping, state is still compared by pointers when submitting */
+	const Texture *const texture = material->base_texture.texture;
+	const uint64_t texture_id = texture ? (uint64_t)(texture->texture.gl_name + 1) & 0xffffu : 0;
+	const float depth = floatMax(0.f, floatMin(1.f, distance / r.uniforms.far));
+	const uint64_t vbo_range = vbo_offset >> 15 > 0xffu ? 0xffu : vbo_offset >> 15;
+
+	r.queue.keys[0][index] =
+		((uint64_t)(r.queue.models[model_index].selected ? 1 : 0) << RENDER_GL_KEY_BLEND_SHIFT)
+		| ((uint64_t)(material->shader & 7) << RENDER_GL_KEY_PROGRAM_SHIFT)
+		| (texture_id << RENDER_GL_KEY_TEXTURE_SHIFT)
+		| ((uint64_t)(lightmap->page & 0xff) << RENDER_GL_KEY_LIGHTMAP_SHIFT)
+		| ((uint64_t)model_index << RENDER_GL_KEY_MODEL_SHIFT)
+		| (vbo_range << RENDER_GL_KEY_VBO_SHIFT)
+		| (uint64_t)(depth * 65535.f);
+	r.queue.order[0][index] = (uint32_t)index;
+}
+
+/* least significant byte first; bytes that are the same in all keys are skipped. Returns sorted packet indices */
+static const uint32_t *renderGlQueueSort(int count) {
+	uint64_t *keys = r.queue.keys[0], *keys_sorted = r.queue.keys[1];
+	uint32_t *order = r.queue.order[0], *order_sorted = r.queue.order[1];
+	for (int shift = 0; shift < 64; shift += 8) {
+		unsigned int offsets[256] = {0};
+		for (int i = 0; i < count; ++i)
+			++offsets[(keys[i] >> shift) & 0xff];
+		if (offsets[(keys[0] >> shift) & 0xff] == (unsigned int)count)
+			continue;
+
+		for (unsigned int b = 0, sum = 0; b < 256; ++b) {
+			const unsigned int bucket = offsets[b];
+			offsets[b] = sum;
+			sum += bucket;
+		}
+
+		for (int i = 0; i < count; ++i) {
+			const unsigned int dst = offsets[(keys[i] >> shift) & 0xff]++;
+			keys_sorted[dst] = keys[i];
+			order_sorted[dst] = order[i];
+		}
+
+		uint64_t *const keys_tmp = keys; keys = keys_sorted; keys_sorted = keys_tmp;
+		uint32_t *const order_tmp = order; order = order_sorted; order_sorted = order_tmp;
+	}
+
+	return order;
+}
+
+static void renderGlBlend(int enable) {
+	if (enable) {
+		GL_CALL(glEnable(GL_BLEND));
+		GL_CALL(glBlendColor(1, 1, 1, .5f));
+		//GL_CALL(glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE));
+		GL_CALL(glBlendFunc(GL_ONE, GL_CONSTANT_ALPHA));
+		GL_CALL(glBlendEquation(GL_FUNC_ADD));
+	} else {
+		GL_CALL(glDisable(GL_BLEND));
+	}
+}
+
+/* counts state changes needed to draw packets in this order, and only draws them if submit is set,
+ * so that the same tracking tells what submitting them unsorted would have cost */
+static void renderGlQueueRun(const uint32_t *order, int count, int submit, RStateChanges *changes) {
+	const RGlQueueModel *model = NULL;
+	const RProgram *program = NULL;
+	const Texture *texture = NULL;
+	const LightmapRegion *lightmap = NULL;
+	int lightmap_page = -1, blend = 0;
+	unsigned int vbo_offset = 0;
+
+	if (submit) {
+		r.current_program = NULL;
+		r.current_lightmap = NULL;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		const RGlPacket *const packet = r.queue.packets + order[i];
+		const RGlQueueModel *const packet_model = r.queue.models + packet->model;
+		const RProgram *const packet_program = programs + packet->material->shader;
+		const Texture *const packet_texture = packet->material->base_texture.texture;
+		int attribs_changed = 0;
+
+		if (packet_model->selected != blend) {
+			blend = packet_model->selected;
+			if (submit)
+				renderGlBlend(blend);
+		}
+
+		if (packet_model != model) {
+			/* texture size uniform depends on texture coordinates scale of the model */
+			const int texture_reset = !model || model->tex_uv_units != packet_model->tex_uv_units;
+			if (texture_reset)
+				texture = NULL;
+			model = packet_model;
+			attribs_changed = 1;
+			++changes->uniforms;
+
+			if (submit) {
+				r.uniforms.mvp = &model->mvp.X.x;
+				r.uniforms.tex_uv_units = model->tex_uv_units;
+				if (texture_reset)
+					r.current_tex0 = NULL;
+				GL_CALL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->model->ibo.gl_name));
+				if (r.current_program)
+					GL_CALL(glUniformMatrix4fv(r.current_program->uniform_locations[RUniformKind_mvp], 1, GL_FALSE,
+								r.uniforms.mvp));
+			}
+		}
+
+		if (packet->lightmap != lightmap) {
+			lightmap = packet->lightmap;
+			++changes->uniforms;
+			if (lightmap->page != lightmap_page) {
+				lightmap_page = lightmap->page;
+				++changes->lightmaps;
+			}
+			if (submit)
+				renderUseLightmap(lightmap);
+		}
+
+		if (packet_program != program) {
+			program = packet_program;
+			texture = NULL;
+			attribs_changed = 1;
+			++changes->programs;
+		}
+
+		if (packet_texture && packet_texture != texture) {
+			texture = packet_texture;
+			++changes->textures;
+		}
+
+		if (packet->vbo_offset != vbo_offset)
+			attribs_changed = 1;
+
+		if (attribs_changed) {
+			vbo_offset = packet->vbo_offset;
+			++changes->buffers;
+		}
+
+		if (!submit)
+			continue;
+
+		renderUseMaterial(packet->material);
+		if (attribs_changed)
+			renderApplyAttribs(model->attribs, &model->model->vbo, vbo_offset);
+
+		GL_CALL(glDrawElements(GL_TRIANGLES, packet->count, model->index_type,
+					(void*)((size_t)model->model->index_size * packet->start)));
+		++r.queue.draw_calls;
+	}
+
+	if (submit && blend)
+		renderGlBlend(0);
+}
+
+static void renderGlQueueFlush(void) {
+	const int count = r.queue.packets_count;
+	if (count) {
+		/* queued order is model by model, and draws of each model in their own order */
+		renderGlQueueRun(r.queue.order[0], count, 0, &r.queue.changes_unsorted);
+		renderGlQueueRun(renderGlQueueSort(count), count, 1, &r.queue.changes);
+	}
+
+	r.queue.packets_count = 0;
+	r.queue.models_count = 0;
+}
+
+static float aMaxf(float a, float b) { return a > b ? a : b; }
+//static float aMinf(float a, float b) { return a < b ? a : b; }
+
+/* distance from point to the closest side of box, negative inside of it */
+static float renderBoxDistance(struct AVec3f pos, const struct AABB *box) {
+	return aMaxf(aMaxf(
+		aMaxf(pos.x - box->max.x, box->min.x - pos.x),
+		aMaxf(pos.y - box->max.y, box->min.y - pos.y)),
+		aMaxf(pos.z - box->max.z, box->min.z - pos.z));
+}
+
+static void renderDrawSet(const RDrawParams *params, const struct BSPModel *model, const struct BSPDrawSet *drawset) {
+	const struct BSPVisibility *const vis = &model->vis;
+	const int use_pvs = vis->camera_cluster >= 0 && drawset == &model->detailed;
+	const struct AVec3f camera_pos = aVec3fSub(params->camera->pos, params->translation);
+	for (int i = 0; i < drawset->draws_count; ++i) {
+		const struct BSPDraw *draw = drawset->draws + i;
+		const struct BSPDrawRange *const ranges = vis->ranges + draw->first_range;
+		const int draw_pvs = use_pvs && draw->ranges_count;
+
+		if (draw_pvs) {
+			unsigned int j = 0;
+			while (j < draw->ranges_count && !vis->visible_sets[ranges[j].cluster_set])
+				++j;
+			if (j == draw->ranges_count)
+				continue;
+		}
+
+		if (params->frustum || params->occluders) {
+			const CullBox box = {
+				aVec3fAdd(draw->aabb.min, params->translation),
+				aVec3fAdd(draw->aabb.max, params->translation)
+			};
+			if (params->frustum && cullFrustumBox(params->frustum, &box) == CullResult_Outside)
+				continue;
+			if (params->occluders && !occlusionBufferTestBox(params->occluders, &box))
+				continue;
+		}
+
+		const LightmapRegion *const lightmap = model->lightmaps + draw->lightmap;
+		const float distance = renderBoxDistance(camera_pos, &draw->aabb);
+
+		if (!draw->meshlets_count || !drawset->meshlets) {
+			renderGlQueuePush(draw->material, lightmap, draw->vbo_offset, draw->start, draw->count, distance);
+			continue;
+		}
+
+		/* meshlets of a draw are back to back, so neighbouring visible ones are drawn together */
+		const struct BSPMeshlet *const meshlets = drawset->meshlets + draw->first_meshlet;
+		const uint8_t *const visible_sets = draw_pvs ? vis->visible_sets : NULL;
+		unsigned int start = 0, count = 0;
+		for (unsigned int j = 0; j < draw->meshlets_count; ++j) {
+			if (!renderMeshletVisible(params, meshlets + j, visible_sets, camera_pos)) {
+				if (count)
+					renderGlQueuePush(draw->material, lightmap, draw->vbo_offset, start, count, distance);
+				count = 0;
+				continue;
+			}
+
+			if (!count)
+				start = meshlets[j].start;
+			count += meshlets[j].count;
+		}
+
+		if (count)
+			renderGlQueuePush(draw->material, lightmap, draw->vbo_offset, start, count, distance);
+	}
+}
+
+static void renderSkybox(const struct Camera *camera, const struct BSPModel *model) {
+	const struct AMat4f op = aMat4fMul(camera->projection, aMat4f3(camera->orientation, aVec3ff(0)));
+	r.current_program = NULL;
+	r.uniforms.mvp = &op.X.x;
+	r.uniforms.tex_uv_units = 1.f;
+
+	GL_CALL(glDisable(GL_CULL_FACE));
+	for (int i = 0; i < BSPSkyboxDir_COUNT; ++i) {
+		if (!model->skybox[i] || !model->skybox[i]->base_texture.texture)
+			continue;
+		renderUseMaterial(model->skybox[i]);
+		renderApplyAttribs(g_attribs, &box_buffer, 0);
+		GL_CALL(glDrawArrays(GL_TRIANGLES, i*6, 6));
+	}
+	GL_CALL(glEnable(GL_CULL_FACE));
+}
+
+static void renderGlModelDraw(const RDrawParams *params, const struct BSPModel *model) {
+	if (!model->detailed.draws_count) return;
+
+	const struct AVec3f rel_pos = aVec3fSub(params->camera->pos, params->translation);
+	const float distance = renderBoxDistance(rel_pos, &model->aabb);
+
+	/*
+	PRINTF("%f %f %f -> %f",
+			rel_pos.x, rel_pos.y, rel_pos.z, distance);
+	*/
+
+	/* sky comes from the closest map, whether it is in view or not */
+	if (distance < r.closest_map.distance) {
+		r.closest_map.distance = distance;
+		r.closest_map.model = model;
+	}
+
+	if (params->culled)
+		return;
+
+	RGlQueueModel *const queued = renderGlQueueModel();
+	queued->model = model;
+	queued->attribs = model->vertex_format == BSPVertexFormat_Packed ? g_packed_attribs : g_attribs;
+	queued->index_type = model->index_size == 4 ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+	queued->tex_uv_units = model->vertex_format == BSPVertexFormat_Packed ? model->dequant.tex_uv_units : 1.f;
+	queued->selected = params->selected;
+
+	/* packed positions are in [-1, 1] of model bounds */
+	const struct AVec3f *const half_size = &model->dequant.half_size;
+	queued->mvp = (model->vertex_format == BSPVertexFormat_Packed)
+		? aMat4fMul(params->camera->view_projection,
+			aMat4f3(aMat3fv(aVec3f(half_size->x, 0, 0), aVec3f(0, half_size->y, 0), aVec3f(0, 0, half_size->z)),
+				aVec3fAdd(params->translation, model->dequant.center)))
+		: aMat4fMul(params->camera->view_projection, aMat4fTranslation(params->translation));
+
+	r.uniforms.far = params->camera->z_far;
+
+	if (distance < 0.f)
+		renderDrawSet(params, model, &model->detailed);
+	else
+		renderDrawSet(params, model, &model->coarse);
+}
+
+static void renderGlOcclusionRead(ROcclusion *occlusion) {
+#ifdef RENDER_GL_OCCLUSION_TARGET
+	if (!occlusion->pending)
+		return;
+
+	GLuint available = 0;
+	GL_CALL(glGetQueryObjectuiv((GLuint)occlusion->gl_name, GL_QUERY_RESULT_AVAILABLE, &available));
+	if (!available)
+		return;
+
+	GLuint samples = 0;
+	GL_CALL(glGetQueryObjectuiv((GLuint)occlusion->gl_name, GL_QUERY_RESULT, &samples));
+	occlusion->occluded = samples == 0;
+	occlusion->pending = 0;
+#else
+	(void)occlusion;
+#endif
+}
+
+static void renderGlOcclusionQuery(const struct Camera *camera, ROcclusion *const *occlusions,
+		const struct AABB *boxes, int count) {
+#ifdef RENDER_GL_OCCLUSION_TARGET
+	renderGlQueueFlush();
+
+	/* only depth test, nothing is written */
+	GL_CALL(glDepthMask(GL_FALSE));
+	GL_CALL(glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE));
+	GL_CALL(glDisable(GL_CULL_FACE));
+
+	r.current_program = NULL;
+	r.uniforms.mvp = &camera->view_projection.X.x;
+	render_ProgramUse(programs + MShader_Unknown);
+	renderApplyAttribs(g_attribs, &box_buffer, 0);
+
+	for (int i = 0; i < count; ++i) {
+		ROcclusion *const occlusion = occlusions[i];
+		const struct AVec3f half_size = aVec3fMulf(aVec3fSub(boxes[i].max, boxes[i].min), .5f);
+		const struct AMat4f mvp = aMat4fMul(camera->view_projection,
+			aMat4f3(aMat3fv(aVec3f(half_size.x, 0, 0), aVec3f(0, half_size.y, 0), aVec3f(0, 0, half_size.z)),
+				aVec3fAdd(boxes[i].min, half_size)));
+		GL_CALL(glUniformMatrix4fv(r.current_program->uniform_locations[RUniformKind_mvp], 1, GL_FALSE, &mvp.X.x));
+
+		if (occlusion->gl_name == -1)
+			GL_CALL(glGenQueries(1, (GLuint*)&occlusion->gl_name));
+
+		GL_CALL(glBeginQuery(RENDER_GL_OCCLUSION_TARGET, (GLuint)occlusion->gl_name));
+		GL_CALL(glDrawArrays(GL_TRIANGLES, 0, COUNTOF(box)));
+		GL_CALL(glEndQuery(RENDER_GL_OCCLUSION_TARGET));
+		occlusion->pending = 1;
+	}
+
+	GL_CALL(glEnable(GL_CULL_FACE));
+	GL_CALL(glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE));
+	GL_CALL(glDepthMask(GL_TRUE));
+#else
+	(void)camera; (void)occlusions; (void)boxes; (void)count;
+#endif
+}
+
+static void renderGlResize(int w, int h) {
+	glViewport(0, 0, w, h);
+}
+
+static void renderGlBegin(void) {
+	glClearColor(0.f,1.f,0.f,0);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	r.closest_map.distance = 1e9f;
+	/* textures might have been uploaded since last frame, which changes bindings */
+	r.current_lightmap = NULL;
+	r.queue.draw_calls = 0;
+	memset(&r.queue.changes, 0, sizeof(r.queue.changes));
+	memset(&r.queue.changes_unsorted, 0, sizeof(r.queue.changes_unsorted));
+}
+
+static void renderGlEnd(const struct Camera *camera, RStats *stats) {
+	renderGlQueueFlush();
+	stats->draw_calls = r.queue.draw_calls;
+	stats->state_changes = r.queue.changes;
+	stats->state_changes_unsorted = r.queue.changes_unsorted;
+
+	renderSkybox(camera, r.closest_map.model);
+}
+
+const RBackend render_backend_gl = {
+	.name = "GL",
+	.init = renderGlInit,
+	.texture_format_supported = renderGlTextureFormatSupported,
+	.max_texture_size = renderGlMaxTextureSize,
+	.indices32_supported = renderGlIndices32Supported,
+	.occlusion_queries_supported = renderGlOcclusionQueriesSupported,
+	.texture_upload = renderGlTextureUpload,
+	.texture_upload_region = renderGlTextureUploadRegion,
+	.texture_destroy = renderGlTextureDestroy,
+	.buffer_create = renderGlBufferCreate,
+	.resize = renderGlResize,
+	.begin = renderGlBegin,
+	.model_draw = renderGlModelDraw,
+	.occlusion_read = renderGlOcclusionRead,
+	.occlusion_query = renderGlOcclusionQuery,
+	.end = renderGlEnd,
+};
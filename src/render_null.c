@@ -0,0 +1,92 @@
+#include "render_backend.h"
+
+/* Does nothing but hand out object names, so that maps can be loaded without a GL context */
+
+static int null_names;
+
+static int renderNullInit(void) {
+	null_names = 0;
+	return 1;
+}
+
+static int renderNullTextureFormatSupported(RTexFormat format) {
+	(void)format;
+	return 1;
+}
+
+/* what most desktop and mobile GPUs of GLES2 era can do */
+static int renderNullMaxTextureSize(void) {
+	return 2048;
+}
+
+static int renderNullIndices32Supported(void) {
+	return 1;
+}
+
+/* nothing is drawn, so nothing can be hidden */
+static int renderNullOcclusionQueriesSupported(void) {
+	return 0;
+}
+
+static void renderNullTextureUpload(RTexture *texture, const RTextureUploadParams *params, int image_size) {
+	(void)image_size;
+
+	if (texture->gl_name == -1) {
+		texture->gl_name = ++null_names;
+		texture->type_flags = 0;
+	}
+
+	if (params->mip_level < 1) {
+		texture->width = params->width;
+		texture->height = params->height;
+	}
+
+	texture->format = params->format;
+	texture->type_flags |= params->type;
+}
+
+static void renderNullTextureUploadRegion(RTexture *texture, int x, int y, const RTextureUploadParams *params) {
+	(void)texture; (void)x; (void)y; (void)params;
+}
+
+static void renderNullTextureDestroy(RTexture *texture) {
+	(void)texture;
+}
+
+static void renderNullBufferCreate(RBuffer *buffer, RBufferType type, int size, const void *data) {
+	(void)size; (void)data;
+	buffer->gl_name = ++null_names;
+	buffer->type = type;
+}
+
+static void renderNullResize(int w, int h) {
+	(void)w; (void)h;
+}
+
+static void renderNullBegin(void) {
+}
+
+static void renderNullModelDraw(const RDrawParams *params, const struct BSPModel *model) {
+	(void)params; (void)model;
+}
+
+static void renderNullEnd(const struct Camera *camera, RStats *stats) {
+	(void)camera; (void)stats;
+}
+
+const RBackend render_backend_null = {
+	.name = "null",
+	.init = renderNullInit,
+	.texture_format_supported = renderNullTextureFormatSupported,
+	.max_texture_size = renderNullMaxTextureSize,
+	.indices32_supported = renderNullIndices32Supported,
+	.occlusion_queries_supported = renderNullOcclusionQueriesSupported,
+	.texture_upload = renderNullTextureUpload,
+	.texture_upload_region = renderNullTextureUploadRegion,
+	.texture_destroy = renderNullTextureDestroy,
+	.buffer_create = renderNullBufferCreate,
+	.resize = renderNullResize,
+	.begin = renderNullBegin,
+	.model_draw = renderNullModelDraw,
+	.end = renderNullEnd,
+};
@@ -0,0 +1,254 @@
+#include "rgbe.h"
+#include "libc.h"
+#include "common.h"
+#include "log.h"
+#include "atto/app.h"
+
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RGBE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RGBE_NEON
+#include <arm_neon.h>
+#endif
+
+/* exponents outside of this range make a sample black */
+#define RGBE_MIN_EXPONENT -15
+#define RGBE_MAX_EXPONENT 15
+#define RGBE_ZERO_ROW (RGBE_MAX_EXPONENT - RGBE_MIN_EXPONENT + 1)
+
+typedef void (*RGBEUnpackRowFunc)(const uint8_t *samples, uint16_t *out, int count);
+
+static struct {
+	/* original fixed point tables, scale is 4096 */
+	int exponent[256];
+	int color[256];
+
+	/* their product, clamped, for each exponent that isn't black */
+	uint8_t scaled[RGBE_ZERO_ROW + 1][256];
+	/* row of scaled for each exponent byte */
+	uint8_t row[256];
+
+	const char *name;
+	RGBEUnpackRowFunc unpack_row;
+} rgbe;
+
+/* what the lightmap loader has always been doing */
+static uint8_t rgbeReferenceScaleColor(int c, int exp) {
+	const unsigned c2 = (rgbe.exponent[exp + 128] * rgbe.color[c]) >> 12;
+	return c2 < 255 ? (uint8_t)c2 : 255;
+}
+
+uint8_t rgbeScaleColor(uint8_t c, int8_t exponent) {
+	return rgbe.scaled[rgbe.row[(uint8_t)exponent]][c];
+}
+
+static uint16_t rgbe565(unsigned r, unsigned g, unsigned b) {
+	return (uint16_t)(((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3));
+}
+
+static void rgbeUnpackRowScalar(const uint8_t *samples, uint16_t *out, int count) {
+	for (int i = 0; i < count; ++i, samples += 4) {
+		const uint8_t *const scaled = rgbe.scaled[rgbe.row[samples[3]]];
+		out[i] = rgbe565(scaled[samples[0]], scaled[samples[1]], scaled[samples[2]]);
+	}
+}
+
+/* Tables don't fit into registers, so lookups stay scalar; channels are then packed 8 samples at a time */
+#ifdef RGBE_SSE2
+static void rgbeUnpackRowSSE2(const uint8_t *samples, uint16_t *out, int count) {
+	const __m128i mask_r = _mm_set1_epi16(0xf8), mask_g = _mm_set1_epi16(0xfc);
+	int i = 0;
+	for (; i + 8 <= count; i += 8, samples += 32) {
+		__m128i r = _mm_setzero_si128(), g = r, b = r;
+#define RGBE_SSE2_LANE(n) { \
+		const uint8_t *const s = samples + 4 * n; \
+		const uint8_t *const scaled = rgbe.scaled[rgbe.row[s[3]]]; \
+		r = _mm_insert_epi16(r, scaled[s[0]], n); \
+		g = _mm_insert_epi16(g, scaled[s[1]], n); \
+		b = _mm_insert_epi16(b, scaled[s[2]], n); }
+		RGBE_SSE2_LANE(0) RGBE_SSE2_LANE(1) RGBE_SSE2_LANE(2) RGBE_SSE2_LANE(3)
+		RGBE_SSE2_LANE(4) RGBE_SSE2_LANE(5) RGBE_SSE2_LANE(6) RGBE_SSE2_LANE(7)
+#undef RGBE_SSE2_LANE
+
+		const __m128i packed = _mm_or_si128(
+			_mm_or_si128(_mm_slli_epi16(_mm_and_si128(r, mask_r), 8), _mm_slli_epi16(_mm_and_si128(g, mask_g), 3)),
+			_mm_srli_epi16(b, 3));
+		_mm_storeu_si128((__m128i*)(out + i), packed);
+	}
+
+	rgbeUnpackRowScalar(samples, out + i, count - i);
+}
+#endif /* RGBE_SSE2 */
+
+#ifdef RGBE_NEON
+static void rgbeUnpackRowNEON(const uint8_t *samples, uint16_t *out, int count) {
+	int i = 0;
+	for (; i + 8 <= count; i += 8, samples += 32) {
+		uint8_t r[8], g[8], b[8];
+		for (int n = 0; n < 8; ++n) {
+			const uint8_t *const s = samples + 4 * n;
+			const uint8_t *const scaled = rgbe.scaled[rgbe.row[s[3]]];
+			r[n] = scaled[s[0]];
+			g[n] = scaled[s[1]];
+			b[n] = scaled[s[2]];
+		}
+
+		const uint16x8_t vr = vshll_n_u8(vand_u8(vld1_u8(r), vdup_n_u8(0xf8)), 8);
+		const uint16x8_t vg = vshll_n_u8(vand_u8(vld1_u8(g), vdup_n_u8(0xfc)), 3);
+		const uint16x8_t vb = vmovl_u8(vshr_n_u8(vld1_u8(b), 3));
+		vst1q_u16(out + i, vorrq_u16(vorrq_u16(vr, vg), vb));
+	}
+
+	rgbeUnpackRowScalar(samples, out + i, count - i);
+}
+#endif /* RGBE_NEON */
+
+/* all exponents and channel values, with enough samples per row to have leftovers */
+static int rgbeSelfTest(RGBEUnpackRowFunc func) {
+	enum { Samples = 256 + 5 };
+	uint8_t samples[Samples * 4];
+	uint16_t actual[Samples];
+
+	for (int exp = 0; exp < 256; ++exp) {
+		for (int i = 0; i < Samples; ++i) {
+			samples[i * 4 + 0] = (uint8_t)i;
+			samples[i * 4 + 1] = (uint8_t)(i * 7 + 3);
+			samples[i * 4 + 2] = (uint8_t)(255 - i);
+			samples[i * 4 + 3] = (uint8_t)(exp + i / 64);
+		}
+
+		memset(actual, 0xff, sizeof(actual));
+		func(samples, actual, Samples);
+		for (int i = 0; i < Samples; ++i) {
+			const uint8_t *const s = samples + i * 4;
+			const int e = (int8_t)s[3];
+			const uint16_t expected = rgbe565(rgbeReferenceScaleColor(s[0], e),
+				rgbeReferenceScaleColor(s[1], e), rgbeReferenceScaleColor(s[2], e));
+			if (actual[i] != expected)
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+void rgbeInit(void) {
+	const int scaling_factor = 4096;
+	for (int i = 0; i < 256; ++i) {
+		const int exp = i - 128;
+		rgbe.exponent[i] = (exp < RGBE_MIN_EXPONENT || exp > RGBE_MAX_EXPONENT) ? 0 :
+			(int)((float)scaling_factor * powf(2.f, (float)exp / 2.2f - 1.f));
+
+		rgbe.color[i] =
+			(int)(255.f * powf((float)i / 255.f, 1.f / 2.2f));
+	}
+
+	for (int i = 0; i < 256; ++i) {
+		const int exp = (int8_t)i;
+		rgbe.row[i] = (exp < RGBE_MIN_EXPONENT || exp > RGBE_MAX_EXPONENT)
+			? RGBE_ZERO_ROW : (uint8_t)(exp - RGBE_MIN_EXPONENT);
+	}
+
+	for (int exp = RGBE_MIN_EXPONENT; exp <= RGBE_MAX_EXPONENT; ++exp)
+		for (int c = 0; c < 256; ++c)
+			rgbe.scaled[exp - RGBE_MIN_EXPONENT][c] = rgbeReferenceScaleColor(c, exp);
+	memset(rgbe.scaled[RGBE_ZERO_ROW], 0, sizeof(rgbe.scaled[RGBE_ZERO_ROW]));
+
+	rgbe.name = "scalar";
+	rgbe.unpack_row = rgbeUnpackRowScalar;
+	if (!rgbeSelfTest(rgbeUnpackRowScalar)) {
+		/* would mean that tables above are built wrong, there's nothing to fall back to */
+		PRINT("Lightmap color tables don't match reference conversion");
+		ASSERT(!"RGBE tables are broken");
+	}
+
+	const char *name = NULL;
+	RGBEUnpackRowFunc func = NULL;
+#ifdef RGBE_SSE2
+	name = "SSE2";
+	func = rgbeUnpackRowSSE2;
+#elif defined(RGBE_NEON)
+	name = "NEON";
+	func = rgbeUnpackRowNEON;
+#endif
+
+	if (func) {
+		if (rgbeSelfTest(func)) {
+			rgbe.name = name;
+			rgbe.unpack_row = func;
+		} else {
+			PRINTF("%s lightmap converter doesn't match scalar one, not using it", name);
+		}
+	}
+
+	PRINTF("Using %s lightmap converter", rgbe.name);
+}
+
+void rgbeUnpackRow(const void *samples, uint16_t *out, int count) {
+	rgbe.unpack_row(samples, out, count);
+}
+
+#define RGBE_BENCHMARK_SAMPLES (1024 * 1024)
+#define RGBE_BENCHMARK_ROW 32
+
+void rgbeBenchmark(void) {
+	const int count = RGBE_BENCHMARK_SAMPLES;
+	uint8_t *samples = malloc((size_t)count * 4);
+	uint16_t *out = malloc(sizeof(*out) * count), *expected = malloc(sizeof(*expected) * count);
+	if (!samples || !out || !expected) {
+		PRINT("Cannot allocate lightmap benchmark buffers");
+		free(samples);
+		free(out);
+		free(expected);
+		return;
+	}
+
+	/* exponents of real lightmaps are mostly in a narrow range around zero */
+	uint32_t seed = 0x2545f491u;
+	for (int i = 0; i < count; ++i) {
+		seed = seed * 1664525u + 1013904223u;
+		samples[i * 4 + 0] = (uint8_t)(seed >> 24);
+		samples[i * 4 + 1] = (uint8_t)(seed >> 16);
+		samples[i * 4 + 2] = (uint8_t)(seed >> 8);
+		samples[i * 4 + 3] = (uint8_t)((int)(seed >> 4 & 7) - 4);
+	}
+
+	const char *const names[] = { "reference", "scalar", rgbe.name };
+	for (int variant = 0; variant < (int)(sizeof(names) / sizeof(*names)); ++variant) {
+		uint16_t *const dst = variant ? out : expected;
+		const ATimeUs start = aAppTime();
+		switch (variant) {
+			case 0:
+				for (int i = 0; i < count; ++i) {
+					const uint8_t *const s = samples + i * 4;
+					const int e = (int8_t)s[3];
+					dst[i] = rgbe565(rgbeReferenceScaleColor(s[0], e),
+						rgbeReferenceScaleColor(s[1], e), rgbeReferenceScaleColor(s[2], e));
+				}
+				break;
+			/* rows about as long as face lightmaps are */
+			case 1:
+				for (int i = 0; i < count; i += RGBE_BENCHMARK_ROW)
+					rgbeUnpackRowScalar(samples + i * 4, dst + i, RGBE_BENCHMARK_ROW);
+				break;
+			case 2:
+				for (int i = 0; i < count; i += RGBE_BENCHMARK_ROW)
+					rgbeUnpackRow(samples + i * 4, dst + i, RGBE_BENCHMARK_ROW);
+				break;
+		}
+		const ATimeUs time = aAppTime() - start;
+
+		PRINTF("Lightmap %-9s %10.0f samples/s%s", names[variant],
+			time > 0 ? count * 1e6 / time : 0.,
+			variant && memcmp(out, expected, sizeof(*out) * count) ? ", MISMATCH" : "");
+	}
+
+	free(samples);
+	free(out);
+	free(expected);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Source lightmap samples are r, g, b and a shared signed power of two exponent, 4 bytes each.
+ * They are converted to gamma corrected 8 bit channels, and then to RGB565 */
+
+/* build conversion tables and pick the fastest row converter this cpu supports */
+void rgbeInit(void);
+
+/* one channel of a sample */
+uint8_t rgbeScaleColor(uint8_t c, int8_t exponent);
+
+/* convert count samples into RGB565, the same as rgbeScaleColor does channel by channel */
+void rgbeUnpackRow(const void *samples, uint16_t *out, int count);
+
+/* convert a synthetic lightmap with the original per channel code and with row converters,
+ * printing samples per second of each */
+void rgbeBenchmark(void);
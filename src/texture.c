@@ -5,8 +5,27 @@
 #include "cache.h"
 #include "collection.h"
 #include "mempools.h"
+#include "loader.h"
+#include "thread.h"
 #include "common.h"
 
+#include <float.h>
+
+static struct {
+	int max_size;
+} texture_cfg;
+
+void textureInit(int max_size) {
+	dxtInit();
+#ifdef ATTO_PLATFORM_RPI
+	/* loader threads are often busy with something else, so packing can use all cores */
+	etc1Init(aThreadCpuCount() - 1);
+#endif
+	texture_cfg.max_size = max_size > 0 ? max_size : 0;
+	if (texture_cfg.max_size)
+		PRINTF("Max texture size: %d", texture_cfg.max_size);
+}
+
 const char *vtfFormatStr(enum VTFImageFormat fmt) {
 	switch(fmt) {
 		case VTFImage_None: return "None";
@@ -92,21 +111,30 @@ static int vtfImageSize(enum VTFImageFormat fmt, int width, int height) {
 	return width * height * pixel_bits / 8;
 }
 
-static void textureUnpackDXTto565(uint8_t *src, uint16_t *dst, int width, int height, enum VTFImageFormat format) {
+/* dst should have space for width and height rounded up to 4 */
+static void textureUnpackDXTto565(const uint8_t *src, uint16_t *dst, int width, int height, enum VTFImageFormat format) {
+	const int blocks_width = 4 * ((width + 3) / 4);
 	const struct DXTUnpackContext dxt_ctx = {
-		.width = width,
-		.height = height,
+		.width = blocks_width,
+		.height = 4 * ((height + 3) / 4),
 		.packed = src,
 		.output = dst
 	};
 
-	if (format == VTFImage_DXT1)
+	if (format == VTFImage_DXT1 || format == VTFImage_DXT1_A1)
 		dxt1Unpack(dxt_ctx);
+	else if (format == VTFImage_DXT3)
+		dxt3Unpack(dxt_ctx);
 	else
 		dxt5Unpack(dxt_ctx);
+
+	/* small mips: drop padding to the right of each row */
+	if (blocks_width != width)
+		for (int y = 1; y < height; ++y)
+			memmove(dst + y * width, dst + y * blocks_width, sizeof(*dst) * width);
 }
 
-static void textureUnpackBGR8to565(uint8_t *src, uint16_t *dst, int width, int height) {
+static void textureUnpackBGR8to565(const uint8_t *src, uint16_t *dst, int width, int height) {
 	const int pixels = width * height;
 	for (int i = 0; i < pixels; ++i, src+=3) {
 		const int r = (src[0] >> 3);
@@ -116,7 +144,7 @@ static void textureUnpackBGR8to565(uint8_t *src, uint16_t *dst, int width, int h
 	}
 }
 
-static void textureUnpackBGRX8to565(uint8_t *src, uint16_t *dst, int width, int height) {
+static void textureUnpackBGRX8to565(const uint8_t *src, uint16_t *dst, int width, int height) {
 	const int pixels = width * height;
 	for (int i = 0; i < pixels; ++i, src+=4) {
 		const int r = (src[0] & 0xf8);
@@ -126,7 +154,7 @@ static void textureUnpackBGRX8to565(uint8_t *src, uint16_t *dst, int width, int
 	}
 }
 
-static void textureUnpackBGRA8to565(uint8_t *src, uint16_t *dst, int width, int height) {
+static void textureUnpackBGRA8to565(const uint8_t *src, uint16_t *dst, int width, int height) {
 	const int pixels = width * height;
 	for (int i = 0; i < pixels; ++i, src+=4) {
 		const int a = src[3] * 8; /* FIXME this is likely HDR and need proper color correction */
@@ -163,25 +191,27 @@ static uint16_t *textureUnpackToTemp(struct Stack *tmp, struct IFile *file, size
 		int width, int height, enum VTFImageFormat format) {
 
 	const int src_texture_size = vtfImageSize(format, width, height);
-	const int dst_texture_size = sizeof(uint16_t) * width * height;
+	const int is_dxt = format == VTFImage_DXT1 || format == VTFImage_DXT1_A1
+		|| format == VTFImage_DXT3 || format == VTFImage_DXT5;
+	const int dst_texture_size = is_dxt
+		? (int)sizeof(uint16_t) * 4 * ((width + 3) / 4) * 4 * ((height + 3) / 4)
+		: (int)sizeof(uint16_t) * width * height;
 	void *dst_texture = stackAlloc(tmp, dst_texture_size);
 	if (!dst_texture) {
 		PRINTF("Cannot allocate %d bytes for texture", dst_texture_size);
 		return 0;
 	}
-	void *src_texture = stackAlloc(tmp, src_texture_size);
+	void *const src_cursor = stackGetCursor(tmp);
+	const void *src_texture = collectionFileMap(file, cursor, src_texture_size, tmp);
 	if (!src_texture) {
-		PRINTF("Cannot allocate %d bytes for texture", src_texture_size);
-		return 0;
-	}
-
-	if (src_texture_size != (int)file->read(file, cursor, src_texture_size, src_texture)) {
 		PRINT("Cannot read texture data");
 		return 0;
 	}
 
 	switch (format) {
 		case VTFImage_DXT1:
+		case VTFImage_DXT1_A1:
+		case VTFImage_DXT3:
 		case VTFImage_DXT5:
 			textureUnpackDXTto565(src_texture, dst_texture, width, height, format);
 			break;
@@ -199,27 +229,82 @@ static uint16_t *textureUnpackToTemp(struct Stack *tmp, struct IFile *file, size
 			break;
 		default:
 			PRINTF("Unsupported texture format %s", vtfFormatStr(format));
+			collectionFileUnmap(file, src_texture, src_texture_size, tmp);
 			return 0;
 	}
 
-	stackFreeUpToPosition(tmp, src_texture);
+	collectionFileUnmap(file, src_texture, src_texture_size, tmp);
+	stackFreeUpToPosition(tmp, src_cursor);
 	return dst_texture;
 }
 
-static int textureUploadMipmapType(struct Stack *tmp, struct IFile *file, size_t cursor,
-		const struct VTFHeader *hdr, int miplevel, RTexture *tex, RTexType tex_type) {
-	for (int mip = hdr->mipmap_count - 1; mip > miplevel; --mip) {
-		const unsigned int mip_width = hdr->width >> mip;
-		const unsigned int mip_height = hdr->height >> mip;
-		const int mip_image_size = vtfImageSize(hdr->hires_format, mip_width, mip_height);
-		cursor += mip_image_size * hdr->frames;
+/* formats that can be given to renderer as is, without decoding on cpu */
+static int textureCompressedFormat(enum VTFImageFormat format, RTexFormat *out_format) {
+	switch (format) {
+		case VTFImage_DXT1: *out_format = RTexFormat_Compressed_DXT1; break;
+		case VTFImage_DXT1_A1: *out_format = RTexFormat_Compressed_DXT1_A1; break;
+		case VTFImage_DXT3: *out_format = RTexFormat_Compressed_DXT3; break;
+		case VTFImage_DXT5: *out_format = RTexFormat_Compressed_DXT5; break;
+		default: return 0;
+	}
+
+	return renderTextureFormatSupported(*out_format);
+}
+
+static int textureUploadCompressed(struct Stack *tmp, struct IFile *file, size_t cursor,
+		enum VTFImageFormat vtf_format, RTexFormat format, int width, int height, int mip_level,
+		RTexture *tex, RTexType tex_type) {
+	const int image_size = vtfImageSize(vtf_format, width, height);
+	const void *data = collectionFileMap(file, cursor, image_size, tmp);
+	if (!data) {
+		PRINT("Cannot read texture data");
+		return 0;
+	}
+
+	const RTextureUploadParams params = {
+		.type = tex_type,
+		.width = width,
+		.height = height,
+		.format = format,
+		.pixels = data,
+		.mip_level = mip_level,
+		.wrap =  RTexWrap_Repeat
+	};
+
+	renderTextureUpload(tex, params);
+
+	collectionFileUnmap(file, data, image_size, tmp);
+	return 1;
+}
 
-		/*PRINTF("cur: %d; size: %d, mip: %d, %dx%d",
-				cursor, mip_image_size, mip, mip_width, mip_height);
-		*/
+static int vtfMipSize(int size, int mip) {
+	const int mip_size = size >> mip;
+	return mip_size > 0 ? mip_size : 1;
+}
+
+/* number of levels down to 1x1 */
+static int textureFullMipCount(int width, int height) {
+	int count = 1;
+	while (width > 1 || height > 1) {
+		width >>= 1;
+		height >>= 1;
+		++count;
 	}
+	return count;
+}
 
-	void *dst_texture = textureUnpackToTemp(tmp, file, cursor, hdr->width, hdr->height, hdr->hires_format);
+/* cursor points to mip data; mip_level is what renderer should do, see RTextureUploadParams */
+static int textureUploadMipmapType(struct Stack *tmp, struct IFile *file, size_t cursor,
+		const struct VTFHeader *hdr, int mip, int mip_level, RTexture *tex, RTexType tex_type) {
+	const int width = vtfMipSize(hdr->width, mip);
+	const int height = vtfMipSize(hdr->height, mip);
+
+	RTexFormat compressed_format;
+	if (textureCompressedFormat(hdr->hires_format, &compressed_format))
+		return textureUploadCompressed(tmp, file, cursor, hdr->hires_format, compressed_format,
+				width, height, mip_level, tex, tex_type);
+
+	void *dst_texture = textureUnpackToTemp(tmp, file, cursor, width, height, hdr->hires_format);
 	if (!dst_texture) {
 		PRINT("Failed to unpack texture");
 		return 0;
@@ -228,35 +313,21 @@ static int textureUploadMipmapType(struct Stack *tmp, struct IFile *file, size_t
 #ifdef ATTO_PLATFORM_RPI
 	{
 		const uint16_t *p565 = dst_texture;
-		uint8_t *etc1_data = stackAlloc(tmp, hdr->width * hdr->height / 2);
-		uint8_t *block = etc1_data;
-
-		// FIXME assumes w and h % 4 == 0
-		for (int by = 0; by < hdr->height; by += 4) {
-			for (int bx = 0; bx < hdr->width; bx += 4) {
-				const uint16_t *bp = p565 + bx + by * hdr->width;
-				ETC1Color ec[16];
-				for (int x = 0; x < 4; ++x) {
-					for (int y = 0; y < 4; ++y) {
-						const unsigned p = bp[x + y * hdr->width];
-						ec[x*4+y].r = (p & 0xf800u) >> 8;
-						ec[x*4+y].g = (p & 0x07e0u) >> 3;
-						ec[x*4+y].b = (p & 0x001fu) << 3;
-					}
-				}
-				
-				etc1PackBlock(ec, block);
-				block += 8;
-			}
+		uint8_t *etc1_data = stackAlloc(tmp, ((width + 3) / 4) * ((height + 3) / 4) * 8);
+		if (!etc1_data) {
+			PRINT("Cannot allocate memory for ETC1 texture");
+			return 0;
 		}
 
+		etc1PackImage565(p565, width, height, etc1_data, ETC1Quality_Fast);
+
 		const RTextureUploadParams params = {
 			.type = tex_type,
-			.width = hdr->width,
-			.height = hdr->height,
+			.width = width,
+			.height = height,
 			.format = RTexFormat_Compressed_ETC1,
 			.pixels = etc1_data,
-			.mip_level = -2,//miplevel,
+			.mip_level = mip_level,
 			.wrap =  RTexWrap_Repeat
 		};
 
@@ -268,11 +339,11 @@ static int textureUploadMipmapType(struct Stack *tmp, struct IFile *file, size_t
 
 	const RTextureUploadParams params = {
 		.type = tex_type,
-		.width = hdr->width,
-		.height = hdr->height,
+		.width = width,
+		.height = height,
 		.format = RTexFormat_RGB565,
 		.pixels = dst_texture,
-		.mip_level = -1,//miplevel,
+		.mip_level = mip_level,
 		.wrap =  RTexWrap_Repeat
 	};
 
@@ -282,7 +353,51 @@ static int textureUploadMipmapType(struct Stack *tmp, struct IFile *file, size_t
 	return 1;
 }
 
-static int textureLoad(struct IFile *file, Texture *tex, struct Stack *tmp, RTexType type) {
+/* largest mip that fits into max_size; 0 means no limit */
+static int textureFitMip(const struct VTFHeader *hdr, int max_size) {
+	int mip = 0;
+	if (max_size)
+		while (mip < hdr->mipmap_count - 1
+				&& (vtfMipSize(hdr->width, mip) > max_size || vtfMipSize(hdr->height, mip) > max_size))
+			++mip;
+	return mip;
+}
+
+/* video memory size of mip as it is given to renderer */
+static int textureMipUploadSize(const struct VTFHeader *hdr, int mip) {
+	const int width = vtfMipSize(hdr->width, mip);
+	const int height = vtfMipSize(hdr->height, mip);
+
+	RTexFormat compressed_format;
+	if (textureCompressedFormat(hdr->hires_format, &compressed_format))
+		return vtfImageSize(hdr->hires_format, width, height);
+
+#ifdef ATTO_PLATFORM_RPI
+	return ((width + 3) / 4) * ((height + 3) / 4) * 8;
+#else
+	return width * height * 2;
+#endif
+}
+
+typedef struct {
+	/* in: smallest mip to start from, and max size of the first uploaded mip, 0 for no limit */
+	int first_mip;
+	int max_size;
+	/* in: only upload images, leave everything else in Texture intact */
+	int mips_only;
+
+	/* out: actual first uploaded mip */
+	/* first_mip */
+	/* out: number of stored mips if they can be uploaded separately, 1 otherwise */
+	int mips_count;
+	/* out: largest mip allowed by max texture size setting */
+	int min_mip;
+	/* out: video memory needed for all stored mips */
+	size_t full_size;
+} TextureLoadInfo;
+
+static int textureLoad(struct IFile *file, Texture *tex, RTexture *rtex, struct Stack *tmp, RTexType type,
+		TextureLoadInfo *info) {
 	struct VTFHeader hdr;
 	size_t cursor = 0;
 	int retval = 0;
@@ -314,11 +429,18 @@ static int textureLoad(struct IFile *file, Texture *tex, struct Stack *tmp, RTex
 	}
 	*/
 
+	if (hdr.mipmap_count < 1) {
+		PRINT("Texture has no mips");
+		return 0;
+	}
+
 	cursor += hdr.header_size;
 
 	/* Compute averaga color from lowres image */
 	void *pre_alloc_cursor = stackGetCursor(tmp);
-	if (hdr.lores_format != VTFImage_DXT1 && hdr.lores_format != VTFImage_DXT5) {
+	if (info->mips_only) {
+		/* texture already has everything else */
+	} else if (hdr.lores_format != VTFImage_DXT1 && hdr.lores_format != VTFImage_DXT5) {
 		PRINTF("Not implemented lores texture format: %s", vtfFormatStr(hdr.lores_format));
 		tex->avg_color = aVec3ff(1.f);
 	} else {
@@ -342,6 +464,11 @@ static int textureLoad(struct IFile *file, Texture *tex, struct Stack *tmp, RTex
 		//PRINTF("Average color %f %f %f", tex->avg_color.x, tex->avg_color.y, tex->avg_color.z);
 	}
 
+	if (!info->mips_only) {
+		tex->width = hdr.width;
+		tex->height = hdr.height;
+	}
+
 	cursor += vtfImageSize(hdr.lores_format, hdr.lores_width, hdr.lores_height);
 
 	/*
@@ -349,35 +476,349 @@ static int textureLoad(struct IFile *file, Texture *tex, struct Stack *tmp, RTex
 		hdr.lores_width, hdr.lores_height, vtfFormatStr(hdr.lores_format), hdr.mipmap_count, hdr.header_size);
 	*/
 
-	for (int mip = 0; mip <= 0/*< hdr.mipmap_count*/; ++mip) {
-		retval = textureUploadMipmapType(tmp, file, cursor, &hdr, mip, &tex->texture, type);
-		if (retval != 1)
-			break;
+	const int full_chain = hdr.mipmap_count >= textureFullMipCount(hdr.width, hdr.height);
+	info->mips_count = full_chain ? hdr.mipmap_count : 1;
+	/* incomplete chains also use the largest stored mip that fits, and renderer generates the smaller ones */
+	info->min_mip = textureFitMip(&hdr, texture_cfg.max_size);
+	info->full_size = 0;
+	for (int mip = 0; mip < info->mips_count; ++mip)
+		info->full_size += (size_t)textureMipUploadSize(&hdr, mip);
+
+	/* largest stored mip that fits into all limits */
+	int first_mip = textureFitMip(&hdr, info->max_size);
+	if (first_mip < info->min_mip) first_mip = info->min_mip;
+	if (first_mip < info->first_mip) first_mip = info->first_mip;
+	if (first_mip > hdr.mipmap_count - 1) first_mip = hdr.mipmap_count - 1;
+	info->first_mip = first_mip;
+
+	/* mips are stored from the smallest to the largest one, with all frames of each mip together.
+	 * Upload them all as is, unless the chain is incomplete, in which case
+	 * only the largest one is used and renderer generates the rest.
+	 * Mips larger than first_mip are not even read. */
+	retval = 1;
+	for (int mip = hdr.mipmap_count - 1; mip >= first_mip; --mip) {
+		if (full_chain || mip == first_mip) {
+			retval = textureUploadMipmapType(tmp, file, cursor, &hdr, mip,
+					full_chain ? mip - first_mip : -1, rtex, type);
+			stackFreeUpToPosition(tmp, pre_alloc_cursor);
+			if (retval != 1)
+				break;
+		}
+
+		cursor += vtfImageSize(hdr.hires_format, vtfMipSize(hdr.width, mip), vtfMipSize(hdr.height, mip)) * hdr.frames;
 	}
 	stackFreeUpToPosition(tmp, pre_alloc_cursor);
 
 	return retval;
 }
 
+/* Texture streaming: textures that can be read again later start at a small mip,
+ * and are reloaded at the resolution needed for distance to the closest map that uses them.
+ * Reloads go into a separate staging texture, which then replaces the old one as a whole. */
+
+/* textures start at mip no larger than this */
+#define TEXTURE_STREAM_START_SIZE 64
+/* distance to map at which full resolution is needed; each next mip is good for twice as far */
+#define TEXTURE_STREAM_MIP0_DISTANCE 128.f
+/* max reloads in flight, and max reloads started per update */
+#define TEXTURE_STREAM_MAX_PENDING 4
+
+struct TextureStream {
+	Texture *texture;
+	struct TextureStream *next;
+	int mips_count;
+	int min_mip, start_mip;
+	int resident_mip;
+	int pending_mip; /* -1 if nothing is being loaded */
+	int failed;
+	size_t full_size;
+	float distance; /* to the closest map that used this texture since last update */
+	RTexture staging;
+	LoaderJob job;
+	char name[];
+};
+
+static struct {
+	size_t budget; /* 0 if streaming is disabled */
+	struct ICollection *collection;
+	struct Stack *persistent;
+	struct TextureStream *streams;
+	int pending;
+} stream;
+
+void textureStreamInit(size_t budget, struct ICollection *collection, struct Stack *persistent) {
+	stream.budget = budget;
+	stream.collection = collection;
+	stream.persistent = persistent;
+	stream.streams = NULL;
+	stream.pending = 0;
+	if (budget)
+		PRINTF("Texture streaming budget: %zuMiB", budget >> 20);
+}
+
+/* only textures from collections that live forever can be read again */
+static int textureStreamCanReload(const struct ICollection *source) {
+	if (!stream.budget)
+		return 0;
+
+	for (const struct ICollection *c = stream.collection; c; c = c->next)
+		if (c == source)
+			return 1;
+
+	return 0;
+}
+
+static void textureStreamAddNow(Texture *texture, const char *name, const TextureLoadInfo *info) {
+	const size_t name_size = strlen(name) + 1;
+	struct TextureStream *s = stackAlloc(stream.persistent, sizeof(*s) + name_size);
+	if (!s) {
+		PRINTF("Not enough memory to stream texture \"%s\"", name);
+		return;
+	}
+
+	s->texture = texture;
+	s->mips_count = info->mips_count;
+	s->min_mip = info->min_mip;
+	s->start_mip = s->resident_mip = info->first_mip;
+	s->pending_mip = -1;
+	s->failed = 0;
+	s->full_size = info->full_size;
+	s->distance = FLT_MAX;
+	memcpy(s->name, name, name_size);
+
+	s->next = stream.streams;
+	stream.streams = s;
+	texture->stream = s;
+}
+
+typedef struct {
+	Texture *texture;
+	TextureLoadInfo info;
+	/* name follows */
+} TextureStreamAdd;
+
+static void textureStreamAddMessage(void *payload) {
+	const TextureStreamAdd *add = payload;
+	textureStreamAddNow(add->texture, (const char*)(add + 1), &add->info);
+}
+
+/* streaming state is only touched on main thread */
+static void textureStreamAdd(Texture *texture, const char *name, const TextureLoadInfo *info) {
+	if (loaderIsMainThread()) {
+		textureStreamAddNow(texture, name, info);
+		return;
+	}
+
+	const size_t name_size = strlen(name) + 1;
+	TextureStreamAdd *add = loaderMainThreadAlloc(sizeof(*add) + name_size);
+	add->texture = texture;
+	add->info = *info;
+	memcpy(add + 1, name, name_size);
+	loaderMainThreadPost(textureStreamAddMessage, add);
+}
+
+static void textureStreamFinish(struct TextureStream *s, int ok) {
+	if (ok) {
+		renderTextureDestroy(&s->texture->texture);
+		s->texture->texture = s->staging;
+		s->resident_mip = s->pending_mip;
+	} else {
+		/* don't try again */
+		renderTextureDestroy(&s->staging);
+		s->failed = 1;
+	}
+
+	s->pending_mip = -1;
+	--stream.pending;
+}
+
+typedef struct {
+	struct TextureStream *stream;
+	int ok;
+} TextureStreamDone;
+
+static void textureStreamDoneMessage(void *payload) {
+	const TextureStreamDone *done = payload;
+	textureStreamFinish(done->stream, done->ok);
+}
+
+static void textureStreamLoad(struct TextureStream *s, struct Stack *tmp) {
+	void *tmp_cursor = stackGetCursor(tmp);
+	int ok = 0;
+
+	renderTextureInit(&s->staging);
+	struct IFile *file;
+	if (CollectionOpen_Success == collectionChainOpen(stream.collection, s->name, File_Texture, tmp, &file)) {
+		TextureLoadInfo info;
+		memset(&info, 0, sizeof(info));
+		info.first_mip = s->pending_mip;
+		info.mips_only = 1;
+		ok = textureLoad(file, NULL, &s->staging, tmp, RTexType_2D, &info) && info.first_mip == s->pending_mip;
+		file->close(file);
+	}
+	stackFreeUpToPosition(tmp, tmp_cursor);
+
+	if (!ok)
+		PRINTF("Cannot stream mip %d of texture \"%s\"", s->pending_mip, s->name);
+
+	if (loaderIsMainThread()) {
+		textureStreamFinish(s, ok);
+		return;
+	}
+
+	TextureStreamDone *done = loaderMainThreadAlloc(sizeof(*done));
+	done->stream = s;
+	done->ok = ok;
+	loaderMainThreadPost(textureStreamDoneMessage, done);
+}
+
+static void textureStreamJob(struct LoaderJob *job, struct Memories *mem) {
+	textureStreamLoad(job->user, mem->temp);
+}
+
+static void textureStreamStart(struct TextureStream *s, int mip, struct Stack *tmp) {
+	s->pending_mip = mip;
+	++stream.pending;
+
+	if (!loaderWorkersCount()) {
+		textureStreamLoad(s, tmp);
+		return;
+	}
+
+	s->job.func = textureStreamJob;
+	s->job.user = s;
+	loaderSubmit(&s->job);
+}
+
+static size_t textureStreamMipSize(const struct TextureStream *s, int mip) {
+	return s->full_size >> (2 * mip);
+}
+
+static int textureStreamWantedMip(const struct TextureStream *s, int bias) {
+	int mip = s->start_mip;
+	if (s->distance < FLT_MAX) {
+		mip = 0;
+		for (float d = TEXTURE_STREAM_MIP0_DISTANCE; d < s->distance && mip < s->mips_count; d *= 2.f)
+			++mip;
+	}
+
+	mip += bias;
+	if (mip < s->min_mip) mip = s->min_mip;
+	if (mip > s->mips_count - 1) mip = s->mips_count - 1;
+	return mip;
+}
+
+void textureStreamTouch(const Texture *texture, float distance) {
+	struct TextureStream *s = texture->stream;
+	if (s && distance < s->distance)
+		s->distance = distance;
+}
+
+void textureStreamUpdate(struct Stack *tmp) {
+	if (!stream.budget)
+		return;
+
+	/* how much lower resolution than wanted everything should be to fit into budget */
+	int bias = 0;
+	for (; bias < 16; ++bias) {
+		size_t wanted = 0;
+		for (const struct TextureStream *s = stream.streams; s; s = s->next)
+			wanted += textureStreamMipSize(s, textureStreamWantedMip(s, bias));
+		if (wanted <= stream.budget)
+			break;
+	}
+
+	size_t resident = 0;
+	for (const struct TextureStream *s = stream.streams; s; s = s->next) {
+		resident += textureStreamMipSize(s, s->resident_mip);
+		if (s->pending_mip >= 0)
+			resident += textureStreamMipSize(s, s->pending_mip);
+	}
+
+	/* free memory first, then use it for raising resolution */
+	int started = 0;
+	for (int pass = 0; pass < 2; ++pass) {
+		for (struct TextureStream *s = stream.streams; s; s = s->next) {
+			if (stream.pending >= TEXTURE_STREAM_MAX_PENDING || started >= TEXTURE_STREAM_MAX_PENDING)
+				break;
+			if (s->pending_mip >= 0 || s->failed)
+				continue;
+
+			const int mip = textureStreamWantedMip(s, bias);
+			if (pass == 0 && mip > s->resident_mip) {
+				/* don't bounce between adjacent mips unless out of budget */
+				if (mip == s->resident_mip + 1 && resident <= stream.budget)
+					continue;
+			} else if (pass == 1 && mip < s->resident_mip) {
+				/* both old and new images are resident until the new one is ready */
+				if (resident + textureStreamMipSize(s, mip) > stream.budget)
+					continue;
+				resident += textureStreamMipSize(s, mip);
+			} else
+				continue;
+
+			textureStreamStart(s, mip, tmp);
+			++started;
+		}
+	}
+
+	for (struct TextureStream *s = stream.streams; s; s = s->next)
+		s->distance = FLT_MAX;
+}
+
+/* posted after deferred uploads of a texture that failed to load, so that it is destroyed after them */
+static void textureDestroyMessage(void *payload) {
+	Texture *const *const tex = payload;
+	renderTextureDestroy(&(*tex)->texture);
+}
+
 const Texture *textureGet(const char *name, struct ICollection *collection, struct Stack *tmp) {
-	const Texture *tex = cacheGetTexture(name);
+	const Texture *tex = cacheAcquireTexture(name);
 	if (tex) return tex;
 
-	struct IFile *texfile;
-	if (CollectionOpen_Success != collectionChainOpen(collection, name, File_Texture, &texfile)) {
-		PRINTF("Texture \"%s\" not found", name);
-		return cacheGetTexture("opensource/placeholder");
+	/* same as collectionChainOpen, but also finds out where the texture came from */
+	struct IFile *texfile = NULL;
+	struct ICollection *source = collection;
+	for (; source; source = source->next) {
+		const enum CollectionOpenResult result = source->open(source, name, File_Texture, tmp, &texfile);
+		if (result == CollectionOpen_Success)
+			break;
+		if (result != CollectionOpen_NotFound) {
+			source = NULL;
+			break;
+		}
 	}
 
-	struct Texture localtex;
-	renderTextureInit(&localtex.texture);
-	if (textureLoad(texfile, &localtex, tmp, RTexType_2D) == 0) {
-		PRINTF("Texture \"%s\" found, but could not be loaded", name);
-	} else {
-		cachePutTexture(name, &localtex);
-		tex = cacheGetTexture(name);
+	Texture *loaded = source ? cacheAllocTexture() : NULL;
+	if (!source) {
+		PRINTF("Texture \"%s\" not found", name);
+	} else if (loaded) {
+		TextureLoadInfo info;
+		memset(&info, 0, sizeof(info));
+		const int streamed = textureStreamCanReload(source);
+		info.max_size = streamed ? TEXTURE_STREAM_START_SIZE : 0;
+
+		/* texture data might be uploaded later on main thread, so it is loaded right into its final storage,
+		 * which only becomes visible to others through cache once loading succeeds */
+		renderTextureInit(&loaded->texture);
+		loaded->stream = NULL;
+		if (textureLoad(texfile, loaded, &loaded->texture, tmp, RTexType_2D, &info) == 0) {
+			PRINTF("Texture \"%s\" found, but could not be loaded", name);
+			if (loaderIsMainThread()) {
+				renderTextureDestroy(&loaded->texture);
+			} else {
+				Texture **message = loaderMainThreadAlloc(sizeof(*message));
+				*message = loaded;
+				loaderMainThreadPost(textureDestroyMessage, message);
+			}
+			loaded = NULL;
+		} else if (streamed && info.mips_count > 1) {
+			textureStreamAdd(loaded, name, &info);
+		}
 	}
 
-	texfile->close(texfile);
-	return tex ? tex : cacheGetTexture("opensource/placeholder");
+	if (source)
+		texfile->close(texfile);
+	cacheReleaseTexture(name, loaded);
+	return loaded ? loaded : cacheGetTexture("opensource/placeholder");
 }
@@ -3,9 +3,27 @@
 #include "collection.h"
 #include "mempools.h"
 
+struct TextureStream;
+
 typedef struct Texture {
 	RTexture texture;
 	struct AVec3f avg_color;
+	/* full resolution size, which texture coordinates refer to; uploaded image might be smaller */
+	int width, height;
+	/* NULL if resolution of this texture doesn't change */
+	struct TextureStream *stream;
 } Texture;
 
+/* max_size: largest width or height of uploaded image, smaller stored mips are used for larger textures; 0 for no limit */
+void textureInit(int max_size);
+
+/* Keep textures at resolution needed for how close they are to the camera, within budget bytes of video memory.
+ * budget == 0 disables streaming. Only textures found in collection chain can be streamed, it should outlive
+ * all textures. Streaming state is allocated on persistent stack, and is only used on main thread. */
+void textureStreamInit(size_t budget, struct ICollection *collection, struct Stack *persistent);
+/* texture was drawn at distance from camera */
+void textureStreamTouch(const Texture *texture, float distance);
+/* start reloading textures whose resolution should change; main thread only, once per frame */
+void textureStreamUpdate(struct Stack *tmp);
+
 const Texture *textureGet(const char *name, struct ICollection *collection, struct Stack *tmp);
@@ -0,0 +1,115 @@
+#include "thread.h"
+#include "common.h"
+#include "log.h"
+
+#ifndef _WIN32
+#include <unistd.h> /* sysconf */
+
+static void *threadEntry(void *arg) {
+	struct AThread *thread = arg;
+	thread->func(thread->arg);
+	return NULL;
+}
+
+int aThreadCreate(struct AThread *thread, AThreadFunc func, void *arg) {
+	thread->func = func;
+	thread->arg = arg;
+	const int result = pthread_create(&thread->impl_.thread, NULL, threadEntry, thread);
+	if (result != 0)
+		PRINTF("pthread_create failed: %d", result);
+	return result == 0;
+}
+
+int aThreadIsCurrent(const struct AThread *thread) {
+	return pthread_equal(thread->impl_.thread, pthread_self());
+}
+
+int aThreadCpuCount(void) {
+	const long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+}
+
+void aMutexInit(struct AMutex *mutex) {
+	pthread_mutex_init(&mutex->impl_.mutex, NULL);
+}
+
+void aMutexLock(struct AMutex *mutex) {
+	pthread_mutex_lock(&mutex->impl_.mutex);
+}
+
+void aMutexUnlock(struct AMutex *mutex) {
+	pthread_mutex_unlock(&mutex->impl_.mutex);
+}
+
+void aCondInit(struct ACond *cond) {
+	pthread_cond_init(&cond->impl_.cond, NULL);
+}
+
+void aCondWait(struct ACond *cond, struct AMutex *mutex) {
+	pthread_cond_wait(&cond->impl_.cond, &mutex->impl_.mutex);
+}
+
+void aCondSignal(struct ACond *cond) {
+	pthread_cond_signal(&cond->impl_.cond);
+}
+
+void aCondBroadcast(struct ACond *cond) {
+	pthread_cond_broadcast(&cond->impl_.cond);
+}
+
+#else
+
+static DWORD WINAPI threadEntry(LPVOID arg) {
+	struct AThread *thread = arg;
+	thread->func(thread->arg);
+	return 0;
+}
+
+int aThreadCreate(struct AThread *thread, AThreadFunc func, void *arg) {
+	thread->func = func;
+	thread->arg = arg;
+	thread->impl_.handle = CreateThread(NULL, 0, threadEntry, thread, 0, &thread->impl_.id);
+	if (!thread->impl_.handle)
+		PRINTF("CreateThread failed: %u", (unsigned)GetLastError());
+	return thread->impl_.handle != NULL;
+}
+
+int aThreadIsCurrent(const struct AThread *thread) {
+	return thread->impl_.id == GetCurrentThreadId();
+}
+
+int aThreadCpuCount(void) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+void aMutexInit(struct AMutex *mutex) {
+	InitializeCriticalSection(&mutex->impl_.cs);
+}
+
+void aMutexLock(struct AMutex *mutex) {
+	EnterCriticalSection(&mutex->impl_.cs);
+}
+
+void aMutexUnlock(struct AMutex *mutex) {
+	LeaveCriticalSection(&mutex->impl_.cs);
+}
+
+void aCondInit(struct ACond *cond) {
+	InitializeConditionVariable(&cond->impl_.cv);
+}
+
+void aCondWait(struct ACond *cond, struct AMutex *mutex) {
+	SleepConditionVariableCS(&cond->impl_.cv, &mutex->impl_.cs, INFINITE);
+}
+
+void aCondSignal(struct ACond *cond) {
+	WakeConditionVariable(&cond->impl_.cv);
+}
+
+void aCondBroadcast(struct ACond *cond) {
+	WakeAllConditionVariable(&cond->impl_.cv);
+}
+
+#endif
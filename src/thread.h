@@ -0,0 +1,59 @@
+#pragma once
+
+#include "libc.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+typedef void (*AThreadFunc)(void *arg);
+
+typedef struct AThread {
+	AThreadFunc func;
+	void *arg;
+	struct {
+#ifndef _WIN32
+		pthread_t thread;
+#else
+		HANDLE handle;
+		DWORD id;
+#endif
+	} impl_;
+} AThread;
+
+typedef struct AMutex {
+	struct {
+#ifndef _WIN32
+		pthread_mutex_t mutex;
+#else
+		CRITICAL_SECTION cs;
+#endif
+	} impl_;
+} AMutex;
+
+typedef struct ACond {
+	struct {
+#ifndef _WIN32
+		pthread_cond_t cond;
+#else
+		CONDITION_VARIABLE cv;
+#endif
+	} impl_;
+} ACond;
+
+/* thread structure must stay alive for the whole thread lifetime */
+int aThreadCreate(struct AThread *thread, AThreadFunc func, void *arg);
+/* returns 1 if called from the given thread */
+int aThreadIsCurrent(const struct AThread *thread);
+/* number of online cpu cores, at least 1 */
+int aThreadCpuCount(void);
+
+void aMutexInit(struct AMutex *mutex);
+void aMutexLock(struct AMutex *mutex);
+void aMutexUnlock(struct AMutex *mutex);
+
+void aCondInit(struct ACond *cond);
+/* mutex must be locked by caller */
+void aCondWait(struct ACond *cond, struct AMutex *mutex);
+void aCondSignal(struct ACond *cond);
+void aCondBroadcast(struct ACond *cond);
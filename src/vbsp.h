@@ -103,6 +103,10 @@ struct VBSPLumpLightMap {
 	uint8_t r, g, b;
 	int8_t exponent;
 };
+/* leaves are 30 bytes of these fields, then padding to 32 bytes in lump version 1;
+ * version 0 has 24 bytes of ambient lighting cube in between */
+#define VBSP_LEAF_SIZE_V0 56
+#define VBSP_LEAF_SIZE_V1 32
 struct VBSPLumpLeaf {
 	uint32_t contents;
 	uint16_t cluster;
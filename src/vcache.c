@@ -0,0 +1,148 @@
+#include "vcache.h"
+#include <string.h> /* memset, memcpy */
+
+#define VCACHE_NO_VERTEX 0xffffffffu
+
+size_t vcacheOptimizeTempSize(unsigned int indices_count, unsigned int vertices_count) {
+	/* adjacency offsets, live triangles and cache stamps per vertex;
+	 * adjacency, dead-end stack, candidates and output per index; emitted flag per triangle */
+	return sizeof(uint32_t) * (3 * (size_t)vertices_count + 1 + 4 * (size_t)indices_count + indices_count / 3);
+}
+
+typedef struct {
+	uint32_t *live, *stamp;
+	uint32_t *dead_end;
+	unsigned int dead_end_count;
+	/* next vertex to check for remaining triangles once everything else is exhausted */
+	unsigned int cursor;
+	unsigned int vertices_count, cache_size, time;
+} VCacheTipsify;
+
+static uint32_t vcacheNextVertex(VCacheTipsify *t, const uint32_t *candidates, unsigned int candidates_count) {
+	/* prefer vertices that are still going to be in cache after emitting all of their triangles, oldest first */
+	uint32_t best = VCACHE_NO_VERTEX;
+	long best_priority = -1;
+	for (unsigned int i = 0; i < candidates_count; ++i) {
+		const uint32_t v = candidates[i];
+		if (!t->live[v])
+			continue;
+
+		long priority = 0;
+		if (t->time - t->stamp[v] + 2 * t->live[v] <= t->cache_size)
+			priority = (long)(t->time - t->stamp[v]);
+		if (priority > best_priority) {
+			best_priority = priority;
+			best = v;
+		}
+	}
+
+	if (best != VCACHE_NO_VERTEX)
+		return best;
+
+	/* dead end: go back to recently used vertices, then to whatever is left */
+	while (t->dead_end_count) {
+		const uint32_t v = t->dead_end[--t->dead_end_count];
+		if (t->live[v])
+			return v;
+	}
+
+	for (; t->cursor < t->vertices_count; ++t->cursor)
+		if (t->live[t->cursor])
+			return t->cursor;
+
+	return VCACHE_NO_VERTEX;
+}
+
+void vcacheOptimize(uint32_t *indices, unsigned int indices_count, unsigned int first_vertex,
+		unsigned int vertices_count, unsigned int cache_size, void *temp) {
+	const unsigned int triangles = indices_count / 3;
+	if (!triangles || !vertices_count)
+		return;
+
+	uint32_t *const adjacency_begin = temp;
+	uint32_t *const live = adjacency_begin + vertices_count + 1;
+	uint32_t *const stamp = live + vertices_count;
+	uint32_t *const adjacency = stamp + vertices_count;
+	uint32_t *const dead_end = adjacency + indices_count;
+	uint32_t *const candidates = dead_end + indices_count;
+	uint32_t *const out = candidates + indices_count;
+	uint32_t *const emitted = out + indices_count;
+
+	/* triangles using each vertex */
+	memset(live, 0, sizeof(*live) * vertices_count);
+	for (unsigned int i = 0; i < triangles * 3; ++i)
+		++live[indices[i] - first_vertex];
+
+	adjacency_begin[0] = 0;
+	for (unsigned int v = 0; v < vertices_count; ++v)
+		adjacency_begin[v + 1] = adjacency_begin[v] + live[v];
+
+	memcpy(stamp, adjacency_begin, sizeof(*stamp) * vertices_count);
+	for (unsigned int i = 0; i < triangles * 3; ++i)
+		adjacency[stamp[indices[i] - first_vertex]++] = i / 3;
+
+	memset(stamp, 0, sizeof(*stamp) * vertices_count);
+	memset(emitted, 0, sizeof(*emitted) * triangles);
+
+	VCacheTipsify t = {
+		.live = live,
+		.stamp = stamp,
+		.dead_end = dead_end,
+		.dead_end_count = 0,
+		.cursor = 0,
+		.vertices_count = vertices_count,
+		.cache_size = cache_size,
+		/* stamp 0 is always out of cache */
+		.time = cache_size + 1,
+	};
+
+	unsigned int out_count = 0;
+	for (uint32_t fanning = 0; fanning != VCACHE_NO_VERTEX;) {
+		/* emit all remaining triangles around fanning vertex */
+		unsigned int candidates_count = 0;
+		for (uint32_t a = adjacency_begin[fanning]; a < adjacency_begin[fanning + 1]; ++a) {
+			const uint32_t triangle = adjacency[a];
+			if (emitted[triangle])
+				continue;
+			emitted[triangle] = 1;
+
+			for (int k = 0; k < 3; ++k) {
+				const uint32_t v = indices[triangle * 3 + k] - first_vertex;
+				out[out_count++] = v;
+				dead_end[t.dead_end_count++] = v;
+				candidates[candidates_count++] = v;
+				--live[v];
+				if (t.time - stamp[v] > cache_size)
+					stamp[v] = t.time++;
+			}
+		}
+
+		fanning = vcacheNextVertex(&t, candidates, candidates_count);
+	}
+
+	for (unsigned int i = 0; i < out_count; ++i)
+		indices[i] = out[i] + first_vertex;
+}
+
+size_t vcacheSimulateTempSize(unsigned int vertices_count) {
+	return sizeof(uint32_t) * vertices_count;
+}
+
+void vcacheSimulate(const uint32_t *indices, unsigned int indices_count, unsigned int first_vertex,
+		unsigned int vertices_count, unsigned int cache_size, void *temp, VCacheStats *stats) {
+	uint32_t *const stamp = temp;
+	memset(stamp, 0, sizeof(*stamp) * vertices_count);
+
+	uint32_t time = cache_size + 1;
+	for (unsigned int i = 0; i < indices_count; ++i) {
+		const uint32_t v = indices[i] - first_vertex;
+		if (!stamp[v])
+			++stats->vertices;
+		if (time - stamp[v] > cache_size) {
+			stamp[v] = time++;
+			++stats->transforms;
+		}
+	}
+
+	stats->triangles += indices_count / 3;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Post-transform vertex cache: GPUs keep results of vertex shader for the last few vertices,
+ * so triangles sharing vertices with recently drawn ones are cheaper. Modelled as FIFO of cache_size entries */
+
+typedef struct {
+	unsigned int triangles;
+	/* distinct vertices referenced */
+	unsigned int vertices;
+	/* vertex shader invocations, i.e. cache misses */
+	unsigned int transforms;
+} VCacheStats;
+
+/* average cache miss ratio: transforms per triangle, 0.5 at best, 3 at worst */
+#define VCACHE_ACMR(stats) ((stats).triangles ? (float)(stats).transforms / (stats).triangles : 0.f)
+/* average transform to vertex ratio: 1 is perfect */
+#define VCACHE_ATVR(stats) ((stats).vertices ? (float)(stats).transforms / (stats).vertices : 0.f)
+
+/* bytes of temp memory that vcacheOptimize() needs */
+size_t vcacheOptimizeTempSize(unsigned int indices_count, unsigned int vertices_count);
+
+/* Reorders triangles of an indexed triangle list in place for fewer cache misses, using Tipsify
+ * (Sander, Nehab, Barczak, "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw", 2007).
+ * All indices must be in [first_vertex, first_vertex + vertices_count). Linear in indices_count */
+void vcacheOptimize(uint32_t *indices, unsigned int indices_count, unsigned int first_vertex,
+		unsigned int vertices_count, unsigned int cache_size, void *temp);
+
+/* bytes of temp memory that vcacheSimulate() needs */
+size_t vcacheSimulateTempSize(unsigned int vertices_count);
+
+/* adds triangles, vertices and transforms of drawing indices to stats */
+void vcacheSimulate(const uint32_t *indices, unsigned int indices_count, unsigned int first_vertex,
+		unsigned int vertices_count, unsigned int cache_size, void *temp, VCacheStats *stats);